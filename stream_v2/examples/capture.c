@@ -0,0 +1,89 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zmq.h>
+
+#include "stream2.h"
+#include "stream2_capture.h"
+
+enum { TIMEOUT_MS = 100 };
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s HOST CAPTURE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char address[100];
+    snprintf(address, sizeof(address), "tcp://%s:31001", argv[1]);
+
+    struct stream2_capture_writer* writer;
+    if ((r = stream2_capture_writer_open(argv[2], &writer))) {
+        fprintf(stderr, "error: error %i creating %s\n", (int)r, argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    void* ctx = zmq_ctx_new();
+    void* socket = zmq_socket(ctx, ZMQ_PULL);
+    const int timeout = TIMEOUT_MS;
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    zmq_connect(socket, address);
+
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    while (!interrupted) {
+        if (zmq_msg_recv(&msg, socket, 0) == -1) {
+            if (zmq_errno() == EAGAIN || zmq_errno() == EINTR)
+                continue;
+            break;
+        }
+
+        const uint8_t* msg_data = (const uint8_t*)zmq_msg_data(&msg);
+        size_t msg_size = zmq_msg_size(&msg);
+        if ((r = stream2_capture_writer_write(writer, msg_data, msg_size))) {
+            fprintf(stderr, "error: error %i writing %s\n", (int)r, argv[2]);
+            break;
+        }
+        messages++;
+        bytes += msg_size;
+
+        enum stream2_msg_type type;
+        uint64_t image_id;
+        if (stream2_peek_msg(msg_data, msg_size, &type, &image_id) ==
+                    STREAM2_OK &&
+            type == STREAM2_MSG_END)
+        {
+            stream2_capture_writer_flush(writer);
+            printf("captured %" PRIu64 " messages %" PRIu64 " bytes\n",
+                   messages, bytes);
+            fflush(stdout);
+        }
+    }
+    zmq_msg_close(&msg);
+    zmq_close(socket);
+    zmq_ctx_term(ctx);
+
+    if ((r = stream2_capture_writer_close(writer))) {
+        fprintf(stderr, "error: error %i closing %s\n", (int)r, argv[2]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -7,6 +7,7 @@
 
 #include "compression/src/compression.h"
 #include "stream2.h"
+#include "stream2_series.h"
 #include "tinycbor/src/cbor.h"
 
 static enum stream2_result decode_bytes(const struct stream2_bytes* bytes,
@@ -201,6 +202,9 @@ static void print_user_data(struct stream2_user_data* user_data) {
     printf("\n");
 }
 
+// State of the current series, used to report missing images.
+static struct stream2_series* series = NULL;
+
 static void handle_start_msg(struct stream2_start_msg* msg) {
     printf("\nSTART MESSAGE: series_id %" PRIu64 " series_unique_id %s\n",
            msg->series_id, msg->series_unique_id);
@@ -299,6 +303,11 @@ static void handle_start_msg(struct stream2_start_msg* msg) {
     print_user_data(&msg->user_data);
     printf("virtual_pixel_interpolation_enabled: %s\n",
            msg->virtual_pixel_interpolation_enabled ? "true" : "false");
+
+    enum stream2_result r;
+    stream2_series_free(series);
+    if ((r = stream2_series_create(msg, NULL, &series)))
+        printf("series: error %i\n", (int)r);
 }
 
 static void handle_image_msg(struct stream2_image_msg* msg) {
@@ -319,11 +328,30 @@ static void handle_image_msg(struct stream2_image_msg* msg) {
         printf("data: \"%s\" ", data->channel);
         print_multidim_array(&data->data);
     }
+    if (series) {
+        enum stream2_result r;
+        if ((r = stream2_series_add_image(series, msg)))
+            printf("series: error %i\n", (int)r);
+    }
 }
 
 static void handle_end_msg(struct stream2_end_msg* msg) {
     printf("\nEND MESSAGE: series_id %" PRIu64 " series_unique_id %s\n",
            msg->series_id, msg->series_unique_id);
+    if (series) {
+        enum stream2_result r;
+        if ((r = stream2_series_end(series, msg))) {
+            printf("series: error %i\n", (int)r);
+        } else {
+            printf("received: %" PRIu64 " of %" PRIu64 " images\n",
+                   series->received_count, series->number_of_images);
+            uint64_t image_id;
+            if (stream2_series_next_missing(series, 0, &image_id))
+                printf("first missing image_id: %" PRIu64 "\n", image_id);
+        }
+        stream2_series_free(series);
+        series = NULL;
+    }
 }
 
 static void handle_msg(struct stream2_msg* msg) {
@@ -0,0 +1,184 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <zmq.h>
+
+#include "stream2.hpp"
+
+// example.c with the C++20 wrapper: dumps a summary of every received
+// message, decodes the image data of every channel and reports missing
+// images at the end of each series.
+
+namespace {
+
+struct series_deleter {
+    void operator()(stream2_series* series) const noexcept {
+        stream2_series_free(series);
+    }
+};
+
+using series_ptr = std::unique_ptr<stream2_series, series_deleter>;
+
+template <class... F>
+struct overloaded : F... {
+    using F::operator()...;
+};
+
+template <class... F>
+overloaded(F...) -> overloaded<F...>;
+
+void print_start_msg(const stream2_start_msg& msg, series_ptr& series) {
+    const std::string_view unique_id = stream2::view(msg.series_unique_id);
+    std::printf("\nSTART MESSAGE: series_id %" PRIu64
+                " series_unique_id %.*s\n",
+                msg.series_id, static_cast<int>(unique_id.size()),
+                unique_id.data());
+    std::printf("channels:");
+    for (const char* channel : stream2::channels(msg))
+        std::printf(" \"%s\"", channel);
+    std::printf("\n");
+    std::printf("image_dtype: \"%s\"\n",
+                msg.image_dtype ? msg.image_dtype : "");
+    std::printf("image_size: %" PRIu64 "x%" PRIu64 "\n", msg.image_size_x,
+                msg.image_size_y);
+    std::printf("number_of_images: %" PRIu64 "\n", msg.number_of_images);
+
+    // Pixel masks that are not compressed are viewed in place.
+    for (const stream2_pixel_mask& mask : stream2::pixel_mask(msg)) {
+        std::span<const uint32_t> values;
+        stream2_result r;
+        if ((r = stream2::typed_view(mask.pixel_mask, values))) {
+            std::printf("pixel_mask: \"%s\" not viewed (%i)\n", mask.channel,
+                        static_cast<int>(r));
+            continue;
+        }
+        size_t masked = 0;
+        for (uint32_t value : values)
+            masked += value != 0;
+        std::printf("pixel_mask: \"%s\" %zu of %zu pixels masked\n",
+                    mask.channel, masked, values.size());
+    }
+
+    stream2_series* created;
+    stream2_result r;
+    if ((r = stream2_series_create(&msg, nullptr, &created))) {
+        std::printf("series: error %i\n", static_cast<int>(r));
+        series.reset();
+        return;
+    }
+    series.reset(created);
+}
+
+template <class T>
+void print_image_data(stream2_series& series,
+                      const stream2_image_msg& msg,
+                      size_t channel) {
+    std::span<const T> frame;
+    stream2_result r;
+    if ((r = stream2::decode(series, msg, channel, 0, frame))) {
+        std::printf("data: error %i\n", static_cast<int>(r));
+        return;
+    }
+    uint64_t max = 0;
+    for (T value : frame) {
+        if (value <= series.saturation_value && value > max)
+            max = value;
+    }
+    std::printf("data: \"%s\" %zu pixels sum %" PRIu64 " max %" PRIu64 "\n",
+                stream2::data(msg)[channel].channel, frame.size(),
+                series.channels[channel].stats.sum[msg.image_id], max);
+}
+
+void print_image_msg(const stream2_image_msg& msg, stream2_series* series) {
+    std::printf("\nIMAGE MESSAGE: series_id %" PRIu64 " image_id %" PRIu64
+                "\n",
+                msg.series_id, msg.image_id);
+    if (series == nullptr)
+        return;
+    stream2_result r;
+    if ((r = stream2_series_add_image(series, &msg))) {
+        std::printf("series: error %i\n", static_cast<int>(r));
+        return;
+    }
+    for (size_t i = 0; i < stream2::data(msg).size(); i++) {
+        switch (series->tag) {
+            case STREAM2_TYPED_ARRAY_UINT8:
+                print_image_data<uint8_t>(*series, msg, i);
+                break;
+            case STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN:
+                print_image_data<uint16_t>(*series, msg, i);
+                break;
+            case STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN:
+                print_image_data<uint32_t>(*series, msg, i);
+                break;
+        }
+    }
+}
+
+void print_end_msg(const stream2_end_msg& msg, series_ptr& series) {
+    std::printf("\nEND MESSAGE: series_id %" PRIu64 "\n", msg.series_id);
+    if (!series)
+        return;
+    stream2_result r;
+    if ((r = stream2_series_end(series.get(), &msg))) {
+        std::printf("series: error %i\n", static_cast<int>(r));
+    } else {
+        std::printf("received: %" PRIu64 " of %" PRIu64 " images\n",
+                    series->received_count, series->number_of_images);
+        uint64_t image_id;
+        if (stream2_series_next_missing(series.get(), 0, &image_id))
+            std::printf("first missing image_id: %" PRIu64 "\n", image_id);
+    }
+    series.reset();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s HOST\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char address[100];
+    std::snprintf(address, sizeof(address), "tcp://%s:31001", argv[1]);
+
+    void* ctx = zmq_ctx_new();
+    void* socket = zmq_socket(ctx, ZMQ_PULL);
+    zmq_connect(socket, address);
+    zmq_msg_t zmsg;
+    zmq_msg_init(&zmsg);
+
+    series_ptr series;
+    for (;;) {
+        if (zmq_msg_recv(&zmsg, socket, 0) == -1)
+            break;
+
+        // The message points into zmsg and is freed before the next receive.
+        stream2::message msg;
+        stream2_result r;
+        if ((r = stream2::message::parse(
+                     {static_cast<const uint8_t*>(zmq_msg_data(&zmsg)),
+                      zmq_msg_size(&zmsg)},
+                     msg)))
+        {
+            std::fprintf(stderr, "error: error %i parsing message\n",
+                         static_cast<int>(r));
+            break;
+        }
+        msg.visit(overloaded{
+                [&](const stream2_start_msg& m) { print_start_msg(m, series); },
+                [&](const stream2_image_msg& m) {
+                    print_image_msg(m, series.get());
+                },
+                [&](const stream2_end_msg& m) { print_end_msg(m, series); },
+        });
+    }
+    zmq_msg_close(&zmsg);
+    zmq_close(socket);
+    zmq_ctx_term(ctx);
+    return EXIT_FAILURE;
+}
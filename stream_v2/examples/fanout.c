@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stream2.h"
+#include "stream2_fanout.h"
+
+enum { DEFAULT_QUEUE_CAPACITY = 256 };
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+// Parses a subscriber argument of the form ENDPOINT[,POLICY[,CAPACITY]].
+static int parse_subscriber(char* arg,
+                            struct stream2_fanout_subscriber_config* config) {
+    config->address = strtok(arg, ",");
+    config->policy = STREAM2_FANOUT_BLOCK;
+    config->queue_capacity = DEFAULT_QUEUE_CAPACITY;
+
+    const char* policy = strtok(NULL, ",");
+    if (policy == NULL)
+        return 0;
+    if (strcmp(policy, "block") == 0)
+        config->policy = STREAM2_FANOUT_BLOCK;
+    else if (strcmp(policy, "drop-newest") == 0)
+        config->policy = STREAM2_FANOUT_DROP_NEWEST;
+    else if (strcmp(policy, "drop-oldest") == 0)
+        config->policy = STREAM2_FANOUT_DROP_OLDEST;
+    else
+        return -1;
+
+    const char* capacity = strtok(NULL, ",");
+    if (capacity)
+        config->queue_capacity = strtoul(capacity, NULL, 10);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    if (argc < 3) {
+        fprintf(stderr,
+                "usage: %s HOST ENDPOINT[,block|drop-newest|drop-oldest"
+                "[,CAPACITY]]...\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char address[100];
+    snprintf(address, sizeof(address), "tcp://%s:31001", argv[1]);
+
+    const size_t len = argc - 2;
+    struct stream2_fanout_subscriber_config* subscribers =
+            calloc(len, sizeof(struct stream2_fanout_subscriber_config));
+    if (subscribers == NULL)
+        return EXIT_FAILURE;
+    for (size_t i = 0; i < len; i++) {
+        if (parse_subscriber(argv[2 + i], &subscribers[i])) {
+            fprintf(stderr, "error: invalid subscriber %s\n", argv[2 + i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct stream2_fanout_config config = {
+            .address = address,
+            .subscribers = subscribers,
+            .subscribers_len = len,
+    };
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct stream2_fanout* fanout;
+    if ((r = stream2_fanout_start(&config, &fanout))) {
+        fprintf(stderr, "error: error %i starting fanout\n", (int)r);
+        return EXIT_FAILURE;
+    }
+
+    while (!interrupted) {
+        sleep(1);
+        for (size_t i = 0; i < len; i++) {
+            struct stream2_fanout_counters counters;
+            stream2_fanout_counters(fanout, i, &counters);
+            printf("%s: sent %" PRIu64 " dropped %" PRIu64
+                   " dropped control %" PRIu64 " queue depth %zu max %zu\n",
+                   subscribers[i].address, counters.sent, counters.dropped,
+                   counters.dropped_control, counters.queue_depth,
+                   counters.max_queue_depth);
+        }
+        fflush(stdout);
+    }
+
+    stream2_fanout_stop(fanout);
+    free(subscribers);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stream2.h"
+#include "stream2_metalog.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double rational(uint64_t num, uint64_t den) {
+    return den ? (double)num / den : 0.0;
+}
+
+// Prints the images of a channel with more than min_saturated saturated
+// pixels.
+static void query_saturated(const struct stream2_metalog_reader* reader,
+                            size_t channel,
+                            uint64_t min_saturated) {
+    struct stream2_metalog_info info;
+    stream2_metalog_reader_info(reader, &info);
+    const size_t col =
+            stream2_metalog_channel_column(channel, STREAM2_METALOG_SATURATED);
+
+    uint64_t count = 0;
+    for (size_t b = 0; b < info.blocks; b++) {
+        struct stream2_metalog_block block;
+        stream2_metalog_reader_block(reader, b, &block);
+        const uint64_t* image_id =
+                block.columns + STREAM2_METALOG_IMAGE_ID * block.rows;
+        const uint64_t* saturated = block.columns + col * block.rows;
+        for (size_t i = 0; i < block.rows; i++) {
+            if (saturated[i] > min_saturated) {
+                printf("saturated: image_id %" PRIu64 " %" PRIu64 "\n",
+                       image_id[i], saturated[i]);
+                count++;
+            }
+        }
+    }
+    printf("saturated: %" PRIu64 " images with more than %" PRIu64
+           " saturated pixels in %s\n",
+           count, min_saturated,
+           stream2_metalog_reader_channel(reader, channel));
+}
+
+// Prints statistics of the intervals between the start times of consecutive
+// images.
+static enum stream2_result query_jitter(
+        const struct stream2_metalog_reader* reader) {
+    struct stream2_metalog_info info;
+    stream2_metalog_reader_info(reader, &info);
+
+    // Rows are not ordered by image_id.
+    double* start = malloc(info.number_of_images * sizeof(double));
+    if (info.number_of_images > 0 && start == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (uint64_t i = 0; i < info.number_of_images; i++)
+        start[i] = NAN;
+    for (size_t b = 0; b < info.blocks; b++) {
+        struct stream2_metalog_block block;
+        stream2_metalog_reader_block(reader, b, &block);
+        const uint64_t* image_id =
+                block.columns + STREAM2_METALOG_IMAGE_ID * block.rows;
+        const uint64_t* num =
+                block.columns + STREAM2_METALOG_START_TIME_NUM * block.rows;
+        const uint64_t* den =
+                block.columns + STREAM2_METALOG_START_TIME_DEN * block.rows;
+        for (size_t i = 0; i < block.rows; i++) {
+            if (image_id[i] < info.number_of_images)
+                start[image_id[i]] = rational(num[i], den[i]);
+        }
+    }
+
+    uint64_t n = 0;
+    double sum = 0.0, sum_sq = 0.0, min = INFINITY, max = -INFINITY;
+    for (uint64_t i = 1; i < info.number_of_images; i++) {
+        if (isnan(start[i - 1]) || isnan(start[i]))
+            continue;
+        const double dt = start[i] - start[i - 1];
+        n++;
+        sum += dt;
+        sum_sq += dt * dt;
+        min = dt < min ? dt : min;
+        max = dt > max ? dt : max;
+    }
+    free(start);
+    if (n == 0) {
+        printf("jitter: no consecutive images\n");
+        return STREAM2_OK;
+    }
+    const double mean = sum / n;
+    const double var = sum_sq / n - mean * mean;
+    printf("jitter: %" PRIu64 " intervals mean %.3f us stddev %.3f us "
+           "min %.3f us max %.3f us\n",
+           n, mean * 1e6, sqrt(var > 0.0 ? var : 0.0) * 1e6, min * 1e6,
+           max * 1e6);
+    return STREAM2_OK;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-c CHANNEL] [-s MIN_SATURATED] [-j] FILE\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    size_t channel = 0;
+    uint64_t min_saturated = 0;
+    int saturated = 0;
+    int jitter = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:j")) != -1) {
+        switch (opt) {
+            case 'c':
+                channel = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                min_saturated = strtoull(optarg, NULL, 10);
+                saturated = 1;
+                break;
+            case 'j':
+                jitter = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct stream2_metalog_reader* reader;
+    if ((r = stream2_metalog_reader_open(argv[optind], &reader))) {
+        fprintf(stderr, "error: error %i opening %s\n", (int)r, argv[optind]);
+        return EXIT_FAILURE;
+    }
+    struct stream2_metalog_info info;
+    stream2_metalog_reader_info(reader, &info);
+    printf("series_id %" PRIu64 " series_unique_id %s number_of_images %" PRIu64
+           " rows %" PRIu64 " channels %zu\n",
+           info.series_id, info.series_unique_id, info.number_of_images,
+           info.rows, info.channels);
+    if (channel >= info.channels && saturated) {
+        fprintf(stderr, "error: no channel %zu\n", channel);
+        stream2_metalog_reader_close(reader);
+        return EXIT_FAILURE;
+    }
+
+    const double start = now();
+    if (saturated)
+        query_saturated(reader, channel, min_saturated);
+    if (jitter && (r = query_jitter(reader))) {
+        fprintf(stderr, "error: error %i\n", (int)r);
+        stream2_metalog_reader_close(reader);
+        return EXIT_FAILURE;
+    }
+    printf("query: %.3f ms\n", (now() - start) * 1e3);
+
+    stream2_metalog_reader_close(reader);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stream2.h"
+#include "stream2_nxmx.h"
+#include "stream2_series.h"
+
+enum { MAX_DECODER_THREADS = 256 };
+
+struct decoder {
+    pthread_t thread;
+    size_t slot;
+    uint64_t images;
+    uint64_t bytes;
+    enum stream2_result result;
+};
+
+static struct stream2_nxmx_reader* reader;
+static struct stream2_series* series;
+static pthread_mutex_t series_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static enum stream2_result decode_image(struct decoder* decoder,
+                                        const struct stream2_image_msg* msg) {
+    enum stream2_result r;
+
+    pthread_mutex_lock(&series_mutex);
+    r = stream2_series_add_image(series, msg);
+    pthread_mutex_unlock(&series_mutex);
+    if (r)
+        return r;
+
+    for (size_t i = 0; i < msg->data.len; i++) {
+        const void* data;
+        if ((r = stream2_series_decode(series, msg, i, decoder->slot, &data)))
+            return r;
+        decoder->bytes += msg->data.ptr[i].data.array.data.len;
+    }
+    decoder->images++;
+    return STREAM2_OK;
+}
+
+// Decodes images until the end of the series, like the decoder threads of
+// the receiver.
+static void* decoder_thread(void* arg) {
+    struct decoder* decoder = arg;
+    enum stream2_result r;
+
+    struct stream2_msg* msg;
+    while ((r = stream2_nxmx_next(reader, &msg)) == STREAM2_OK && msg) {
+        if (msg->type == STREAM2_MSG_IMAGE) {
+            r = decode_image(decoder, (const struct stream2_image_msg*)msg);
+        } else if (msg->type == STREAM2_MSG_END) {
+            pthread_mutex_lock(&series_mutex);
+            r = stream2_series_end(series,
+                                   (const struct stream2_end_msg*)msg);
+            pthread_mutex_unlock(&series_mutex);
+        }
+        if (r) {
+            fprintf(stderr, "error: error %i image_id %" PRIu64 "\n", (int)r,
+                    msg->type == STREAM2_MSG_IMAGE
+                            ? ((const struct stream2_image_msg*)msg)->image_id
+                            : 0);
+        }
+        stream2_nxmx_free_msg(reader, msg);
+    }
+    decoder->result = r;
+    return NULL;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-t DECODER_THREADS] [-p PREFETCH] MASTER_FILE\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    struct stream2_nxmx_config config;
+    stream2_nxmx_config_default(&config);
+    size_t threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:p:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                config.prefetch = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || threads == 0 || threads > MAX_DECODER_THREADS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((r = stream2_nxmx_open(argv[optind], &config, &reader))) {
+        fprintf(stderr, "error: error %i opening %s\n", (int)r, argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    // The first message is the start message.
+    struct stream2_msg* msg;
+    if ((r = stream2_nxmx_next(reader, &msg))) {
+        fprintf(stderr, "error: error %i reading start message\n", (int)r);
+        stream2_nxmx_close(reader);
+        return EXIT_FAILURE;
+    }
+    const struct stream2_start_msg* start_msg =
+            (const struct stream2_start_msg*)msg;
+    struct stream2_series_config series_config;
+    stream2_series_config_default(&series_config);
+    series_config.decode_slots = threads;
+    if ((r = stream2_series_create(start_msg, &series_config, &series))) {
+        fprintf(stderr, "error: error %i creating series\n", (int)r);
+        stream2_nxmx_free_msg(reader, msg);
+        stream2_nxmx_close(reader);
+        return EXIT_FAILURE;
+    }
+    printf("start: series_id %" PRIu64 " number_of_images %" PRIu64
+           " channels %zu\n",
+           series->series_id, series->number_of_images, series->channels_len);
+    stream2_nxmx_free_msg(reader, msg);
+
+    struct decoder decoders[MAX_DECODER_THREADS];
+    const double start = now();
+    for (size_t i = 0; i < threads; i++) {
+        decoders[i].slot = i;
+        decoders[i].images = 0;
+        decoders[i].bytes = 0;
+        decoders[i].result = STREAM2_OK;
+        pthread_create(&decoders[i].thread, NULL, decoder_thread,
+                       &decoders[i]);
+    }
+    uint64_t images = 0;
+    uint64_t bytes = 0;
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(decoders[i].thread, NULL);
+        images += decoders[i].images;
+        bytes += decoders[i].bytes;
+        if (decoders[i].result) {
+            fprintf(stderr, "error: error %i reading %s\n",
+                    (int)decoders[i].result, argv[optind]);
+            status = EXIT_FAILURE;
+        }
+    }
+    const double elapsed = now() - start;
+
+    printf("end: series_id %" PRIu64 " received %" PRIu64 " of %" PRIu64
+           " images\n",
+           series->series_id, series->received_count,
+           series->number_of_images);
+    printf("decoded %" PRIu64 " images in %.3f s: %.1f images/s %.2f GB/s "
+           "compressed\n",
+           images, elapsed, images / elapsed, bytes / elapsed * 1e-9);
+
+    stream2_series_free(series);
+    stream2_nxmx_close(reader);
+    return status;
+}
@@ -0,0 +1,874 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stream2.h"
+#include "stream2_azint.h"
+#include "stream2_binning.h"
+#include "stream2_latency.h"
+#include "stream2_metalog.h"
+#include "stream2_peaks.h"
+#include "stream2_pixstats.h"
+#include "stream2_placement.h"
+#include "stream2_preview.h"
+#include "stream2_receiver.h"
+#include "stream2_series.h"
+#include "stream2_shm.h"
+#include "stream2_sink.h"
+#include "stream2_slab.h"
+#include "stream2_stats.h"
+#include "stream2_telemetry.h"
+
+enum { MAX_DECODER_CPUS = 256, SHM_SLOTS = 64 };
+
+static volatile sig_atomic_t interrupted = 0;
+
+// Shared memory ring the decoded frames are published to, if any. Decoder
+// threads take turns as its single writer.
+static const char* shm_name = NULL;
+static struct stream2_shm_writer* shm_writer = NULL;
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared memory ring the preview pyramids of sampled frames are published to,
+// if any. The thread that took the pyramid is its single writer.
+static const char* preview_shm_name = NULL;
+static struct stream2_shm_writer* preview_writer = NULL;
+static struct stream2_preview_config preview_config;
+static struct stream2_preview* preview = NULL;
+
+// File the image payloads are written to as received, if any.
+static struct stream2_sink* sink = NULL;
+static pthread_mutex_t sink_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics of the stages of the receiver, if printed, into which the
+// writes to the sink are recorded as well.
+static struct stream2_stats* stats = NULL;
+// Accounting of the memory of parsed messages, printed with the statistics.
+static struct stream2_allocator_stats allocator_stats;
+
+// Tracker of the lag of the images behind their exposure, if printed.
+static struct stream2_latency* latency = NULL;
+
+// Compression ratio and bandwidth of every channel, if printed.
+static struct stream2_telemetry* telemetry = NULL;
+
+// Directory the metadata log of every series is written to, if any.
+static const char* metalog_dir = NULL;
+static struct stream2_metalog_writer* metalog = NULL;
+
+// Slab every frame of the current series is kept in, if any. It is freed
+// when the next series starts.
+static bool slab_enabled = false;
+static struct stream2_slab_config slab_config;
+static struct stream2_slab* slab = NULL;
+
+// File the peaks of every frame are written to, if any, as records of
+// struct stream2_peak_record.
+static FILE* peaks_file = NULL;
+static struct stream2_peak_config peak_config;
+static struct stream2_peak_finder* peak_finder = NULL;
+static uint8_t* peaks_record = NULL;
+static pthread_mutex_t peaks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// File the azimuthally integrated profiles of every frame are written to, if
+// any, as records of struct stream2_azint_record. Each decoder thread
+// integrates into its own profile.
+static FILE* profiles_file = NULL;
+static struct stream2_azint_config azint_config;
+static struct stream2_azint* azint = NULL;
+static float* profiles = NULL;
+static pthread_mutex_t profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// File the candidate masks of every series are written to, if any, as
+// image_size_x * image_size_y values of uint32 per channel, from the
+// statistics of the pixels of the series.
+static FILE* candidates_file = NULL;
+static struct stream2_pixstats_config pixstats_config;
+static struct stream2_pixstats* pixstats = NULL;
+
+// Binning of the frames of the current series, if any. binning_data holds
+// the decode buffers of every channel of every decoder thread, or
+// binning_frames their sparse frames if images are decoded into sparse
+// frames.
+static bool binning_enabled = false;
+static struct stream2_binning_config binning_config;
+static struct stream2_binning* binning = NULL;
+static size_t binning_slots = 0;
+static const void** binning_data = NULL;
+static const struct stream2_sparse_frame** binning_frames = NULL;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+static void close_metalog(void) {
+    enum stream2_result r;
+    if (metalog && (r = stream2_metalog_writer_close(metalog)))
+        fprintf(stderr, "error: error %i writing metadata log\n", (int)r);
+    metalog = NULL;
+}
+
+static void handle_binned(void* user,
+                          const struct stream2_image_msg* msg,
+                          size_t frames) {
+    (void)user;
+    printf("binned: image_id %" PRIu64 " frames %zu\n", msg->image_id,
+           frames);
+}
+
+static void handle_start(void* user,
+                         struct stream2_series* series,
+                         const struct stream2_start_msg* msg) {
+    (void)user;
+    printf("start: series_id %" PRIu64 " number_of_images %" PRIu64
+           " channels %zu\n",
+           series->series_id, series->number_of_images, series->channels_len);
+
+    // The ring is sized for the frames of the first series.
+    if (shm_name && shm_writer == NULL) {
+        enum stream2_result r;
+        pthread_mutex_lock(&shm_mutex);
+        if ((r = stream2_shm_writer_create(shm_name, SHM_SLOTS,
+                                           series->frame_size, &shm_writer)))
+            fprintf(stderr, "error: error %i creating %s\n", (int)r, shm_name);
+        pthread_mutex_unlock(&shm_mutex);
+    }
+
+    // The preview ring is sized for the largest level of the first series.
+    if (preview_shm_name) {
+        enum stream2_result r;
+        stream2_preview_free(preview);
+        if ((r = stream2_preview_create(series, &preview_config, &preview))) {
+            fprintf(stderr, "error: error %i creating preview\n", (int)r);
+        } else if (preview_writer == NULL && series->channels_len > 0) {
+            struct stream2_preview_level level;
+            stream2_preview_level(preview, 0, 1, &level);
+            if ((r = stream2_shm_writer_create(preview_shm_name, SHM_SLOTS,
+                                               level.size, &preview_writer)))
+            {
+                fprintf(stderr, "error: error %i creating %s\n", (int)r,
+                        preview_shm_name);
+            }
+        }
+    }
+
+    // The log of a series that did not end is closed with the next series.
+    if (metalog_dir) {
+        enum stream2_result r;
+        close_metalog();
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/series_%" PRIu64 ".metalog",
+                 metalog_dir, series->series_id);
+        if ((r = stream2_metalog_writer_open(path, series, NULL, &metalog)))
+            fprintf(stderr, "error: error %i opening %s\n", (int)r, path);
+    }
+
+    if (slab_enabled) {
+        enum stream2_result r;
+        stream2_slab_free(slab);
+        if ((r = stream2_slab_create(series, &slab_config, &slab)))
+            fprintf(stderr, "error: error %i creating slab\n", (int)r);
+    }
+
+    if (peaks_file) {
+        enum stream2_result r;
+        stream2_peak_finder_free(peak_finder);
+        if ((r = stream2_peak_finder_create(series, msg, &peak_config,
+                                            &peak_finder)))
+            fprintf(stderr, "error: error %i creating peak finder\n", (int)r);
+    }
+
+    if (profiles_file) {
+        enum stream2_result r;
+        stream2_azint_free(azint);
+        if ((r = stream2_azint_create(series, msg, &azint_config, &azint)))
+            fprintf(stderr, "error: error %i creating integrator\n", (int)r);
+    }
+
+    if (candidates_file) {
+        enum stream2_result r;
+        stream2_pixstats_free(pixstats);
+        if ((r = stream2_pixstats_create(series, msg, &pixstats_config,
+                                         &pixstats)))
+            fprintf(stderr, "error: error %i creating statistics\n", (int)r);
+    }
+
+    if (binning_enabled) {
+        enum stream2_result r;
+        stream2_binning_free(binning);
+        free(binning_data);
+        free(binning_frames);
+        const size_t len = binning_slots * series->channels_len;
+        binning_data = malloc(len * sizeof(void*));
+        binning_frames = malloc(len * sizeof(struct stream2_sparse_frame*));
+        if (binning_data == NULL || binning_frames == NULL) {
+            r = STREAM2_ERROR_OUT_OF_MEMORY;
+        } else {
+            for (size_t i = 0; i < binning_slots; i++) {
+                for (size_t j = 0; j < series->channels_len; j++) {
+                    const size_t k = i * series->channels_len + j;
+                    const struct stream2_series_channel* channel =
+                            &series->channels[j];
+                    binning_data[k] = channel->decode_buffers
+                                              ? channel->decode_buffers[i]
+                                              : NULL;
+                    binning_frames[k] = channel->sparse_frames
+                                                ? channel->sparse_frames[i]
+                                                : NULL;
+                }
+            }
+            // Sums of 32-bit frames rarely fit into 32 bits.
+            binning_config.accumulator_size = series->elem_size == 4 ? 8 : 4;
+            r = stream2_binning_create(series, &binning_config, &binning);
+        }
+        if (r)
+            fprintf(stderr, "error: error %i creating binning\n", (int)r);
+    }
+}
+
+// Publishes every level of the pyramid of every channel of an image.
+static enum stream2_result publish_preview(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t decoder) {
+    enum stream2_result r;
+
+    for (size_t i = 0; i < series->channels_len; i++) {
+        if ((r = stream2_preview_build(
+                     preview, i, series->channels[i].decode_buffers[decoder])))
+            return r;
+        for (size_t j = 1; j <= stream2_preview_levels(preview); j++) {
+            struct stream2_preview_level level;
+            if ((r = stream2_preview_level(preview, i, j, &level)))
+                return r;
+            if (level.size > stream2_shm_writer_slot_size(preview_writer))
+                return STREAM2_ERROR_OUT_OF_MEMORY;
+
+            struct stream2_shm_frame frame;
+            stream2_shm_frame_from_msg(&frame, msg, i, series->tag);
+            frame.dim[0] = level.height;
+            frame.dim[1] = level.width;
+            frame.level = level.level;
+            memcpy(stream2_shm_writer_reserve(preview_writer), level.data,
+                   level.size);
+            if ((r = stream2_shm_writer_commit(preview_writer,
+                                               STREAM2_SHM_FRAME, &frame,
+                                               level.size)))
+                return r;
+        }
+    }
+    return STREAM2_OK;
+}
+
+static void handle_image(void* user,
+                         struct stream2_series* series,
+                         const struct stream2_image_msg* msg,
+                         size_t decoder) {
+    enum stream2_result r;
+
+    (void)user;
+    pthread_mutex_lock(&shm_mutex);
+    for (size_t i = 0; shm_writer && i < series->channels_len; i++) {
+        if ((r = stream2_shm_writer_write_frame(
+                     shm_writer, msg, i, series->tag,
+                     series->channels[i].decode_buffers[decoder],
+                     series->frame_size)))
+        {
+            fprintf(stderr,
+                    "error: error %i publishing image_id %" PRIu64 "\n",
+                    (int)r, msg->image_id);
+        }
+    }
+    pthread_mutex_unlock(&shm_mutex);
+
+    if (preview && preview_writer && stream2_preview_begin(preview)) {
+        if ((r = publish_preview(series, msg, decoder))) {
+            fprintf(stderr,
+                    "error: error %i previewing image_id %" PRIu64 "\n",
+                    (int)r, msg->image_id);
+        }
+        stream2_preview_end(preview);
+    }
+
+    if (sink) {
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < msg->data.len; i++)
+            bytes += msg->data.ptr[i].data.array.data.len;
+        pthread_mutex_lock(&sink_mutex);
+        const uint64_t start = stats ? stream2_stats_now_ns() : 0;
+        if ((r = stream2_sink_write_image(sink, msg))) {
+            fprintf(stderr,
+                    "error: error %i writing image_id %" PRIu64 "\n",
+                    (int)r, msg->image_id);
+        }
+        if (stats) {
+            stream2_stats_record(stats, 1 + decoder, STREAM2_STAGE_WRITE,
+                                 stream2_stats_now_ns() - start, bytes);
+        }
+        pthread_mutex_unlock(&sink_mutex);
+    }
+
+    if (slab && slab_config.storage == STREAM2_SLAB_DECODED) {
+        for (size_t i = 0; i < series->channels_len; i++) {
+            if ((r = stream2_slab_store_decoded(
+                         slab, msg->image_id, i,
+                         series->channels[i].decode_buffers[decoder])))
+            {
+                fprintf(stderr,
+                        "error: error %i storing image_id %" PRIu64 "\n",
+                        (int)r, msg->image_id);
+            }
+        }
+    } else if (slab && (r = stream2_slab_store_image(slab, series, msg))) {
+        fprintf(stderr, "error: error %i storing image_id %" PRIu64 "\n",
+                (int)r, msg->image_id);
+    }
+
+    for (size_t i = 0; peak_finder && i < series->channels_len; i++) {
+        struct stream2_peak_list list;
+        if ((r = stream2_peak_finder_find(
+                     peak_finder, decoder, i, msg->image_id,
+                     series->channels[i].decode_buffers[decoder], &list)))
+        {
+            fprintf(stderr,
+                    "error: error %i finding peaks of image_id %" PRIu64 "\n",
+                    (int)r, msg->image_id);
+            continue;
+        }
+        pthread_mutex_lock(&peaks_mutex);
+        stream2_peak_record_encode(&list, peaks_record);
+        fwrite(peaks_record, 1, stream2_peak_record_size(&list), peaks_file);
+        pthread_mutex_unlock(&peaks_mutex);
+    }
+
+    for (size_t i = 0; azint && i < series->channels_len; i++) {
+        const size_t bins = azint_config.bins;
+        float* profile = profiles + decoder * bins;
+        if ((r = stream2_azint_integrate(
+                     azint, i, series->channels[i].decode_buffers[decoder],
+                     profile, NULL)))
+        {
+            fprintf(stderr,
+                    "error: error %i integrating image_id %" PRIu64 "\n",
+                    (int)r, msg->image_id);
+            continue;
+        }
+        const struct stream2_azint_record record = {
+                .image_id = msg->image_id,
+                .channel = (uint32_t)i,
+                .bins = (uint32_t)bins,
+        };
+        pthread_mutex_lock(&profiles_mutex);
+        fwrite(&record, sizeof(record), 1, profiles_file);
+        fwrite(profile, sizeof(float), bins, profiles_file);
+        pthread_mutex_unlock(&profiles_mutex);
+    }
+
+    for (size_t i = 0; pixstats && i < series->channels_len; i++) {
+        if (series->config.sparse)
+            r = stream2_pixstats_add_sparse(
+                    pixstats, i, series->channels[i].sparse_frames[decoder]);
+        else
+            r = stream2_pixstats_add(
+                    pixstats, i, series->channels[i].decode_buffers[decoder]);
+        if (r) {
+            fprintf(stderr,
+                    "error: error %i adding image_id %" PRIu64
+                    " to statistics\n",
+                    (int)r, msg->image_id);
+        }
+    }
+
+    const size_t first = decoder * series->channels_len;
+    if (binning &&
+        (r = series->config.sparse
+                     ? stream2_binning_add_sparse(binning, msg,
+                                                  binning_frames + first)
+                     : stream2_binning_add(binning, msg,
+                                           binning_data + first)))
+    {
+        fprintf(stderr, "error: error %i binning image_id %" PRIu64 "\n",
+                (int)r, msg->image_id);
+    }
+
+    if (metalog && (r = stream2_metalog_writer_append(metalog, series, msg))) {
+        fprintf(stderr, "error: error %i logging image_id %" PRIu64 "\n",
+                (int)r, msg->image_id);
+    }
+}
+
+// Prints the summary of the statistics of every channel and writes its
+// candidate mask.
+static void summarize_pixstats(const struct stream2_series* series) {
+    const size_t pixels = series->image_size_x * series->image_size_y;
+    uint32_t* candidates = malloc(pixels * sizeof(uint32_t));
+    if (candidates == NULL) {
+        fprintf(stderr, "error: error %i summarizing statistics\n",
+                (int)STREAM2_ERROR_OUT_OF_MEMORY);
+        return;
+    }
+    for (size_t i = 0; i < series->channels_len; i++) {
+        struct stream2_pixstats_summary summary;
+        stream2_pixstats_summarize(pixstats, i, &summary, candidates);
+        printf("pixels: channel %zu frames %" PRIu64 " mean %.3f variance "
+               "%.3f dead %" PRIu64 " hot %" PRIu64 " noisy %" PRIu64
+               " unmasked %" PRIu64 " masked %" PRIu64 "\n",
+               i, summary.frames, summary.mean, summary.variance,
+               summary.dead, summary.hot, summary.noisy,
+               summary.flagged_unmasked, summary.masked_unflagged);
+        fwrite(candidates, sizeof(uint32_t), pixels, candidates_file);
+    }
+    free(candidates);
+}
+
+static void handle_end(void* user,
+                       struct stream2_series* series,
+                       const struct stream2_end_msg* msg) {
+    (void)user;
+    (void)msg;
+    close_metalog();
+    if (binning)
+        stream2_binning_flush(binning);
+    if (pixstats)
+        summarize_pixstats(series);
+    if (slab) {
+        struct stream2_slab_stats stats;
+        stream2_slab_stats(slab, &stats);
+        printf("slab: %" PRIu64 " frames %zu of %zu bytes%s\n", stats.frames,
+               stats.used, stats.size, stats.hugepages ? " hugepages" : "");
+    }
+    if (latency) {
+        struct stream2_latency_snapshot snapshot;
+        stream2_latency_snapshot(latency, &snapshot);
+        stream2_latency_print(&snapshot, stdout);
+    }
+    printf("end: series_id %" PRIu64 " received %" PRIu64 " of %" PRIu64
+           " images\n",
+           series->series_id, series->received_count,
+           series->number_of_images);
+}
+
+static void handle_dropped(void* user,
+                           struct stream2_series* series,
+                           uint64_t image_id) {
+    (void)user;
+    (void)series;
+    printf("dropped: image_id %" PRIu64 "\n", image_id);
+}
+
+static void handle_overload(void* user,
+                            enum stream2_overload_mode from,
+                            enum stream2_overload_mode to,
+                            size_t queue_depth) {
+    (void)user;
+    printf("overload: %s -> %s queue depth %zu\n",
+           stream2_overload_mode_name(from), stream2_overload_mode_name(to),
+           queue_depth);
+}
+
+static void handle_error(void* user,
+                         enum stream2_result r,
+                         const struct stream2_msg* msg) {
+    (void)user;
+    if (msg && msg->type == STREAM2_MSG_IMAGE) {
+        fprintf(stderr, "error: error %i image_id %" PRIu64 "\n", (int)r,
+                ((const struct stream2_image_msg*)msg)->image_id);
+    } else {
+        fprintf(stderr, "error: error %i\n", (int)r);
+    }
+}
+
+static void print_stats(bool json) {
+    if (stats) {
+        struct stream2_stats_snapshot snapshot;
+        stream2_stats_snapshot(stats, &snapshot);
+        if (json)
+            stream2_stats_print_json(&snapshot, stdout);
+        else
+            stream2_stats_print(&snapshot, stdout);
+        const char* types[] = {"start", "image", "end"};
+        for (int type = 0; !json && type < STREAM2_MSG_TYPES; type++) {
+            const struct stream2_allocator_counters* c =
+                    &allocator_stats.types[type];
+            printf("alloc: %-5s %" PRIu64 " allocations %" PRIu64
+                   " frees %" PRIu64 " bytes peak %" PRIu64 " bytes\n",
+                   types[type], c->allocations, c->frees, c->current_bytes,
+                   c->peak_bytes);
+        }
+    }
+    if (latency) {
+        struct stream2_latency_snapshot snapshot;
+        stream2_latency_snapshot(latency, &snapshot);
+        stream2_latency_print(&snapshot, stdout);
+    }
+    if (telemetry) {
+        struct stream2_telemetry_snapshot snapshot;
+        stream2_telemetry_snapshot(telemetry, &snapshot);
+        stream2_telemetry_print(&snapshot, stdout);
+    }
+    fflush(stdout);
+}
+
+static void handle_telemetry_alert(
+        void* user,
+        size_t channel,
+        const struct stream2_telemetry_channel* window) {
+    (void)user;
+    (void)channel;
+    fprintf(stderr, "warning: channel %s ratio %.2f p10 %.2f %.3f GB/s:",
+            window->name, window->ratio, window->ratio_p10,
+            window->compressed_gbps);
+    for (unsigned alert = 1; alert <= STREAM2_TELEMETRY_UNCOMPRESSED_HIGH;
+         alert <<= 1)
+    {
+        if (window->alerts & alert)
+            fprintf(stderr, " %s", stream2_telemetry_alert_name(alert));
+    }
+    fprintf(stderr, "\n");
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-t DECODER_THREADS] [-q QUEUE_CAPACITY] "
+            "[-i NIC_INTERFACE] [-n NIC_NODE] [-c DECODER_CPUS] [-f] [-o] "
+            "[-s SHM_NAME] [-w FILE] [-m METALOG_DIR] [-M compressed|decoded] "
+            "[-H] [-P PEAKS_FILE] [-A PROFILES_FILE] [-S SUM_FRAMES] "
+            "[-B BIN_SIZE] [-p PREVIEW_SHM_NAME] [-r PREVIEW_RATE] "
+            "[-D CANDIDATES_FILE] [-z] [-T STATS_INTERVAL] [-J] [-L] "
+            "[-R MIN_RATIO] HOST\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    struct stream2_receiver_config config;
+    stream2_receiver_config_default(&config);
+    config.callbacks.start = handle_start;
+    config.callbacks.end = handle_end;
+    config.callbacks.dropped = handle_dropped;
+    config.callbacks.overload = handle_overload;
+    config.callbacks.error = handle_error;
+
+    stream2_slab_config_default(&slab_config);
+    stream2_peak_config_default(&peak_config);
+    const char* peaks_path = NULL;
+    stream2_azint_config_default(&azint_config);
+    const char* profiles_path = NULL;
+    stream2_pixstats_config_default(&pixstats_config);
+    const char* candidates_path = NULL;
+    stream2_preview_config_default(&preview_config);
+    stream2_binning_config_default(&binning_config);
+    binning_config.frames = 1;
+    binning_config.emit = handle_binned;
+
+    int decoder_cpus[MAX_DECODER_CPUS];
+    const char* sink_path = NULL;
+    bool stats_enabled = false;
+    bool stats_json = false;
+    unsigned stats_interval = 0;
+    bool latency_enabled = false;
+    struct stream2_telemetry_config telemetry_config;
+    stream2_telemetry_config_default(&telemetry_config);
+    telemetry_config.alert = handle_telemetry_alert;
+    bool telemetry_enabled = false;
+    int opt;
+    while ((opt = getopt(argc, argv,
+                         "t:q:i:n:c:fos:w:m:M:HP:A:S:B:p:r:D:zT:JLR:")) != -1)
+    {
+        switch (opt) {
+            case 't':
+                config.decoder_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                config.queue_capacity = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                config.placement.nic_interface = optarg;
+                break;
+            case 'n':
+                config.placement.nic_node = atoi(optarg);
+                break;
+            case 'c': {
+                struct stream2_cpu_set cpus;
+                if (stream2_cpu_set_parse(optarg, &cpus)) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                size_t len = 0;
+                for (int cpu = 0; cpu < STREAM2_MAX_CPUS; cpu++) {
+                    if (stream2_cpu_set_has(&cpus, cpu) &&
+                        len < MAX_DECODER_CPUS)
+                        decoder_cpus[len++] = cpu;
+                }
+                config.placement.decoder_cpus = decoder_cpus;
+                config.placement.decoder_cpus_len = len;
+                break;
+            }
+            case 'f':
+                config.placement.first_touch = true;
+                break;
+            case 'o':
+                config.overload.enabled = true;
+                break;
+            case 's':
+                shm_name = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'w':
+                sink_path = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'm':
+                metalog_dir = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'M':
+                if (strcmp(optarg, "compressed") == 0) {
+                    slab_config.storage = STREAM2_SLAB_COMPRESSED;
+                } else if (strcmp(optarg, "decoded") == 0) {
+                    slab_config.storage = STREAM2_SLAB_DECODED;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                slab_enabled = true;
+                config.callbacks.image = handle_image;
+                break;
+            case 'H':
+                slab_config.pages = STREAM2_SLAB_PAGES_EXPLICIT;
+                break;
+            case 'P':
+                peaks_path = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'A':
+                profiles_path = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'S':
+                binning_config.frames = strtoul(optarg, NULL, 10);
+                binning_enabled = true;
+                config.callbacks.image = handle_image;
+                break;
+            case 'B':
+                binning_config.bin_size = strtoul(optarg, NULL, 10);
+                binning_enabled = true;
+                config.callbacks.image = handle_image;
+                break;
+            case 'p':
+                preview_shm_name = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'r':
+                preview_config.rate = strtod(optarg, NULL);
+                break;
+            case 'D':
+                candidates_path = optarg;
+                config.callbacks.image = handle_image;
+                break;
+            case 'z':
+                config.sparse = true;
+                break;
+            case 'T':
+                stats_interval = strtoul(optarg, NULL, 10);
+                stats_enabled = true;
+                break;
+            case 'J':
+                stats_json = true;
+                stats_enabled = true;
+                break;
+            case 'L':
+                latency_enabled = true;
+                break;
+            case 'R':
+                telemetry_config.min_ratio = strtod(optarg, NULL);
+                telemetry_enabled = true;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // Only binning and statistics take sparse frames.
+    if (config.sparse &&
+        (shm_name || preview_shm_name || peaks_path || profiles_path ||
+         (slab_enabled && slab_config.storage == STREAM2_SLAB_DECODED)))
+    {
+        fprintf(stderr, "error: -z only works with -S, -B, -D, -w, -m and "
+                        "-M compressed\n");
+        return EXIT_FAILURE;
+    }
+
+    char address[100];
+    snprintf(address, sizeof(address), "tcp://%s:31001", argv[optind]);
+    config.address = address;
+
+    if (sink_path) {
+        struct stream2_sink_config sink_config;
+        stream2_sink_config_default(&sink_config);
+        if ((r = stream2_sink_open(sink_path, &sink_config, &sink))) {
+            fprintf(stderr, "error: error %i opening %s\n", (int)r,
+                    sink_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (peaks_path) {
+        peak_config.slots = config.decoder_threads;
+        peaks_record = malloc(sizeof(struct stream2_peak_record) +
+                              peak_config.max_peaks *
+                                      sizeof(struct stream2_peak));
+        if (peaks_record == NULL ||
+            (peaks_file = fopen(peaks_path, "wb")) == NULL)
+        {
+            fprintf(stderr, "error: error opening %s\n", peaks_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (profiles_path) {
+        profiles = malloc(config.decoder_threads * azint_config.bins *
+                          sizeof(float));
+        if (profiles == NULL ||
+            (profiles_file = fopen(profiles_path, "wb")) == NULL)
+        {
+            fprintf(stderr, "error: error opening %s\n", profiles_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Every decoder thread adds its own frames, one at a time, so a pool of
+    // threads per frame would only make the decoder threads wait longer.
+    if (candidates_path) {
+        pixstats_config.threads = 1;
+        if ((candidates_file = fopen(candidates_path, "wb")) == NULL) {
+            fprintf(stderr, "error: error opening %s\n", candidates_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    binning_slots = config.decoder_threads;
+
+    struct stream2_allocator allocator;
+    stream2_allocator_default(&allocator);
+    allocator.stats = &allocator_stats;
+    if (stats_enabled) {
+        if ((r = stream2_stats_create(1 + config.decoder_threads, &stats))) {
+            fprintf(stderr, "error: error %i creating statistics\n", (int)r);
+            return EXIT_FAILURE;
+        }
+        config.stats = stats;
+        config.allocator = &allocator;
+    }
+    if (latency_enabled) {
+        struct stream2_latency_config latency_config;
+        stream2_latency_config_default(&latency_config);
+        if ((r = stream2_latency_create(&latency_config,
+                                        config.decoder_threads, &latency)))
+        {
+            fprintf(stderr, "error: error %i creating latency tracker\n",
+                    (int)r);
+            return EXIT_FAILURE;
+        }
+        config.latency = latency;
+    }
+    if (telemetry_enabled) {
+        if ((r = stream2_telemetry_create(&telemetry_config, &telemetry))) {
+            fprintf(stderr, "error: error %i creating telemetry\n", (int)r);
+            return EXIT_FAILURE;
+        }
+        config.telemetry = telemetry;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct stream2_receiver* receiver;
+    if ((r = stream2_receiver_start(&config, &receiver))) {
+        fprintf(stderr, "error: error %i starting receiver\n", (int)r);
+        return EXIT_FAILURE;
+    }
+    stream2_receiver_print_placement(receiver, stdout);
+    fflush(stdout);
+
+    // Statistics, latencies and telemetry are printed every stats_interval
+    // seconds, if not zero, and statistics once more when the receiver stops.
+    // Latencies are printed at the end of every series as well.
+    while (!interrupted) {
+        if ((stats || latency || telemetry) && stats_interval > 0) {
+            sleep(stats_interval);
+            print_stats(stats_json);
+        } else {
+            pause();
+        }
+    }
+
+    struct stream2_overload_counters counters;
+    stream2_receiver_overload_counters(receiver, &counters);
+    for (int mode = 0; mode < STREAM2_OVERLOAD_MODES; mode++) {
+        printf("overload: %s: %" PRIu64 " images\n",
+               stream2_overload_mode_name(mode), counters.images[mode]);
+    }
+    printf("overload: %" PRIu64 " dropped %" PRIu64 " transitions\n",
+           counters.dropped, counters.transitions);
+
+    stream2_receiver_stop(receiver);
+    if (stats)
+        print_stats(stats_json);
+    stream2_stats_free(stats);
+    stream2_latency_free(latency);
+    stream2_telemetry_free(telemetry);
+    stream2_shm_writer_free(shm_writer);
+    stream2_shm_writer_free(preview_writer);
+    stream2_preview_free(preview);
+    close_metalog();
+    stream2_slab_free(slab);
+    stream2_peak_finder_free(peak_finder);
+    free(peaks_record);
+    if (peaks_file && fclose(peaks_file)) {
+        fprintf(stderr, "error: error writing %s\n", peaks_path);
+        return EXIT_FAILURE;
+    }
+    stream2_binning_free(binning);
+    free(binning_data);
+    free(binning_frames);
+    stream2_pixstats_free(pixstats);
+    if (candidates_file && fclose(candidates_file)) {
+        fprintf(stderr, "error: error writing %s\n", candidates_path);
+        return EXIT_FAILURE;
+    }
+    stream2_azint_free(azint);
+    free(profiles);
+    if (profiles_file && fclose(profiles_file)) {
+        fprintf(stderr, "error: error writing %s\n", profiles_path);
+        return EXIT_FAILURE;
+    }
+
+    if (sink) {
+        struct stream2_sink_stats stats;
+        stream2_sink_stats(sink, &stats);
+        printf("sink: %" PRIu64 " bytes %" PRIu64 " writes %.2f GB/s latency "
+               "p50 %.0f us p99 %.0f us max %.0f us\n",
+               stats.bytes, stats.writes, stats.gbps, stats.latency_p50_us,
+               stats.latency_p99_us, stats.latency_max_us);
+        if ((r = stream2_sink_close(sink))) {
+            fprintf(stderr, "error: error %i writing %s\n", (int)r,
+                    sink_path);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <zmq.h>
+
+#include "stream2.h"
+#include "stream2_capture.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_until(double t) {
+    const double dt = t - now();
+    if (dt > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)dt;
+        ts.tv_nsec = (long)((dt - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void print_entry(const struct stream2_capture_reader* reader,
+                        size_t index) {
+    const struct stream2_capture_entry* entry =
+            stream2_capture_reader_entry(reader, index);
+    printf("message %zu: offset %" PRIu64 " size %" PRIu64 " type %" PRIu32
+           " series %" PRIu32 " image_id %" PRIu64 "\n",
+           index, entry->offset, entry->size, entry->type, entry->series,
+           entry->image_id);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-a ADDRESS] [-r IMAGE_RATE] [-l LOOPS] [-p] "
+            "[-i SERIES/IMAGE_ID] CAPTURE\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    const char* address = "tcp://*:31001";
+    double rate = 0;
+    unsigned long loops = 1;
+    bool parse_only = false;
+    const char* find = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:r:l:pi:")) != -1) {
+        switch (opt) {
+            case 'a':
+                address = optarg;
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'l':
+                loops = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                parse_only = true;
+                break;
+            case 'i':
+                find = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct stream2_capture_reader* reader;
+    if ((r = stream2_capture_reader_open(argv[optind], &reader))) {
+        fprintf(stderr, "error: error %i opening %s\n", (int)r, argv[optind]);
+        return EXIT_FAILURE;
+    }
+    const size_t len = stream2_capture_reader_len(reader);
+
+    if (find) {
+        uint32_t series = 0;
+        uint64_t image_id = 0;
+        size_t index;
+        if (sscanf(find, "%" SCNu32 "/%" SCNu64, &series, &image_id) != 2 ||
+            !stream2_capture_reader_find(reader, series, image_id, &index))
+        {
+            fprintf(stderr, "error: image %s not captured\n", find);
+            stream2_capture_reader_close(reader);
+            return EXIT_FAILURE;
+        }
+        print_entry(reader, index);
+        stream2_capture_reader_close(reader);
+        return EXIT_SUCCESS;
+    }
+
+    void* ctx = NULL;
+    void* socket = NULL;
+    if (!parse_only) {
+        ctx = zmq_ctx_new();
+        socket = zmq_socket(ctx, ZMQ_PUSH);
+        if (zmq_bind(socket, address)) {
+            fprintf(stderr, "error: cannot bind %s\n", address);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t messages = 0;
+    uint64_t images = 0;
+    uint64_t bytes = 0;
+    const double start = now();
+    for (unsigned long loop = 0; loop < loops; loop++) {
+        for (size_t i = 0; i < len; i++) {
+            const struct stream2_capture_entry* entry =
+                    stream2_capture_reader_entry(reader, i);
+            const uint8_t* data = stream2_capture_reader_data(reader, i);
+
+            if (entry->type == STREAM2_MSG_IMAGE) {
+                if (rate > 0)
+                    sleep_until(start + images / rate);
+                images++;
+            }
+
+            if (parse_only) {
+                struct stream2_msg* msg;
+                if ((r = stream2_capture_reader_parse(reader, i, &msg))) {
+                    fprintf(stderr, "error: error %i parsing message %zu\n",
+                            (int)r, i);
+                } else {
+                    stream2_free_msg(msg);
+                }
+            } else {
+                // The mapping outlives the socket, so messages are sent
+                // without copies.
+                zmq_msg_t msg;
+                zmq_msg_init_data(&msg, (void*)data, entry->size, NULL, NULL);
+                if (zmq_msg_send(&msg, socket, 0) == -1) {
+                    zmq_msg_close(&msg);
+                    fprintf(stderr, "error: error sending message %zu\n", i);
+                }
+            }
+            messages++;
+            bytes += entry->size;
+        }
+    }
+    const double elapsed = now() - start;
+
+    printf("replayed %" PRIu64 " messages %" PRIu64 " images in %.3f s: "
+           "%.1f images/s %.2f GB/s\n",
+           messages, images, elapsed, images / elapsed,
+           bytes / elapsed * 1e-9);
+
+    if (socket) {
+        // Waits until queued messages are sent before unmapping them.
+        zmq_close(socket);
+        zmq_ctx_term(ctx);
+    }
+    stream2_capture_reader_close(reader);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stream2.h"
+#include "stream2_shm.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads every byte of the slot, as a consumer would.
+static uint64_t checksum(const uint8_t* data, size_t size) {
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        sum += word;
+    }
+    for (; i < size; i++)
+        sum += data[i];
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s SHM_NAME\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct stream2_shm_reader* reader;
+    if ((r = stream2_shm_reader_open(argv[1], &reader))) {
+        fprintf(stderr, "error: error %i opening %s\n", (int)r, argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t sum = 0;
+    uint64_t image_id = 0;
+    double last = now();
+    while (!interrupted) {
+        struct stream2_shm_slot slot;
+        if (!stream2_shm_reader_next(reader, &slot)) {
+            const struct timespec idle = {0, 100000};
+            nanosleep(&idle, NULL);
+        } else {
+            const uint64_t slot_sum = checksum(slot.data, slot.size);
+            const uint64_t slot_image_id =
+                    slot.frame ? slot.frame->image_id : 0;
+            if (stream2_shm_reader_validate(reader, &slot)) {
+                frames++;
+                bytes += slot.size;
+                sum += slot_sum;
+                image_id = slot_image_id;
+            }
+        }
+
+        const double t = now();
+        if (t - last >= 1.0) {
+            printf("frames %" PRIu64 " lost %" PRIu64 " last image_id %" PRIu64
+                   " %.2f GB/s checksum %" PRIx64 "\n",
+                   frames, stream2_shm_reader_lost(reader), image_id,
+                   bytes / (t - last) * 1e-9, sum);
+            fflush(stdout);
+            bytes = 0;
+            last = t;
+        }
+    }
+
+    stream2_shm_reader_free(reader);
+    return EXIT_SUCCESS;
+}
@@ -42,6 +42,95 @@ static enum stream2_result CBOR_RESULT(CborError e) {
     }
 }
 
+// Allocator and type of the message being parsed or freed.
+struct allocation {
+    const struct stream2_allocator* allocator;
+    enum stream2_msg_type type;
+};
+
+static void* default_alloc(void* context, size_t size) {
+    (void)context;
+    return malloc(size);
+}
+
+static void default_free(void* context, void* ptr, size_t size) {
+    (void)context;
+    (void)size;
+    free(ptr);
+}
+
+static const struct stream2_allocator DEFAULT_ALLOCATOR = {
+        default_alloc, default_free, NULL, NULL};
+
+void stream2_allocator_default(struct stream2_allocator* allocator) {
+    *allocator = DEFAULT_ALLOCATOR;
+}
+
+static void account_alloc(struct stream2_allocator_counters* c, size_t size) {
+#if defined(__GNUC__)
+    __atomic_add_fetch(&c->allocations, 1, __ATOMIC_RELAXED);
+    const uint64_t current =
+            __atomic_add_fetch(&c->current_bytes, size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&c->peak_bytes, __ATOMIC_RELAXED);
+    while (current > peak &&
+           !__atomic_compare_exchange_n(&c->peak_bytes, &peak, current, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+#else
+    c->allocations++;
+    c->current_bytes += size;
+    if (c->current_bytes > c->peak_bytes)
+        c->peak_bytes = c->current_bytes;
+#endif
+}
+
+static void account_free(struct stream2_allocator_counters* c, size_t size) {
+#if defined(__GNUC__)
+    __atomic_add_fetch(&c->frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->current_bytes, size, __ATOMIC_RELAXED);
+#else
+    c->frees++;
+    c->current_bytes -= size;
+#endif
+}
+
+// Size of the block of n elements. Empty arrays get a block of 1 byte, so that
+// NULL only means that the allocation failed.
+static size_t block_size(size_t n, size_t size) {
+    return n > 0 ? n * size : 1;
+}
+
+// Allocates a zeroed block of n elements.
+static void* alloc_array(const struct allocation* a, size_t n, size_t size) {
+    if (size > 0 && n > SIZE_MAX / size)
+        return NULL;
+    const size_t bytes = block_size(n, size);
+    void* ptr = a->allocator->alloc(a->allocator->context, bytes);
+    if (ptr == NULL)
+        return NULL;
+    memset(ptr, 0, bytes);
+    if (a->allocator->stats)
+        account_alloc(&a->allocator->stats->types[a->type], bytes);
+    return ptr;
+}
+
+static void free_array(const struct allocation* a,
+                       void* ptr,
+                       size_t n,
+                       size_t size) {
+    if (ptr == NULL)
+        return;
+    const size_t bytes = block_size(n, size);
+    a->allocator->free(a->allocator->context, ptr, bytes);
+    if (a->allocator->stats)
+        account_free(&a->allocator->stats->types[a->type], bytes);
+}
+
+static void free_string(const struct allocation* a, char* str) {
+    if (str)
+        free_array(a, str, strlen(str) + 1, 1);
+}
+
 static enum stream2_result consume_byte_string_nocopy(const CborValue* it,
                                                       const uint8_t** bstr,
                                                       size_t* bstr_len,
@@ -163,12 +252,35 @@ static enum stream2_result parse_uint64(CborValue* it, uint64_t* value) {
     return CBOR_RESULT(cbor_value_advance_fixed(it));
 }
 
-static enum stream2_result parse_text_string(CborValue* it, char** tstr) {
+// Allocates and copies a text string. Text strings with a null character are
+// rejected, so that the size of the block is known when it is freed.
+static enum stream2_result parse_text_string(const struct allocation* a,
+                                             CborValue* it,
+                                             char** tstr) {
+    enum stream2_result r;
+
     if (!cbor_value_is_text_string(it))
         return STREAM2_ERROR_PARSE;
 
     size_t len;
-    return CBOR_RESULT(cbor_value_dup_text_string(it, tstr, &len, it));
+    if ((r = CBOR_RESULT(cbor_value_calculate_string_length(it, &len))))
+        return r;
+
+    char* str = alloc_array(a, len + 1, 1);
+    if (str == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    size_t copied = len + 1;
+    if ((r = CBOR_RESULT(cbor_value_copy_text_string(it, str, &copied, it)))) {
+        free_array(a, str, len + 1, 1);
+        return r;
+    }
+    if (strlen(str) != len) {
+        free_array(a, str, len + 1, 1);
+        return STREAM2_ERROR_PARSE;
+    }
+    *tstr = str;
+    return STREAM2_OK;
 }
 
 static enum stream2_result parse_array_2_uint64(CborValue* it,
@@ -198,6 +310,7 @@ static enum stream2_result parse_array_2_uint64(CborValue* it,
 }
 
 static enum stream2_result parse_dectris_compression(
+        const struct allocation* a,
         CborValue* it,
         struct stream2_compression* compression,
         const uint8_t** bstr,
@@ -225,7 +338,7 @@ static enum stream2_result parse_dectris_compression(
     if ((r = CBOR_RESULT(cbor_value_enter_container(it, &elt))))
         return r;
 
-    if ((r = parse_text_string(&elt, &compression->algorithm)))
+    if ((r = parse_text_string(a, &elt, &compression->algorithm)))
         return r;
 
     if ((r = parse_uint64(&elt, &compression->elem_size)))
@@ -251,7 +364,8 @@ static enum stream2_result parse_dectris_compression(
     return CBOR_RESULT(cbor_value_leave_container(it, &elt));
 }
 
-static enum stream2_result parse_bytes(CborValue* it,
+static enum stream2_result parse_bytes(const struct allocation* a,
+                                       CborValue* it,
                                        struct stream2_bytes* bytes) {
     enum stream2_result r;
 
@@ -261,7 +375,7 @@ static enum stream2_result parse_bytes(CborValue* it,
             return r;
 
         if (tag == DECTRIS_COMPRESSION) {
-            return parse_dectris_compression(it, &bytes->compression,
+            return parse_dectris_compression(a, it, &bytes->compression,
                                              &bytes->ptr, &bytes->len);
         } else {
             return STREAM2_ERROR_PARSE;
@@ -282,7 +396,8 @@ static enum stream2_result parse_bytes(CborValue* it,
 //
 // [RFC 8746 section 2]:
 // https://www.rfc-editor.org/rfc/rfc8746.html#name-typed-arrays
-static enum stream2_result parse_typed_array(CborValue* it,
+static enum stream2_result parse_typed_array(const struct allocation* a,
+                                             CborValue* it,
                                              struct stream2_typed_array* array,
                                              uint64_t* len) {
     enum stream2_result r;
@@ -290,7 +405,7 @@ static enum stream2_result parse_typed_array(CborValue* it,
     if ((r = parse_tag(it, &array->tag)))
         return r;
 
-    if ((r = parse_bytes(it, &array->data)))
+    if ((r = parse_bytes(a, it, &array->data)))
         return r;
 
     uint64_t elem_size;
@@ -315,6 +430,7 @@ static enum stream2_result parse_typed_array(CborValue* it,
 // [RFC 8746 section 3.1.1]:
 // https://www.rfc-editor.org/rfc/rfc8746.html#name-row-major-order
 static enum stream2_result parse_multidim_array(
+        const struct allocation* a,
         CborValue* it,
         struct stream2_multidim_array* multidim) {
     enum stream2_result r;
@@ -344,7 +460,7 @@ static enum stream2_result parse_multidim_array(
         return r;
 
     uint64_t array_len;
-    if ((r = parse_typed_array(&elt, &multidim->array, &array_len)))
+    if ((r = parse_typed_array(a, &elt, &multidim->array, &array_len)))
         return r;
 
     if (multidim->dim[0] * multidim->dim[1] != array_len)
@@ -448,11 +564,13 @@ static enum stream2_result parse_user_data(
     return STREAM2_OK;
 }
 
-static enum stream2_result parse_start_msg(CborValue* it,
+static enum stream2_result parse_start_msg(const struct allocation* a,
+                                           CborValue* it,
                                            struct stream2_msg** msg_out) {
     enum stream2_result r;
 
-    struct stream2_start_msg* msg = calloc(1, sizeof(struct stream2_start_msg));
+    struct stream2_start_msg* msg =
+            alloc_array(a, 1, sizeof(struct stream2_start_msg));
     *msg_out = (struct stream2_msg*)msg;
     if (msg == NULL)
         return STREAM2_ERROR_OUT_OF_MEMORY;
@@ -475,10 +593,10 @@ static enum stream2_result parse_start_msg(CborValue* it,
             if ((r = parse_uint64(it, &msg->series_id)))
                 return r;
         } else if (strcmp(key, "series_unique_id") == 0) {
-            if ((r = parse_text_string(it, &msg->series_unique_id)))
+            if ((r = parse_text_string(a, it, &msg->series_unique_id)))
                 return r;
         } else if (strcmp(key, "arm_date") == 0) {
-            if ((r = parse_text_string(it, &msg->arm_date)))
+            if ((r = parse_text_string(a, it, &msg->arm_date)))
                 return r;
         } else if (strcmp(key, "beam_center_x") == 0) {
             if ((r = parse_double(it, &msg->beam_center_x)))
@@ -494,7 +612,7 @@ static enum stream2_result parse_start_msg(CborValue* it,
             if ((r = CBOR_RESULT(cbor_value_get_array_length(it, &len))))
                 return r;
 
-            msg->channels.ptr = calloc(len, sizeof(char*));
+            msg->channels.ptr = alloc_array(a, len, sizeof(char*));
             if (msg->channels.ptr == NULL)
                 return STREAM2_ERROR_OUT_OF_MEMORY;
 
@@ -505,7 +623,7 @@ static enum stream2_result parse_start_msg(CborValue* it,
                 return r;
 
             for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&elt, &msg->channels.ptr[i])))
+                if ((r = parse_text_string(a, &elt, &msg->channels.ptr[i])))
                     return r;
             }
 
@@ -519,14 +637,15 @@ static enum stream2_result parse_start_msg(CborValue* it,
                 return r;
         } else if (strcmp(key, "countrate_correction_lookup_table") == 0) {
             uint64_t len;
-            if ((r = parse_typed_array(
-                         it, &msg->countrate_correction_lookup_table, &len)))
+            if ((r = parse_typed_array(a, it,
+                                       &msg->countrate_correction_lookup_table,
+                                       &len)))
                 return r;
         } else if (strcmp(key, "detector_description") == 0) {
-            if ((r = parse_text_string(it, &msg->detector_description)))
+            if ((r = parse_text_string(a, it, &msg->detector_description)))
                 return r;
         } else if (strcmp(key, "detector_serial_number") == 0) {
-            if ((r = parse_text_string(it, &msg->detector_serial_number)))
+            if ((r = parse_text_string(a, it, &msg->detector_serial_number)))
                 return r;
         } else if (strcmp(key, "detector_translation") == 0) {
             if (!cbor_value_is_array(it))
@@ -558,7 +677,8 @@ static enum stream2_result parse_start_msg(CborValue* it,
             if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
                 return r;
 
-            msg->flatfield.ptr = calloc(len, sizeof(struct stream2_flatfield));
+            msg->flatfield.ptr =
+                    alloc_array(a, len, sizeof(struct stream2_flatfield));
             if (msg->flatfield.ptr == NULL)
                 return STREAM2_ERROR_OUT_OF_MEMORY;
 
@@ -569,12 +689,12 @@ static enum stream2_result parse_start_msg(CborValue* it,
                 return r;
 
             for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&field,
+                if ((r = parse_text_string(a, &field,
                                            &msg->flatfield.ptr[i].channel)))
                     return r;
 
                 if ((r = parse_multidim_array(
-                             &field, &msg->flatfield.ptr[i].flatfield)))
+                             a, &field, &msg->flatfield.ptr[i].flatfield)))
                     return r;
             }
 
@@ -590,7 +710,7 @@ static enum stream2_result parse_start_msg(CborValue* it,
             if ((r = parse_goniometer(it, &msg->goniometer)))
                 return r;
         } else if (strcmp(key, "image_dtype") == 0) {
-            if ((r = parse_text_string(it, &msg->image_dtype)))
+            if ((r = parse_text_string(a, it, &msg->image_dtype)))
                 return r;
         } else if (strcmp(key, "image_size_x") == 0) {
             if ((r = parse_uint64(it, &msg->image_size_x)))
@@ -616,7 +736,7 @@ static enum stream2_result parse_start_msg(CborValue* it,
                 return r;
 
             msg->pixel_mask.ptr =
-                    calloc(len, sizeof(struct stream2_pixel_mask));
+                    alloc_array(a, len, sizeof(struct stream2_pixel_mask));
             if (msg->pixel_mask.ptr == NULL)
                 return STREAM2_ERROR_OUT_OF_MEMORY;
 
@@ -627,12 +747,12 @@ static enum stream2_result parse_start_msg(CborValue* it,
                 return r;
 
             for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&field,
+                if ((r = parse_text_string(a, &field,
                                            &msg->pixel_mask.ptr[i].channel)))
                     return r;
 
                 if ((r = parse_multidim_array(
-                             &field, &msg->pixel_mask.ptr[i].pixel_mask)))
+                             a, &field, &msg->pixel_mask.ptr[i].pixel_mask)))
                     return r;
             }
 
@@ -651,7 +771,7 @@ static enum stream2_result parse_start_msg(CborValue* it,
             if ((r = parse_uint64(it, &msg->saturation_value)))
                 return r;
         } else if (strcmp(key, "sensor_material") == 0) {
-            if ((r = parse_text_string(it, &msg->sensor_material)))
+            if ((r = parse_text_string(a, it, &msg->sensor_material)))
                 return r;
         } else if (strcmp(key, "sensor_thickness") == 0) {
             if ((r = parse_double(it, &msg->sensor_thickness)))
@@ -664,8 +784,8 @@ static enum stream2_result parse_start_msg(CborValue* it,
             if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
                 return r;
 
-            msg->threshold_energy.ptr =
-                    calloc(len, sizeof(struct stream2_threshold_energy));
+            msg->threshold_energy.ptr = alloc_array(
+                    a, len, sizeof(struct stream2_threshold_energy));
             if (msg->threshold_energy.ptr == NULL)
                 return STREAM2_ERROR_OUT_OF_MEMORY;
 
@@ -677,7 +797,8 @@ static enum stream2_result parse_start_msg(CborValue* it,
 
             for (size_t i = 0; i < len; i++) {
                 if ((r = parse_text_string(
-                             &field, &msg->threshold_energy.ptr[i].channel)))
+                             a, &field,
+                             &msg->threshold_energy.ptr[i].channel)))
                     return r;
 
                 if ((r = parse_double(&field,
@@ -701,11 +822,13 @@ static enum stream2_result parse_start_msg(CborValue* it,
     return STREAM2_OK;
 }
 
-static enum stream2_result parse_image_msg(CborValue* it,
+static enum stream2_result parse_image_msg(const struct allocation* a,
+                                           CborValue* it,
                                            struct stream2_msg** msg_out) {
     enum stream2_result r;
 
-    struct stream2_image_msg* msg = calloc(1, sizeof(struct stream2_image_msg));
+    struct stream2_image_msg* msg =
+            alloc_array(a, 1, sizeof(struct stream2_image_msg));
     *msg_out = (struct stream2_msg*)msg;
     if (msg == NULL)
         return STREAM2_ERROR_OUT_OF_MEMORY;
@@ -724,7 +847,7 @@ static enum stream2_result parse_image_msg(CborValue* it,
             if ((r = parse_uint64(it, &msg->series_id)))
                 return r;
         } else if (strcmp(key, "series_unique_id") == 0) {
-            if ((r = parse_text_string(it, &msg->series_unique_id)))
+            if ((r = parse_text_string(a, it, &msg->series_unique_id)))
                 return r;
         } else if (strcmp(key, "image_id") == 0) {
             if ((r = parse_uint64(it, &msg->image_id)))
@@ -733,7 +856,7 @@ static enum stream2_result parse_image_msg(CborValue* it,
             if ((r = parse_array_2_uint64(it, msg->real_time)))
                 return r;
         } else if (strcmp(key, "series_date") == 0) {
-            if ((r = parse_text_string(it, &msg->series_date)))
+            if ((r = parse_text_string(a, it, &msg->series_date)))
                 return r;
         } else if (strcmp(key, "start_time") == 0) {
             if ((r = parse_array_2_uint64(it, msg->start_time)))
@@ -752,7 +875,8 @@ static enum stream2_result parse_image_msg(CborValue* it,
             if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
                 return r;
 
-            msg->data.ptr = calloc(len, sizeof(struct stream2_image_data));
+            msg->data.ptr =
+                    alloc_array(a, len, sizeof(struct stream2_image_data));
             if (msg->data.ptr == NULL)
                 return STREAM2_ERROR_OUT_OF_MEMORY;
 
@@ -763,10 +887,12 @@ static enum stream2_result parse_image_msg(CborValue* it,
                 return r;
 
             for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&field, &msg->data.ptr[i].channel)))
+                if ((r = parse_text_string(a, &field,
+                                           &msg->data.ptr[i].channel)))
                     return r;
 
-                if ((r = parse_multidim_array(&field, &msg->data.ptr[i].data)))
+                if ((r = parse_multidim_array(a, &field,
+                                              &msg->data.ptr[i].data)))
                     return r;
             }
 
@@ -780,11 +906,13 @@ static enum stream2_result parse_image_msg(CborValue* it,
     return STREAM2_OK;
 }
 
-static enum stream2_result parse_end_msg(CborValue* it,
+static enum stream2_result parse_end_msg(const struct allocation* a,
+                                         CborValue* it,
                                          struct stream2_msg** msg_out) {
     enum stream2_result r;
 
-    struct stream2_end_msg* msg = calloc(1, sizeof(struct stream2_end_msg));
+    struct stream2_end_msg* msg =
+            alloc_array(a, 1, sizeof(struct stream2_end_msg));
     *msg_out = (struct stream2_msg*)msg;
     if (msg == NULL)
         return STREAM2_ERROR_OUT_OF_MEMORY;
@@ -803,7 +931,7 @@ static enum stream2_result parse_end_msg(CborValue* it,
             if ((r = parse_uint64(it, &msg->series_id)))
                 return r;
         } else if (strcmp(key, "series_unique_id") == 0) {
-            if ((r = parse_text_string(it, &msg->series_unique_id)))
+            if ((r = parse_text_string(a, it, &msg->series_unique_id)))
                 return r;
         } else {
             if ((r = CBOR_RESULT(cbor_value_advance(it))))
@@ -830,9 +958,14 @@ static enum stream2_result parse_msg_type(CborValue* it,
     return parse_key(it, type);
 }
 
-static enum stream2_result parse_msg(const uint8_t* buffer,
+// Checks the signature of a message, enters its top-level map and parses the
+// message type.
+static enum stream2_result enter_msg(const uint8_t* buffer,
                                      size_t size,
-                                     struct stream2_msg** msg_out) {
+                                     CborParser* parser,
+                                     CborValue* it,
+                                     CborValue* field,
+                                     char type[MAX_KEY_LEN]) {
     enum stream2_result r;
 
     // https://www.rfc-editor.org/rfc/rfc8949.html#name-self-described-cbor
@@ -843,30 +976,42 @@ static enum stream2_result parse_msg(const uint8_t* buffer,
     buffer += sizeof(MAGIC);
     size -= sizeof(MAGIC);
 
-    CborParser parser;
-    CborValue it;
-    if ((r = CBOR_RESULT(cbor_parser_init(buffer, size, 0, &parser, &it))))
+    if ((r = CBOR_RESULT(cbor_parser_init(buffer, size, 0, parser, it))))
         return r;
 
-    if (!cbor_value_is_map(&it))
+    if (!cbor_value_is_map(it))
         return STREAM2_ERROR_PARSE;
 
-    CborValue field;
-    if ((r = CBOR_RESULT(cbor_value_enter_container(&it, &field))))
+    if ((r = CBOR_RESULT(cbor_value_enter_container(it, field))))
         return r;
 
+    return parse_msg_type(field, type);
+}
+
+static enum stream2_result parse_msg(const uint8_t* buffer,
+                                     size_t size,
+                                     const struct stream2_allocator* allocator,
+                                     struct stream2_msg** msg_out) {
+    enum stream2_result r;
+
+    CborParser parser;
+    CborValue it;
+    CborValue field;
     char type[MAX_KEY_LEN];
-    if ((r = parse_msg_type(&field, type)))
+    if ((r = enter_msg(buffer, size, &parser, &it, &field, type)))
         return r;
 
+    struct allocation a = {allocator, STREAM2_MSG_START};
     if (strcmp(type, "start") == 0) {
-        if ((r = parse_start_msg(&field, msg_out)))
+        if ((r = parse_start_msg(&a, &field, msg_out)))
             return r;
     } else if (strcmp(type, "image") == 0) {
-        if ((r = parse_image_msg(&field, msg_out)))
+        a.type = STREAM2_MSG_IMAGE;
+        if ((r = parse_image_msg(&a, &field, msg_out)))
             return r;
     } else if (strcmp(type, "end") == 0) {
-        if ((r = parse_end_msg(&field, msg_out)))
+        a.type = STREAM2_MSG_END;
+        if ((r = parse_end_msg(&a, &field, msg_out)))
             return r;
     } else {
         return STREAM2_ERROR_PARSE;
@@ -878,12 +1023,23 @@ static enum stream2_result parse_msg(const uint8_t* buffer,
 enum stream2_result stream2_parse_msg(const uint8_t* buffer,
                                       size_t size,
                                       struct stream2_msg** msg_out) {
+    return stream2_parse_msg_with_allocator(buffer, size, NULL, msg_out);
+}
+
+enum stream2_result stream2_parse_msg_with_allocator(
+        const uint8_t* buffer,
+        size_t size,
+        const struct stream2_allocator* allocator,
+        struct stream2_msg** msg_out) {
     enum stream2_result r;
 
+    if (allocator == NULL)
+        allocator = &DEFAULT_ALLOCATOR;
+
     *msg_out = NULL;
-    if ((r = parse_msg(buffer, size, msg_out))) {
+    if ((r = parse_msg(buffer, size, allocator, msg_out))) {
         if (*msg_out) {
-            stream2_free_msg(*msg_out);
+            stream2_free_msg_with_allocator(*msg_out, allocator);
             *msg_out = NULL;
         }
         return r;
@@ -891,54 +1047,118 @@ enum stream2_result stream2_parse_msg(const uint8_t* buffer,
     return STREAM2_OK;
 }
 
-static void free_start_msg(struct stream2_start_msg* msg) {
-    free(msg->arm_date);
+enum stream2_result stream2_peek_msg(const uint8_t* buffer,
+                                     size_t size,
+                                     enum stream2_msg_type* type,
+                                     uint64_t* image_id) {
+    enum stream2_result r;
+
+    CborParser parser;
+    CborValue it;
+    CborValue field;
+    char type_str[MAX_KEY_LEN];
+    if ((r = enter_msg(buffer, size, &parser, &it, &field, type_str)))
+        return r;
+
+    *image_id = 0;
+    if (strcmp(type_str, "start") == 0) {
+        *type = STREAM2_MSG_START;
+        return STREAM2_OK;
+    } else if (strcmp(type_str, "end") == 0) {
+        *type = STREAM2_MSG_END;
+        return STREAM2_OK;
+    } else if (strcmp(type_str, "image") != 0) {
+        return STREAM2_ERROR_PARSE;
+    }
+    *type = STREAM2_MSG_IMAGE;
+
+    // Skipping other fields walks their headers only; byte strings such as
+    // image data are skipped without being read.
+    while (cbor_value_is_valid(&field)) {
+        char key[MAX_KEY_LEN];
+        if ((r = parse_key(&field, key)))
+            return r;
+
+        if ((r = CBOR_RESULT(cbor_value_skip_tag(&field))))
+            return r;
+
+        if (strcmp(key, "image_id") == 0)
+            return parse_uint64(&field, image_id);
+
+        if ((r = CBOR_RESULT(cbor_value_advance(&field))))
+            return r;
+    }
+    return STREAM2_ERROR_PARSE;
+}
+
+static void free_start_msg(const struct allocation* a,
+                           struct stream2_start_msg* msg) {
+    free_string(a, msg->arm_date);
     for (size_t i = 0; i < msg->channels.len; i++)
-        free(msg->channels.ptr[i]);
-    free(msg->channels.ptr);
-    free(msg->countrate_correction_lookup_table.data.compression.algorithm);
-    free(msg->detector_description);
-    free(msg->detector_serial_number);
+        free_string(a, msg->channels.ptr[i]);
+    free_array(a, msg->channels.ptr, msg->channels.len, sizeof(char*));
+    free_string(a,
+                msg->countrate_correction_lookup_table.data.compression
+                        .algorithm);
+    free_string(a, msg->detector_description);
+    free_string(a, msg->detector_serial_number);
     for (size_t i = 0; i < msg->flatfield.len; i++) {
-        free(msg->flatfield.ptr[i].channel);
-        free(msg->flatfield.ptr[i].flatfield.array.data.compression.algorithm);
+        free_string(a, msg->flatfield.ptr[i].channel);
+        free_string(a, msg->flatfield.ptr[i]
+                               .flatfield.array.data.compression.algorithm);
     }
-    free(msg->flatfield.ptr);
-    free(msg->image_dtype);
+    free_array(a, msg->flatfield.ptr, msg->flatfield.len,
+               sizeof(struct stream2_flatfield));
+    free_string(a, msg->image_dtype);
     for (size_t i = 0; i < msg->pixel_mask.len; i++) {
-        free(msg->pixel_mask.ptr[i].channel);
-        free(msg->pixel_mask.ptr[i]
-                     .pixel_mask.array.data.compression.algorithm);
+        free_string(a, msg->pixel_mask.ptr[i].channel);
+        free_string(a, msg->pixel_mask.ptr[i]
+                               .pixel_mask.array.data.compression.algorithm);
     }
-    free(msg->pixel_mask.ptr);
-    free(msg->sensor_material);
+    free_array(a, msg->pixel_mask.ptr, msg->pixel_mask.len,
+               sizeof(struct stream2_pixel_mask));
+    free_string(a, msg->sensor_material);
     for (size_t i = 0; i < msg->threshold_energy.len; i++)
-        free(msg->threshold_energy.ptr[i].channel);
-    free(msg->threshold_energy.ptr);
+        free_string(a, msg->threshold_energy.ptr[i].channel);
+    free_array(a, msg->threshold_energy.ptr, msg->threshold_energy.len,
+               sizeof(struct stream2_threshold_energy));
 }
 
-static void free_image_msg(struct stream2_image_msg* msg) {
-    free(msg->series_date);
+static void free_image_msg(const struct allocation* a,
+                           struct stream2_image_msg* msg) {
+    free_string(a, msg->series_date);
     for (size_t i = 0; i < msg->data.len; i++) {
-        free(msg->data.ptr[i].channel);
-        free(msg->data.ptr[i].data.array.data.compression.algorithm);
+        free_string(a, msg->data.ptr[i].channel);
+        free_string(a, msg->data.ptr[i].data.array.data.compression.algorithm);
     }
-    free(msg->data.ptr);
+    free_array(a, msg->data.ptr, msg->data.len,
+               sizeof(struct stream2_image_data));
 }
 
 void stream2_free_msg(struct stream2_msg* msg) {
+    stream2_free_msg_with_allocator(msg, NULL);
+}
+
+void stream2_free_msg_with_allocator(
+        struct stream2_msg* msg,
+        const struct stream2_allocator* allocator) {
+    const struct allocation a = {allocator ? allocator : &DEFAULT_ALLOCATOR,
+                                 msg->type};
+    size_t size = sizeof(struct stream2_end_msg);
     switch (msg->type) {
         case STREAM2_MSG_START:
-            free_start_msg((struct stream2_start_msg*)msg);
+            free_start_msg(&a, (struct stream2_start_msg*)msg);
+            size = sizeof(struct stream2_start_msg);
             break;
         case STREAM2_MSG_IMAGE:
-            free_image_msg((struct stream2_image_msg*)msg);
+            free_image_msg(&a, (struct stream2_image_msg*)msg);
+            size = sizeof(struct stream2_image_msg);
             break;
         case STREAM2_MSG_END:
             break;
     }
-    free(msg->series_unique_id);
-    free(msg);
+    free_string(&a, msg->series_unique_id);
+    free_array(&a, msg, 1, size);
 }
 
 enum stream2_result stream2_typed_array_elem_size(
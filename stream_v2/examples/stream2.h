@@ -15,6 +15,9 @@ enum stream2_result {
     STREAM2_ERROR_DECODE,
     STREAM2_ERROR_PARSE,
     STREAM2_ERROR_NOT_IMPLEMENTED,
+    STREAM2_ERROR_SERIES_MISMATCH,
+    STREAM2_ERROR_IMAGE_ID,
+    STREAM2_ERROR_SYSTEM,
 };
 
 // https://github.com/dectris/documentation/blob/main/cbor/dectris-compression-tag.md
@@ -42,6 +45,7 @@ enum stream2_typed_array_tag {
     STREAM2_TYPED_ARRAY_UINT8 = 64,
     STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN = 69,
     STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN = 70,
+    STREAM2_TYPED_ARRAY_UINT64_LITTLE_ENDIAN = 71,
     STREAM2_TYPED_ARRAY_FLOAT32_LITTLE_ENDIAN = 85,
 };
 
@@ -135,6 +139,8 @@ enum stream2_msg_type {
     STREAM2_MSG_END,
 };
 
+enum { STREAM2_MSG_TYPES = STREAM2_MSG_END + 1 };
+
 struct stream2_msg {
     enum stream2_msg_type type;
     uint64_t series_id;
@@ -198,11 +204,60 @@ struct stream2_end_msg {
     char* series_unique_id;
 };
 
+struct stream2_allocator_counters {
+    uint64_t allocations;
+    uint64_t frees;
+    // Bytes allocated and not freed yet, and their maximum.
+    uint64_t current_bytes;
+    uint64_t peak_bytes;
+};
+
+// Accounting of the memory of messages, per message type.
+struct stream2_allocator_stats {
+    struct stream2_allocator_counters types[STREAM2_MSG_TYPES];
+};
+
+// Allocator of every block of a parsed message, including its strings, e.g.
+// a thread-caching allocator or an arena per decoder thread.
+struct stream2_allocator {
+    // Allocates size bytes, at least 1, aligned for any type, or returns
+    // NULL.
+    void* (*alloc)(void* context, size_t size);
+    // Frees a block allocated by alloc, with the size it was allocated with.
+    void (*free)(void* context, void* ptr, size_t size);
+    void* context;
+    // Counters updated by every allocation and free, if not NULL. The
+    // counters are updated atomically with GCC and Clang only, so with other
+    // compilers, messages must be parsed and freed by one thread at a time.
+    struct stream2_allocator_stats* stats;
+};
+
+// Gets the allocator of malloc() and free() without accounting, which
+// stream2_parse_msg() and stream2_free_msg() use.
+void stream2_allocator_default(struct stream2_allocator* allocator);
+
 enum stream2_result stream2_parse_msg(const uint8_t* buffer,
                                       const size_t size,
                                       struct stream2_msg** msg_out);
 void stream2_free_msg(struct stream2_msg* msg);
 
+// Parses a message into blocks of an allocator, or of the default allocator
+// if allocator is NULL. The message must be freed with the same allocator.
+enum stream2_result stream2_parse_msg_with_allocator(
+        const uint8_t* buffer,
+        size_t size,
+        const struct stream2_allocator* allocator,
+        struct stream2_msg** msg_out);
+void stream2_free_msg_with_allocator(struct stream2_msg* msg,
+                                     const struct stream2_allocator* allocator);
+
+// Gets the type of a message and, for image messages, its image_id without
+// parsing the rest of the message. The image_id is 0 for other messages.
+enum stream2_result stream2_peek_msg(const uint8_t* buffer,
+                                     size_t size,
+                                     enum stream2_msg_type* type,
+                                     uint64_t* image_id);
+
 // Gets the element size of a typed array.
 enum stream2_result stream2_typed_array_elem_size(
         const struct stream2_typed_array* array,
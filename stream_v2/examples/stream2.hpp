@@ -0,0 +1,282 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+// C++20 wrapper of stream2.h: an owning handle of parsed messages, dispatch
+// on their type and views of their strings, arrays and channels.
+//
+// Nothing is copied or allocated: every view points into the message, or into
+// the buffer it was parsed from, and is valid as long as both are. Errors are
+// returned as enum stream2_result as by the C API.
+namespace stream2 {
+
+// Gets a view of a string of a message, which is empty if NULL.
+inline std::string_view view(const char* s) noexcept {
+    return s ? std::string_view(s) : std::string_view();
+}
+
+inline std::span<const uint8_t> bytes(const stream2_bytes& bytes) noexcept {
+    return {bytes.ptr, bytes.len};
+}
+
+// Gets the encoded CBOR of user_data.
+inline std::span<const uint8_t> bytes(
+        const stream2_user_data& user_data) noexcept {
+    return {user_data.ptr, user_data.len};
+}
+
+inline std::span<char* const> channels(const stream2_start_msg& msg) noexcept {
+    return {msg.channels.ptr, msg.channels.len};
+}
+
+inline std::span<const stream2_flatfield> flatfield(
+        const stream2_start_msg& msg) noexcept {
+    return {msg.flatfield.ptr, msg.flatfield.len};
+}
+
+inline std::span<const stream2_pixel_mask> pixel_mask(
+        const stream2_start_msg& msg) noexcept {
+    return {msg.pixel_mask.ptr, msg.pixel_mask.len};
+}
+
+inline std::span<const stream2_threshold_energy> threshold_energy(
+        const stream2_start_msg& msg) noexcept {
+    return {msg.threshold_energy.ptr, msg.threshold_energy.len};
+}
+
+// Gets the image data of every channel, in the order of the start message:
+//
+//   for (const stream2_image_data& data : stream2::data(msg))
+inline std::span<const stream2_image_data> data(
+        const stream2_image_msg& msg) noexcept {
+    return {msg.data.ptr, msg.data.len};
+}
+
+// Typed array tag of the element type T.
+template <class T>
+struct typed_array_traits;
+
+template <>
+struct typed_array_traits<uint8_t> {
+    static constexpr uint64_t tag = STREAM2_TYPED_ARRAY_UINT8;
+};
+
+template <>
+struct typed_array_traits<uint16_t> {
+    static constexpr uint64_t tag = STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN;
+};
+
+template <>
+struct typed_array_traits<uint32_t> {
+    static constexpr uint64_t tag = STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN;
+};
+
+template <>
+struct typed_array_traits<uint64_t> {
+    static constexpr uint64_t tag = STREAM2_TYPED_ARRAY_UINT64_LITTLE_ENDIAN;
+};
+
+template <>
+struct typed_array_traits<float> {
+    static constexpr uint64_t tag = STREAM2_TYPED_ARRAY_FLOAT32_LITTLE_ENDIAN;
+};
+
+// Views the elements of a typed array that is not compressed, e.g. a pixel
+// mask, in place.
+//
+// Returns STREAM2_ERROR_NOT_IMPLEMENTED if T does not match the tag of the
+// array, and STREAM2_ERROR_DECODE if the data is compressed, and has to be
+// decoded first, or is not aligned for T.
+template <class T>
+stream2_result typed_view(const stream2_typed_array& array,
+                          std::span<const T>& view) noexcept {
+    static_assert(std::endian::native == std::endian::little,
+                  "typed arrays are little-endian");
+    view = {};
+    if (array.tag != typed_array_traits<T>::tag)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    const stream2_bytes& data = array.data;
+    if (data.compression.algorithm != nullptr || data.len % sizeof(T) != 0 ||
+        reinterpret_cast<uintptr_t>(data.ptr) % alignof(T) != 0)
+        return STREAM2_ERROR_DECODE;
+    view = {reinterpret_cast<const T*>(data.ptr), data.len / sizeof(T)};
+    return STREAM2_OK;
+}
+
+template <class T>
+stream2_result typed_view(const stream2_multidim_array& array,
+                          std::span<const T>& view) noexcept {
+    return typed_view(array.array, view);
+}
+
+// Decodes the image data of a channel into the decode buffer of a slot, see
+// stream2_series_decode(), and views the decoded frame.
+//
+// Returns STREAM2_ERROR_NOT_IMPLEMENTED if T does not match the image_dtype
+// of the series.
+template <class T>
+stream2_result decode(stream2_series& series,
+                      const stream2_image_msg& msg,
+                      size_t channel,
+                      size_t slot,
+                      std::span<const T>& view) noexcept {
+    stream2_result r;
+    view = {};
+    if (series.tag != typed_array_traits<T>::tag)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    const void* data;
+    if ((r = stream2_series_decode(&series, &msg, channel, slot, &data)))
+        return r;
+    view = {static_cast<const T*>(data), series.frame_size / sizeof(T)};
+    return STREAM2_OK;
+}
+
+// Message type of each message struct.
+template <class T>
+struct msg_traits;
+
+template <>
+struct msg_traits<stream2_start_msg> {
+    static constexpr stream2_msg_type type = STREAM2_MSG_START;
+};
+
+template <>
+struct msg_traits<stream2_image_msg> {
+    static constexpr stream2_msg_type type = STREAM2_MSG_IMAGE;
+};
+
+template <>
+struct msg_traits<stream2_end_msg> {
+    static constexpr stream2_msg_type type = STREAM2_MSG_END;
+};
+
+using msg_variant = std::variant<const stream2_start_msg*,
+                                 const stream2_image_msg*,
+                                 const stream2_end_msg*>;
+
+// Owning handle of a parsed message, freed with the allocator it was parsed
+// with. Handles are moved, never copied.
+class message {
+public:
+    message() noexcept = default;
+
+    // Takes ownership of a message parsed with allocator, or with the default
+    // allocator if NULL.
+    explicit message(stream2_msg* msg,
+                     const stream2_allocator* allocator = nullptr) noexcept
+        : msg_(msg), allocator_(allocator) {}
+
+    message(message&& other) noexcept
+        : msg_(std::exchange(other.msg_, nullptr)),
+          allocator_(other.allocator_) {}
+
+    message& operator=(message&& other) noexcept {
+        if (this != &other) {
+            reset();
+            msg_ = std::exchange(other.msg_, nullptr);
+            allocator_ = other.allocator_;
+        }
+        return *this;
+    }
+
+    message(const message&) = delete;
+    message& operator=(const message&) = delete;
+
+    ~message() { reset(); }
+
+    // Parses a message, see stream2_parse_msg_with_allocator(). The message
+    // points into buffer, which must outlive it.
+    static stream2_result parse(std::span<const uint8_t> buffer,
+                                message& msg,
+                                const stream2_allocator* allocator = nullptr)
+            noexcept {
+        stream2_result r;
+        stream2_msg* parsed;
+        if ((r = stream2_parse_msg_with_allocator(buffer.data(), buffer.size(),
+                                                  allocator, &parsed)))
+            return r;
+        msg = message(parsed, allocator);
+        return STREAM2_OK;
+    }
+
+    explicit operator bool() const noexcept { return msg_ != nullptr; }
+
+    stream2_msg* get() const noexcept { return msg_; }
+
+    const stream2_allocator* allocator() const noexcept { return allocator_; }
+
+    // Gives up ownership of the message, which must then be freed with
+    // allocator().
+    stream2_msg* release() noexcept { return std::exchange(msg_, nullptr); }
+
+    void reset() noexcept {
+        if (msg_ != nullptr)
+            stream2_free_msg_with_allocator(msg_, allocator_);
+        msg_ = nullptr;
+    }
+
+    // The accessors below require a message.
+    stream2_msg_type type() const noexcept { return msg_->type; }
+
+    uint64_t series_id() const noexcept { return msg_->series_id; }
+
+    std::string_view series_unique_id() const noexcept {
+        return view(msg_->series_unique_id);
+    }
+
+    // Gets the message as T if it is of type T, or NULL.
+    template <class T>
+    const T* get_if() const noexcept {
+        return msg_->type == msg_traits<T>::type
+                       ? reinterpret_cast<const T*>(msg_)
+                       : nullptr;
+    }
+
+    msg_variant variant() const noexcept {
+        switch (msg_->type) {
+            case STREAM2_MSG_START:
+                return get_if<stream2_start_msg>();
+            case STREAM2_MSG_IMAGE:
+                return get_if<stream2_image_msg>();
+            case STREAM2_MSG_END:
+                break;
+        }
+        return reinterpret_cast<const stream2_end_msg*>(msg_);
+    }
+
+    // Calls f with the message as const stream2_start_msg&,
+    // const stream2_image_msg& or const stream2_end_msg&. Dispatches on the
+    // type without constructing a msg_variant, e.g.
+    //
+    //   msg.visit([](const auto& m) { ... });
+    template <class F>
+    decltype(auto) visit(F&& f) const {
+        switch (msg_->type) {
+            case STREAM2_MSG_START:
+                return std::forward<F>(f)(
+                        *reinterpret_cast<const stream2_start_msg*>(msg_));
+            case STREAM2_MSG_IMAGE:
+                return std::forward<F>(f)(
+                        *reinterpret_cast<const stream2_image_msg*>(msg_));
+            case STREAM2_MSG_END:
+                break;
+        }
+        return std::forward<F>(f)(
+                *reinterpret_cast<const stream2_end_msg*>(msg_));
+    }
+
+private:
+    stream2_msg* msg_ = nullptr;
+    const stream2_allocator* allocator_ = nullptr;
+};
+
+}  // namespace stream2
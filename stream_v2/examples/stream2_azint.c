@@ -0,0 +1,607 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_azint.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define PI 3.14159265358979323846
+
+// Sparse matrix with one row per bin and one column per pixel.
+struct csr {
+    // Offsets of the rows in columns and weights, bins + 1 entries.
+    size_t* rows;
+    uint32_t* columns;
+    float* weights;
+    // First row of every thread and bins, threads + 1 entries, so that every
+    // thread takes about the same number of entries.
+    size_t* parts;
+};
+
+struct worker {
+    struct stream2_azint* azint;
+    size_t part;
+    pthread_t thread;
+};
+
+struct stream2_azint {
+    struct stream2_azint_config config;
+    size_t width;
+    size_t height;
+    size_t elem_size;
+    uint32_t saturation;
+
+    double beam_center_x;
+    double beam_center_y;
+    double pixel_size_x;
+    double pixel_size_y;
+    double distance;
+    double wavelength;
+    // Radial value of the lower edge of the first bin and bins per unit.
+    double radial_min;
+    double scale;
+    double* radial;
+
+    struct csr* channels;
+    size_t channels_len;
+
+    struct worker* workers;
+    size_t workers_len;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // Incremented for every frame to wake up the workers.
+    uint64_t generation;
+    size_t active;
+    bool stop;
+
+    // Frame being integrated.
+    const struct csr* csr;
+    const void* data;
+    float* intensity;
+    float* count;
+};
+
+// Radial positions of the pixels of one row in bins, from lo to hi.
+struct row_ranges {
+    // Radial values of the corners above and below the row. The corners
+    // below a row are reused as the corners above the next row.
+    double* top;
+    double* bottom;
+    size_t bottom_y;
+    float* lo;
+    float* hi;
+};
+
+void stream2_azint_config_default(struct stream2_azint_config* config) {
+    config->unit = STREAM2_AZINT_Q;
+    config->bins = 1000;
+    config->radial_min = 0.0;
+    config->radial_max = 0.0;
+    config->split_pixels = true;
+    config->threads = 1;
+}
+
+// Gets the radial value of a point of the detector in pixel coordinates.
+static double radial_at(const struct stream2_azint* azint, double x, double y) {
+    const double dx = (x - azint->beam_center_x) * azint->pixel_size_x;
+    const double dy = (y - azint->beam_center_y) * azint->pixel_size_y;
+    const double r = sqrt(dx * dx + dy * dy);
+    if (azint->config.unit == STREAM2_AZINT_TWO_THETA)
+        return atan2(r, azint->distance) * (180.0 / PI);
+    // sin(theta) = r / sqrt(2 l (l + d)) with l the distance to the sample,
+    // which is exact close to the beam.
+    const double l = sqrt(r * r + azint->distance * azint->distance);
+    return 4.0 * PI * r / sqrt(2.0 * l * (l + azint->distance)) /
+           azint->wavelength;
+}
+
+// Gets the radial range of the pixels of row y in bins. A split pixel ranges
+// over its corners and the beam center if it lies within the pixel.
+static void get_row_ranges(const struct stream2_azint* azint,
+                           size_t y,
+                           struct row_ranges* ranges) {
+    const double min = azint->radial_min;
+    const double scale = azint->scale;
+
+    if (!azint->config.split_pixels) {
+        for (size_t x = 0; x < azint->width; x++) {
+            const double r = radial_at(azint, x + 0.5, y + 0.5);
+            ranges->lo[x] = ranges->hi[x] = (float)((r - min) * scale);
+        }
+        return;
+    }
+
+    if (y > 0 && ranges->bottom_y == y) {
+        double* top = ranges->top;
+        ranges->top = ranges->bottom;
+        ranges->bottom = top;
+    } else {
+        for (size_t x = 0; x <= azint->width; x++)
+            ranges->top[x] = radial_at(azint, x, y);
+    }
+    for (size_t x = 0; x <= azint->width; x++)
+        ranges->bottom[x] = radial_at(azint, x, y + 1);
+    ranges->bottom_y = y + 1;
+    const bool center_row =
+            azint->beam_center_y >= y && azint->beam_center_y < y + 1;
+    for (size_t x = 0; x < azint->width; x++) {
+        const double c[4] = {ranges->top[x], ranges->top[x + 1],
+                             ranges->bottom[x], ranges->bottom[x + 1]};
+        double lo = c[0], hi = c[0];
+        for (int i = 1; i < 4; i++) {
+            lo = c[i] < lo ? c[i] : lo;
+            hi = c[i] > hi ? c[i] : hi;
+        }
+        if (center_row && azint->beam_center_x >= x &&
+            azint->beam_center_x < x + 1)
+            lo = 0.0;
+        ranges->lo[x] = (float)((lo - min) * scale);
+        ranges->hi[x] = (float)((hi - min) * scale);
+    }
+}
+
+// Counts the entries of a pixel per row of csr or, if next is not NULL,
+// stores them at the next free entry of every row.
+static void add_pixel(const struct stream2_azint* azint,
+                      struct csr* csr,
+                      size_t* next,
+                      uint32_t pixel,
+                      float lo,
+                      float hi) {
+    const size_t bins = azint->config.bins;
+
+    if (!(hi > lo)) {
+        // The upper edge of the range belongs to the last bin.
+        if (!(lo >= 0.0f && lo <= (float)bins))
+            return;
+        size_t b = (size_t)lo;
+        b = b < bins ? b : bins - 1;
+        if (next == NULL) {
+            csr->rows[b + 1]++;
+        } else {
+            csr->columns[next[b]] = pixel;
+            csr->weights[next[b]++] = 1.0f;
+        }
+        return;
+    }
+
+    if (hi <= 0.0f || lo >= (float)bins)
+        return;
+    const size_t first = lo > 0.0f ? (size_t)lo : 0;
+    const size_t last = hi < (float)bins ? (size_t)ceilf(hi) : bins;
+    for (size_t b = first; b < last; b++) {
+        const float from = lo > (float)b ? lo : (float)b;
+        const float to = hi < (float)(b + 1) ? hi : (float)(b + 1);
+        if (!(to > from))
+            continue;
+        if (next == NULL) {
+            csr->rows[b + 1]++;
+        } else {
+            csr->columns[next[b]] = pixel;
+            csr->weights[next[b]++] = (to - from) / (hi - lo);
+        }
+    }
+}
+
+// Adds the valid pixels of a channel to csr, counting the entries of every
+// row if next is NULL.
+static void add_pixels(const struct stream2_azint* azint,
+                       const uint32_t* mask,
+                       struct row_ranges* ranges,
+                       struct csr* csr,
+                       size_t* next) {
+    ranges->bottom_y = 0;
+    for (size_t y = 0; y < azint->height; y++) {
+        get_row_ranges(azint, y, ranges);
+        for (size_t x = 0; x < azint->width; x++) {
+            const size_t pixel = y * azint->width + x;
+            if (mask[pixel] == 0) {
+                add_pixel(azint, csr, next, (uint32_t)pixel, ranges->lo[x],
+                          ranges->hi[x]);
+            }
+        }
+    }
+}
+
+// Splits the rows between the threads by the number of entries.
+static void split_rows(const struct stream2_azint* azint, struct csr* csr) {
+    const size_t bins = azint->config.bins;
+    const size_t threads = azint->config.threads;
+    const size_t entries = csr->rows[bins];
+
+    size_t row = 0;
+    csr->parts[0] = 0;
+    for (size_t t = 1; t < threads; t++) {
+        const size_t target = entries / threads * t;
+        while (row < bins && csr->rows[row] < target)
+            row++;
+        csr->parts[t] = row;
+    }
+    csr->parts[threads] = bins;
+}
+
+static enum stream2_result build_csr(const struct stream2_azint* azint,
+                                     const uint32_t* mask,
+                                     struct row_ranges* ranges,
+                                     struct csr* csr) {
+    const size_t bins = azint->config.bins;
+
+    if ((csr->rows = calloc(bins + 1, sizeof(size_t))) == NULL ||
+        (csr->parts = malloc((azint->config.threads + 1) * sizeof(size_t))) ==
+                NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    add_pixels(azint, mask, ranges, csr, NULL);
+    for (size_t b = 0; b < bins; b++)
+        csr->rows[b + 1] += csr->rows[b];
+
+    const size_t entries = csr->rows[bins];
+    size_t* next = malloc(bins * sizeof(size_t));
+    if (next == NULL ||
+        (csr->columns = malloc((entries ? entries : 1) * sizeof(uint32_t))) ==
+                NULL ||
+        (csr->weights = malloc((entries ? entries : 1) * sizeof(float))) ==
+                NULL)
+    {
+        free(next);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(next, csr->rows, bins * sizeof(size_t));
+    add_pixels(azint, mask, ranges, csr, next);
+    free(next);
+
+    split_rows(azint, csr);
+    return STREAM2_OK;
+}
+
+// Sets the range of the bins to the range of all pixels if not configured.
+static enum stream2_result set_range(struct stream2_azint* azint,
+                                     struct row_ranges* ranges) {
+    const struct stream2_azint_config* config = &azint->config;
+
+    double min = config->radial_min;
+    double max = config->radial_max;
+    if (min == max) {
+        azint->radial_min = 0.0;
+        azint->scale = 1.0;
+        min = INFINITY;
+        max = -INFINITY;
+        ranges->bottom_y = 0;
+        for (size_t y = 0; y < azint->height; y++) {
+            get_row_ranges(azint, y, ranges);
+            for (size_t x = 0; x < azint->width; x++) {
+                min = ranges->lo[x] < min ? ranges->lo[x] : min;
+                max = ranges->hi[x] > max ? ranges->hi[x] : max;
+            }
+        }
+        // The pixels at the ends of the range stay within the bins despite
+        // rounding.
+        const double margin = (max - min) * 1e-6;
+        min -= margin;
+        max += margin;
+    }
+    if (!(max > min))
+        return STREAM2_ERROR_PARSE;
+
+    azint->radial_min = min;
+    azint->scale = config->bins / (max - min);
+    for (size_t b = 0; b < config->bins; b++)
+        azint->radial[b] = min + (b + 0.5) / azint->scale;
+    return STREAM2_OK;
+}
+
+static enum stream2_result build_channels(
+        struct stream2_azint* azint,
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg) {
+    enum stream2_result r;
+
+    const size_t w = azint->width;
+    const size_t pixels = w * azint->height;
+    struct row_ranges ranges = {
+            .top = malloc((w + 1) * sizeof(double)),
+            .bottom = malloc((w + 1) * sizeof(double)),
+            .lo = malloc((w ? w : 1) * sizeof(float)),
+            .hi = malloc((w ? w : 1) * sizeof(float)),
+    };
+    uint32_t* mask = malloc((pixels ? pixels : 1) * sizeof(uint32_t));
+    if (ranges.top == NULL || ranges.bottom == NULL || ranges.lo == NULL ||
+        ranges.hi == NULL || mask == NULL)
+    {
+        r = STREAM2_ERROR_OUT_OF_MEMORY;
+    } else {
+        r = set_range(azint, &ranges);
+    }
+    for (size_t i = 0; r == STREAM2_OK && i < azint->channels_len; i++) {
+        if ((r = stream2_series_pixel_mask(series, msg, i, mask)) == 0)
+            r = build_csr(azint, mask, &ranges, &azint->channels[i]);
+    }
+    free(mask);
+    free(ranges.top);
+    free(ranges.bottom);
+    free(ranges.lo);
+    free(ranges.hi);
+    return r;
+}
+
+#if defined(__SSE2__)
+// Entries summed in single precision before they are added to the double
+// precision sums of a row.
+enum { BLOCK_ENTRIES = 256 };
+
+// Sums the weighted values of the entries of a row not above saturation and
+// their weights, 4 entries at a time.
+#define DEFINE_ROW_SUMS(NAME, TYPE)                                         \
+    static void NAME(const struct csr* csr, size_t row, const TYPE* data,   \
+                     uint32_t saturation, double* sum, double* norm) {      \
+        const uint32_t* columns = csr->columns;                             \
+        const float* weights = csr->weights;                                \
+        const size_t end = csr->rows[row + 1];                              \
+        const __m128i bias = _mm_set1_epi32((int)0x80000000u);              \
+        const __m128i s = _mm_set1_epi32((int)(saturation ^ 0x80000000u));  \
+        size_t i = csr->rows[row];                                          \
+        double total = 0.0, weight = 0.0;                                   \
+        while (end - i >= 4) {                                              \
+            const size_t stop =                                             \
+                    end - i < BLOCK_ENTRIES ? end : i + BLOCK_ENTRIES;      \
+            __m128 block_sum = _mm_setzero_ps();                            \
+            __m128 block_weight = _mm_setzero_ps();                         \
+            for (; stop - i >= 4; i += 4) {                                 \
+                const uint32_t v0 = data[columns[i]];                       \
+                const uint32_t v1 = data[columns[i + 1]];                   \
+                const uint32_t v2 = data[columns[i + 2]];                   \
+                const uint32_t v3 = data[columns[i + 3]];                   \
+                const __m128i v = _mm_set_epi32((int)v3, (int)v2, (int)v1,  \
+                                                (int)v0);                   \
+                const __m128 over = _mm_castsi128_ps(                       \
+                        _mm_cmpgt_epi32(_mm_xor_si128(v, bias), s));        \
+                const __m128 w = _mm_loadu_ps(weights + i);                 \
+                const __m128 x = _mm_set_ps((float)v3, (float)v2,           \
+                                            (float)v1, (float)v0);          \
+                block_sum = _mm_add_ps(                                     \
+                        block_sum, _mm_andnot_ps(over, _mm_mul_ps(w, x)));  \
+                block_weight =                                              \
+                        _mm_add_ps(block_weight, _mm_andnot_ps(over, w));   \
+            }                                                               \
+            float lanes_sum[4], lanes_weight[4];                            \
+            _mm_storeu_ps(lanes_sum, block_sum);                            \
+            _mm_storeu_ps(lanes_weight, block_weight);                      \
+            total += (double)lanes_sum[0] + lanes_sum[1] + lanes_sum[2] +   \
+                     lanes_sum[3];                                          \
+            weight += (double)lanes_weight[0] + lanes_weight[1] +           \
+                      lanes_weight[2] + lanes_weight[3];                    \
+        }                                                                   \
+        for (; i < end; i++) {                                              \
+            const uint32_t v = data[columns[i]];                            \
+            if (v <= saturation) {                                          \
+                total += (double)weights[i] * v;                            \
+                weight += weights[i];                                       \
+            }                                                               \
+        }                                                                   \
+        *sum = total;                                                       \
+        *norm = weight;                                                     \
+    }
+#else
+#define DEFINE_ROW_SUMS(NAME, TYPE)                                         \
+    static void NAME(const struct csr* csr, size_t row, const TYPE* data,   \
+                     uint32_t saturation, double* sum, double* norm) {      \
+        double total = 0.0, weight = 0.0;                                   \
+        for (size_t i = csr->rows[row]; i < csr->rows[row + 1]; i++) {      \
+            const uint32_t v = data[csr->columns[i]];                       \
+            if (v <= saturation) {                                          \
+                total += (double)csr->weights[i] * v;                       \
+                weight += csr->weights[i];                                  \
+            }                                                               \
+        }                                                                   \
+        *sum = total;                                                       \
+        *norm = weight;                                                     \
+    }
+#endif
+
+DEFINE_ROW_SUMS(row_sums_u8, uint8_t)
+DEFINE_ROW_SUMS(row_sums_u16, uint16_t)
+DEFINE_ROW_SUMS(row_sums_u32, uint32_t)
+
+// Integrates the rows of one thread.
+static void integrate_part(const struct stream2_azint* azint,
+                           const struct csr* csr,
+                           size_t part,
+                           const void* data,
+                           float* intensity,
+                           float* count) {
+    for (size_t b = csr->parts[part]; b < csr->parts[part + 1]; b++) {
+        double sum, norm;
+        switch (azint->elem_size) {
+            case 1:
+                row_sums_u8(csr, b, data, azint->saturation, &sum, &norm);
+                break;
+            case 2:
+                row_sums_u16(csr, b, data, azint->saturation, &sum, &norm);
+                break;
+            default:
+                row_sums_u32(csr, b, data, azint->saturation, &sum, &norm);
+                break;
+        }
+        intensity[b] = norm > 0.0 ? (float)(sum / norm) : 0.0f;
+        if (count)
+            count[b] = (float)norm;
+    }
+}
+
+static void* worker_thread(void* arg) {
+    struct worker* worker = arg;
+    struct stream2_azint* azint = worker->azint;
+
+    uint64_t generation = 0;
+    pthread_mutex_lock(&azint->mutex);
+    for (;;) {
+        while (!azint->stop && azint->generation == generation)
+            pthread_cond_wait(&azint->start, &azint->mutex);
+        if (azint->stop)
+            break;
+        generation = azint->generation;
+        pthread_mutex_unlock(&azint->mutex);
+
+        integrate_part(azint, azint->csr, worker->part, azint->data,
+                       azint->intensity, azint->count);
+
+        pthread_mutex_lock(&azint->mutex);
+        if (--azint->active == 0)
+            pthread_cond_signal(&azint->done);
+    }
+    pthread_mutex_unlock(&azint->mutex);
+    return NULL;
+}
+
+static enum stream2_result azint_init(struct stream2_azint* azint,
+                                      const struct stream2_series* series,
+                                      const struct stream2_start_msg* msg) {
+    enum stream2_result r;
+
+    const struct stream2_azint_config* config = &azint->config;
+    if (config->bins == 0 || config->threads == 0 ||
+        config->radial_max < config->radial_min)
+        return STREAM2_ERROR_PARSE;
+
+    azint->width = series->image_size_x;
+    azint->height = series->image_size_y;
+    azint->elem_size = series->elem_size;
+    azint->saturation = series->saturation;
+    if (azint->width * azint->height > UINT32_MAX)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+
+    azint->beam_center_x = msg->beam_center_x;
+    azint->beam_center_y = msg->beam_center_y;
+    azint->pixel_size_x = msg->pixel_size_x;
+    azint->pixel_size_y = msg->pixel_size_y;
+    azint->distance = msg->detector_translation[2];
+    azint->wavelength = msg->incident_wavelength;
+    if (!(azint->pixel_size_x > 0.0) || !(azint->pixel_size_y > 0.0) ||
+        !(azint->distance > 0.0) ||
+        (config->unit == STREAM2_AZINT_Q && !(azint->wavelength > 0.0)))
+        return STREAM2_ERROR_PARSE;
+
+    azint->channels_len = series->channels_len;
+    if ((azint->radial = malloc(config->bins * sizeof(double))) == NULL ||
+        (azint->channels = calloc(azint->channels_len ? azint->channels_len
+                                                      : 1,
+                                  sizeof(struct csr))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((r = build_channels(azint, series, msg)))
+        return r;
+
+    if ((azint->workers = calloc(config->threads, sizeof(struct worker))) ==
+        NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (; azint->workers_len < config->threads - 1; azint->workers_len++) {
+        struct worker* worker = &azint->workers[azint->workers_len];
+        worker->azint = azint;
+        worker->part = azint->workers_len + 1;
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker))
+            return STREAM2_ERROR_SYSTEM;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_azint_create(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        const struct stream2_azint_config* config,
+        struct stream2_azint** azint_out) {
+    enum stream2_result r;
+
+    *azint_out = NULL;
+
+    struct stream2_azint* azint = calloc(1, sizeof(struct stream2_azint));
+    if (azint == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (config)
+        azint->config = *config;
+    else
+        stream2_azint_config_default(&azint->config);
+    pthread_mutex_init(&azint->mutex, NULL);
+    pthread_cond_init(&azint->start, NULL);
+    pthread_cond_init(&azint->done, NULL);
+
+    if ((r = azint_init(azint, series, msg))) {
+        stream2_azint_free(azint);
+        return r;
+    }
+
+    *azint_out = azint;
+    return STREAM2_OK;
+}
+
+void stream2_azint_free(struct stream2_azint* azint) {
+    if (azint == NULL)
+        return;
+
+    pthread_mutex_lock(&azint->mutex);
+    azint->stop = true;
+    pthread_cond_broadcast(&azint->start);
+    pthread_mutex_unlock(&azint->mutex);
+    for (size_t i = 0; i < azint->workers_len; i++)
+        pthread_join(azint->workers[i].thread, NULL);
+    free(azint->workers);
+
+    if (azint->channels) {
+        for (size_t i = 0; i < azint->channels_len; i++) {
+            struct csr* csr = &azint->channels[i];
+            free(csr->rows);
+            free(csr->columns);
+            free(csr->weights);
+            free(csr->parts);
+        }
+    }
+    free(azint->channels);
+    free(azint->radial);
+    pthread_cond_destroy(&azint->done);
+    pthread_cond_destroy(&azint->start);
+    pthread_mutex_destroy(&azint->mutex);
+    free(azint);
+}
+
+const double* stream2_azint_radial(const struct stream2_azint* azint,
+                                   size_t* bins) {
+    *bins = azint->config.bins;
+    return azint->radial;
+}
+
+enum stream2_result stream2_azint_integrate(struct stream2_azint* azint,
+                                            size_t channel,
+                                            const void* data,
+                                            float* intensity,
+                                            float* count) {
+    if (channel >= azint->channels_len)
+        return STREAM2_ERROR_PARSE;
+    const struct csr* csr = &azint->channels[channel];
+
+    if (azint->workers_len == 0) {
+        integrate_part(azint, csr, 0, data, intensity, count);
+        return STREAM2_OK;
+    }
+
+    pthread_mutex_lock(&azint->mutex);
+    azint->csr = csr;
+    azint->data = data;
+    azint->intensity = intensity;
+    azint->count = count;
+    azint->active = azint->workers_len;
+    azint->generation++;
+    pthread_cond_broadcast(&azint->start);
+    pthread_mutex_unlock(&azint->mutex);
+
+    integrate_part(azint, csr, 0, data, intensity, count);
+
+    pthread_mutex_lock(&azint->mutex);
+    while (azint->active > 0)
+        pthread_cond_wait(&azint->done, &azint->mutex);
+    pthread_mutex_unlock(&azint->mutex);
+    return STREAM2_OK;
+}
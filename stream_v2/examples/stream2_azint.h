@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Integrates decoded frames azimuthally into 1D profiles using the geometry
+// of the start message.
+//
+// The scattering angle of a pixel follows from beam_center_x/y and
+// pixel_size_x/y, with the detector at a distance of detector_translation[2]
+// perpendicular to the beam. Pixel (x, y) covers [x, x + 1) and [y, y + 1) in
+// the coordinates of the beam center. The contribution of every pixel to
+// every bin is computed once per series into a sparse matrix of one row per
+// bin, so that integrating a frame is a sparse matrix-vector product.
+//
+// The profile is the mean of the valid pixels of each bin, weighted by the
+// fraction of each pixel in the bin. Masked pixels and pixels above
+// saturation_value are not counted. No solid angle or polarization
+// correction is applied.
+struct stream2_azint;
+
+enum stream2_azint_unit {
+    // Momentum transfer 4 pi sin(theta) / incident_wavelength in inverse
+    // angstroms.
+    STREAM2_AZINT_Q,
+    // Scattering angle 2 theta in degrees.
+    STREAM2_AZINT_TWO_THETA,
+};
+
+struct stream2_azint_config {
+    enum stream2_azint_unit unit;
+    size_t bins;
+    // Range of the bins in the unit. If radial_min equals radial_max, the
+    // range covered by the detector is used.
+    double radial_min;
+    double radial_max;
+    // If true, each pixel is split between the bins covered by its corners
+    // in proportion to the overlap. Otherwise, each pixel is assigned to the
+    // bin of its center.
+    bool split_pixels;
+    // Number of threads integrating a frame, including the calling thread.
+    size_t threads;
+};
+
+// Header of a profile written by receiver, followed by bins values of float.
+// Records are in host byte order and can be written back to back.
+struct stream2_azint_record {
+    uint64_t image_id;
+    uint32_t channel;
+    uint32_t bins;
+};
+
+void stream2_azint_config_default(struct stream2_azint_config* config);
+
+// Creates the integrator of a series. The pixel mask of every channel is
+// decoded from the start message if pixel_mask_enabled. If config is NULL,
+// the default configuration is used.
+//
+// Returns STREAM2_ERROR_PARSE if the geometry of the start message does not
+// define the unit, e.g. if the detector distance or the wavelength is not
+// positive.
+enum stream2_result stream2_azint_create(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        const struct stream2_azint_config* config,
+        struct stream2_azint** azint_out);
+void stream2_azint_free(struct stream2_azint* azint);
+
+// Gets the centers of the bins in the unit of the configuration.
+const double* stream2_azint_radial(const struct stream2_azint* azint,
+                                   size_t* bins);
+
+// Integrates a decoded frame of a channel into intensity and, if not NULL,
+// count, which hold bins values each. count is the number of valid pixels of
+// each bin and the intensity of bins without valid pixels is 0.
+//
+// If threads is 1, frames may be integrated concurrently. Otherwise, an
+// integrator integrates one frame at a time.
+enum stream2_result stream2_azint_integrate(struct stream2_azint* azint,
+                                            size_t channel,
+                                            const void* data,
+                                            float* intensity,
+                                            float* count);
+
+#if defined(__cplusplus)
+}
+#endif
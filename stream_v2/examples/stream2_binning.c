@@ -0,0 +1,686 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_binning.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Accumulators are locked and added to in blocks of rows of about this many
+// bytes, so that threads adding frames of the same bin work on different
+// blocks that stay in cache while they are added to.
+enum { BLOCK_SIZE = 256 << 10 };
+
+enum accumulator_state {
+    ACCUMULATOR_EMPTY,
+    ACCUMULATOR_FILLING,
+    ACCUMULATOR_EMITTING,
+};
+
+struct accumulator {
+    enum accumulator_state state;
+    // Bin of the accumulator if used. Bins before it were emitted.
+    uint64_t bin;
+    bool used;
+    size_t frames;
+    // Whether the frame of every image of the bin was added, by image_id
+    // modulo the frames of a bin, so that duplicates are rejected.
+    bool* added;
+    // Number of threads adding a frame.
+    size_t active;
+    uint64_t real_time[2];
+    uint64_t start_time[2];
+    uint64_t stop_time[2];
+    // Binned frame of every channel.
+    uint8_t* data;
+    struct stream2_image_data* image_data;
+    // Number of frames added to every block, guarded by its lock. The first
+    // frame added to a block overwrites it.
+    uint32_t* block_frames;
+    pthread_mutex_t* block_locks;
+    size_t block_locks_len;
+};
+
+struct stream2_binning {
+    struct stream2_binning_config config;
+    uint64_t series_id;
+    char* series_unique_id;
+    char* series_date;
+    char** channel_names;
+    size_t channels;
+
+    size_t width;
+    size_t height;
+    size_t elem_size;
+    uint32_t saturation;
+
+    size_t out_width;
+    size_t out_height;
+    size_t frame_size;
+    uint64_t tag;
+    uint64_t saturated;
+    size_t rows_per_block;
+    size_t blocks;
+
+    struct accumulator* accumulators;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Block every add starts at, incremented atomically.
+    size_t next_block;
+};
+
+void stream2_binning_config_default(struct stream2_binning_config* config) {
+    config->frames = 10;
+    config->bin_size = 1;
+    config->accumulator_size = 4;
+    config->depth = 4;
+    config->user = NULL;
+    config->emit = NULL;
+}
+
+static char* dup_string(const char* s) {
+    if (s == NULL)
+        return NULL;
+    const size_t len = strlen(s) + 1;
+    char* d = malloc(len);
+    if (d)
+        memcpy(d, s, len);
+    return d;
+}
+
+// Sums bin_size pixels of a row into every accumulator of a row. If first,
+// the accumulators are overwritten.
+#define DEFINE_ADD_ROW(NAME, IN, ACC)                                       \
+    static void NAME(const struct stream2_binning* binning, const IN* in,   \
+                     size_t from, ACC* acc, bool first) {                   \
+        const size_t k = binning->config.bin_size;                          \
+        const uint32_t saturation = binning->saturation;                    \
+        const ACC saturated = (ACC)binning->saturated;                      \
+        const ACC nodata = (ACC)-1;                                         \
+        for (size_t ox = from; ox < binning->out_width; ox++) {             \
+            const size_t end = (ox + 1) * k < binning->width                \
+                                       ? (ox + 1) * k                       \
+                                       : binning->width;                    \
+            ACC sum = first ? 0 : acc[ox];                                  \
+            bool over = sum == nodata;                                      \
+            bool at = !first && sum == saturated;                           \
+            for (size_t x = ox * k; x < end; x++) {                         \
+                const uint32_t v = in[x];                                   \
+                over |= v > saturation;                                     \
+                at |= v == saturation;                                      \
+                sum += v;                                                   \
+            }                                                               \
+            acc[ox] = over ? nodata : at ? saturated : sum;                 \
+        }                                                                   \
+    }
+
+DEFINE_ADD_ROW(add_row_u8_u32, uint8_t, uint32_t)
+DEFINE_ADD_ROW(add_row_u16_u32, uint16_t, uint32_t)
+DEFINE_ADD_ROW(add_row_u32_u32, uint32_t, uint32_t)
+DEFINE_ADD_ROW(add_row_u8_u64, uint8_t, uint64_t)
+DEFINE_ADD_ROW(add_row_u16_u64, uint16_t, uint64_t)
+DEFINE_ADD_ROW(add_row_u32_u64, uint32_t, uint64_t)
+
+#if defined(__SSE2__)
+struct add_constants {
+    __m128i bias;
+    __m128i saturation;
+    __m128i biased_saturation;
+    __m128i saturated;
+    __m128i nodata;
+};
+
+static struct add_constants add_constants(
+        const struct stream2_binning* binning) {
+    const struct add_constants c = {
+            .bias = _mm_set1_epi32((int)0x80000000u),
+            .saturation = _mm_set1_epi32((int)binning->saturation),
+            .biased_saturation =
+                    _mm_set1_epi32((int)(binning->saturation ^ 0x80000000u)),
+            .saturated = _mm_set1_epi32((int)(uint32_t)binning->saturated),
+            .nodata = _mm_set1_epi32(-1),
+    };
+    return c;
+}
+
+// Adds 4 pixels to 4 uint32 accumulators as the scalar rows. NODATA is all
+// ones, so it is set by or-ing the mask of the accumulators that are NODATA.
+static void add_u32x4(const struct add_constants* c,
+                      __m128i v,
+                      uint32_t* acc,
+                      bool first) {
+    const __m128i a = first ? _mm_setzero_si128()
+                            : _mm_loadu_si128((const __m128i*)acc);
+    const __m128i over = _mm_or_si128(
+            _mm_cmpeq_epi32(a, c->nodata),
+            _mm_cmpgt_epi32(_mm_xor_si128(v, c->bias), c->biased_saturation));
+    __m128i at = _mm_cmpeq_epi32(v, c->saturation);
+    if (!first)
+        at = _mm_or_si128(at, _mm_cmpeq_epi32(a, c->saturated));
+    const __m128i sum = _mm_add_epi32(a, v);
+    const __m128i r = _mm_or_si128(_mm_andnot_si128(at, sum),
+                                   _mm_and_si128(at, c->saturated));
+    _mm_storeu_si128((__m128i*)acc, _mm_or_si128(r, over));
+}
+
+static void add_row_u8_u32_sse2(const struct stream2_binning* binning,
+                                const uint8_t* in,
+                                uint32_t* acc,
+                                bool first) {
+    const struct add_constants c = add_constants(binning);
+    const __m128i zero = _mm_setzero_si128();
+    size_t x = 0;
+    for (; binning->width - x >= 16; x += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+        add_u32x4(&c, _mm_unpacklo_epi16(lo, zero), acc + x, first);
+        add_u32x4(&c, _mm_unpackhi_epi16(lo, zero), acc + x + 4, first);
+        add_u32x4(&c, _mm_unpacklo_epi16(hi, zero), acc + x + 8, first);
+        add_u32x4(&c, _mm_unpackhi_epi16(hi, zero), acc + x + 12, first);
+    }
+    add_row_u8_u32(binning, in, x, acc, first);
+}
+
+static void add_row_u16_u32_sse2(const struct stream2_binning* binning,
+                                 const uint16_t* in,
+                                 uint32_t* acc,
+                                 bool first) {
+    const struct add_constants c = add_constants(binning);
+    const __m128i zero = _mm_setzero_si128();
+    size_t x = 0;
+    for (; binning->width - x >= 8; x += 8) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+        add_u32x4(&c, _mm_unpacklo_epi16(v, zero), acc + x, first);
+        add_u32x4(&c, _mm_unpackhi_epi16(v, zero), acc + x + 4, first);
+    }
+    add_row_u16_u32(binning, in, x, acc, first);
+}
+
+static void add_row_u32_u32_sse2(const struct stream2_binning* binning,
+                                 const uint32_t* in,
+                                 uint32_t* acc,
+                                 bool first) {
+    const struct add_constants c = add_constants(binning);
+    size_t x = 0;
+    for (; binning->width - x >= 4; x += 4) {
+        add_u32x4(&c, _mm_loadu_si128((const __m128i*)(in + x)), acc + x,
+                  first);
+    }
+    add_row_u32_u32(binning, in, x, acc, first);
+}
+#endif
+
+static void add_row(const struct stream2_binning* binning,
+                    const uint8_t* in,
+                    uint8_t* acc,
+                    bool first) {
+#if defined(__SSE2__)
+    // Frames that are only summed are added 4 accumulators at a time.
+    if (binning->config.bin_size == 1 &&
+        binning->config.accumulator_size == 4)
+    {
+        switch (binning->elem_size) {
+            case 1:
+                add_row_u8_u32_sse2(binning, in, (uint32_t*)acc, first);
+                return;
+            case 2:
+                add_row_u16_u32_sse2(binning, (const uint16_t*)in,
+                                     (uint32_t*)acc, first);
+                return;
+            default:
+                add_row_u32_u32_sse2(binning, (const uint32_t*)in,
+                                     (uint32_t*)acc, first);
+                return;
+        }
+    }
+#endif
+    const size_t elem_size = binning->elem_size;
+    if (binning->config.accumulator_size == 4) {
+        if (elem_size == 1)
+            add_row_u8_u32(binning, in, 0, (uint32_t*)acc, first);
+        else if (elem_size == 2)
+            add_row_u16_u32(binning, (const uint16_t*)in, 0, (uint32_t*)acc,
+                            first);
+        else
+            add_row_u32_u32(binning, (const uint32_t*)in, 0, (uint32_t*)acc,
+                            first);
+    } else {
+        if (elem_size == 1)
+            add_row_u8_u64(binning, in, 0, (uint64_t*)acc, first);
+        else if (elem_size == 2)
+            add_row_u16_u64(binning, (const uint16_t*)in, 0, (uint64_t*)acc,
+                            first);
+        else
+            add_row_u32_u64(binning, (const uint32_t*)in, 0, (uint64_t*)acc,
+                            first);
+    }
+}
+
+// Adds the input rows of a block of binned rows of a channel.
+static void add_block(const struct stream2_binning* binning,
+                      struct accumulator* acc,
+                      size_t channel,
+                      size_t block,
+                      const uint8_t* in,
+                      bool first) {
+    const size_t k = binning->config.bin_size;
+    const size_t row_size = binning->out_width *
+                            binning->config.accumulator_size;
+    const size_t in_row_size = binning->width * binning->elem_size;
+    const size_t from = block * binning->rows_per_block;
+    const size_t to = from + binning->rows_per_block < binning->out_height
+                              ? from + binning->rows_per_block
+                              : binning->out_height;
+
+    uint8_t* out = acc->data + channel * binning->frame_size;
+    for (size_t oy = from; oy < to; oy++) {
+        for (size_t y = oy * k; y < (oy + 1) * k && y < binning->height;
+             y++)
+        {
+            add_row(binning, in + y * in_row_size, out + oy * row_size,
+                    first && y == oy * k);
+        }
+    }
+}
+
+// Adds the nonzero pixels of a sparse frame to the accumulators of a row as
+// the rows of dense frames add them.
+#define DEFINE_ADD_SPARSE_ROW(NAME, ACC)                                    \
+    static void NAME(const struct stream2_binning* binning,                 \
+                     const struct stream2_sparse_frame* frame, size_t y,    \
+                     ACC* acc) {                                            \
+        const size_t k = binning->config.bin_size;                          \
+        const uint32_t saturation = binning->saturation;                    \
+        const ACC saturated = (ACC)binning->saturated;                      \
+        const ACC nodata = (ACC)-1;                                         \
+        for (size_t j = frame->rows[y]; j < frame->rows[y + 1]; j++) {      \
+            const uint32_t v = frame->values[j];                            \
+            ACC* a = &acc[frame->columns[j] / k];                           \
+            if (*a == nodata || v > saturation)                             \
+                *a = nodata;                                                \
+            else if (*a == saturated || v == saturation)                    \
+                *a = saturated;                                             \
+            else                                                            \
+                *a += v;                                                    \
+        }                                                                   \
+    }
+
+DEFINE_ADD_SPARSE_ROW(add_sparse_row_u32, uint32_t)
+DEFINE_ADD_SPARSE_ROW(add_sparse_row_u64, uint64_t)
+
+// Adds the input rows of a block of binned rows of a channel from a sparse
+// frame. If first, the block is cleared first, as the zeros of the frame are
+// not added.
+static void add_block_sparse(const struct stream2_binning* binning,
+                             struct accumulator* acc,
+                             size_t channel,
+                             size_t block,
+                             const struct stream2_sparse_frame* frame,
+                             bool first) {
+    const size_t k = binning->config.bin_size;
+    const size_t row_size = binning->out_width *
+                            binning->config.accumulator_size;
+    const size_t from = block * binning->rows_per_block;
+    const size_t to = from + binning->rows_per_block < binning->out_height
+                              ? from + binning->rows_per_block
+                              : binning->out_height;
+
+    uint8_t* out = acc->data + channel * binning->frame_size;
+    if (first)
+        memset(out + from * row_size, 0, (to - from) * row_size);
+    for (size_t oy = from; oy < to; oy++) {
+        for (size_t y = oy * k; y < (oy + 1) * k && y < binning->height;
+             y++)
+        {
+            if (binning->config.accumulator_size == 4)
+                add_sparse_row_u32(binning, frame, y,
+                                   (uint32_t*)(out + oy * row_size));
+            else
+                add_sparse_row_u64(binning, frame, y,
+                                   (uint64_t*)(out + oy * row_size));
+        }
+    }
+}
+
+static enum stream2_result create_accumulator(
+        struct stream2_binning* binning,
+        struct accumulator* acc) {
+    const size_t blocks = binning->channels * binning->blocks;
+    if ((acc->data = malloc(binning->channels * binning->frame_size)) ==
+                NULL ||
+        (acc->image_data = calloc(binning->channels,
+                                  sizeof(struct stream2_image_data))) ==
+                NULL ||
+        (acc->added = calloc(binning->config.frames, sizeof(bool))) ==
+                NULL ||
+        (acc->block_frames = calloc(blocks, sizeof(uint32_t))) == NULL ||
+        (acc->block_locks = malloc(blocks * sizeof(pthread_mutex_t))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (; acc->block_locks_len < blocks; acc->block_locks_len++)
+        pthread_mutex_init(&acc->block_locks[acc->block_locks_len], NULL);
+
+    for (size_t i = 0; i < binning->channels; i++) {
+        struct stream2_image_data* image_data = &acc->image_data[i];
+        image_data->channel = binning->channel_names[i];
+        image_data->data.dim[0] = binning->out_height;
+        image_data->data.dim[1] = binning->out_width;
+        image_data->data.array.tag = binning->tag;
+        image_data->data.array.data.ptr = acc->data + i * binning->frame_size;
+        image_data->data.array.data.len = binning->frame_size;
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result binning_init(struct stream2_binning* binning,
+                                        const struct stream2_series* series) {
+    enum stream2_result r;
+
+    const struct stream2_binning_config* config = &binning->config;
+    const size_t acc_size = config->accumulator_size;
+    if (config->frames == 0 || config->bin_size == 0 || config->depth == 0 ||
+        (acc_size != 4 && acc_size != 8))
+        return STREAM2_ERROR_PARSE;
+
+    binning->series_id = series->series_id;
+    if (series->series_unique_id &&
+        (binning->series_unique_id = dup_string(series->series_unique_id)) ==
+                NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    binning->channels = series->channels_len;
+    if ((binning->channel_names = calloc(binning->channels ? binning->channels
+                                                           : 1,
+                                         sizeof(char*))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < binning->channels; i++) {
+        const char* name = series->channels[i].name;
+        if (name && (binning->channel_names[i] = dup_string(name)) == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    binning->width = series->image_size_x;
+    binning->height = series->image_size_y;
+    binning->elem_size = series->elem_size;
+    binning->saturation = series->saturation;
+
+    // The saturation value of the binning is below NODATA, so that sums of
+    // pixels below saturation_value are below both.
+    const uint64_t acc_max = acc_size == 4 ? UINT32_MAX : UINT64_MAX;
+    const uint64_t pixels = (uint64_t)config->bin_size * config->bin_size;
+    if (config->bin_size > UINT32_MAX || config->frames > acc_max / pixels ||
+        (binning->saturation > 0 &&
+         config->frames * pixels > (acc_max - 1) / binning->saturation))
+        return STREAM2_ERROR_PARSE;
+    binning->saturated = config->frames * pixels * binning->saturation;
+
+    const size_t k = config->bin_size;
+    binning->out_width = (binning->width + k - 1) / k;
+    binning->out_height = (binning->height + k - 1) / k;
+    binning->frame_size = binning->out_width * binning->out_height * acc_size;
+    binning->tag = acc_size == 4 ? STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN
+                                 : STREAM2_TYPED_ARRAY_UINT64_LITTLE_ENDIAN;
+    const size_t row_size = binning->out_width * acc_size;
+    binning->rows_per_block =
+            row_size * k < BLOCK_SIZE ? BLOCK_SIZE / (row_size * k) : 1;
+    binning->blocks = (binning->out_height + binning->rows_per_block - 1) /
+                      binning->rows_per_block;
+
+    if ((binning->accumulators = calloc(config->depth,
+                                        sizeof(struct accumulator))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < config->depth; i++) {
+        if ((r = create_accumulator(binning, &binning->accumulators[i])))
+            return r;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_binning_create(
+        const struct stream2_series* series,
+        const struct stream2_binning_config* config,
+        struct stream2_binning** binning_out) {
+    enum stream2_result r;
+
+    *binning_out = NULL;
+
+    struct stream2_binning* binning =
+            calloc(1, sizeof(struct stream2_binning));
+    if (binning == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (config)
+        binning->config = *config;
+    else
+        stream2_binning_config_default(&binning->config);
+    pthread_mutex_init(&binning->mutex, NULL);
+    pthread_cond_init(&binning->cond, NULL);
+
+    if ((r = binning_init(binning, series))) {
+        stream2_binning_free(binning);
+        return r;
+    }
+
+    *binning_out = binning;
+    return STREAM2_OK;
+}
+
+void stream2_binning_free(struct stream2_binning* binning) {
+    if (binning == NULL)
+        return;
+    if (binning->accumulators) {
+        for (size_t i = 0; i < binning->config.depth; i++) {
+            struct accumulator* acc = &binning->accumulators[i];
+            for (size_t j = 0; j < acc->block_locks_len; j++)
+                pthread_mutex_destroy(&acc->block_locks[j]);
+            free(acc->block_locks);
+            free(acc->block_frames);
+            free(acc->added);
+            free(acc->image_data);
+            free(acc->data);
+        }
+    }
+    free(binning->accumulators);
+    if (binning->channel_names) {
+        for (size_t i = 0; i < binning->channels; i++)
+            free(binning->channel_names[i]);
+    }
+    free(binning->channel_names);
+    free(binning->series_date);
+    free(binning->series_unique_id);
+    pthread_cond_destroy(&binning->cond);
+    pthread_mutex_destroy(&binning->mutex);
+    free(binning);
+}
+
+void stream2_binning_geometry(const struct stream2_binning* binning,
+                              uint64_t* image_size_x,
+                              uint64_t* image_size_y,
+                              uint64_t* tag,
+                              uint64_t* saturation_value) {
+    *image_size_x = binning->out_width;
+    *image_size_y = binning->out_height;
+    *tag = binning->tag;
+    *saturation_value = binning->saturated;
+}
+
+// Emits the bin of an accumulator in state ACCUMULATOR_EMITTING and empties
+// the accumulator. Called with the mutex locked, which is unlocked while the
+// bin is emitted.
+static void emit_bin(struct stream2_binning* binning,
+                     struct accumulator* acc) {
+    const struct stream2_image_msg msg = {
+            .type = STREAM2_MSG_IMAGE,
+            .series_id = binning->series_id,
+            .series_unique_id = binning->series_unique_id,
+            .image_id = acc->bin,
+            .real_time = {acc->real_time[0], acc->real_time[1]},
+            .series_date = binning->series_date,
+            .start_time = {acc->start_time[0], acc->start_time[1]},
+            .stop_time = {acc->stop_time[0], acc->stop_time[1]},
+            .data = {acc->image_data, binning->channels},
+    };
+    pthread_mutex_unlock(&binning->mutex);
+    if (binning->config.emit)
+        binning->config.emit(binning->config.user, &msg, acc->frames);
+    pthread_mutex_lock(&binning->mutex);
+
+    acc->state = ACCUMULATOR_EMPTY;
+    acc->frames = 0;
+    memset(acc->added, 0, binning->config.frames * sizeof(bool));
+    memset(acc->block_frames, 0,
+           binning->channels * binning->blocks * sizeof(uint32_t));
+    pthread_cond_broadcast(&binning->cond);
+}
+
+// Adds the times of an image to its bin. The real time of a bin is the sum
+// of the real times of its frames.
+static void add_times(struct accumulator* acc,
+                      const struct stream2_image_msg* msg) {
+    acc->real_time[0] += msg->real_time[0];
+    if (msg->start_time[0] < acc->start_time[0])
+        acc->start_time[0] = msg->start_time[0];
+    if (msg->stop_time[0] > acc->stop_time[0])
+        acc->stop_time[0] = msg->stop_time[0];
+}
+
+// Takes the accumulator of a bin for adding a frame. An older bin in its
+// place is emitted incomplete. Called with the mutex locked.
+static enum stream2_result claim_accumulator(
+        struct stream2_binning* binning,
+        const struct stream2_image_msg* msg,
+        uint64_t bin,
+        struct accumulator** acc_out) {
+    struct accumulator* acc =
+            &binning->accumulators[bin % binning->config.depth];
+    for (;;) {
+        if (acc->used && (bin < acc->bin ||
+                          (bin == acc->bin &&
+                           acc->state != ACCUMULATOR_FILLING)))
+            return STREAM2_ERROR_IMAGE_ID;
+
+        if (acc->state == ACCUMULATOR_EMPTY) {
+            acc->state = ACCUMULATOR_FILLING;
+            acc->bin = bin;
+            acc->used = true;
+            memcpy(acc->real_time, msg->real_time, sizeof(acc->real_time));
+            memcpy(acc->start_time, msg->start_time, sizeof(acc->start_time));
+            memcpy(acc->stop_time, msg->stop_time, sizeof(acc->stop_time));
+            acc->real_time[0] = 0;
+        }
+        if (acc->state == ACCUMULATOR_FILLING && acc->bin == bin) {
+            bool* added = &acc->added[msg->image_id % binning->config.frames];
+            if (*added)
+                return STREAM2_ERROR_IMAGE_ID;
+            *added = true;
+            add_times(acc, msg);
+            acc->active++;
+            *acc_out = acc;
+            return STREAM2_OK;
+        }
+        if (acc->state == ACCUMULATOR_FILLING && acc->active == 0) {
+            acc->state = ACCUMULATOR_EMITTING;
+            emit_bin(binning, acc);
+            continue;
+        }
+        pthread_cond_wait(&binning->cond, &binning->mutex);
+    }
+}
+
+// Adds the dense frames in data or, if data is NULL, the sparse frames of
+// every channel of an image.
+static enum stream2_result add_image(
+        struct stream2_binning* binning,
+        const struct stream2_image_msg* msg,
+        const void* const* data,
+        const struct stream2_sparse_frame* const* frames) {
+    enum stream2_result r;
+
+    if (msg->series_id != binning->series_id)
+        return STREAM2_ERROR_SERIES_MISMATCH;
+    const uint64_t bin = msg->image_id / binning->config.frames;
+
+    struct accumulator* acc;
+    pthread_mutex_lock(&binning->mutex);
+    if (binning->series_date == NULL && msg->series_date &&
+        (binning->series_date = dup_string(msg->series_date)) == NULL)
+    {
+        pthread_mutex_unlock(&binning->mutex);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    if ((r = claim_accumulator(binning, msg, bin, &acc))) {
+        pthread_mutex_unlock(&binning->mutex);
+        return r;
+    }
+    pthread_mutex_unlock(&binning->mutex);
+
+    // Threads start at different blocks so that they rarely wait for the
+    // lock of a block.
+    const size_t blocks = binning->channels * binning->blocks;
+    const size_t start =
+            __atomic_fetch_add(&binning->next_block, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < blocks; i++) {
+        const size_t block = (start + i) % blocks;
+        const size_t channel = block / binning->blocks;
+        pthread_mutex_lock(&acc->block_locks[block]);
+        const bool first = acc->block_frames[block] == 0;
+        if (data)
+            add_block(binning, acc, channel, block % binning->blocks,
+                      data[channel], first);
+        else
+            add_block_sparse(binning, acc, channel, block % binning->blocks,
+                             frames[channel], first);
+        acc->block_frames[block]++;
+        pthread_mutex_unlock(&acc->block_locks[block]);
+    }
+
+    pthread_mutex_lock(&binning->mutex);
+    acc->frames++;
+    acc->active--;
+    if (acc->frames == binning->config.frames) {
+        acc->state = ACCUMULATOR_EMITTING;
+        emit_bin(binning, acc);
+    } else if (acc->active == 0) {
+        pthread_cond_broadcast(&binning->cond);
+    }
+    pthread_mutex_unlock(&binning->mutex);
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_binning_add(struct stream2_binning* binning,
+                                        const struct stream2_image_msg* msg,
+                                        const void* const* data) {
+    return add_image(binning, msg, data, NULL);
+}
+
+enum stream2_result stream2_binning_add_sparse(
+        struct stream2_binning* binning,
+        const struct stream2_image_msg* msg,
+        const struct stream2_sparse_frame* const* frames) {
+    for (size_t i = 0; i < binning->channels; i++) {
+        if (frames[i]->width != binning->width ||
+            frames[i]->height != binning->height)
+            return STREAM2_ERROR_PARSE;
+    }
+    return add_image(binning, msg, NULL, frames);
+}
+
+void stream2_binning_flush(struct stream2_binning* binning) {
+    pthread_mutex_lock(&binning->mutex);
+    for (;;) {
+        struct accumulator* oldest = NULL;
+        for (size_t i = 0; i < binning->config.depth; i++) {
+            struct accumulator* acc = &binning->accumulators[i];
+            if (acc->state == ACCUMULATOR_FILLING &&
+                (oldest == NULL || acc->bin < oldest->bin))
+                oldest = acc;
+        }
+        if (oldest == NULL)
+            break;
+        oldest->state = ACCUMULATOR_EMITTING;
+        emit_bin(binning, oldest);
+    }
+    pthread_mutex_unlock(&binning->mutex);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Sums decoded frames of a series over consecutive image_ids (temporal
+// binning) and over square blocks of pixels (spatial binning), e.g. to
+// reduce the frame rate of a series before it is stored or published.
+//
+// Bin i holds the frames with image_ids from i * frames to
+// (i + 1) * frames - 1. Frames may be added from several threads and out of
+// order. When every frame of a bin was added, the bin is emitted as an image
+// message with image_id i and uncompressed data of one uint32 or uint64
+// accumulator per binned pixel.
+//
+// A binned pixel is NODATA, the maximum value of the accumulator type, if any
+// of its pixels is above saturation_value, and is the saturation value of
+// the binning if any of its pixels equals saturation_value. Otherwise, it is
+// the sum of its pixels.
+struct stream2_binning;
+
+struct stream2_binning_config {
+    // Number of consecutive frames summed into one.
+    size_t frames;
+    // Width and height of the square blocks of pixels summed into one.
+    size_t bin_size;
+    // Size of an accumulator in bytes, 4 or 8.
+    size_t accumulator_size;
+    // Number of bins accumulated at the same time. A bin is emitted
+    // incomplete when a frame of the bin that takes its place is added.
+    size_t depth;
+    void* user;
+    // Called with every binned frame on the thread that completes or flushes
+    // the bin. The message and its data are valid until the callback
+    // returns. frames is the number of frames summed, which is less than the
+    // frames of the configuration if frames were missing.
+    void (*emit)(void* user,
+                 const struct stream2_image_msg* msg,
+                 size_t frames);
+};
+
+void stream2_binning_config_default(struct stream2_binning_config* config);
+
+// Creates the binning of a series. If config is NULL, the default
+// configuration is used, which sums 10 frames without spatial binning and
+// emits nothing.
+//
+// Returns STREAM2_ERROR_PARSE if the saturation value of the binning does not
+// fit into the accumulators.
+enum stream2_result stream2_binning_create(
+        const struct stream2_series* series,
+        const struct stream2_binning_config* config,
+        struct stream2_binning** binning_out);
+void stream2_binning_free(struct stream2_binning* binning);
+
+// Gets the geometry of the binned frames: their width and height, the typed
+// array tag of their data and their saturation value, frames * bin_size *
+// bin_size * saturation_value.
+void stream2_binning_geometry(const struct stream2_binning* binning,
+                              uint64_t* image_size_x,
+                              uint64_t* image_size_y,
+                              uint64_t* tag,
+                              uint64_t* saturation_value);
+
+// Adds the decoded frames of every channel of an image, e.g. the decode
+// buffers of a slot of the series, and emits the bin of the image if it is
+// complete.
+//
+// Returns STREAM2_ERROR_IMAGE_ID if the bin of the image was already emitted
+// or the image was already added, e.g. a replayed image.
+// May be called from several threads.
+enum stream2_result stream2_binning_add(struct stream2_binning* binning,
+                                        const struct stream2_image_msg* msg,
+                                        const void* const* data);
+
+// Adds the sparse frames of every channel of an image, e.g. those of a slot
+// of a series decoded into sparse frames, only walking their nonzero pixels.
+enum stream2_result stream2_binning_add_sparse(
+        struct stream2_binning* binning,
+        const struct stream2_image_msg* msg,
+        const struct stream2_sparse_frame* const* frames);
+
+// Emits the bins that are not complete in the order of their image_ids, e.g.
+// after the end message. Must not be called while frames are added.
+void stream2_binning_flush(struct stream2_binning* binning);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,381 @@
+#include "stream2_blockmap.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    // https://github.com/lz4/lz4/blob/master/doc/lz4_Block_format.md
+    LZ4_MIN_MATCH = 4,
+    BSHUF_BLOCKED_MULT = 8,
+    HEADER_SIZE = 12,
+    // Runs followed in a block, enough for the 32 bit planes of a constant
+    // block of 32-bit elements.
+    MAX_RUNS = 32,
+    // A run takes a few bytes, so blocks compressed to more than this
+    // fraction of their size are not constant in practice.
+    MAX_RATIO = 8,
+};
+
+// Output of the sequences of a block decoded so far, as runs of equal bytes.
+struct runs {
+    size_t len;
+    // Number of runs after which the block cannot be constant.
+    size_t max;
+    // End of every run; a run starts at the end of the run before it.
+    size_t end[MAX_RUNS];
+    uint8_t byte[MAX_RUNS];
+};
+
+// Walks the blocks of "bslz4" data.
+struct reader {
+    const uint8_t* src;
+    size_t len;
+    size_t pos;
+    size_t elem_size;
+    size_t elems;
+    size_t block_elems;
+    size_t first;
+    bool done;
+};
+
+static uint32_t read_u32_be(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+}
+
+static uint64_t read_u64_be(const uint8_t* p) {
+    return (uint64_t)read_u32_be(p) << 32 | read_u32_be(p + 4);
+}
+
+// Appends n bytes of byte. Returns false if there are too many runs for the
+// block to be constant.
+static bool runs_append(struct runs* runs, uint8_t byte, size_t n) {
+    const size_t end = runs->len > 0 ? runs->end[runs->len - 1] : 0;
+    if (runs->len > 0 && runs->byte[runs->len - 1] == byte) {
+        runs->end[runs->len - 1] = end + n;
+        return true;
+    }
+    if (runs->len == runs->max)
+        return false;
+    runs->end[runs->len] = end + n;
+    runs->byte[runs->len] = byte;
+    runs->len++;
+    return true;
+}
+
+// Gets the run holding the byte at pos, which is before the end of the last
+// run.
+static size_t runs_find(const struct runs* runs, size_t pos) {
+    size_t i = 0;
+    while (runs->end[i] <= pos)
+        i++;
+    return i;
+}
+
+// Reads a length of a sequence continued in bytes of 255.
+static bool lz4_read_length(const uint8_t** ip,
+                            const uint8_t* end,
+                            size_t* len) {
+    uint8_t byte;
+    do {
+        if (*ip == end)
+            return false;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Follows the sequences of an LZ4 block of dst_len bytes as up to runs->max
+// runs. Returns false if the block is not valid or has too many runs.
+static bool lz4_runs(const uint8_t* src,
+                     size_t src_len,
+                     size_t dst_len,
+                     struct runs* runs) {
+    const uint8_t* ip = src;
+    const uint8_t* const end = src + src_len;
+    size_t pos = 0;
+
+    runs->len = 0;
+    for (;;) {
+        if (ip == end)
+            return false;
+        const unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15 && !lz4_read_length(&ip, end, &len))
+            return false;
+        if ((size_t)(end - ip) < len || dst_len - pos < len)
+            return false;
+        for (size_t i = 0; i < len; i++) {
+            if (!runs_append(runs, ip[i], 1))
+                return false;
+        }
+        ip += len;
+        pos += len;
+
+        // The last sequence has literals only.
+        if (ip == end)
+            return pos == dst_len;
+
+        if (end - ip < 2)
+            return false;
+        const size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > pos)
+            return false;
+        len = token & 15;
+        if (len == 15 && !lz4_read_length(&ip, end, &len))
+            return false;
+        len += LZ4_MIN_MATCH;
+        if (dst_len - pos < len)
+            return false;
+
+        // A match copies runs from offset bytes back. Once it reaches the
+        // last run, which it extends, the rest of it repeats its byte.
+        size_t from = pos - offset;
+        pos += len;
+        while (len > 0) {
+            const size_t i = runs_find(runs, from);
+            const size_t n = i + 1 == runs->len || runs->end[i] - from > len
+                                     ? len
+                                     : runs->end[i] - from;
+            if (!runs_append(runs, runs->byte[i], n))
+                return false;
+            from += n;
+            len -= n;
+        }
+    }
+}
+
+enum stream2_block_kind stream2_block_classify_bslz4(const uint8_t* src,
+                                                     size_t len,
+                                                     size_t n,
+                                                     size_t elem_size,
+                                                     uint32_t* value) {
+    struct runs runs;
+    runs.max = 8 * elem_size;
+    if (n == 0 || n % BSHUF_BLOCKED_MULT != 0 || elem_size == 0 ||
+        elem_size > 4 || len > n * elem_size / MAX_RATIO + 64 ||
+        !lz4_runs(src, len, n * elem_size, &runs))
+        return STREAM2_BLOCK_MIXED;
+
+    // Bit k of every element is in plane k of n / 8 bytes, each byte holding
+    // the bit of 8 elements.
+    const size_t row = n / BSHUF_BLOCKED_MULT;
+    uint32_t v = 0;
+    size_t i = 0;
+    for (size_t k = 0; k < 8 * elem_size; k++) {
+        while (runs.end[i] <= k * row)
+            i++;
+        if (runs.end[i] < (k + 1) * row ||
+            (runs.byte[i] != 0x00 && runs.byte[i] != 0xff))
+            return STREAM2_BLOCK_MIXED;
+        if (runs.byte[i] == 0xff)
+            v |= UINT32_C(1) << k;
+    }
+    *value = v;
+    return v == 0 ? STREAM2_BLOCK_ZERO : STREAM2_BLOCK_CONSTANT;
+}
+
+// Classifies n elements that are not compressed.
+static enum stream2_block_kind classify_dense(const uint8_t* src,
+                                              size_t n,
+                                              size_t elem_size,
+                                              uint32_t* value) {
+    uint32_t v = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t x = 0;
+        for (size_t j = 0; j < elem_size; j++)
+            x |= (uint32_t)src[i * elem_size + j] << (8 * j);
+        if (i > 0 && x != v)
+            return STREAM2_BLOCK_MIXED;
+        v = x;
+    }
+    *value = v;
+    return v == 0 ? STREAM2_BLOCK_ZERO : STREAM2_BLOCK_CONSTANT;
+}
+
+static enum stream2_result reader_start(struct reader* reader,
+                                        const uint8_t* src,
+                                        size_t len,
+                                        size_t elem_size,
+                                        size_t elems) {
+    if (elem_size == 0 || elem_size > 4 || len < HEADER_SIZE ||
+        read_u64_be(src) != elems * elem_size)
+        return STREAM2_ERROR_DECODE;
+    const size_t block_size = read_u32_be(src + 8);
+    if (block_size == 0 ||
+        block_size % (elem_size * BSHUF_BLOCKED_MULT) != 0)
+        return STREAM2_ERROR_DECODE;
+
+    reader->src = src;
+    reader->len = len;
+    reader->pos = HEADER_SIZE;
+    reader->elem_size = elem_size;
+    reader->elems = elems;
+    reader->block_elems = block_size / elem_size;
+    reader->first = 0;
+    reader->done = false;
+    return STREAM2_OK;
+}
+
+// Classifies the next block. Sets done after the last block.
+static enum stream2_result reader_next(struct reader* reader,
+                                       struct stream2_block* block) {
+    const size_t elem_size = reader->elem_size;
+    const size_t rest = reader->elems % BSHUF_BLOCKED_MULT;
+    const size_t left = reader->elems - rest - reader->first;
+    block->first = reader->first;
+
+    // Blocks hold a multiple of 8 elements; the last block may be shorter
+    // and fewer than 8 remaining elements follow it uncompressed.
+    if (left == 0) {
+        if (reader->len - reader->pos != rest * elem_size)
+            return STREAM2_ERROR_DECODE;
+        block->elems = rest;
+        block->kind = classify_dense(reader->src + reader->pos, rest,
+                                     elem_size, &block->value);
+        reader->first += rest;
+        reader->pos = reader->len;
+        reader->done = true;
+        return STREAM2_OK;
+    }
+
+    const size_t n = left < reader->block_elems ? left : reader->block_elems;
+    if (reader->len - reader->pos < 4)
+        return STREAM2_ERROR_DECODE;
+    const size_t compressed = read_u32_be(reader->src + reader->pos);
+    reader->pos += 4;
+    if (reader->len - reader->pos < compressed)
+        return STREAM2_ERROR_DECODE;
+    block->elems = n;
+    block->kind = stream2_block_classify_bslz4(reader->src + reader->pos,
+                                               compressed, n, elem_size,
+                                               &block->value);
+    reader->pos += compressed;
+    reader->first += n;
+    if (rest == 0 && reader->first == reader->elems) {
+        if (reader->pos != reader->len)
+            return STREAM2_ERROR_DECODE;
+        reader->done = true;
+    }
+    return STREAM2_OK;
+}
+
+static bool is_bslz4(const struct stream2_bytes* bytes) {
+    const char* algorithm = bytes->compression.algorithm;
+    return algorithm && strcmp(algorithm, "bslz4") == 0;
+}
+
+static bool check_compression(const struct stream2_bytes* bytes,
+                              size_t elem_size,
+                              size_t elems) {
+    return bytes->compression.elem_size == elem_size &&
+           bytes->compression.orig_size == elems * elem_size;
+}
+
+enum stream2_result stream2_block_map_create(struct stream2_block_map** map) {
+    if ((*map = calloc(1, sizeof(struct stream2_block_map))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    return STREAM2_OK;
+}
+
+void stream2_block_map_free(struct stream2_block_map* map) {
+    if (map == NULL)
+        return;
+    free(map->blocks);
+    free(map);
+}
+
+static enum stream2_result map_append(struct stream2_block_map* map,
+                                      const struct stream2_block* block) {
+    if (map->len == map->capacity) {
+        const size_t capacity = map->capacity ? 2 * map->capacity : 64;
+        struct stream2_block* blocks =
+                realloc(map->blocks, capacity * sizeof(struct stream2_block));
+        if (blocks == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        map->blocks = blocks;
+        map->capacity = capacity;
+    }
+    map->blocks[map->len++] = *block;
+
+    if (block->kind == STREAM2_BLOCK_ZERO)
+        map->zero_elems += block->elems;
+    else if (block->kind == STREAM2_BLOCK_CONSTANT)
+        map->constant_elems += block->elems;
+
+    // The frame is constant while all of its blocks have the same value.
+    if (map->len == 1) {
+        map->kind = block->kind;
+        map->value = block->value;
+    } else if (map->kind != STREAM2_BLOCK_MIXED &&
+               (block->kind == STREAM2_BLOCK_MIXED ||
+                block->value != map->value))
+    {
+        map->kind = STREAM2_BLOCK_MIXED;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_block_map_classify(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        size_t elems,
+        struct stream2_block_map* map) {
+    enum stream2_result r;
+
+    map->kind = STREAM2_BLOCK_ZERO;
+    map->value = 0;
+    map->len = 0;
+    map->zero_elems = 0;
+    map->constant_elems = 0;
+    if (elems == 0)
+        return STREAM2_OK;
+
+    if (!is_bslz4(bytes)) {
+        const struct stream2_block block = {
+                .first = 0,
+                .elems = elems,
+                .kind = STREAM2_BLOCK_MIXED,
+        };
+        return map_append(map, &block);
+    }
+
+    struct reader reader;
+    if (!check_compression(bytes, elem_size, elems))
+        return STREAM2_ERROR_DECODE;
+    if ((r = reader_start(&reader, bytes->ptr, bytes->len, elem_size, elems)))
+        return r;
+    while (!reader.done) {
+        struct stream2_block block;
+        if ((r = reader_next(&reader, &block)) ||
+            (r = map_append(map, &block)))
+            return r;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_block_kind stream2_block_classify_frame(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        size_t elems,
+        uint32_t* value) {
+    struct reader reader;
+    if (!is_bslz4(bytes) || !check_compression(bytes, elem_size, elems) ||
+        reader_start(&reader, bytes->ptr, bytes->len, elem_size, elems))
+        return STREAM2_BLOCK_MIXED;
+
+    uint32_t v = 0;
+    while (!reader.done) {
+        struct stream2_block block;
+        if (reader_next(&reader, &block) ||
+            block.kind == STREAM2_BLOCK_MIXED ||
+            (block.first > 0 && block.value != v))
+            return STREAM2_BLOCK_MIXED;
+        v = block.value;
+    }
+    *value = v;
+    return v == 0 ? STREAM2_BLOCK_ZERO : STREAM2_BLOCK_CONSTANT;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Classifies the bitshuffle blocks of "bslz4" image data from their LZ4
+// sequences alone, e.g. to skip the blocks of dark frames that are all zero
+// without decompressing or unshuffling them.
+//
+// The output of the sequences of a block is followed as runs of equal bytes.
+// A block is constant if every bit plane is a single run of 0x00 or 0xff
+// bytes, which is shown within a few sequences for the blocks the LZ4
+// compressor reduces to runs, and given up on after a few dozen literals for
+// the others.
+enum stream2_block_kind {
+    // Every element is zero.
+    STREAM2_BLOCK_ZERO,
+    // Every element has the same nonzero value, e.g. gaps of NODATA.
+    STREAM2_BLOCK_CONSTANT,
+    // Not shown to be constant. The block has to be decoded.
+    STREAM2_BLOCK_MIXED,
+};
+
+struct stream2_block {
+    // Index of the first element and number of elements of the block.
+    size_t first;
+    size_t elems;
+    enum stream2_block_kind kind;
+    // Value of every element if the block is constant.
+    uint32_t value;
+};
+
+struct stream2_block_map {
+    // Kind and value of the whole frame.
+    enum stream2_block_kind kind;
+    uint32_t value;
+    // Blocks in the order of their elements. The fewer than 8 elements that
+    // follow the bitshuffle blocks uncompressed are a block of their own.
+    struct stream2_block* blocks;
+    size_t len;
+    size_t capacity;
+    // Number of elements in zero and in constant blocks.
+    uint64_t zero_elems;
+    uint64_t constant_elems;
+};
+
+enum stream2_result stream2_block_map_create(struct stream2_block_map** map);
+void stream2_block_map_free(struct stream2_block_map* map);
+
+// Classifies the blocks of bytes of elems elements of elem_size bytes. Data
+// that is not compressed with "bslz4" is a single mixed block.
+//
+// Returns STREAM2_ERROR_DECODE if the blocks do not add up to the frame.
+enum stream2_result stream2_block_map_classify(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        size_t elems,
+        struct stream2_block_map* map);
+
+// Classifies a whole frame as stream2_block_map_classify(), stopping at the
+// first mixed block without allocating. Data that cannot be classified,
+// including data that is not valid, is mixed.
+enum stream2_block_kind stream2_block_classify_frame(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        size_t elems,
+        uint32_t* value);
+
+// Classifies one LZ4-compressed bitshuffle block of n elements of elem_size
+// bytes, n a multiple of 8. A block that is not valid is mixed.
+enum stream2_block_kind stream2_block_classify_bslz4(const uint8_t* src,
+                                                     size_t len,
+                                                     size_t n,
+                                                     size_t elem_size,
+                                                     uint32_t* value);
+
+#if defined(__cplusplus)
+}
+#endif
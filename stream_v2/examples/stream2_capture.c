@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_capture.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum { WRITE_BUFFER_SIZE = 1 << 20 };
+
+#define CAPTURE_VERSION 1
+
+static const char DATA_MAGIC[8] = {'S', '2', 'C', 'A', 'P', 'D', 'A', 'T'};
+static const char INDEX_MAGIC[8] = {'S', '2', 'C', 'A', 'P', 'I', 'D', 'X'};
+
+struct file_header {
+    char magic[8];
+    uint64_t version;
+};
+
+struct stream2_capture_writer {
+    FILE* data;
+    FILE* index;
+    uint64_t offset;
+    uint64_t starts;
+};
+
+struct lookup_entry {
+    uint32_t series;
+    uint64_t image_id;
+    size_t index;
+};
+
+struct mapping {
+    uint8_t* ptr;
+    size_t size;
+};
+
+struct stream2_capture_reader {
+    struct mapping data;
+    struct mapping index;
+    const struct stream2_capture_entry* entries;
+    size_t len;
+    // Image entries sorted by series, image_id and index.
+    struct lookup_entry* lookup;
+    size_t lookup_len;
+};
+
+static char* index_path(const char* path) {
+    const size_t len = strlen(path);
+    char* s = malloc(len + sizeof(".idx"));
+    if (s) {
+        memcpy(s, path, len);
+        memcpy(s + len, ".idx", sizeof(".idx"));
+    }
+    return s;
+}
+
+static FILE* create_file(const char* path, const char magic[8]) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+    struct file_header header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+enum stream2_result stream2_capture_writer_open(
+        const char* path,
+        struct stream2_capture_writer** writer_out) {
+    *writer_out = NULL;
+
+    struct stream2_capture_writer* writer =
+            calloc(1, sizeof(struct stream2_capture_writer));
+    char* idx_path = index_path(path);
+    if (writer == NULL || idx_path == NULL) {
+        free(idx_path);
+        free(writer);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    writer->data = create_file(path, DATA_MAGIC);
+    writer->index = create_file(idx_path, INDEX_MAGIC);
+    free(idx_path);
+    if (writer->data == NULL || writer->index == NULL) {
+        stream2_capture_writer_close(writer);
+        return STREAM2_ERROR_SYSTEM;
+    }
+    writer->offset = sizeof(struct file_header);
+
+    *writer_out = writer;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_capture_writer_close(
+        struct stream2_capture_writer* writer) {
+    enum stream2_result r = STREAM2_OK;
+    if (writer == NULL)
+        return r;
+    // The data is closed first so that no index entry outlives its message.
+    if (writer->data && fclose(writer->data))
+        r = STREAM2_ERROR_SYSTEM;
+    if (writer->index && fclose(writer->index))
+        r = STREAM2_ERROR_SYSTEM;
+    free(writer);
+    return r;
+}
+
+enum stream2_result stream2_capture_writer_write(
+        struct stream2_capture_writer* writer,
+        const uint8_t* data,
+        size_t size) {
+    struct stream2_capture_entry entry = {
+            .offset = writer->offset,
+            .size = size,
+    };
+
+    enum stream2_msg_type type;
+    if (stream2_peek_msg(data, size, &type, &entry.image_id) == STREAM2_OK) {
+        entry.type = type;
+        if (type == STREAM2_MSG_START)
+            writer->starts++;
+    } else {
+        entry.type = STREAM2_CAPTURE_UNKNOWN;
+        entry.image_id = 0;
+    }
+    entry.series = writer->starts > 0 ? (uint32_t)(writer->starts - 1) : 0;
+
+    if (fwrite(data, 1, size, writer->data) != size ||
+        fwrite(&entry, sizeof(entry), 1, writer->index) != 1)
+        return STREAM2_ERROR_SYSTEM;
+    writer->offset += size;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_capture_writer_flush(
+        struct stream2_capture_writer* writer) {
+    if (fflush(writer->data) || fflush(writer->index))
+        return STREAM2_ERROR_SYSTEM;
+    return STREAM2_OK;
+}
+
+static enum stream2_result map_file(const char* path,
+                                    const char magic[8],
+                                    struct mapping* mapping) {
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return STREAM2_ERROR_SYSTEM;
+
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(struct file_header))
+        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return STREAM2_ERROR_SYSTEM;
+
+    mapping->ptr = ptr;
+    mapping->size = st.st_size;
+
+    const struct file_header* header = ptr;
+    if (memcmp(header->magic, magic, sizeof(header->magic)) != 0 ||
+        header->version != CAPTURE_VERSION)
+        return STREAM2_ERROR_SIGNATURE;
+    return STREAM2_OK;
+}
+
+static int compare_lookup(const void* a, const void* b) {
+    const struct lookup_entry* x = a;
+    const struct lookup_entry* y = b;
+    if (x->series != y->series)
+        return x->series < y->series ? -1 : 1;
+    if (x->image_id != y->image_id)
+        return x->image_id < y->image_id ? -1 : 1;
+    if (x->index != y->index)
+        return x->index < y->index ? -1 : 1;
+    return 0;
+}
+
+static enum stream2_result build_lookup(struct stream2_capture_reader* reader) {
+    size_t len = 0;
+    for (size_t i = 0; i < reader->len; i++)
+        len += reader->entries[i].type == STREAM2_MSG_IMAGE;
+    if (len == 0)
+        return STREAM2_OK;
+
+    if ((reader->lookup = malloc(len * sizeof(struct lookup_entry))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < reader->len; i++) {
+        const struct stream2_capture_entry* entry = &reader->entries[i];
+        if (entry->type == STREAM2_MSG_IMAGE) {
+            struct lookup_entry* l = &reader->lookup[reader->lookup_len++];
+            l->series = entry->series;
+            l->image_id = entry->image_id;
+            l->index = i;
+        }
+    }
+    qsort(reader->lookup, reader->lookup_len, sizeof(struct lookup_entry),
+          compare_lookup);
+    return STREAM2_OK;
+}
+
+static enum stream2_result reader_open(struct stream2_capture_reader* reader,
+                                       const char* path) {
+    enum stream2_result r;
+
+    char* idx_path = index_path(path);
+    if (idx_path == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    r = map_file(idx_path, INDEX_MAGIC, &reader->index);
+    free(idx_path);
+    if (r)
+        return r;
+    if ((r = map_file(path, DATA_MAGIC, &reader->data)))
+        return r;
+
+    reader->entries =
+            (const struct stream2_capture_entry*)(reader->index.ptr +
+                                                  sizeof(struct file_header));
+    reader->len = (reader->index.size - sizeof(struct file_header)) /
+                  sizeof(struct stream2_capture_entry);
+    // Only the tail of the index can refer to data that was never written.
+    while (reader->len > 0) {
+        const struct stream2_capture_entry* last =
+                &reader->entries[reader->len - 1];
+        if (last->offset <= reader->data.size &&
+            last->size <= reader->data.size - last->offset)
+            break;
+        reader->len--;
+    }
+
+    posix_madvise(reader->data.ptr, reader->data.size,
+                  POSIX_MADV_SEQUENTIAL);
+    return build_lookup(reader);
+}
+
+enum stream2_result stream2_capture_reader_open(
+        const char* path,
+        struct stream2_capture_reader** reader_out) {
+    enum stream2_result r;
+
+    *reader_out = NULL;
+
+    struct stream2_capture_reader* reader =
+            calloc(1, sizeof(struct stream2_capture_reader));
+    if (reader == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if ((r = reader_open(reader, path))) {
+        stream2_capture_reader_close(reader);
+        return r;
+    }
+
+    *reader_out = reader;
+    return STREAM2_OK;
+}
+
+void stream2_capture_reader_close(struct stream2_capture_reader* reader) {
+    if (reader == NULL)
+        return;
+    if (reader->data.ptr)
+        munmap(reader->data.ptr, reader->data.size);
+    if (reader->index.ptr)
+        munmap(reader->index.ptr, reader->index.size);
+    free(reader->lookup);
+    free(reader);
+}
+
+size_t stream2_capture_reader_len(const struct stream2_capture_reader* reader) {
+    return reader->len;
+}
+
+const struct stream2_capture_entry* stream2_capture_reader_entry(
+        const struct stream2_capture_reader* reader,
+        size_t index) {
+    return &reader->entries[index];
+}
+
+const uint8_t* stream2_capture_reader_data(
+        const struct stream2_capture_reader* reader,
+        size_t index) {
+    return reader->data.ptr + reader->entries[index].offset;
+}
+
+enum stream2_result stream2_capture_reader_parse(
+        const struct stream2_capture_reader* reader,
+        size_t index,
+        struct stream2_msg** msg_out) {
+    return stream2_parse_msg(stream2_capture_reader_data(reader, index),
+                             reader->entries[index].size, msg_out);
+}
+
+bool stream2_capture_reader_find(const struct stream2_capture_reader* reader,
+                                 uint32_t series,
+                                 uint64_t image_id,
+                                 size_t* index) {
+    const struct lookup_entry key = {series, image_id, 0};
+
+    // Finds the first entry not less than key.
+    size_t lo = 0;
+    size_t hi = reader->lookup_len;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (compare_lookup(&reader->lookup[mid], &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == reader->lookup_len || reader->lookup[lo].series != series ||
+        reader->lookup[lo].image_id != image_id)
+        return false;
+    *index = reader->lookup[lo].index;
+    return true;
+}
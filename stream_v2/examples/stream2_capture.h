@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// A capture of path P consists of the data file P, holding the raw messages
+// back to back, and the index file P.idx, holding one entry per message. Both
+// files are append-only and in host byte order.
+
+// Type of an entry whose message could not be peeked.
+#define STREAM2_CAPTURE_UNKNOWN UINT32_MAX
+
+// Index entry of one captured message.
+struct stream2_capture_entry {
+    // Offset and size of the message in the data file.
+    uint64_t offset;
+    uint64_t size;
+    // image_id of image messages, 0 otherwise.
+    uint64_t image_id;
+    // enum stream2_msg_type, or STREAM2_CAPTURE_UNKNOWN.
+    uint32_t type;
+    // Number of start messages captured before the message, minus one, i.e.
+    // the series of the message within the capture.
+    uint32_t series;
+};
+
+struct stream2_capture_writer;
+struct stream2_capture_reader;
+
+// Creates a capture, replacing any capture of the same path.
+enum stream2_result stream2_capture_writer_open(
+        const char* path,
+        struct stream2_capture_writer** writer_out);
+
+// Flushes and closes the capture.
+enum stream2_result stream2_capture_writer_close(
+        struct stream2_capture_writer* writer);
+
+// Appends a message as received. Messages that cannot be peeked are captured
+// with type STREAM2_CAPTURE_UNKNOWN.
+enum stream2_result stream2_capture_writer_write(
+        struct stream2_capture_writer* writer,
+        const uint8_t* data,
+        size_t size);
+
+enum stream2_result stream2_capture_writer_flush(
+        struct stream2_capture_writer* writer);
+
+// Maps a capture read-only. Index entries beyond the end of the data file,
+// e.g. of a capture that was not closed, are ignored.
+enum stream2_result stream2_capture_reader_open(
+        const char* path,
+        struct stream2_capture_reader** reader_out);
+void stream2_capture_reader_close(struct stream2_capture_reader* reader);
+
+size_t stream2_capture_reader_len(const struct stream2_capture_reader* reader);
+
+const struct stream2_capture_entry* stream2_capture_reader_entry(
+        const struct stream2_capture_reader* reader,
+        size_t index);
+
+// Gets the mapped bytes of a message.
+const uint8_t* stream2_capture_reader_data(
+        const struct stream2_capture_reader* reader,
+        size_t index);
+
+// Parses a message in place. Byte strings of the message point into the
+// mapping and stay valid until the reader is closed.
+enum stream2_result stream2_capture_reader_parse(
+        const struct stream2_capture_reader* reader,
+        size_t index,
+        struct stream2_msg** msg_out);
+
+// Finds the index of the image message of a series by image_id.
+//
+// Returns false if the image was not captured.
+bool stream2_capture_reader_find(const struct stream2_capture_reader* reader,
+                                 uint32_t series,
+                                 uint64_t image_id,
+                                 size_t* index);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,364 @@
+#include "stream2_compress.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+enum {
+    // https://github.com/lz4/lz4/blob/master/doc/lz4_Block_format.md
+    LZ4_MIN_MATCH = 4,
+    LZ4_MFLIMIT = 12,
+    LZ4_LAST_LITERALS = 5,
+    LZ4_MAX_OFFSET = 65535,
+    LZ4_HASH_LOG = 12,
+    // Bitshuffle target block size in bytes and block size multiple in
+    // elements, see bshuf_default_block_size().
+    BSHUF_TARGET_BLOCK_SIZE = 8192,
+    BSHUF_BLOCKED_MULT = 8,
+    BSHUF_MIN_BLOCK = 128,
+    MAX_ELEM_SIZE = BSHUF_TARGET_BLOCK_SIZE / BSHUF_MIN_BLOCK,
+    // Block size of "lz4" data. The HDF5 LZ4 filter stores it in the
+    // header, so frames of more than one block are compressed in parallel.
+    LZ4_BLOCK_SIZE = 1 << 20,
+    HEADER_SIZE = 12,
+};
+
+enum algorithm {
+    ALGORITHM_BSLZ4,
+    ALGORITHM_LZ4,
+};
+
+static enum stream2_result parse_algorithm(const char* name,
+                                           enum algorithm* algorithm) {
+    if (strcmp(name, "bslz4") == 0)
+        *algorithm = ALGORITHM_BSLZ4;
+    else if (strcmp(name, "lz4") == 0)
+        *algorithm = ALGORITHM_LZ4;
+    else
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    return STREAM2_OK;
+}
+
+static void write_u32_be(uint8_t* buf, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        buf[i] = (uint8_t)(value >> (24 - 8 * i));
+}
+
+static void write_u64_be(uint8_t* buf, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        buf[i] = (uint8_t)(value >> (56 - 8 * i));
+}
+
+static uint32_t read_u32(const uint8_t* buf) {
+    uint32_t value;
+    memcpy(&value, buf, sizeof(value));
+    return value;
+}
+
+static size_t lz4_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+static uint8_t* lz4_write_length(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t* lz4_write_sequence(uint8_t* op,
+                                   const uint8_t* literals,
+                                   size_t literals_len,
+                                   size_t offset,
+                                   size_t match_len) {
+    uint8_t* token = op++;
+    *token = (uint8_t)((literals_len < 15 ? literals_len : 15) << 4);
+    if (literals_len >= 15)
+        op = lz4_write_length(op, literals_len - 15);
+    memcpy(op, literals, literals_len);
+    op += literals_len;
+
+    if (match_len == 0)
+        return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= LZ4_MIN_MATCH;
+    *token |= (uint8_t)(match_len < 15 ? match_len : 15);
+    if (match_len >= 15)
+        op = lz4_write_length(op, match_len - 15);
+    return op;
+}
+
+// Compresses one LZ4 block with a greedy single-probe match finder. dst must
+// hold lz4_bound(size) bytes.
+static size_t lz4_compress_block(const uint8_t* src,
+                                 size_t size,
+                                 uint8_t* dst) {
+    uint32_t table[1 << LZ4_HASH_LOG];
+    uint8_t* op = dst;
+    const uint8_t* anchor = src;
+    const uint8_t* const end = src + size;
+
+    if (size > LZ4_MFLIMIT) {
+        memset(table, 0, sizeof(table));
+        const uint8_t* const match_start_limit = end - LZ4_MFLIMIT;
+        const uint8_t* const match_end_limit = end - LZ4_LAST_LITERALS;
+        const uint8_t* ip = src;
+        // Skips faster through incompressible data.
+        size_t misses = 0;
+        while (ip < match_start_limit) {
+            const uint32_t sequence = read_u32(ip);
+            const uint32_t h =
+                    (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+                read_u32(ref) != sequence)
+            {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            size_t len = LZ4_MIN_MATCH;
+            while (ip + len < match_end_limit && ip[len] == ref[len])
+                len++;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+                len++;
+            }
+
+            op = lz4_write_sequence(op, anchor, ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_write_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+// Transposes the bits of a block of n elements, n a multiple of 8, as
+// bshuf_trans_bit_elem(): bit i of byte j of element e goes to bit e % 8 of
+// byte e / 8 of row 8 * j + i. Groups of 8 elements from first on are
+// transposed.
+static void bitshuffle_scalar(const uint8_t* in,
+                              uint8_t* out,
+                              size_t n,
+                              size_t elem_size,
+                              size_t first) {
+    const size_t row = n / 8;
+    for (size_t j = 0; j < elem_size; j++) {
+        for (size_t b = first / 8; b < row; b++) {
+            uint64_t x = 0;
+            for (size_t m = 0; m < 8; m++)
+                x |= (uint64_t)in[(8 * b + m) * elem_size + j] << (8 * m);
+
+            // Transposes the 8x8 bit matrix x, see TRANS_BIT_8X8.
+            uint64_t t;
+            t = (x ^ (x >> 7)) & UINT64_C(0x00AA00AA00AA00AA);
+            x = x ^ t ^ (t << 7);
+            t = (x ^ (x >> 14)) & UINT64_C(0x0000CCCC0000CCCC);
+            x = x ^ t ^ (t << 14);
+            t = (x ^ (x >> 28)) & UINT64_C(0x00000000F0F0F0F0);
+            x = x ^ t ^ (t << 28);
+
+            for (size_t i = 0; i < 8; i++)
+                out[(8 * j + i) * row + b] = (uint8_t)(x >> (8 * i));
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Transposes the bits of groups of 16 elements as bshuf_trans_bit_elem_SSE()
+// and returns the number of elements transposed. Byte j of the elements is
+// gathered first, then _mm_movemask_epi8() collects one bit of 16 bytes at
+// once, i.e. 16 output bits per instruction.
+static size_t bitshuffle_sse2(const uint8_t* in,
+                              uint8_t* out,
+                              size_t n,
+                              size_t elem_size) {
+    uint8_t column[BSHUF_TARGET_BLOCK_SIZE];
+    const size_t row = n / 8;
+    const size_t n16 = n / 16 * 16;
+
+    for (size_t j = 0; j < elem_size; j++) {
+        const uint8_t* bytes = in;
+        if (elem_size > 1) {
+            for (size_t e = 0; e < n16; e++)
+                column[e] = in[e * elem_size + j];
+            bytes = column;
+        }
+        for (size_t e = 0; e < n16; e += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(bytes + e));
+            for (int i = 7; i >= 0; i--) {
+                const uint16_t bits = (uint16_t)_mm_movemask_epi8(x);
+                out[(8 * j + i) * row + e / 8] = (uint8_t)bits;
+                out[(8 * j + i) * row + e / 8 + 1] = (uint8_t)(bits >> 8);
+                x = _mm_slli_epi16(x, 1);
+            }
+        }
+    }
+    return n16;
+}
+#endif
+
+static void bitshuffle_block(const uint8_t* in,
+                             uint8_t* out,
+                             size_t n,
+                             size_t elem_size) {
+    size_t first = 0;
+#if defined(__SSE2__)
+    first = bitshuffle_sse2(in, out, n, elem_size);
+#endif
+    bitshuffle_scalar(in, out, n, elem_size, first);
+}
+
+static size_t bshuf_block_elems(size_t elem_size) {
+    size_t n = BSHUF_TARGET_BLOCK_SIZE / elem_size;
+    n = n / BSHUF_BLOCKED_MULT * BSHUF_BLOCKED_MULT;
+    return n > BSHUF_MIN_BLOCK ? n : BSHUF_MIN_BLOCK;
+}
+
+enum stream2_result stream2_compress_get_layout(
+        const char* algorithm,
+        size_t size,
+        size_t elem_size,
+        struct stream2_compress_layout* layout) {
+    enum stream2_result r;
+
+    enum algorithm a;
+    if ((r = parse_algorithm(algorithm, &a)))
+        return r;
+
+    layout->header_size = HEADER_SIZE;
+    if (a == ALGORITHM_BSLZ4) {
+        if (elem_size == 0 || elem_size > MAX_ELEM_SIZE ||
+            size % elem_size != 0)
+            return STREAM2_ERROR_PARSE;
+        // Blocks hold a multiple of 8 elements; the last block may be
+        // shorter and fewer than 8 remaining elements are copied.
+        const size_t block_elems = bshuf_block_elems(elem_size);
+        const size_t elems = size / elem_size;
+        layout->block_size = block_elems * elem_size;
+        layout->blocks = elems / block_elems +
+                         (elems % block_elems >= BSHUF_BLOCKED_MULT);
+        layout->rest = elems % BSHUF_BLOCKED_MULT * elem_size;
+    } else {
+        layout->block_size = LZ4_BLOCK_SIZE;
+        layout->blocks = (size + LZ4_BLOCK_SIZE - 1) / LZ4_BLOCK_SIZE;
+        layout->rest = 0;
+    }
+    return STREAM2_OK;
+}
+
+size_t stream2_compress_bound(const char* algorithm,
+                              size_t size,
+                              size_t elem_size) {
+    struct stream2_compress_layout layout;
+    if (stream2_compress_get_layout(algorithm, size, elem_size, &layout))
+        return 0;
+    return layout.header_size + layout.blocks * 4 + lz4_bound(size) +
+           layout.blocks * 16;
+}
+
+size_t stream2_compress_block_bound(
+        const struct stream2_compress_layout* layout) {
+    return 4 + lz4_bound(layout->block_size);
+}
+
+void stream2_compress_write_header(const struct stream2_compress_layout* layout,
+                                   size_t size,
+                                   uint8_t* dst) {
+    write_u64_be(dst, size);
+    write_u32_be(dst + 8, (uint32_t)layout->block_size);
+}
+
+enum stream2_result stream2_compress_block(
+        const char* algorithm,
+        const struct stream2_compress_layout* layout,
+        const uint8_t* src,
+        size_t size,
+        size_t elem_size,
+        size_t index,
+        uint8_t* dst,
+        size_t dst_size,
+        size_t* compressed_size) {
+    enum stream2_result r;
+
+    enum algorithm a;
+    if ((r = parse_algorithm(algorithm, &a)))
+        return r;
+    if (index >= layout->blocks)
+        return STREAM2_ERROR_PARSE;
+
+    const size_t offset = index * layout->block_size;
+    const size_t end = size - layout->rest;
+    const size_t n = end - offset < layout->block_size ? end - offset
+                                                       : layout->block_size;
+    if (dst_size < 4 + lz4_bound(n))
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    size_t len;
+    if (a == ALGORITHM_BSLZ4) {
+        // Blocks are at most BSHUF_TARGET_BLOCK_SIZE bytes for element sizes
+        // up to MAX_ELEM_SIZE. The last block is rounded down to a multiple
+        // of 8 elements by the layout.
+        uint8_t shuffled[BSHUF_TARGET_BLOCK_SIZE];
+        const size_t elems = n / elem_size / BSHUF_BLOCKED_MULT *
+                             BSHUF_BLOCKED_MULT;
+        bitshuffle_block(src + offset, shuffled, elems, elem_size);
+        len = lz4_compress_block(shuffled, elems * elem_size, dst + 4);
+    } else {
+        len = lz4_compress_block(src + offset, n, dst + 4);
+        // Blocks that do not compress are stored as is.
+        if (len >= n) {
+            memcpy(dst + 4, src + offset, n);
+            len = n;
+        }
+    }
+    write_u32_be(dst, (uint32_t)len);
+    *compressed_size = 4 + len;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_compress(const char* algorithm,
+                                     const uint8_t* src,
+                                     size_t size,
+                                     size_t elem_size,
+                                     uint8_t* dst,
+                                     size_t dst_size,
+                                     size_t* compressed_size) {
+    enum stream2_result r;
+
+    struct stream2_compress_layout layout;
+    if ((r = stream2_compress_get_layout(algorithm, size, elem_size,
+                                         &layout)))
+        return r;
+
+    if (dst_size < layout.header_size)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    stream2_compress_write_header(&layout, size, dst);
+    size_t pos = layout.header_size;
+
+    for (size_t i = 0; i < layout.blocks; i++) {
+        size_t len;
+        if ((r = stream2_compress_block(algorithm, &layout, src, size,
+                                        elem_size, i, dst + pos,
+                                        dst_size - pos, &len)))
+            return r;
+        pos += len;
+    }
+
+    // Fewer than 8 remaining elements are copied.
+    if (dst_size - pos < layout.rest)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    memcpy(dst + pos, src + size - layout.rest, layout.rest);
+    *compressed_size = pos + layout.rest;
+    return STREAM2_OK;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Compresses data into the HDF5 framing used by the "bslz4" and "lz4"
+// algorithms of the DECTRIS compression tag, so that it can be decompressed
+// with the dectris compression library.
+//
+// https://github.com/dectris/documentation/blob/main/cbor/dectris-compression-tag.md
+
+// Gets an upper bound of the compressed size of size bytes.
+size_t stream2_compress_bound(const char* algorithm,
+                              size_t size,
+                              size_t elem_size);
+
+// Compresses size bytes of elements of elem_size bytes with algorithm "bslz4"
+// or "lz4". elem_size is unused with "lz4".
+//
+// Returns STREAM2_ERROR_OUT_OF_MEMORY if dst is smaller than the compressed
+// data.
+enum stream2_result stream2_compress(const char* algorithm,
+                                     const uint8_t* src,
+                                     size_t size,
+                                     size_t elem_size,
+                                     uint8_t* dst,
+                                     size_t dst_size,
+                                     size_t* compressed_size);
+
+// Blocks of the framing, which are compressed independently, e.g. by
+// several threads.
+struct stream2_compress_layout {
+    // Size of the header preceding the blocks.
+    size_t header_size;
+    // Number of blocks and size in bytes of all but the last block.
+    size_t blocks;
+    size_t block_size;
+    // Number of bytes at the end copied after the blocks.
+    size_t rest;
+};
+
+// Gets the blocks of size bytes of elements of elem_size bytes.
+enum stream2_result stream2_compress_get_layout(
+        const char* algorithm,
+        size_t size,
+        size_t elem_size,
+        struct stream2_compress_layout* layout);
+
+// Gets an upper bound of the output size of stream2_compress_block().
+size_t stream2_compress_block_bound(
+        const struct stream2_compress_layout* layout);
+
+// Writes the header of the framing of size bytes, layout->header_size bytes.
+void stream2_compress_write_header(const struct stream2_compress_layout* layout,
+                                   size_t size,
+                                   uint8_t* dst);
+
+// Compresses block index of src into dst, preceded by its compressed size as
+// in the framing. The framing is the header, all blocks in order and the
+// last layout->rest bytes of src.
+enum stream2_result stream2_compress_block(
+        const char* algorithm,
+        const struct stream2_compress_layout* layout,
+        const uint8_t* src,
+        size_t size,
+        size_t elem_size,
+        size_t index,
+        uint8_t* dst,
+        size_t dst_size,
+        size_t* compressed_size);
+
+#if defined(__cplusplus)
+}
+#endif
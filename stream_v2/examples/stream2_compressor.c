@@ -0,0 +1,251 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_compressor.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream2_compress.h"
+
+// Blocks are handed out to threads in tasks of about this many bytes.
+enum { TASK_SIZE = 128 << 10 };
+
+// Consecutive blocks compressed by one thread into its scratch area.
+struct task {
+    size_t first;
+    size_t count;
+    size_t len;
+    enum stream2_result result;
+};
+
+struct worker {
+    struct stream2_compressor* compressor;
+    pthread_t thread;
+};
+
+struct stream2_compressor {
+    struct worker* workers;
+    size_t workers_len;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // Incremented for every frame to wake up the workers.
+    uint64_t generation;
+    size_t active;
+    bool stop;
+
+    // Frame being compressed.
+    const char* algorithm;
+    const uint8_t* src;
+    size_t size;
+    size_t elem_size;
+    struct stream2_compress_layout layout;
+    struct task* tasks;
+    size_t tasks_len;
+    size_t tasks_capacity;
+    // Index of the next task to take, updated atomically.
+    size_t next_task;
+    uint8_t* scratch;
+    size_t scratch_size;
+    size_t task_bound;
+};
+
+static void run_tasks(struct stream2_compressor* c) {
+    size_t i;
+    while ((i = __atomic_fetch_add(&c->next_task, 1, __ATOMIC_RELAXED)) <
+           c->tasks_len)
+    {
+        struct task* task = &c->tasks[i];
+        uint8_t* dst = c->scratch + i * c->task_bound;
+        task->len = 0;
+        task->result = STREAM2_OK;
+        for (size_t b = task->first; b < task->first + task->count; b++) {
+            size_t len;
+            if ((task->result = stream2_compress_block(
+                         c->algorithm, &c->layout, c->src, c->size,
+                         c->elem_size, b, dst + task->len,
+                         c->task_bound - task->len, &len)))
+                break;
+            task->len += len;
+        }
+    }
+}
+
+static void* worker_thread(void* arg) {
+    struct worker* worker = arg;
+    struct stream2_compressor* c = worker->compressor;
+
+    uint64_t generation = 0;
+    pthread_mutex_lock(&c->mutex);
+    for (;;) {
+        while (!c->stop && c->generation == generation)
+            pthread_cond_wait(&c->start, &c->mutex);
+        if (c->stop)
+            break;
+        generation = c->generation;
+        pthread_mutex_unlock(&c->mutex);
+
+        run_tasks(c);
+
+        pthread_mutex_lock(&c->mutex);
+        if (--c->active == 0)
+            pthread_cond_signal(&c->done);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return NULL;
+}
+
+enum stream2_result stream2_compressor_create(
+        size_t threads,
+        struct stream2_compressor** compressor_out) {
+    *compressor_out = NULL;
+    if (threads == 0)
+        return STREAM2_ERROR_PARSE;
+
+    struct stream2_compressor* c =
+            calloc(1, sizeof(struct stream2_compressor));
+    if (c == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->start, NULL);
+    pthread_cond_init(&c->done, NULL);
+
+    if ((c->workers = calloc(threads, sizeof(struct worker))) == NULL) {
+        stream2_compressor_free(c);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    for (; c->workers_len < threads - 1; c->workers_len++) {
+        struct worker* worker = &c->workers[c->workers_len];
+        worker->compressor = c;
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+            stream2_compressor_free(c);
+            return STREAM2_ERROR_SYSTEM;
+        }
+    }
+
+    *compressor_out = c;
+    return STREAM2_OK;
+}
+
+void stream2_compressor_free(struct stream2_compressor* c) {
+    if (c == NULL)
+        return;
+
+    pthread_mutex_lock(&c->mutex);
+    c->stop = true;
+    pthread_cond_broadcast(&c->start);
+    pthread_mutex_unlock(&c->mutex);
+    for (size_t i = 0; i < c->workers_len; i++)
+        pthread_join(c->workers[i].thread, NULL);
+
+    free(c->workers);
+    free(c->tasks);
+    free(c->scratch);
+    pthread_cond_destroy(&c->done);
+    pthread_cond_destroy(&c->start);
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
+}
+
+// Splits the blocks of the frame into tasks with a scratch area each.
+static enum stream2_result prepare_tasks(struct stream2_compressor* c,
+                                         size_t per_task) {
+    const struct stream2_compress_layout* layout = &c->layout;
+    c->task_bound = per_task * stream2_compress_block_bound(layout);
+
+    if (c->tasks_len > c->tasks_capacity) {
+        struct task* tasks =
+                realloc(c->tasks, c->tasks_len * sizeof(struct task));
+        if (tasks == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        c->tasks = tasks;
+        c->tasks_capacity = c->tasks_len;
+    }
+    if (c->tasks_len * c->task_bound > c->scratch_size) {
+        uint8_t* scratch = realloc(c->scratch, c->tasks_len * c->task_bound);
+        if (scratch == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        c->scratch = scratch;
+        c->scratch_size = c->tasks_len * c->task_bound;
+    }
+
+    for (size_t i = 0; i < c->tasks_len; i++) {
+        c->tasks[i].first = i * per_task;
+        c->tasks[i].count = layout->blocks - i * per_task < per_task
+                                    ? layout->blocks - i * per_task
+                                    : per_task;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_compressor_compress(
+        struct stream2_compressor* c,
+        const char* algorithm,
+        const uint8_t* src,
+        size_t size,
+        size_t elem_size,
+        uint8_t* dst,
+        size_t dst_size,
+        size_t* compressed_size) {
+    enum stream2_result r;
+
+    if ((r = stream2_compress_get_layout(algorithm, size, elem_size,
+                                         &c->layout)))
+        return r;
+    const size_t per_task = c->layout.block_size < TASK_SIZE
+                                    ? TASK_SIZE / c->layout.block_size
+                                    : 1;
+    c->tasks_len = (c->layout.blocks + per_task - 1) / per_task;
+
+    // A single task is compressed in place without the workers.
+    if (c->tasks_len <= 1 || c->workers_len == 0) {
+        return stream2_compress(algorithm, src, size, elem_size, dst,
+                                dst_size, compressed_size);
+    }
+
+    c->algorithm = algorithm;
+    c->src = src;
+    c->size = size;
+    c->elem_size = elem_size;
+    if ((r = prepare_tasks(c, per_task)))
+        return r;
+
+    pthread_mutex_lock(&c->mutex);
+    c->next_task = 0;
+    c->active = c->workers_len;
+    c->generation++;
+    pthread_cond_broadcast(&c->start);
+    pthread_mutex_unlock(&c->mutex);
+
+    run_tasks(c);
+
+    pthread_mutex_lock(&c->mutex);
+    while (c->active > 0)
+        pthread_cond_wait(&c->done, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+
+    // The compressed blocks are concatenated after the header.
+    if (dst_size < c->layout.header_size)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    stream2_compress_write_header(&c->layout, size, dst);
+    size_t pos = c->layout.header_size;
+    for (size_t i = 0; i < c->tasks_len; i++) {
+        const struct task* task = &c->tasks[i];
+        if (task->result)
+            return task->result;
+        if (dst_size - pos < task->len)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        memcpy(dst + pos, c->scratch + i * c->task_bound, task->len);
+        pos += task->len;
+    }
+
+    // Fewer than 8 remaining elements are copied.
+    const size_t rest = c->layout.rest;
+    if (dst_size - pos < rest)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    memcpy(dst + pos, src + size - rest, rest);
+    *compressed_size = pos + rest;
+    return STREAM2_OK;
+}
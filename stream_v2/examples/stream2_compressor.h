@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Compresses frames with a pool of threads into the same framing as
+// stream2_compress(), e.g. to re-publish corrected or reduced frames within
+// the bandwidth of the original stream.
+//
+// The blocks of a frame are compressed in parallel: about 128 KiB of
+// "bslz4" blocks or one 1 MiB "lz4" block per task. Frames of a single task
+// are compressed by the calling thread.
+struct stream2_compressor;
+
+// Creates a compressor using the calling thread and threads - 1 workers.
+enum stream2_result stream2_compressor_create(
+        size_t threads,
+        struct stream2_compressor** compressor_out);
+void stream2_compressor_free(struct stream2_compressor* compressor);
+
+// Compresses size bytes as stream2_compress(). dst holds
+// stream2_compress_bound() bytes. A compressor compresses one frame at a
+// time.
+enum stream2_result stream2_compressor_compress(
+        struct stream2_compressor* compressor,
+        const char* algorithm,
+        const uint8_t* src,
+        size_t size,
+        size_t elem_size,
+        uint8_t* dst,
+        size_t dst_size,
+        size_t* compressed_size);
+
+#if defined(__cplusplus)
+}
+#endif
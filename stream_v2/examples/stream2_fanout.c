@@ -0,0 +1,381 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_fanout.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zmq.h>
+
+enum {
+    TIMEOUT_MS = 100,
+    // Start and end messages are queued beyond the image queue capacity so
+    // that they are not held back by queued images.
+    CONTROL_RESERVE = 16,
+};
+
+struct entry {
+    zmq_msg_t msg;
+    bool image;
+    uint64_t image_id;
+};
+
+struct subscriber {
+    struct stream2_fanout_subscriber_config config;
+    void* socket;
+    pthread_t thread;
+    bool started;
+
+    // Queue of messages to send, protected by mutex. Messages share their
+    // data with the received message and the queues of other subscribers.
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct entry* ring;
+    size_t ring_size;
+    size_t head;
+    size_t len;
+    size_t images;
+    bool stop;
+    struct stream2_fanout_counters counters;
+};
+
+struct stream2_fanout {
+    void* ctx;
+    void* socket;
+    pthread_t receive_thread;
+    bool receive_started;
+    pthread_mutex_t mutex;
+    bool stop;
+    struct subscriber* subscribers;
+    size_t subscribers_len;
+};
+
+// Drops the oldest queued image. The start and end messages queued before it
+// move up by one.
+static void drop_oldest_image(struct subscriber* sub) {
+    size_t i = 0;
+    while (!sub->ring[(sub->head + i) % sub->ring_size].image)
+        i++;
+    struct entry* e = &sub->ring[(sub->head + i) % sub->ring_size];
+    sub->counters.dropped++;
+    sub->counters.last_dropped_image_id = e->image_id;
+    zmq_msg_close(&e->msg);
+    zmq_msg_init(&e->msg);
+    for (; i > 0; i--) {
+        struct entry* to = &sub->ring[(sub->head + i) % sub->ring_size];
+        struct entry* from = &sub->ring[(sub->head + i - 1) % sub->ring_size];
+        zmq_msg_move(&to->msg, &from->msg);
+        to->image = from->image;
+        to->image_id = from->image_id;
+    }
+    zmq_msg_close(&sub->ring[sub->head].msg);
+    sub->head = (sub->head + 1) % sub->ring_size;
+    sub->len--;
+    sub->images--;
+}
+
+// Drops the oldest queued start or end message of a subscriber whose queue
+// holds nothing else, i.e. that has stalled over several series.
+static void drop_head_control(struct subscriber* sub) {
+    sub->counters.dropped_control++;
+    zmq_msg_close(&sub->ring[sub->head].msg);
+    sub->head = (sub->head + 1) % sub->ring_size;
+    sub->len--;
+}
+
+// Queues a reference to msg for the subscriber according to its policy.
+// Only STREAM2_FANOUT_BLOCK waits for the subscriber.
+static void enqueue(struct subscriber* sub,
+                    zmq_msg_t* msg,
+                    bool image,
+                    uint64_t image_id) {
+    pthread_mutex_lock(&sub->mutex);
+    for (;;) {
+        if (sub->stop) {
+            pthread_mutex_unlock(&sub->mutex);
+            return;
+        }
+        if (image ? sub->images < sub->config.queue_capacity
+                  : sub->len < sub->ring_size)
+            break;
+
+        if (image && sub->config.policy == STREAM2_FANOUT_DROP_OLDEST &&
+            sub->images > 0)
+        {
+            drop_oldest_image(sub);
+        } else if (image && sub->config.policy != STREAM2_FANOUT_BLOCK) {
+            sub->counters.dropped++;
+            sub->counters.last_dropped_image_id = image_id;
+            pthread_mutex_unlock(&sub->mutex);
+            return;
+        } else if (sub->config.policy != STREAM2_FANOUT_BLOCK) {
+            // Start and end messages take the place of queued images.
+            if (sub->images > 0)
+                drop_oldest_image(sub);
+            else
+                drop_head_control(sub);
+        } else {
+            pthread_cond_wait(&sub->not_full, &sub->mutex);
+        }
+    }
+
+    struct entry* e = &sub->ring[(sub->head + sub->len) % sub->ring_size];
+    zmq_msg_init(&e->msg);
+    zmq_msg_copy(&e->msg, msg);
+    e->image = image;
+    e->image_id = image_id;
+    sub->len++;
+    sub->images += image;
+    sub->counters.queue_depth = sub->images;
+    if (sub->images > sub->counters.max_queue_depth)
+        sub->counters.max_queue_depth = sub->images;
+    pthread_cond_signal(&sub->not_empty);
+    pthread_mutex_unlock(&sub->mutex);
+}
+
+static void* subscriber_main(void* arg) {
+    struct subscriber* sub = arg;
+
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    pthread_mutex_lock(&sub->mutex);
+    for (;;) {
+        while (!sub->stop && sub->len == 0)
+            pthread_cond_wait(&sub->not_empty, &sub->mutex);
+        if (sub->stop)
+            break;
+
+        struct entry* e = &sub->ring[sub->head];
+        zmq_msg_move(&msg, &e->msg);
+        sub->head = (sub->head + 1) % sub->ring_size;
+        sub->len--;
+        sub->images -= e->image;
+        sub->counters.queue_depth = sub->images;
+        pthread_cond_signal(&sub->not_full);
+        pthread_mutex_unlock(&sub->mutex);
+
+        // Sends time out so that a subscriber without a connected client
+        // notices stop.
+        bool sent = false;
+        for (;;) {
+            if (zmq_msg_send(&msg, sub->socket, 0) != -1) {
+                sent = true;
+                break;
+            }
+            if (zmq_errno() != EAGAIN && zmq_errno() != EINTR)
+                break;
+            pthread_mutex_lock(&sub->mutex);
+            const bool stop = sub->stop;
+            pthread_mutex_unlock(&sub->mutex);
+            if (stop)
+                break;
+        }
+
+        pthread_mutex_lock(&sub->mutex);
+        if (sent)
+            sub->counters.sent++;
+    }
+    pthread_mutex_unlock(&sub->mutex);
+    zmq_msg_close(&msg);
+    return NULL;
+}
+
+static void* receive_main(void* arg) {
+    struct stream2_fanout* fanout = arg;
+
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    for (;;) {
+        pthread_mutex_lock(&fanout->mutex);
+        const bool stop = fanout->stop;
+        pthread_mutex_unlock(&fanout->mutex);
+        if (stop)
+            break;
+
+        if (zmq_msg_recv(&msg, fanout->socket, 0) == -1) {
+            if (zmq_errno() == EAGAIN || zmq_errno() == EINTR)
+                continue;
+            break;
+        }
+
+        // Messages that cannot be peeked are forwarded like start and end
+        // messages; the subscribers report the error.
+        enum stream2_msg_type type;
+        uint64_t image_id;
+        const bool image =
+                stream2_peek_msg((const uint8_t*)zmq_msg_data(&msg),
+                                 zmq_msg_size(&msg), &type,
+                                 &image_id) == STREAM2_OK &&
+                type == STREAM2_MSG_IMAGE;
+
+        for (size_t i = 0; i < fanout->subscribers_len; i++)
+            enqueue(&fanout->subscribers[i], &msg, image, image_id);
+    }
+    zmq_msg_close(&msg);
+    return NULL;
+}
+
+static void subscriber_free(struct subscriber* sub) {
+    for (size_t i = 0; i < sub->len; i++)
+        zmq_msg_close(&sub->ring[(sub->head + i) % sub->ring_size].msg);
+    if (sub->socket)
+        zmq_close(sub->socket);
+    pthread_cond_destroy(&sub->not_full);
+    pthread_cond_destroy(&sub->not_empty);
+    pthread_mutex_destroy(&sub->mutex);
+    free(sub->ring);
+}
+
+static enum stream2_result subscriber_init(
+        struct stream2_fanout* fanout,
+        struct subscriber* sub,
+        const struct stream2_fanout_subscriber_config* config) {
+    sub->config = *config;
+    pthread_mutex_init(&sub->mutex, NULL);
+    pthread_cond_init(&sub->not_empty, NULL);
+    pthread_cond_init(&sub->not_full, NULL);
+
+    if (config->address == NULL || config->queue_capacity == 0)
+        return STREAM2_ERROR_PARSE;
+
+    sub->ring_size = config->queue_capacity + CONTROL_RESERVE;
+    if ((sub->ring = calloc(sub->ring_size, sizeof(struct entry))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if ((sub->socket = zmq_socket(fanout->ctx, ZMQ_PUSH)) == NULL)
+        return STREAM2_ERROR_SYSTEM;
+
+    const int timeout = TIMEOUT_MS;
+    const int linger = 0;
+    if (zmq_setsockopt(sub->socket, ZMQ_SNDTIMEO, &timeout, sizeof(timeout)) ||
+        zmq_setsockopt(sub->socket, ZMQ_LINGER, &linger, sizeof(linger)) ||
+        (config->sndhwm > 0 &&
+         zmq_setsockopt(sub->socket, ZMQ_SNDHWM, &config->sndhwm,
+                        sizeof(config->sndhwm))) ||
+        zmq_bind(sub->socket, config->address))
+        return STREAM2_ERROR_SYSTEM;
+
+    return STREAM2_OK;
+}
+
+static void fanout_free(struct stream2_fanout* fanout) {
+    pthread_mutex_lock(&fanout->mutex);
+    fanout->stop = true;
+    pthread_mutex_unlock(&fanout->mutex);
+
+    // The receive thread may wait for a blocking subscriber, so subscribers
+    // are stopped before joining it.
+    for (size_t i = 0; i < fanout->subscribers_len; i++) {
+        struct subscriber* sub = &fanout->subscribers[i];
+        pthread_mutex_lock(&sub->mutex);
+        sub->stop = true;
+        pthread_cond_broadcast(&sub->not_empty);
+        pthread_cond_broadcast(&sub->not_full);
+        pthread_mutex_unlock(&sub->mutex);
+    }
+    if (fanout->receive_started)
+        pthread_join(fanout->receive_thread, NULL);
+
+    for (size_t i = 0; i < fanout->subscribers_len; i++) {
+        struct subscriber* sub = &fanout->subscribers[i];
+        if (sub->started)
+            pthread_join(sub->thread, NULL);
+        subscriber_free(sub);
+    }
+
+    if (fanout->socket)
+        zmq_close(fanout->socket);
+    if (fanout->ctx)
+        zmq_ctx_term(fanout->ctx);
+    pthread_mutex_destroy(&fanout->mutex);
+    free(fanout->subscribers);
+    free(fanout);
+}
+
+static enum stream2_result fanout_init(
+        struct stream2_fanout* fanout,
+        const struct stream2_fanout_config* config) {
+    enum stream2_result r;
+
+    if ((fanout->ctx = zmq_ctx_new()) == NULL)
+        return STREAM2_ERROR_SYSTEM;
+
+    fanout->subscribers =
+            calloc(config->subscribers_len, sizeof(struct subscriber));
+    if (fanout->subscribers == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < config->subscribers_len; i++) {
+        fanout->subscribers_len++;
+        if ((r = subscriber_init(fanout, &fanout->subscribers[i],
+                                 &config->subscribers[i])))
+            return r;
+    }
+
+    if ((fanout->socket = zmq_socket(fanout->ctx, ZMQ_PULL)) == NULL)
+        return STREAM2_ERROR_SYSTEM;
+
+    const int timeout = TIMEOUT_MS;
+    if (zmq_setsockopt(fanout->socket, ZMQ_RCVTIMEO, &timeout,
+                       sizeof(timeout)))
+        return STREAM2_ERROR_SYSTEM;
+
+    if (config->rcvhwm > 0 &&
+        zmq_setsockopt(fanout->socket, ZMQ_RCVHWM, &config->rcvhwm,
+                       sizeof(config->rcvhwm)))
+        return STREAM2_ERROR_SYSTEM;
+
+    if (zmq_connect(fanout->socket, config->address))
+        return STREAM2_ERROR_SYSTEM;
+
+    for (size_t i = 0; i < fanout->subscribers_len; i++) {
+        struct subscriber* sub = &fanout->subscribers[i];
+        if (pthread_create(&sub->thread, NULL, subscriber_main, sub))
+            return STREAM2_ERROR_SYSTEM;
+        sub->started = true;
+    }
+
+    if (pthread_create(&fanout->receive_thread, NULL, receive_main, fanout))
+        return STREAM2_ERROR_SYSTEM;
+    fanout->receive_started = true;
+
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_fanout_start(
+        const struct stream2_fanout_config* config,
+        struct stream2_fanout** fanout_out) {
+    enum stream2_result r;
+
+    *fanout_out = NULL;
+
+    if (config->address == NULL || config->subscribers_len == 0)
+        return STREAM2_ERROR_PARSE;
+
+    struct stream2_fanout* fanout = calloc(1, sizeof(struct stream2_fanout));
+    if (fanout == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    pthread_mutex_init(&fanout->mutex, NULL);
+
+    if ((r = fanout_init(fanout, config))) {
+        fanout_free(fanout);
+        return r;
+    }
+
+    *fanout_out = fanout;
+    return STREAM2_OK;
+}
+
+void stream2_fanout_stop(struct stream2_fanout* fanout) {
+    fanout_free(fanout);
+}
+
+void stream2_fanout_counters(struct stream2_fanout* fanout,
+                             size_t subscriber,
+                             struct stream2_fanout_counters* counters) {
+    struct subscriber* sub = &fanout->subscribers[subscriber];
+    pthread_mutex_lock(&sub->mutex);
+    *counters = sub->counters;
+    pthread_mutex_unlock(&sub->mutex);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct stream2_fanout;
+
+// What a subscriber does with an image message when its queue is full.
+//
+// Start and end messages are queued beyond the capacity for images. When
+// that is full as well, the drop policies drop the oldest queued image, or
+// the oldest start or end message if no image is queued, instead of waiting.
+enum stream2_fanout_policy {
+    // Wait for the subscriber. A blocked subscriber stalls every subscriber
+    // and eventually the detector, so use it for lossless consumers only.
+    STREAM2_FANOUT_BLOCK,
+    // Drop the incoming image.
+    STREAM2_FANOUT_DROP_NEWEST,
+    // Drop the oldest queued image to keep the subscriber up to date, e.g. for
+    // live viewers.
+    STREAM2_FANOUT_DROP_OLDEST,
+};
+
+struct stream2_fanout_subscriber_config {
+    // ZeroMQ endpoint of the PUSH socket the subscriber connects to with a
+    // PULL socket, e.g. "tcp://*:31002" or "ipc:///tmp/viewer".
+    const char* address;
+    // Number of image messages queued for the subscriber.
+    size_t queue_capacity;
+    enum stream2_fanout_policy policy;
+    // ZMQ_SNDHWM of the PUSH socket, or 0 for the ZeroMQ default. ZeroMQ
+    // buffers up to this many messages before the queue policy applies.
+    int sndhwm;
+};
+
+struct stream2_fanout_config {
+    // ZeroMQ endpoint to pull messages from, e.g. "tcp://dcu:31001".
+    const char* address;
+    // ZMQ_RCVHWM of the PULL socket, or 0 for the ZeroMQ default.
+    int rcvhwm;
+    const struct stream2_fanout_subscriber_config* subscribers;
+    size_t subscribers_len;
+};
+
+struct stream2_fanout_counters {
+    // Number of messages sent to the subscriber.
+    uint64_t sent;
+    // Number of image messages dropped for the subscriber.
+    uint64_t dropped;
+    // image_id of the last dropped image.
+    uint64_t last_dropped_image_id;
+    // Number of start and end messages dropped for a subscriber that stalled
+    // over several series.
+    uint64_t dropped_control;
+    // Current and maximum number of queued image messages.
+    size_t queue_depth;
+    size_t max_queue_depth;
+};
+
+// Starts a proxy that pulls every message once and re-publishes it to each
+// subscriber. Messages are shared between subscribers without copies.
+enum stream2_result stream2_fanout_start(
+        const struct stream2_fanout_config* config,
+        struct stream2_fanout** fanout_out);
+
+// Stops the proxy and frees it. Queued messages are discarded.
+void stream2_fanout_stop(struct stream2_fanout* fanout);
+
+// Gets the counters of a subscriber.
+void stream2_fanout_counters(struct stream2_fanout* fanout,
+                             size_t subscriber,
+                             struct stream2_fanout_counters* counters);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram of 64-bit values, e.g. latencies in nanoseconds,
+// shared by the modules that report quantiles.
+//
+// Values below 8 have a bucket each, and every power of two above is split
+// into 8 sub-buckets, so that the middle of a bucket is within 6.25% of its
+// values. A histogram is an array of STREAM2_HISTOGRAM_BUCKETS counts.
+enum {
+    STREAM2_HISTOGRAM_SUB_BUCKETS = 8,
+    STREAM2_HISTOGRAM_BUCKETS = 64 * STREAM2_HISTOGRAM_SUB_BUCKETS,
+};
+
+static inline size_t stream2_histogram_bucket(uint64_t value) {
+    if (value < STREAM2_HISTOGRAM_SUB_BUCKETS)
+        return value;
+#if defined(__GNUC__)
+    const int e = 63 - __builtin_clzll(value);
+#else
+    int e = 63;
+    while (!(value >> e))
+        e--;
+#endif
+    const size_t sub =
+            (value >> (e - 3)) & (STREAM2_HISTOGRAM_SUB_BUCKETS - 1);
+    return STREAM2_HISTOGRAM_SUB_BUCKETS * (e - 2) + sub;
+}
+
+// Gets the middle of a bucket.
+static inline double stream2_histogram_value(size_t bucket) {
+    if (bucket < STREAM2_HISTOGRAM_SUB_BUCKETS)
+        return (double)bucket;
+    const int e = (int)(bucket / STREAM2_HISTOGRAM_SUB_BUCKETS) + 2;
+    const size_t sub = bucket % STREAM2_HISTOGRAM_SUB_BUCKETS;
+    return (STREAM2_HISTOGRAM_SUB_BUCKETS + sub + 0.5) *
+           (double)(UINT64_C(1) << (e - 3));
+}
+
+// Gets the values of len ascending quantiles, e.g. 0.5 for the median, as
+// the middles of their buckets. values is not written to if the histogram is
+// empty.
+static inline void stream2_histogram_quantiles(const uint64_t* buckets,
+                                               const double* quantiles,
+                                               size_t len,
+                                               double* values) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < STREAM2_HISTOGRAM_BUCKETS; i++)
+        count += buckets[i];
+    uint64_t seen = 0;
+    size_t q = 0;
+    for (size_t i = 0; i < STREAM2_HISTOGRAM_BUCKETS && count > 0 && q < len;
+         i++)
+    {
+        seen += buckets[i];
+        while (q < len && seen >= quantiles[q] * count)
+            values[q++] = stream2_histogram_value(i);
+    }
+}
@@ -0,0 +1,451 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_latency.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stream2_histogram.h"
+
+enum {
+    // Windows kept per thread, so that the windows fitted over are kept while
+    // threads record into windows a few apart.
+    WINDOWS = 64,
+    MAX_TREND_WINDOWS = 32,
+    CACHE_LINE = 64,
+};
+
+struct lag_counters {
+    int64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t latency[STREAM2_HISTOGRAM_BUCKETS];
+};
+
+struct window {
+    int64_t index;
+    uint64_t count;
+    int64_t sum_ns;
+};
+
+// Counters written by one thread only, and read by snapshots.
+struct thread_latency {
+    bool started;
+    uint64_t series_id;
+    // series_date of the series, converted by this thread.
+    bool date_valid;
+    int64_t date_ns;
+
+    uint64_t images;
+    uint64_t skipped;
+    uint64_t early;
+    struct lag_counters receive;
+    struct lag_counters complete;
+    struct window windows[WINDOWS];
+    char padding[CACHE_LINE];
+};
+
+struct stream2_latency {
+    struct stream2_latency_config config;
+    int64_t window_ns;
+    struct thread_latency* threads;
+    size_t threads_len;
+};
+
+void stream2_latency_config_default(struct stream2_latency_config* config) {
+    config->window_s = 0.5;
+    config->trend_windows = 8;
+    config->growth_limit = 0.01;
+}
+
+enum stream2_result stream2_latency_create(
+        const struct stream2_latency_config* config,
+        size_t threads,
+        struct stream2_latency** latency_out) {
+    *latency_out = NULL;
+
+    if (threads == 0 || !(config->window_s > 0) ||
+        config->trend_windows > MAX_TREND_WINDOWS)
+        return STREAM2_ERROR_PARSE;
+    struct stream2_latency* latency = calloc(1, sizeof(struct stream2_latency));
+    if (latency == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((latency->threads = calloc(threads, sizeof(struct thread_latency))) ==
+        NULL)
+    {
+        free(latency);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    latency->config = *config;
+    latency->window_ns = (int64_t)(config->window_s * 1e9);
+    if (latency->window_ns < 1)
+        latency->window_ns = 1;
+    latency->threads_len = threads;
+
+    *latency_out = latency;
+    return STREAM2_OK;
+}
+
+void stream2_latency_free(struct stream2_latency* latency) {
+    if (latency == NULL)
+        return;
+    free(latency->threads);
+    free(latency);
+}
+
+int64_t stream2_latency_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Parses exactly n digits.
+static bool parse_digits(const char** s, int n, int* value) {
+    *value = 0;
+    for (int i = 0; i < n; i++) {
+        const char c = (*s)[i];
+        if (c < '0' || c > '9')
+            return false;
+        *value = *value * 10 + (c - '0');
+    }
+    *s += n;
+    return true;
+}
+
+static bool parse_char(const char** s, const char* chars) {
+    if (**s == '\0' || strchr(chars, **s) == NULL)
+        return false;
+    (*s)++;
+    return true;
+}
+
+// Days since 1970-01-01 of a date of the proleptic Gregorian calendar.
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const int64_t yoe = y - era * 400;
+    const int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+enum stream2_result stream2_latency_parse_date(const char* date,
+                                               int64_t* ns) {
+    const char* s = date;
+    int year, month, day, hour, minute, second;
+    if (!parse_digits(&s, 4, &year) || !parse_char(&s, "-") ||
+        !parse_digits(&s, 2, &month) || !parse_char(&s, "-") ||
+        !parse_digits(&s, 2, &day) || !parse_char(&s, "Tt ") ||
+        !parse_digits(&s, 2, &hour) || !parse_char(&s, ":") ||
+        !parse_digits(&s, 2, &minute) || !parse_char(&s, ":") ||
+        !parse_digits(&s, 2, &second))
+        return STREAM2_ERROR_PARSE;
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 ||
+        minute > 59 || second > 60)
+        return STREAM2_ERROR_PARSE;
+
+    int64_t fraction_ns = 0;
+    if (parse_char(&s, ".")) {
+        int64_t scale = 100000000;
+        if (*s < '0' || *s > '9')
+            return STREAM2_ERROR_PARSE;
+        for (; *s >= '0' && *s <= '9'; s++) {
+            fraction_ns += (*s - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    int offset_s = 0;
+    if (!parse_char(&s, "Zz")) {
+        const bool negative = *s == '-';
+        int offset_hour, offset_minute;
+        if (!parse_char(&s, "+-") || !parse_digits(&s, 2, &offset_hour) ||
+            !parse_char(&s, ":") || !parse_digits(&s, 2, &offset_minute) ||
+            offset_hour > 23 || offset_minute > 59)
+            return STREAM2_ERROR_PARSE;
+        offset_s = offset_hour * 3600 + offset_minute * 60;
+        if (negative)
+            offset_s = -offset_s;
+    }
+    if (*s != '\0')
+        return STREAM2_ERROR_PARSE;
+
+    const int64_t seconds = days_from_civil(year, month, day) * 86400 +
+                            hour * 3600 + minute * 60 + second - offset_s;
+    *ns = seconds * 1000000000 + fraction_ns;
+    return STREAM2_OK;
+}
+
+// Stores to counters that only the calling thread writes atomically, so that
+// snapshots never read a torn value.
+static void store_u64(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static void store_i64(int64_t* counter, int64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load_u64(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int64_t load_i64(const int64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void clear_lag(struct lag_counters* c) {
+    store_i64(&c->sum_ns, 0);
+    store_u64(&c->max_ns, 0);
+    for (size_t i = 0; i < STREAM2_HISTOGRAM_BUCKETS; i++)
+        store_u64(&c->latency[i], 0);
+}
+
+// Resets the counters of a thread for a new series and converts its
+// series_date.
+static void start_series(struct thread_latency* t,
+                         const struct stream2_image_msg* msg) {
+    store_u64(&t->images, 0);
+    store_u64(&t->skipped, 0);
+    store_u64(&t->early, 0);
+    clear_lag(&t->receive);
+    clear_lag(&t->complete);
+    for (size_t i = 0; i < WINDOWS; i++) {
+        store_i64(&t->windows[i].index, -1);
+        store_u64(&t->windows[i].count, 0);
+        store_i64(&t->windows[i].sum_ns, 0);
+    }
+    t->date_valid =
+            msg->series_date &&
+            stream2_latency_parse_date(msg->series_date, &t->date_ns) ==
+                    STREAM2_OK;
+    store_u64(&t->series_id, msg->series_id);
+    __atomic_store_n(&t->started, true, __ATOMIC_RELEASE);
+}
+
+// Converts a rational time in seconds to nanoseconds. Returns false if the
+// time is missing.
+static bool rational_ns(const uint64_t time[2], int64_t* ns) {
+    if (time[1] == 0)
+        return false;
+    const uint64_t seconds = time[0] / time[1];
+    const uint64_t rest = time[0] % time[1];
+    if (seconds > INT64_MAX / 1000000000 - 1)
+        return false;
+    *ns = (int64_t)(seconds * 1000000000 +
+                    (uint64_t)((double)rest * 1e9 / (double)time[1]));
+    return true;
+}
+
+static void add_lag(struct lag_counters* c, int64_t lag_ns) {
+    store_i64(&c->sum_ns, c->sum_ns + lag_ns);
+    const uint64_t ns = lag_ns > 0 ? (uint64_t)lag_ns : 0;
+    uint64_t* bucket = &c->latency[stream2_histogram_bucket(ns)];
+    store_u64(bucket, *bucket + 1);
+    if (ns > c->max_ns)
+        store_u64(&c->max_ns, ns);
+}
+
+void stream2_latency_record(struct stream2_latency* latency,
+                            size_t thread,
+                            const struct stream2_image_msg* msg,
+                            int64_t received_ns,
+                            int64_t completed_ns) {
+    if (thread >= latency->threads_len)
+        return;
+    struct thread_latency* t = &latency->threads[thread];
+    if (!t->started || t->series_id != msg->series_id)
+        start_series(t, msg);
+
+    // The end of the exposure, or its start if the message has no stop time.
+    int64_t offset_ns;
+    if (!t->date_valid || !(rational_ns(msg->stop_time, &offset_ns) ||
+                            rational_ns(msg->start_time, &offset_ns)))
+    {
+        store_u64(&t->skipped, t->skipped + 1);
+        return;
+    }
+    const int64_t exposed_ns = t->date_ns + offset_ns;
+    const int64_t receive_ns = received_ns - exposed_ns;
+    const int64_t complete_ns = completed_ns - exposed_ns;
+
+    store_u64(&t->images, t->images + 1);
+    if (receive_ns < 0 || complete_ns < 0)
+        store_u64(&t->early, t->early + 1);
+    add_lag(&t->receive, receive_ns);
+    add_lag(&t->complete, complete_ns);
+
+    const int64_t index = offset_ns / latency->window_ns;
+    struct window* w = &t->windows[index % WINDOWS];
+    if (w->index != index) {
+        store_u64(&w->count, 0);
+        store_i64(&w->sum_ns, 0);
+        store_i64(&w->index, index);
+    }
+    store_u64(&w->count, w->count + 1);
+    store_i64(&w->sum_ns, w->sum_ns + complete_ns);
+}
+
+static void lag_quantiles(const uint64_t latency[STREAM2_HISTOGRAM_BUCKETS],
+                          uint64_t max_ns,
+                          struct stream2_latency_lag* lag) {
+    static const double QUANTILES[] = {0.5, 0.9, 0.99};
+    double ns[] = {0, 0, 0};
+    stream2_histogram_quantiles(latency, QUANTILES, 3, ns);
+    double* values[] = {&lag->p50_ms, &lag->p90_ms, &lag->p99_ms};
+    for (size_t q = 0; q < 3; q++) {
+        // The middle of the last bucket may be above the maximum.
+        *values[q] = (ns[q] < max_ns ? ns[q] : max_ns) * 1e-6;
+    }
+    lag->max_ms = max_ns * 1e-6;
+}
+
+// Merges the receive or the processing lags of the threads of the series.
+static void merge_lag(const struct stream2_latency* latency,
+                      uint64_t series_id,
+                      bool complete,
+                      uint64_t images,
+                      struct stream2_latency_lag* lag) {
+    uint64_t buckets[STREAM2_HISTOGRAM_BUCKETS] = {0};
+    int64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+    for (size_t t = 0; t < latency->threads_len; t++) {
+        const struct thread_latency* thread = &latency->threads[t];
+        if (!__atomic_load_n(&thread->started, __ATOMIC_ACQUIRE) ||
+            load_u64(&thread->series_id) != series_id)
+            continue;
+        const struct lag_counters* c =
+                complete ? &thread->complete : &thread->receive;
+        sum_ns += load_i64(&c->sum_ns);
+        const uint64_t thread_max_ns = load_u64(&c->max_ns);
+        if (thread_max_ns > max_ns)
+            max_ns = thread_max_ns;
+        for (size_t i = 0; i < STREAM2_HISTOGRAM_BUCKETS; i++)
+            buckets[i] += load_u64(&c->latency[i]);
+    }
+    if (images > 0)
+        lag->mean_ms = sum_ns * 1e-6 / images;
+    lag_quantiles(buckets, max_ns, lag);
+}
+
+// Fits the growth of the mean processing lag over the last complete windows
+// of the series.
+static void fit_trend(const struct stream2_latency* latency,
+                      uint64_t series_id,
+                      struct stream2_latency_snapshot* snapshot) {
+    // Latest window, which is still being recorded into.
+    int64_t last = -1;
+    for (size_t t = 0; t < latency->threads_len; t++) {
+        const struct thread_latency* thread = &latency->threads[t];
+        if (!__atomic_load_n(&thread->started, __ATOMIC_ACQUIRE) ||
+            load_u64(&thread->series_id) != series_id)
+            continue;
+        for (size_t i = 0; i < WINDOWS; i++) {
+            const int64_t index = load_i64(&thread->windows[i].index);
+            if (index > last)
+                last = index;
+        }
+    }
+
+    const double window_s = latency->config.window_s;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    size_t n = 0;
+    bool lag_set = false;
+    const int64_t windows = (int64_t)latency->config.trend_windows;
+    for (int64_t index = last - 1; index >= 0 && index >= last - windows;
+         index--)
+    {
+        uint64_t count = 0;
+        int64_t sum_ns = 0;
+        for (size_t t = 0; t < latency->threads_len; t++) {
+            const struct thread_latency* thread = &latency->threads[t];
+            if (!__atomic_load_n(&thread->started, __ATOMIC_ACQUIRE) ||
+                load_u64(&thread->series_id) != series_id)
+                continue;
+            const struct window* w = &thread->windows[index % WINDOWS];
+            if (load_i64(&w->index) != index)
+                continue;
+            count += load_u64(&w->count);
+            sum_ns += load_i64(&w->sum_ns);
+        }
+        if (count == 0)
+            continue;
+        const double x = (index + 0.5) * window_s;
+        const double y = sum_ns * 1e-9 / count;
+        if (!lag_set) {
+            snapshot->lag_s = y;
+            lag_set = true;
+        }
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        n++;
+    }
+
+    const double d = n * sxx - sx * sx;
+    if (n >= 3 && d > 0) {
+        snapshot->growth = (n * sxy - sx * sy) / d;
+        snapshot->trend_windows = n;
+        snapshot->growing = snapshot->growth > latency->config.growth_limit;
+    }
+}
+
+void stream2_latency_snapshot(const struct stream2_latency* latency,
+                              struct stream2_latency_snapshot* snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    bool started = false;
+    for (size_t t = 0; t < latency->threads_len; t++) {
+        const struct thread_latency* thread = &latency->threads[t];
+        if (!__atomic_load_n(&thread->started, __ATOMIC_ACQUIRE))
+            continue;
+        const uint64_t series_id = load_u64(&thread->series_id);
+        if (!started || series_id > snapshot->series_id)
+            snapshot->series_id = series_id;
+        started = true;
+    }
+    if (!started)
+        return;
+
+    for (size_t t = 0; t < latency->threads_len; t++) {
+        const struct thread_latency* thread = &latency->threads[t];
+        if (!__atomic_load_n(&thread->started, __ATOMIC_ACQUIRE) ||
+            load_u64(&thread->series_id) != snapshot->series_id)
+            continue;
+        snapshot->images += load_u64(&thread->images);
+        snapshot->skipped += load_u64(&thread->skipped);
+        snapshot->early += load_u64(&thread->early);
+    }
+    merge_lag(latency, snapshot->series_id, false, snapshot->images,
+              &snapshot->receive);
+    merge_lag(latency, snapshot->series_id, true, snapshot->images,
+              &snapshot->complete);
+    fit_trend(latency, snapshot->series_id, snapshot);
+}
+
+void stream2_latency_print(const struct stream2_latency_snapshot* snapshot,
+                           FILE* file) {
+    const struct stream2_latency_lag* lags[] = {&snapshot->receive,
+                                                &snapshot->complete};
+    const char* names[] = {"receive", "complete"};
+    fprintf(file,
+            "latency: series %" PRIu64 " images %" PRIu64 " skipped %" PRIu64
+            " early %" PRIu64 "\n",
+            snapshot->series_id, snapshot->images, snapshot->skipped,
+            snapshot->early);
+    for (size_t i = 0; i < 2; i++) {
+        fprintf(file,
+                "latency: %-8s mean %.1f ms p50 %.1f ms p90 %.1f ms "
+                "p99 %.1f ms max %.1f ms\n",
+                names[i], lags[i]->mean_ms, lags[i]->p50_ms, lags[i]->p90_ms,
+                lags[i]->p99_ms, lags[i]->max_ms);
+    }
+    if (snapshot->trend_windows > 0) {
+        fprintf(file,
+                "latency: lag %.1f ms growth %.2f ms/s over %zu windows%s\n",
+                snapshot->lag_s * 1e3, snapshot->growth * 1e3,
+                snapshot->trend_windows,
+                snapshot->growing ? ", falling behind" : "");
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Tracks how long after the end of its exposure each image is received and
+// processed, from the series_date and stop_time of the image messages, and
+// whether that lag grows during a series.
+//
+// A lag that grows steadily means that images are processed more slowly than
+// they are acquired, and that the queues and eventually the ZeroMQ high water
+// mark will fill: with a growth of g seconds per second, the lag grows by one
+// frame time every frame_time / g seconds. The growth is fitted over the mean
+// lag of the last windows of exposure time, so that it is detected within a
+// few seconds, long before the queues fill.
+//
+// As stream2_stats, every thread records into its own histograms and windows,
+// which a snapshot merges. The series_date of each series is converted once
+// per thread. The lag includes the offset between the clocks of the detector
+// and of the host, which should be synchronized, e.g. with PTP.
+struct stream2_latency;
+
+struct stream2_latency_config {
+    // Width of the windows of exposure time the lag is averaged over.
+    double window_s;
+    // Number of complete windows the growth of the lag is fitted over, at
+    // most 32.
+    size_t trend_windows;
+    // Growth in seconds of lag per second of exposure above which the lag is
+    // reported as growing.
+    double growth_limit;
+};
+
+struct stream2_latency_lag {
+    // Lags in milliseconds. Lags below zero, i.e. timestamps of the host
+    // before the end of the exposure, count as zero in the percentiles.
+    double mean_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+};
+
+struct stream2_latency_snapshot {
+    // Latest series recorded, which the snapshot is of.
+    uint64_t series_id;
+    // Images recorded, and images without a series_date or stop_time that
+    // could be converted.
+    uint64_t images;
+    uint64_t skipped;
+    // Images received or processed before the end of their exposure
+    // according to the clocks.
+    uint64_t early;
+    // Lag from the end of the exposure until the message was received and
+    // until the image was processed.
+    struct stream2_latency_lag receive;
+    struct stream2_latency_lag complete;
+    // Mean processing lag of the last complete window in seconds.
+    double lag_s;
+    // Fitted growth of the processing lag in seconds per second of exposure,
+    // and number of windows it was fitted over, 0 if fewer than 3.
+    double growth;
+    size_t trend_windows;
+    bool growing;
+};
+
+void stream2_latency_config_default(struct stream2_latency_config* config);
+
+// Creates a tracker recorded into by threads threads.
+enum stream2_result stream2_latency_create(
+        const struct stream2_latency_config* config,
+        size_t threads,
+        struct stream2_latency** latency_out);
+void stream2_latency_free(struct stream2_latency* latency);
+
+// Gets the time of the host in nanoseconds since the Unix epoch.
+int64_t stream2_latency_now_ns(void);
+
+// Converts an RFC 3339 date and time, e.g. "2024-01-02T03:04:05.678+01:00",
+// to nanoseconds since the Unix epoch.
+//
+// Returns STREAM2_ERROR_PARSE if date is not an RFC 3339 date and time.
+enum stream2_result stream2_latency_parse_date(const char* date,
+                                               int64_t* ns);
+
+// Records the lags of an image received at received_ns and processed at
+// completed_ns, times of stream2_latency_now_ns(), on thread thread. A thread
+// index must be used by one thread at a time.
+void stream2_latency_record(struct stream2_latency* latency,
+                            size_t thread,
+                            const struct stream2_image_msg* msg,
+                            int64_t received_ns,
+                            int64_t completed_ns);
+
+// Merges the histograms and windows of every thread for the latest series.
+// May be called while images are recorded.
+void stream2_latency_snapshot(const struct stream2_latency* latency,
+                              struct stream2_latency_snapshot* snapshot);
+
+// Prints the lags and, once fitted, their growth, a line each.
+void stream2_latency_print(const struct stream2_latency_snapshot* snapshot,
+                           FILE* file);
+
+#if defined(__cplusplus)
+}
+#endif
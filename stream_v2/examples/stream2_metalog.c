@@ -0,0 +1,511 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_metalog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define METALOG_VERSION 1
+
+enum { SERIES_UNIQUE_ID_SIZE = 80 };
+
+static const char MAGIC[8] = {'S', '2', 'M', 'E', 'T', 'L', 'O', 'G'};
+
+// The header is followed by channels names of STREAM2_METALOG_NAME_SIZE
+// bytes and the blocks.
+struct file_header {
+    char magic[8];
+    uint64_t version;
+    uint64_t series_id;
+    uint64_t number_of_images;
+    uint64_t channels;
+    uint64_t columns;
+    char series_unique_id[SERIES_UNIQUE_ID_SIZE];
+};
+
+// Each block is followed by its columns of rows values each and its user
+// data, padded to a multiple of 8 bytes.
+struct block_header {
+    uint64_t rows;
+    uint64_t user_data_size;
+};
+
+// Block filled by appends. Column c is stored at columns + c * block_rows.
+struct block {
+    uint64_t* columns;
+    size_t rows;
+    uint8_t* user_data;
+    size_t user_data_size;
+    size_t user_data_capacity;
+};
+
+struct stream2_metalog_writer {
+    int fd;
+    struct stream2_metalog_config config;
+    size_t channels;
+    size_t columns;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t queued_cond;
+    pthread_cond_t space_cond;
+    // Ring of blocks: queued blocks from head on, followed by the block
+    // being filled.
+    struct block* blocks;
+    size_t head;
+    size_t queued;
+    bool stop;
+    enum stream2_result result;
+    pthread_t thread;
+    bool thread_started;
+};
+
+struct stream2_metalog_reader {
+    uint8_t* ptr;
+    size_t size;
+    const struct file_header* header;
+    char series_unique_id[SERIES_UNIQUE_ID_SIZE + 1];
+    // Offsets of the block headers in the file.
+    size_t* blocks;
+    size_t blocks_len;
+    uint64_t rows;
+};
+
+size_t stream2_metalog_channel_column(size_t channel,
+                                      enum stream2_metalog_channel_column col) {
+    return STREAM2_METALOG_IMAGE_COLUMNS +
+           channel * STREAM2_METALOG_CHANNEL_COLUMNS + col;
+}
+
+void stream2_metalog_config_default(struct stream2_metalog_config* config) {
+    config->block_rows = 4096;
+    config->blocks = 4;
+}
+
+static size_t padding(size_t size) {
+    return (8 - size % 8) % 8;
+}
+
+static enum stream2_result write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = data;
+    while (size > 0) {
+        const ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return STREAM2_ERROR_SYSTEM;
+        }
+        p += n;
+        size -= n;
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result write_header(struct stream2_metalog_writer* writer,
+                                        const struct stream2_series* series) {
+    enum stream2_result r;
+
+    struct file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.version = METALOG_VERSION;
+    header.series_id = series->series_id;
+    header.number_of_images = series->number_of_images;
+    header.channels = writer->channels;
+    header.columns = writer->columns;
+    // The series_unique_id is only null-terminated if it is shorter than the
+    // field.
+    if (series->series_unique_id) {
+        const size_t len = strlen(series->series_unique_id);
+        memcpy(header.series_unique_id, series->series_unique_id,
+               len < SERIES_UNIQUE_ID_SIZE ? len : SERIES_UNIQUE_ID_SIZE);
+    }
+    if ((r = write_all(writer->fd, &header, sizeof(header))))
+        return r;
+
+    for (size_t i = 0; i < writer->channels; i++) {
+        char name[STREAM2_METALOG_NAME_SIZE];
+        memset(name, 0, sizeof(name));
+        if (series->channels[i].name)
+            strncpy(name, series->channels[i].name, sizeof(name) - 1);
+        if ((r = write_all(writer->fd, name, sizeof(name))))
+            return r;
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result write_block(struct stream2_metalog_writer* writer,
+                                       struct block* block) {
+    enum stream2_result r;
+
+    // The columns of a partial block are moved together.
+    const size_t rows = block->rows;
+    if (rows < writer->config.block_rows) {
+        for (size_t c = 1; c < writer->columns; c++) {
+            memmove(block->columns + c * rows,
+                    block->columns + c * writer->config.block_rows,
+                    rows * sizeof(uint64_t));
+        }
+    }
+
+    const struct block_header header = {
+            .rows = rows,
+            .user_data_size = block->user_data_size,
+    };
+    static const uint8_t zeros[8];
+    if ((r = write_all(writer->fd, &header, sizeof(header))) ||
+        (r = write_all(writer->fd, block->columns,
+                       writer->columns * rows * sizeof(uint64_t))) ||
+        (r = write_all(writer->fd, block->user_data,
+                       block->user_data_size)) ||
+        (r = write_all(writer->fd, zeros, padding(block->user_data_size))))
+        return r;
+    return STREAM2_OK;
+}
+
+// Writes queued blocks until the writer is stopped and all blocks are
+// written. After an error, blocks are discarded so that appends never wait
+// forever.
+static void* writer_thread(void* arg) {
+    struct stream2_metalog_writer* writer = arg;
+
+    pthread_mutex_lock(&writer->mutex);
+    for (;;) {
+        while (!writer->stop && writer->queued == 0)
+            pthread_cond_wait(&writer->queued_cond, &writer->mutex);
+        if (writer->queued == 0)
+            break;
+        struct block* block = &writer->blocks[writer->head];
+        const bool failed = writer->result != STREAM2_OK;
+        pthread_mutex_unlock(&writer->mutex);
+
+        const enum stream2_result r =
+                failed ? STREAM2_OK : write_block(writer, block);
+
+        pthread_mutex_lock(&writer->mutex);
+        if (r && writer->result == STREAM2_OK)
+            writer->result = r;
+        block->rows = 0;
+        block->user_data_size = 0;
+        writer->head = (writer->head + 1) % writer->config.blocks;
+        writer->queued--;
+        pthread_cond_broadcast(&writer->space_cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+static void writer_free(struct stream2_metalog_writer* writer) {
+    if (writer->blocks) {
+        for (size_t i = 0; i < writer->config.blocks; i++) {
+            free(writer->blocks[i].columns);
+            free(writer->blocks[i].user_data);
+        }
+    }
+    free(writer->blocks);
+    if (writer->fd != -1)
+        close(writer->fd);
+    pthread_cond_destroy(&writer->space_cond);
+    pthread_cond_destroy(&writer->queued_cond);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer);
+}
+
+enum stream2_result stream2_metalog_writer_open(
+        const char* path,
+        const struct stream2_series* series,
+        const struct stream2_metalog_config* config,
+        struct stream2_metalog_writer** writer_out) {
+    enum stream2_result r;
+
+    *writer_out = NULL;
+
+    struct stream2_metalog_writer* writer =
+            calloc(1, sizeof(struct stream2_metalog_writer));
+    if (writer == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    writer->fd = -1;
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->queued_cond, NULL);
+    pthread_cond_init(&writer->space_cond, NULL);
+    if (config)
+        writer->config = *config;
+    else
+        stream2_metalog_config_default(&writer->config);
+    if (writer->config.block_rows == 0 || writer->config.blocks == 0) {
+        writer_free(writer);
+        return STREAM2_ERROR_PARSE;
+    }
+    writer->channels = series->channels_len;
+    writer->columns = STREAM2_METALOG_IMAGE_COLUMNS +
+                      writer->channels * STREAM2_METALOG_CHANNEL_COLUMNS;
+
+    if ((writer->blocks = calloc(writer->config.blocks,
+                                 sizeof(struct block))) == NULL)
+    {
+        writer_free(writer);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < writer->config.blocks; i++) {
+        if ((writer->blocks[i].columns =
+                     malloc(writer->columns * writer->config.block_rows *
+                            sizeof(uint64_t))) == NULL)
+        {
+            writer_free(writer);
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    if ((writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        writer_free(writer);
+        return STREAM2_ERROR_SYSTEM;
+    }
+    if ((r = write_header(writer, series))) {
+        writer_free(writer);
+        return r;
+    }
+
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer)) {
+        writer_free(writer);
+        return STREAM2_ERROR_SYSTEM;
+    }
+    writer->thread_started = true;
+
+    *writer_out = writer;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_metalog_writer_close(
+        struct stream2_metalog_writer* writer) {
+    if (writer == NULL)
+        return STREAM2_OK;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->queued == writer->config.blocks)
+        pthread_cond_wait(&writer->space_cond, &writer->mutex);
+    const size_t current =
+            (writer->head + writer->queued) % writer->config.blocks;
+    if (writer->blocks[current].rows > 0)
+        writer->queued++;
+    writer->stop = true;
+    pthread_cond_signal(&writer->queued_cond);
+    pthread_mutex_unlock(&writer->mutex);
+    if (writer->thread_started)
+        pthread_join(writer->thread, NULL);
+
+    enum stream2_result r = writer->result;
+    if (close(writer->fd) && r == STREAM2_OK)
+        r = STREAM2_ERROR_SYSTEM;
+    writer->fd = -1;
+    writer_free(writer);
+    return r;
+}
+
+static enum stream2_result append_user_data(struct block* block,
+                                            const struct stream2_user_data* ud) {
+    if (block->user_data_capacity - block->user_data_size < ud->len) {
+        size_t capacity = block->user_data_capacity
+                                  ? block->user_data_capacity
+                                  : 4096;
+        while (capacity - block->user_data_size < ud->len)
+            capacity *= 2;
+        uint8_t* user_data = realloc(block->user_data, capacity);
+        if (user_data == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        block->user_data = user_data;
+        block->user_data_capacity = capacity;
+    }
+    if (ud->len > 0)
+        memcpy(block->user_data + block->user_data_size, ud->ptr, ud->len);
+    block->user_data_size += ud->len;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_metalog_writer_append(
+        struct stream2_metalog_writer* writer,
+        const struct stream2_series* series,
+        const struct stream2_image_msg* msg) {
+    enum stream2_result r;
+
+    if (series->channels_len != writer->channels)
+        return STREAM2_ERROR_SERIES_MISMATCH;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->queued == writer->config.blocks)
+        pthread_cond_wait(&writer->space_cond, &writer->mutex);
+    struct block* block =
+            &writer->blocks[(writer->head + writer->queued) %
+                            writer->config.blocks];
+    const size_t stride = writer->config.block_rows;
+    uint64_t* row = block->columns + block->rows;
+
+    const uint64_t offset = block->user_data_size;
+    if ((r = append_user_data(block, &msg->user_data))) {
+        pthread_mutex_unlock(&writer->mutex);
+        return r;
+    }
+    row[STREAM2_METALOG_IMAGE_ID * stride] = msg->image_id;
+    row[STREAM2_METALOG_REAL_TIME_NUM * stride] = msg->real_time[0];
+    row[STREAM2_METALOG_REAL_TIME_DEN * stride] = msg->real_time[1];
+    row[STREAM2_METALOG_START_TIME_NUM * stride] = msg->start_time[0];
+    row[STREAM2_METALOG_START_TIME_DEN * stride] = msg->start_time[1];
+    row[STREAM2_METALOG_STOP_TIME_NUM * stride] = msg->stop_time[0];
+    row[STREAM2_METALOG_STOP_TIME_DEN * stride] = msg->stop_time[1];
+    row[STREAM2_METALOG_USER_DATA_OFFSET * stride] = offset;
+    row[STREAM2_METALOG_USER_DATA_LEN * stride] = msg->user_data.len;
+
+    // Images out of range of the series have no statistics.
+    const bool in_range = msg->image_id < series->number_of_images;
+    for (size_t i = 0; i < writer->channels; i++) {
+        const struct stream2_series_stats* stats = &series->channels[i].stats;
+        const uint64_t id = msg->image_id;
+        uint64_t* ch = row + stream2_metalog_channel_column(i, 0) * stride;
+        ch[STREAM2_METALOG_SUM * stride] = in_range ? stats->sum[id] : 0;
+        ch[STREAM2_METALOG_MAX * stride] = in_range ? stats->max[id] : 0;
+        ch[STREAM2_METALOG_SATURATED * stride] =
+                in_range ? stats->saturated[id] : 0;
+        ch[STREAM2_METALOG_NODATA * stride] =
+                in_range ? stats->nodata[id] : 0;
+    }
+
+    if (++block->rows == stride) {
+        writer->queued++;
+        pthread_cond_signal(&writer->queued_cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return STREAM2_OK;
+}
+
+// Finds the complete blocks of the mapped file.
+static enum stream2_result index_blocks(struct stream2_metalog_reader* reader) {
+    const size_t columns = reader->header->columns;
+    size_t offset = sizeof(struct file_header) +
+                    reader->header->channels * STREAM2_METALOG_NAME_SIZE;
+    size_t capacity = 0;
+    while (reader->size - offset >= sizeof(struct block_header)) {
+        const struct block_header* header =
+                (const struct block_header*)(reader->ptr + offset);
+        const size_t avail =
+                reader->size - offset - sizeof(struct block_header);
+        if (header->rows > avail / sizeof(uint64_t) / columns)
+            break;
+        const size_t column_bytes = columns * header->rows * sizeof(uint64_t);
+        if (header->user_data_size > avail - column_bytes ||
+            padding(header->user_data_size) >
+                    avail - column_bytes - header->user_data_size)
+            break;
+
+        if (reader->blocks_len == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            size_t* blocks = realloc(reader->blocks, capacity * sizeof(size_t));
+            if (blocks == NULL)
+                return STREAM2_ERROR_OUT_OF_MEMORY;
+            reader->blocks = blocks;
+        }
+        reader->blocks[reader->blocks_len++] = offset;
+        reader->rows += header->rows;
+        offset += sizeof(struct block_header) + column_bytes +
+                  header->user_data_size + padding(header->user_data_size);
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result reader_open(struct stream2_metalog_reader* reader,
+                                       const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return STREAM2_ERROR_SYSTEM;
+
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(struct file_header))
+        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return STREAM2_ERROR_SYSTEM;
+    reader->ptr = ptr;
+    reader->size = st.st_size;
+
+    const struct file_header* header = ptr;
+    if (memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != METALOG_VERSION)
+        return STREAM2_ERROR_SIGNATURE;
+    if (header->channels > (reader->size - sizeof(struct file_header)) /
+                                   STREAM2_METALOG_NAME_SIZE ||
+        header->columns !=
+                STREAM2_METALOG_IMAGE_COLUMNS +
+                        header->channels * STREAM2_METALOG_CHANNEL_COLUMNS)
+        return STREAM2_ERROR_PARSE;
+    reader->header = header;
+    memcpy(reader->series_unique_id, header->series_unique_id,
+           SERIES_UNIQUE_ID_SIZE);
+    reader->series_unique_id[SERIES_UNIQUE_ID_SIZE] = '\0';
+
+    return index_blocks(reader);
+}
+
+enum stream2_result stream2_metalog_reader_open(
+        const char* path,
+        struct stream2_metalog_reader** reader_out) {
+    enum stream2_result r;
+
+    *reader_out = NULL;
+
+    struct stream2_metalog_reader* reader =
+            calloc(1, sizeof(struct stream2_metalog_reader));
+    if (reader == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if ((r = reader_open(reader, path))) {
+        stream2_metalog_reader_close(reader);
+        return r;
+    }
+
+    *reader_out = reader;
+    return STREAM2_OK;
+}
+
+void stream2_metalog_reader_close(struct stream2_metalog_reader* reader) {
+    if (reader == NULL)
+        return;
+    if (reader->ptr)
+        munmap(reader->ptr, reader->size);
+    free(reader->blocks);
+    free(reader);
+}
+
+void stream2_metalog_reader_info(const struct stream2_metalog_reader* reader,
+                                 struct stream2_metalog_info* info) {
+    info->series_id = reader->header->series_id;
+    info->series_unique_id = reader->series_unique_id;
+    info->number_of_images = reader->header->number_of_images;
+    info->channels = reader->header->channels;
+    info->columns = reader->header->columns;
+    info->blocks = reader->blocks_len;
+    info->rows = reader->rows;
+}
+
+const char* stream2_metalog_reader_channel(
+        const struct stream2_metalog_reader* reader,
+        size_t channel) {
+    return (const char*)reader->ptr + sizeof(struct file_header) +
+           channel * STREAM2_METALOG_NAME_SIZE;
+}
+
+void stream2_metalog_reader_block(const struct stream2_metalog_reader* reader,
+                                  size_t index,
+                                  struct stream2_metalog_block* block) {
+    const uint8_t* p = reader->ptr + reader->blocks[index];
+    const struct block_header* header = (const struct block_header*)p;
+    block->rows = header->rows;
+    block->columns = (const uint64_t*)(p + sizeof(struct block_header));
+    block->user_data = (const uint8_t*)(block->columns +
+                                        reader->header->columns * header->rows);
+    block->user_data_size = header->user_data_size;
+}
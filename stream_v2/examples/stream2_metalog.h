@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// A metadata log holds one row of fixed-width uint64_t columns per image of a
+// series: the metadata of the image message followed by the statistics of
+// every channel. The file is append-only and in host byte order. It consists
+// of a header, the channel names and blocks of rows stored column by column,
+// so that a query over millions of images scans contiguous arrays of the
+// mapped file instead of the image data.
+//
+// Rows are appended in the order the images are handled, which is not
+// necessarily the order of image_id.
+
+// Columns of the image message.
+enum stream2_metalog_column {
+    STREAM2_METALOG_IMAGE_ID,
+    STREAM2_METALOG_REAL_TIME_NUM,
+    STREAM2_METALOG_REAL_TIME_DEN,
+    STREAM2_METALOG_START_TIME_NUM,
+    STREAM2_METALOG_START_TIME_DEN,
+    STREAM2_METALOG_STOP_TIME_NUM,
+    STREAM2_METALOG_STOP_TIME_DEN,
+    // Offset of the user_data of the row within the user data of its block.
+    STREAM2_METALOG_USER_DATA_OFFSET,
+    STREAM2_METALOG_USER_DATA_LEN,
+};
+
+enum { STREAM2_METALOG_IMAGE_COLUMNS = STREAM2_METALOG_USER_DATA_LEN + 1 };
+
+// Columns of each channel, as in struct stream2_series_stats.
+enum stream2_metalog_channel_column {
+    STREAM2_METALOG_SUM,
+    STREAM2_METALOG_MAX,
+    STREAM2_METALOG_SATURATED,
+    STREAM2_METALOG_NODATA,
+};
+
+enum { STREAM2_METALOG_CHANNEL_COLUMNS = STREAM2_METALOG_NODATA + 1 };
+
+// Size of the channel names stored in the log, including the terminating
+// null character. Longer names are truncated.
+enum { STREAM2_METALOG_NAME_SIZE = 32 };
+
+// Gets the index of a column of a channel.
+size_t stream2_metalog_channel_column(size_t channel,
+                                      enum stream2_metalog_channel_column col);
+
+struct stream2_metalog_config {
+    // Number of rows per block.
+    size_t block_rows;
+    // Number of blocks being filled or queued for the writer thread. Appends
+    // wait if all blocks are queued.
+    size_t blocks;
+};
+
+void stream2_metalog_config_default(struct stream2_metalog_config* config);
+
+struct stream2_metalog_writer;
+struct stream2_metalog_reader;
+
+// Creates the log of a series, replacing any file of the same path, and
+// starts its writer thread. If config is NULL, the default configuration is
+// used.
+enum stream2_result stream2_metalog_writer_open(
+        const char* path,
+        const struct stream2_series* series,
+        const struct stream2_metalog_config* config,
+        struct stream2_metalog_writer** writer_out);
+
+// Writes the remaining rows, stops the writer thread and closes the file.
+//
+// Returns the first error of the writer thread.
+enum stream2_result stream2_metalog_writer_close(
+        struct stream2_metalog_writer* writer);
+
+// Appends the row of an image whose channels were decoded, taking the
+// statistics from the series. May be called from several threads, e.g. from
+// the image callback of the receiver.
+enum stream2_result stream2_metalog_writer_append(
+        struct stream2_metalog_writer* writer,
+        const struct stream2_series* series,
+        const struct stream2_image_msg* msg);
+
+struct stream2_metalog_info {
+    uint64_t series_id;
+    const char* series_unique_id;
+    uint64_t number_of_images;
+    size_t channels;
+    size_t columns;
+    size_t blocks;
+    uint64_t rows;
+};
+
+// Rows of one block.
+struct stream2_metalog_block {
+    size_t rows;
+    // Column c of the block is the array columns + c * rows.
+    const uint64_t* columns;
+    const uint8_t* user_data;
+    size_t user_data_size;
+};
+
+// Maps a log read-only. A block truncated at the end of the file, e.g. of a
+// log still being written, is ignored.
+enum stream2_result stream2_metalog_reader_open(
+        const char* path,
+        struct stream2_metalog_reader** reader_out);
+void stream2_metalog_reader_close(struct stream2_metalog_reader* reader);
+
+void stream2_metalog_reader_info(const struct stream2_metalog_reader* reader,
+                                 struct stream2_metalog_info* info);
+
+const char* stream2_metalog_reader_channel(
+        const struct stream2_metalog_reader* reader,
+        size_t channel);
+
+void stream2_metalog_reader_block(const struct stream2_metalog_reader* reader,
+                                  size_t index,
+                                  struct stream2_metalog_block* block);
+
+#if defined(__cplusplus)
+}
+#endif
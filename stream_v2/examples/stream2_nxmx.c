@@ -0,0 +1,1076 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_nxmx.h"
+
+#include <hdf5.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    DEFAULT_PREFETCH = 64,
+    // HDF5 filter IDs and the bitshuffle filter option for LZ4.
+    //
+    // https://github.com/HDFGroup/hdf5_plugins/blob/master/docs/RegisteredFilterPlugins.md
+    FILTER_LZ4 = 32004,
+    FILTER_BITSHUFFLE = 32008,
+    BITSHUFFLE_COMPRESS_LZ4 = 2,
+    MAX_FILTER_VALUES = 8,
+};
+
+static const char DATA_PATH[] = "/entry/data/data";
+static const char DETECTOR_PATH[] = "/entry/instrument/detector";
+static const char BEAM_PATH[] = "/entry/instrument/beam";
+static const char MASTER_SUFFIX[] = "_master.h5";
+
+// Images first to first + count - 1 of the series stored from image
+// source_first of a dataset.
+struct source {
+    // Path of the file relative to the working directory, or NULL for the
+    // master file.
+    char* file;
+    char* dataset;
+    uint64_t first;
+    uint64_t count;
+    uint64_t source_first;
+};
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_FILLED,
+    SLOT_TAKEN,
+};
+
+// Chunks of all channels of one image.
+struct slot {
+    enum slot_state state;
+    uint64_t image_id;
+    const char* algorithm;
+    uint8_t* buffer;
+    size_t capacity;
+    // Offset and size of the chunk of every channel in buffer, and whether
+    // it is compressed.
+    size_t* offsets;
+    size_t* sizes;
+    bool* compressed;
+};
+
+// Image message handed out for a slot.
+struct nxmx_image_msg {
+    struct stream2_image_msg msg;
+    size_t slot;
+};
+
+struct stream2_nxmx_reader {
+    struct stream2_nxmx_config config;
+    hid_t file;
+
+    // Start message and the flatfields and pixel masks it references, owned
+    // by the reader.
+    struct stream2_start_msg* start;
+    void** arrays;
+    size_t arrays_len;
+
+    uint64_t series_id;
+    char* series_unique_id;
+    char* series_date;
+    size_t channels;
+    uint64_t rows;
+    uint64_t cols;
+    // Typed array tag and element size of the image data.
+    uint64_t tag;
+    size_t elem_size;
+    // Relative start time of every image in seconds, or NULL.
+    double* start_times;
+    double count_time;
+
+    struct source* sources;
+    size_t sources_len;
+
+    pthread_t thread;
+    bool thread_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+    struct slot* slots;
+    // Number of slots filled by the prefetch thread and taken by consumers.
+    uint64_t fill_count;
+    uint64_t take_count;
+    // Set by the prefetch thread when it stops, with its result.
+    bool eof;
+    enum stream2_result result;
+    bool stop;
+    bool start_taken;
+    bool end_taken;
+};
+
+static char* dup_string(const char* s) {
+    const size_t len = strlen(s);
+    char* copy = malloc(len + 1);
+    if (copy)
+        memcpy(copy, s, len + 1);
+    return copy;
+}
+
+static char* join_path(const char* dir, size_t dir_len, const char* name) {
+    const size_t len = strlen(name);
+    char* path = malloc(dir_len + len + 1);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        memcpy(path + dir_len, name, len + 1);
+    }
+    return path;
+}
+
+static uint64_t seconds_to_ns(double seconds) {
+    return seconds > 0 ? (uint64_t)(seconds * 1e9 + 0.5) : 0;
+}
+
+// Opens a dataset relative to a file or group, or returns a negative id if it
+// does not exist.
+static hid_t open_dataset(hid_t loc, const char* path) {
+    if (loc < 0 || H5Lexists(loc, path, H5P_DEFAULT) <= 0)
+        return -1;
+    return H5Dopen2(loc, path, H5P_DEFAULT);
+}
+
+// Gets the number of elements of a dataset and its first two dimensions.
+static hssize_t dataset_shape(hid_t dset, int* rank, hsize_t dims[2]) {
+    const hid_t space = H5Dget_space(dset);
+    if (space < 0)
+        return -1;
+    hsize_t all[H5S_MAX_RANK];
+    *rank = H5Sget_simple_extent_dims(space, all, NULL);
+    const hssize_t n = H5Sget_simple_extent_npoints(space);
+    H5Sclose(space);
+    dims[0] = *rank > 0 ? all[0] : 1;
+    dims[1] = *rank > 1 ? all[1] : 1;
+    return *rank < 0 ? -1 : n;
+}
+
+// Reads the first element of a numeric dataset.
+static bool read_value(hid_t file,
+                       const char* path,
+                       hid_t mem_type,
+                       void* value,
+                       size_t size) {
+    const hid_t dset = open_dataset(file, path);
+    if (dset < 0)
+        return false;
+    int rank;
+    hsize_t dims[2];
+    const hssize_t n = dataset_shape(dset, &rank, dims);
+    bool ok = false;
+    if (n > 0) {
+        void* buf = malloc((size_t)n * size);
+        if (buf &&
+            H5Dread(dset, mem_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf) >= 0)
+        {
+            memcpy(value, buf, size);
+            ok = true;
+        }
+        free(buf);
+    }
+    H5Dclose(dset);
+    return ok;
+}
+
+static double read_double(hid_t file, const char* path) {
+    double value = 0;
+    read_value(file, path, H5T_NATIVE_DOUBLE, &value, sizeof(value));
+    return value;
+}
+
+static uint64_t read_u64(hid_t file, const char* path) {
+    uint64_t value = 0;
+    read_value(file, path, H5T_NATIVE_UINT64, &value, sizeof(value));
+    return value;
+}
+
+static bool read_bool(hid_t file, const char* path) {
+    int value = 0;
+    read_value(file, path, H5T_NATIVE_INT, &value, sizeof(value));
+    return value != 0;
+}
+
+static enum stream2_result copy_strings(char* const* strings,
+                                        size_t n,
+                                        size_t stride,
+                                        struct stream2_array_text_string* out) {
+    if ((out->ptr = calloc(n + 1, sizeof(char*))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (; out->len < n; out->len++) {
+        const char* s = stride ? (const char*)strings + out->len * stride
+                               : strings[out->len];
+        if ((out->ptr[out->len] = dup_string(s ? s : "")) == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    return STREAM2_OK;
+}
+
+// Reads the strings of a dataset of fixed or variable length strings.
+static enum stream2_result read_dataset_strings(
+        hid_t dset,
+        hid_t space,
+        hid_t type,
+        struct stream2_array_text_string* out) {
+    enum stream2_result r;
+
+    const hssize_t n = H5Sget_simple_extent_npoints(space);
+    const htri_t variable = H5Tis_variable_str(type);
+    if (n < 0 || variable < 0 || H5Tget_class(type) != H5T_STRING)
+        return STREAM2_ERROR_PARSE;
+
+    // Variable length strings are read as pointers, fixed length strings
+    // with one more byte for the terminator.
+    const size_t stride = variable ? 0 : H5Tget_size(type) + 1;
+    const hid_t mem_type = H5Tcopy(H5T_C_S1);
+    void* buf = calloc((size_t)n + 1, variable ? sizeof(char*) : stride);
+    if (mem_type < 0 || buf == NULL) {
+        r = STREAM2_ERROR_OUT_OF_MEMORY;
+    } else if (H5Tset_size(mem_type, variable ? H5T_VARIABLE : stride) < 0 ||
+               H5Tset_strpad(mem_type, H5T_STR_NULLTERM) < 0 ||
+               H5Dread(dset, mem_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf) <
+                       0)
+    {
+        r = STREAM2_ERROR_PARSE;
+    } else {
+        r = copy_strings(buf, (size_t)n, stride, out);
+        if (variable)
+            H5Dvlen_reclaim(mem_type, space, H5P_DEFAULT, buf);
+    }
+    free(buf);
+    if (mem_type >= 0)
+        H5Tclose(mem_type);
+    return r;
+}
+
+// Reads a string or an array of strings, or none if the dataset does not
+// exist.
+static enum stream2_result read_strings(hid_t file,
+                                        const char* path,
+                                        struct stream2_array_text_string* out) {
+    enum stream2_result r = STREAM2_ERROR_PARSE;
+
+    out->ptr = NULL;
+    out->len = 0;
+    const hid_t dset = open_dataset(file, path);
+    if (dset < 0)
+        return STREAM2_OK;
+
+    const hid_t space = H5Dget_space(dset);
+    const hid_t type = H5Dget_type(dset);
+    if (space >= 0 && type >= 0)
+        r = read_dataset_strings(dset, space, type, out);
+    if (type >= 0)
+        H5Tclose(type);
+    if (space >= 0)
+        H5Sclose(space);
+    H5Dclose(dset);
+    return r;
+}
+
+// Reads a string dataset, or returns NULL if it does not exist.
+static char* read_string(hid_t file, const char* path) {
+    struct stream2_array_text_string strings;
+    char* s = NULL;
+    if (read_strings(file, path, &strings) == STREAM2_OK && strings.len > 0) {
+        s = strings.ptr[0];
+        strings.ptr[0] = NULL;
+    }
+    for (size_t i = 0; i < strings.len; i++)
+        free(strings.ptr[i]);
+    free(strings.ptr);
+    return s;
+}
+
+// Reads an image-sized array of a channel as a typed array owned by the
+// reader.
+static enum stream2_result read_channel_array(
+        struct stream2_nxmx_reader* reader,
+        const char* path,
+        hid_t mem_type,
+        uint64_t tag,
+        size_t elem_size,
+        struct stream2_multidim_array* array,
+        bool* found) {
+    *found = false;
+    const hid_t dset = open_dataset(reader->file, path);
+    if (dset < 0)
+        return STREAM2_OK;
+
+    enum stream2_result r = STREAM2_OK;
+    int rank;
+    hsize_t dims[2];
+    if (dataset_shape(dset, &rank, dims) < 0 || rank != 2 ||
+        dims[0] != reader->rows || dims[1] != reader->cols)
+    {
+        H5Dclose(dset);
+        return STREAM2_ERROR_PARSE;
+    }
+
+    const size_t size = reader->rows * reader->cols * elem_size;
+    void* data = malloc(size);
+    void** arrays = realloc(reader->arrays,
+                            (reader->arrays_len + 1) * sizeof(void*));
+    if (arrays)
+        reader->arrays = arrays;
+    if (data == NULL || arrays == NULL) {
+        free(data);
+        r = STREAM2_ERROR_OUT_OF_MEMORY;
+    } else if (H5Dread(dset, mem_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data) <
+               0)
+    {
+        free(data);
+        r = STREAM2_ERROR_PARSE;
+    } else {
+        reader->arrays[reader->arrays_len++] = data;
+        array->dim[0] = reader->rows;
+        array->dim[1] = reader->cols;
+        array->array.tag = tag;
+        array->array.data.ptr = data;
+        array->array.data.len = size;
+        *found = true;
+    }
+    H5Dclose(dset);
+    return r;
+}
+
+static enum stream2_result read_channels(struct stream2_nxmx_reader* reader) {
+    enum stream2_result r;
+    struct stream2_start_msg* msg = reader->start;
+    const size_t n = msg->channels.len;
+
+    msg->flatfield.ptr = calloc(n, sizeof(struct stream2_flatfield));
+    msg->pixel_mask.ptr = calloc(n, sizeof(struct stream2_pixel_mask));
+    msg->threshold_energy.ptr =
+            calloc(n, sizeof(struct stream2_threshold_energy));
+    if (n > 0 && (msg->flatfield.ptr == NULL || msg->pixel_mask.ptr == NULL ||
+                  msg->threshold_energy.ptr == NULL))
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < n; i++) {
+        const char* channel = msg->channels.ptr[i];
+        char path[256];
+        bool found;
+
+        // Difference channels have two threshold energies; the first one
+        // is used.
+        snprintf(path, sizeof(path), "%s/%s_channel/threshold_energy",
+                 DETECTOR_PATH, channel);
+        double energy;
+        if (read_value(reader->file, path, H5T_NATIVE_DOUBLE, &energy,
+                       sizeof(energy)))
+        {
+            struct stream2_threshold_energy* e =
+                    &msg->threshold_energy.ptr[msg->threshold_energy.len];
+            if ((e->channel = dup_string(channel)) == NULL)
+                return STREAM2_ERROR_OUT_OF_MEMORY;
+            e->energy = energy;
+            msg->threshold_energy.len++;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s_channel/flatfield",
+                 DETECTOR_PATH, channel);
+        struct stream2_flatfield* f = &msg->flatfield.ptr[msg->flatfield.len];
+        if ((r = read_channel_array(reader, path, H5T_NATIVE_FLOAT,
+                                    STREAM2_TYPED_ARRAY_FLOAT32_LITTLE_ENDIAN,
+                                    sizeof(float), &f->flatfield, &found)))
+            return r;
+        if (found) {
+            if ((f->channel = dup_string(channel)) == NULL)
+                return STREAM2_ERROR_OUT_OF_MEMORY;
+            msg->flatfield.len++;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s_channel/pixel_mask",
+                 DETECTOR_PATH, channel);
+        struct stream2_pixel_mask* m =
+                &msg->pixel_mask.ptr[msg->pixel_mask.len];
+        if ((r = read_channel_array(reader, path, H5T_NATIVE_UINT32,
+                                    STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN,
+                                    sizeof(uint32_t), &m->pixel_mask, &found)))
+            return r;
+        if (found) {
+            if ((m->channel = dup_string(channel)) == NULL)
+                return STREAM2_ERROR_OUT_OF_MEMORY;
+            msg->pixel_mask.len++;
+        }
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result read_image_dtype(struct stream2_nxmx_reader* reader,
+                                            hid_t dset,
+                                            char** dtype) {
+    const hid_t type = H5Dget_type(dset);
+    if (type < 0)
+        return STREAM2_ERROR_PARSE;
+    const H5T_class_t cls = H5Tget_class(type);
+    const H5T_sign_t sign = H5Tget_sign(type);
+    const size_t size = H5Tget_size(type);
+    H5Tclose(type);
+
+    if (cls != H5T_INTEGER || sign != H5T_SGN_NONE)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    char name[16];
+    if (size == 1)
+        reader->tag = STREAM2_TYPED_ARRAY_UINT8;
+    else if (size == 2)
+        reader->tag = STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN;
+    else if (size == 4)
+        reader->tag = STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN;
+    else
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    reader->elem_size = size;
+    snprintf(name, sizeof(name), "uint%zu", 8 * size);
+    if ((*dtype = dup_string(name)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    return STREAM2_OK;
+}
+
+static enum stream2_result read_start_msg(struct stream2_nxmx_reader* reader,
+                                          hid_t data) {
+    enum stream2_result r;
+    const hid_t file = reader->file;
+
+    struct stream2_start_msg* msg =
+            calloc(1, sizeof(struct stream2_start_msg));
+    if ((reader->start = msg) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    msg->type = STREAM2_MSG_START;
+    msg->series_id = reader->series_id;
+    if ((msg->series_unique_id = dup_string(reader->series_unique_id)) ==
+        NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if ((r = read_image_dtype(reader, data, &msg->image_dtype)) ||
+        (r = read_strings(file, "/entry/data/channel", &msg->channels)))
+        return r;
+    if (msg->channels.len != reader->channels)
+        return STREAM2_ERROR_PARSE;
+    msg->image_size_x = reader->cols;
+    msg->image_size_y = reader->rows;
+    msg->arm_date = read_string(file, "/entry/start_time");
+
+    // Fields are looked up relative to their group; if a group is missing,
+    // its fields are left unset.
+    const hid_t detector = H5Gopen2(file, DETECTOR_PATH, H5P_DEFAULT);
+    const hid_t beam = H5Gopen2(file, BEAM_PATH, H5P_DEFAULT);
+    msg->beam_center_x = read_double(detector, "beam_center_x");
+    msg->beam_center_y = read_double(detector, "beam_center_y");
+    msg->count_time = read_double(detector, "count_time");
+    msg->countrate_correction_enabled =
+            read_bool(detector, "countrate_correction_applied");
+    msg->detector_description = read_string(detector, "description");
+    msg->detector_serial_number = read_string(detector, "serial_number");
+    msg->flatfield_enabled = read_bool(detector, "flatfield_applied");
+    msg->frame_time = read_double(detector, "frame_time");
+    msg->pixel_mask_enabled = read_bool(detector, "pixel_mask_applied");
+    msg->pixel_size_x = read_double(detector, "x_pixel_size");
+    msg->pixel_size_y = read_double(detector, "y_pixel_size");
+    msg->saturation_value = read_u64(detector, "saturation_value");
+    msg->sensor_material = read_string(detector, "sensor_material");
+    msg->sensor_thickness = read_double(detector, "sensor_thickness");
+    msg->virtual_pixel_interpolation_enabled =
+            read_bool(detector, "virtual_pixel_interpolation_applied");
+    msg->incident_energy = read_double(beam, "incident_energy");
+    msg->incident_wavelength = read_double(beam, "incident_wavelength");
+    if (beam >= 0)
+        H5Gclose(beam);
+    if (detector >= 0)
+        H5Gclose(detector);
+
+    reader->count_time = msg->count_time;
+    if (msg->arm_date &&
+        (reader->series_date = dup_string(msg->arm_date)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    return read_channels(reader);
+}
+
+static enum stream2_result read_start_times(
+        struct stream2_nxmx_reader* reader,
+        uint64_t images) {
+    const hid_t dset = open_dataset(reader->file, "/entry/data/start_time");
+    if (dset < 0)
+        return STREAM2_OK;
+    int rank;
+    hsize_t dims[2];
+    const hssize_t n = dataset_shape(dset, &rank, dims);
+    if (n == (hssize_t)images && images > 0) {
+        if ((reader->start_times = malloc(images * sizeof(double))) == NULL) {
+            H5Dclose(dset);
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        }
+        if (H5Dread(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                    reader->start_times) < 0)
+        {
+            free(reader->start_times);
+            reader->start_times = NULL;
+        }
+    }
+    H5Dclose(dset);
+    return STREAM2_OK;
+}
+
+static enum stream2_result add_source(struct stream2_nxmx_reader* reader,
+                                      char* file,
+                                      char* dataset,
+                                      uint64_t first,
+                                      uint64_t count,
+                                      uint64_t source_first) {
+    struct source* sources =
+            realloc(reader->sources,
+                    (reader->sources_len + 1) * sizeof(struct source));
+    if (sources == NULL || dataset == NULL) {
+        free(file);
+        free(dataset);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    reader->sources = sources;
+    struct source* s = &reader->sources[reader->sources_len++];
+    s->file = file;
+    s->dataset = dataset;
+    s->first = first;
+    s->count = count;
+    s->source_first = source_first;
+    return STREAM2_OK;
+}
+
+static int compare_sources(const void* a, const void* b) {
+    const struct source* x = a;
+    const struct source* y = b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+// Resolves the mappings of the virtual dataset /entry/data/data to the
+// datasets of the data files. Without data files, the images are stored in
+// the master file.
+static enum stream2_result read_sources(struct stream2_nxmx_reader* reader,
+                                        hid_t data,
+                                        const char* master,
+                                        uint64_t images) {
+    enum stream2_result r = STREAM2_OK;
+
+    const hid_t dcpl = H5Dget_create_plist(data);
+    if (dcpl < 0)
+        return STREAM2_ERROR_PARSE;
+    if (H5Pget_layout(dcpl) != H5D_VIRTUAL) {
+        H5Pclose(dcpl);
+        return add_source(reader, NULL, dup_string(DATA_PATH), 0, images, 0);
+    }
+
+    const char* slash = strrchr(master, '/');
+    const size_t dir_len = slash ? (size_t)(slash - master) + 1 : 0;
+
+    size_t count;
+    if (H5Pget_virtual_count(dcpl, &count) < 0)
+        r = STREAM2_ERROR_PARSE;
+    for (size_t i = 0; r == STREAM2_OK && i < count; i++) {
+        char name[4096];
+        char dataset[4096];
+        hsize_t vstart[H5S_MAX_RANK], vend[H5S_MAX_RANK];
+        hsize_t sstart[H5S_MAX_RANK], send[H5S_MAX_RANK];
+
+        const hid_t vspace = H5Pget_virtual_vspace(dcpl, i);
+        const hid_t sspace = H5Pget_virtual_srcspace(dcpl, i);
+        const ssize_t name_len =
+                H5Pget_virtual_filename(dcpl, i, name, sizeof(name));
+        const ssize_t dataset_len =
+                H5Pget_virtual_dsetname(dcpl, i, dataset, sizeof(dataset));
+        if (vspace < 0 || sspace < 0 || name_len < 0 || dataset_len < 0 ||
+            (size_t)name_len >= sizeof(name) ||
+            (size_t)dataset_len >= sizeof(dataset) ||
+            H5Sget_select_bounds(vspace, vstart, vend) < 0 ||
+            H5Sget_select_bounds(sspace, sstart, send) < 0)
+        {
+            r = STREAM2_ERROR_PARSE;
+        } else {
+            char* file = NULL;
+            if (strcmp(name, ".") != 0) {
+                file = name[0] == '/' ? dup_string(name)
+                                      : join_path(master, dir_len, name);
+                if (file == NULL)
+                    r = STREAM2_ERROR_OUT_OF_MEMORY;
+            }
+            if (r == STREAM2_OK) {
+                r = add_source(reader, file, dup_string(dataset), vstart[0],
+                               vend[0] - vstart[0] + 1, sstart[0]);
+            }
+        }
+        if (vspace >= 0)
+            H5Sclose(vspace);
+        if (sspace >= 0)
+            H5Sclose(sspace);
+    }
+    H5Pclose(dcpl);
+
+    qsort(reader->sources, reader->sources_len, sizeof(struct source),
+          compare_sources);
+    return r;
+}
+
+// Derives series_id and series_unique_id from the file name
+// <name_pattern>_master.h5, e.g. series_<series_id>_master.h5.
+static enum stream2_result parse_series_name(
+        struct stream2_nxmx_reader* reader,
+        const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    size_t len = strlen(name);
+    const size_t suffix_len = sizeof(MASTER_SUFFIX) - 1;
+    if (len > suffix_len &&
+        strcmp(name + len - suffix_len, MASTER_SUFFIX) == 0)
+        len -= suffix_len;
+
+    if ((reader->series_unique_id = malloc(len + 1)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    memcpy(reader->series_unique_id, name, len);
+    reader->series_unique_id[len] = '\0';
+
+    if (sscanf(reader->series_unique_id, "series_%" SCNu64,
+               &reader->series_id) != 1)
+        reader->series_id = 0;
+    return STREAM2_OK;
+}
+
+static enum stream2_result check_layout(
+        const struct stream2_nxmx_reader* reader,
+        hid_t dset,
+        const char** algorithm) {
+    enum stream2_result r = STREAM2_OK;
+    const hid_t dcpl = H5Dget_create_plist(dset);
+    if (dcpl < 0)
+        return STREAM2_ERROR_PARSE;
+
+    hsize_t chunk[4];
+    if (H5Pget_layout(dcpl) != H5D_CHUNKED ||
+        H5Pget_chunk(dcpl, 4, chunk) != 4 || chunk[0] != 1 || chunk[1] != 1 ||
+        chunk[2] != reader->rows || chunk[3] != reader->cols)
+        r = STREAM2_ERROR_NOT_IMPLEMENTED;
+
+    const int filters = H5Pget_nfilters(dcpl);
+    *algorithm = NULL;
+    if (r == STREAM2_OK && filters == 1) {
+        unsigned flags;
+        size_t values_len = MAX_FILTER_VALUES;
+        unsigned values[MAX_FILTER_VALUES];
+        const H5Z_filter_t filter = H5Pget_filter2(
+                dcpl, 0, &flags, &values_len, values, 0, NULL, NULL);
+        if (filter == FILTER_BITSHUFFLE && values_len > 4 &&
+            values[4] == BITSHUFFLE_COMPRESS_LZ4)
+            *algorithm = "bslz4";
+        else if (filter == FILTER_LZ4)
+            *algorithm = "lz4";
+        else
+            r = STREAM2_ERROR_NOT_IMPLEMENTED;
+    } else if (filters != 0) {
+        r = STREAM2_ERROR_NOT_IMPLEMENTED;
+    }
+    H5Pclose(dcpl);
+    return r;
+}
+
+// Reads the chunks of all channels of an image into a slot. Sets stored to
+// false if a chunk was not written, i.e. the image was lost.
+static enum stream2_result read_image(struct stream2_nxmx_reader* reader,
+                                      hid_t dset,
+                                      uint64_t index,
+                                      struct slot* slot,
+                                      bool* stored) {
+    size_t total = 0;
+    *stored = false;
+    for (size_t c = 0; c < reader->channels; c++) {
+        const hsize_t offset[4] = {index, c, 0, 0};
+        hsize_t size;
+        if (H5Dget_chunk_storage_size(dset, offset, &size) < 0 || size == 0)
+            return STREAM2_OK;
+        slot->offsets[c] = total;
+        slot->sizes[c] = size;
+        total += size;
+    }
+
+    if (total > slot->capacity) {
+        uint8_t* buffer = realloc(slot->buffer, total);
+        if (buffer == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        slot->buffer = buffer;
+        slot->capacity = total;
+    }
+
+    for (size_t c = 0; c < reader->channels; c++) {
+        const hsize_t offset[4] = {index, c, 0, 0};
+        uint32_t filter_mask = 0;
+        if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &filter_mask,
+                          slot->buffer + slot->offsets[c]) < 0)
+            return STREAM2_ERROR_SYSTEM;
+        // A set bit means the filter was skipped for this chunk.
+        slot->compressed[c] = (filter_mask & 1) == 0;
+    }
+    *stored = true;
+    return STREAM2_OK;
+}
+
+// Waits until the next slot is free, or returns NULL if the reader stops.
+static struct slot* wait_free_slot(struct stream2_nxmx_reader* reader) {
+    struct slot* slot =
+            &reader->slots[reader->fill_count % reader->config.prefetch];
+    pthread_mutex_lock(&reader->mutex);
+    while (!reader->stop && slot->state != SLOT_FREE)
+        pthread_cond_wait(&reader->freed, &reader->mutex);
+    const bool stop = reader->stop;
+    pthread_mutex_unlock(&reader->mutex);
+    return stop ? NULL : slot;
+}
+
+static enum stream2_result prefetch_source(struct stream2_nxmx_reader* reader,
+                                           const struct source* source) {
+    enum stream2_result r = STREAM2_OK;
+
+    hid_t file = reader->file;
+    if (source->file &&
+        (file = H5Fopen(source->file, H5F_ACC_RDONLY, H5P_DEFAULT)) < 0)
+        return STREAM2_ERROR_SYSTEM;
+    const hid_t dset = H5Dopen2(file, source->dataset, H5P_DEFAULT);
+    const char* algorithm = NULL;
+    if (dset < 0)
+        r = STREAM2_ERROR_PARSE;
+    else
+        r = check_layout(reader, dset, &algorithm);
+
+    for (uint64_t i = 0; r == STREAM2_OK && i < source->count; i++) {
+        struct slot* slot = wait_free_slot(reader);
+        if (slot == NULL)
+            break;
+
+        bool stored;
+        if ((r = read_image(reader, dset, source->source_first + i, slot,
+                            &stored)) ||
+            !stored)
+            continue;
+        slot->image_id = source->first + i;
+        slot->algorithm = algorithm;
+
+        pthread_mutex_lock(&reader->mutex);
+        slot->state = SLOT_FILLED;
+        reader->fill_count++;
+        pthread_cond_broadcast(&reader->filled);
+        pthread_mutex_unlock(&reader->mutex);
+    }
+
+    if (dset >= 0)
+        H5Dclose(dset);
+    if (file != reader->file)
+        H5Fclose(file);
+    return r;
+}
+
+// Reads the images of all data files in order into the free slots, ahead of
+// the consumers. It is the only thread calling HDF5 while the reader is open
+// as HDF5 is usually not built thread-safe.
+static void* prefetch_thread(void* arg) {
+    struct stream2_nxmx_reader* reader = arg;
+    enum stream2_result r = STREAM2_OK;
+
+    // Missing chunks are expected for lost images.
+    H5E_auto2_t func;
+    void* data;
+    H5Eget_auto2(H5E_DEFAULT, &func, &data);
+    H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+
+    for (size_t i = 0; r == STREAM2_OK && i < reader->sources_len; i++)
+        r = prefetch_source(reader, &reader->sources[i]);
+
+    H5Eset_auto2(H5E_DEFAULT, func, data);
+
+    pthread_mutex_lock(&reader->mutex);
+    reader->eof = true;
+    reader->result = r;
+    pthread_cond_broadcast(&reader->filled);
+    pthread_mutex_unlock(&reader->mutex);
+    return NULL;
+}
+
+static enum stream2_result reader_init(struct stream2_nxmx_reader* reader,
+                                       const char* path) {
+    enum stream2_result r;
+
+    if ((r = parse_series_name(reader, path)))
+        return r;
+    if ((reader->file = H5Fopen(path, H5F_ACC_RDONLY, H5P_DEFAULT)) < 0)
+        return STREAM2_ERROR_SYSTEM;
+
+    const hid_t data = open_dataset(reader->file, DATA_PATH);
+    if (data < 0)
+        return STREAM2_ERROR_PARSE;
+
+    // /entry/data/data has shape [images, channels, rows, cols].
+    const hid_t space = H5Dget_space(data);
+    hsize_t dims[4];
+    if (space < 0 || H5Sget_simple_extent_ndims(space) != 4 ||
+        H5Sget_simple_extent_dims(space, dims, NULL) != 4)
+        r = STREAM2_ERROR_PARSE;
+    if (space >= 0)
+        H5Sclose(space);
+    if (r == STREAM2_OK) {
+        reader->channels = dims[1];
+        reader->rows = dims[2];
+        reader->cols = dims[3];
+        r = read_start_msg(reader, data);
+    }
+    if (r == STREAM2_OK) {
+        reader->start->number_of_images = dims[0];
+        r = read_sources(reader, data, path, dims[0]);
+    }
+    if (r == STREAM2_OK)
+        r = read_start_times(reader, dims[0]);
+    H5Dclose(data);
+    if (r)
+        return r;
+
+    const size_t n = reader->config.prefetch;
+    if ((reader->slots = calloc(n, sizeof(struct slot))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < n; i++) {
+        struct slot* slot = &reader->slots[i];
+        slot->offsets = calloc(reader->channels, sizeof(size_t));
+        slot->sizes = calloc(reader->channels, sizeof(size_t));
+        slot->compressed = calloc(reader->channels, sizeof(bool));
+        if (slot->offsets == NULL || slot->sizes == NULL ||
+            slot->compressed == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    return STREAM2_OK;
+}
+
+// Starts prefetching once the reader is initialized and the HDF5 error
+// handler of the caller is restored, as the prefetch thread calls HDF5 from
+// then on.
+static enum stream2_result reader_start(struct stream2_nxmx_reader* reader) {
+    if (pthread_create(&reader->thread, NULL, prefetch_thread, reader))
+        return STREAM2_ERROR_SYSTEM;
+    reader->thread_started = true;
+    return STREAM2_OK;
+}
+
+void stream2_nxmx_config_default(struct stream2_nxmx_config* config) {
+    config->prefetch = DEFAULT_PREFETCH;
+}
+
+enum stream2_result stream2_nxmx_open(const char* path,
+                                      const struct stream2_nxmx_config* config,
+                                      struct stream2_nxmx_reader** reader_out) {
+    enum stream2_result r;
+
+    *reader_out = NULL;
+    if (config->prefetch == 0)
+        return STREAM2_ERROR_PARSE;
+
+    struct stream2_nxmx_reader* reader =
+            calloc(1, sizeof(struct stream2_nxmx_reader));
+    if (reader == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    reader->config = *config;
+    reader->file = -1;
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->filled, NULL);
+    pthread_cond_init(&reader->freed, NULL);
+
+    // Optional fields are looked up without printing HDF5 errors.
+    H5E_auto2_t func;
+    void* data;
+    H5Eget_auto2(H5E_DEFAULT, &func, &data);
+    H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+    r = reader_init(reader, path);
+    H5Eset_auto2(H5E_DEFAULT, func, data);
+
+    if (r == STREAM2_OK)
+        r = reader_start(reader);
+    if (r) {
+        stream2_nxmx_close(reader);
+        return r;
+    }
+    *reader_out = reader;
+    return STREAM2_OK;
+}
+
+void stream2_nxmx_close(struct stream2_nxmx_reader* reader) {
+    if (reader == NULL)
+        return;
+
+    if (reader->thread_started) {
+        pthread_mutex_lock(&reader->mutex);
+        reader->stop = true;
+        pthread_cond_broadcast(&reader->freed);
+        pthread_mutex_unlock(&reader->mutex);
+        pthread_join(reader->thread, NULL);
+    }
+
+    if (reader->file >= 0)
+        H5Fclose(reader->file);
+    if (reader->start)
+        stream2_free_msg((struct stream2_msg*)reader->start);
+    for (size_t i = 0; i < reader->arrays_len; i++)
+        free(reader->arrays[i]);
+    free(reader->arrays);
+    for (size_t i = 0; i < reader->sources_len; i++) {
+        free(reader->sources[i].file);
+        free(reader->sources[i].dataset);
+    }
+    free(reader->sources);
+    for (size_t i = 0; reader->slots && i < reader->config.prefetch; i++) {
+        free(reader->slots[i].buffer);
+        free(reader->slots[i].offsets);
+        free(reader->slots[i].sizes);
+        free(reader->slots[i].compressed);
+    }
+    free(reader->slots);
+    free(reader->start_times);
+    free(reader->series_unique_id);
+    free(reader->series_date);
+    pthread_cond_destroy(&reader->freed);
+    pthread_cond_destroy(&reader->filled);
+    pthread_mutex_destroy(&reader->mutex);
+    free(reader);
+}
+
+static enum stream2_result make_image_msg(struct stream2_nxmx_reader* reader,
+                                          size_t index,
+                                          struct stream2_msg** msg_out) {
+    const struct slot* slot = &reader->slots[index];
+    const struct stream2_array_text_string* channels =
+            &reader->start->channels;
+
+    struct nxmx_image_msg* image = calloc(1, sizeof(struct nxmx_image_msg));
+    if (image == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    image->slot = index;
+    struct stream2_image_msg* msg = &image->msg;
+    msg->type = STREAM2_MSG_IMAGE;
+    msg->series_id = reader->series_id;
+    msg->image_id = slot->image_id;
+
+    // Times are rationals in nanoseconds.
+    const double t = reader->start_times ? reader->start_times[slot->image_id]
+                                         : 0;
+    msg->start_time[0] = seconds_to_ns(t);
+    msg->stop_time[0] = seconds_to_ns(t + reader->count_time);
+    msg->real_time[0] = seconds_to_ns(reader->count_time);
+    msg->start_time[1] = msg->stop_time[1] = msg->real_time[1] = 1000000000;
+
+    enum stream2_result r = STREAM2_OK;
+    if ((msg->series_unique_id = dup_string(reader->series_unique_id)) ==
+                NULL ||
+        (reader->series_date &&
+         (msg->series_date = dup_string(reader->series_date)) == NULL) ||
+        (msg->data.ptr = calloc(reader->channels,
+                                sizeof(struct stream2_image_data))) == NULL)
+        r = STREAM2_ERROR_OUT_OF_MEMORY;
+
+    for (size_t c = 0; r == STREAM2_OK && c < reader->channels; c++) {
+        struct stream2_image_data* data = &msg->data.ptr[c];
+        struct stream2_bytes* bytes = &data->data.array.data;
+        msg->data.len++;
+        data->data.dim[0] = reader->rows;
+        data->data.dim[1] = reader->cols;
+        data->data.array.tag = reader->tag;
+        bytes->ptr = slot->buffer + slot->offsets[c];
+        bytes->len = slot->sizes[c];
+        if ((data->channel = dup_string(channels->ptr[c])) == NULL) {
+            r = STREAM2_ERROR_OUT_OF_MEMORY;
+        } else if (slot->algorithm && slot->compressed[c]) {
+            bytes->compression.elem_size = reader->elem_size;
+            bytes->compression.orig_size =
+                    reader->rows * reader->cols * reader->elem_size;
+            if ((bytes->compression.algorithm =
+                         dup_string(slot->algorithm)) == NULL)
+                r = STREAM2_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    if (r) {
+        stream2_free_msg((struct stream2_msg*)msg);
+        return r;
+    }
+    *msg_out = (struct stream2_msg*)msg;
+    return STREAM2_OK;
+}
+
+static enum stream2_result make_end_msg(struct stream2_nxmx_reader* reader,
+                                        struct stream2_msg** msg_out) {
+    struct stream2_end_msg* msg = calloc(1, sizeof(struct stream2_end_msg));
+    if (msg == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    msg->type = STREAM2_MSG_END;
+    msg->series_id = reader->series_id;
+    if ((msg->series_unique_id = dup_string(reader->series_unique_id)) ==
+        NULL)
+    {
+        free(msg);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    *msg_out = (struct stream2_msg*)msg;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_nxmx_next(struct stream2_nxmx_reader* reader,
+                                      struct stream2_msg** msg_out) {
+    enum stream2_result r = STREAM2_OK;
+
+    *msg_out = NULL;
+    pthread_mutex_lock(&reader->mutex);
+
+    if (!reader->start_taken) {
+        *msg_out = (struct stream2_msg*)reader->start;
+        reader->start_taken = true;
+        pthread_mutex_unlock(&reader->mutex);
+        return STREAM2_OK;
+    }
+
+    for (;;) {
+        const size_t index = reader->take_count % reader->config.prefetch;
+        if (reader->take_count < reader->fill_count &&
+            reader->slots[index].state == SLOT_FILLED)
+        {
+            reader->slots[index].state = SLOT_TAKEN;
+            reader->take_count++;
+            pthread_mutex_unlock(&reader->mutex);
+
+            if ((r = make_image_msg(reader, index, msg_out))) {
+                pthread_mutex_lock(&reader->mutex);
+                reader->slots[index].state = SLOT_FREE;
+                pthread_cond_signal(&reader->freed);
+                pthread_mutex_unlock(&reader->mutex);
+            }
+            return r;
+        }
+        if (reader->eof)
+            break;
+        pthread_cond_wait(&reader->filled, &reader->mutex);
+    }
+
+    if ((r = reader->result) == STREAM2_OK && !reader->end_taken) {
+        reader->end_taken = true;
+        r = make_end_msg(reader, msg_out);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    return r;
+}
+
+void stream2_nxmx_free_msg(struct stream2_nxmx_reader* reader,
+                           struct stream2_msg* msg) {
+    // The start message is freed with the reader.
+    if (msg == NULL || msg == (struct stream2_msg*)reader->start)
+        return;
+    if (msg->type == STREAM2_MSG_IMAGE) {
+        const size_t index = ((struct nxmx_image_msg*)msg)->slot;
+        pthread_mutex_lock(&reader->mutex);
+        reader->slots[index].state = SLOT_FREE;
+        pthread_cond_signal(&reader->freed);
+        pthread_mutex_unlock(&reader->mutex);
+    }
+    stream2_free_msg(msg);
+}
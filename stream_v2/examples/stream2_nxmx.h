@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Reads a series written by the FileWriter in format
+// "hdf5 nexus v2024.2 nxmx" as the messages of the stream, so that archived
+// series are processed by the same code as live series.
+//
+// https://github.com/dectris/documentation/blob/main/filewriter/README.md
+struct stream2_nxmx_reader;
+
+struct stream2_nxmx_config {
+    // Number of images read ahead of the consumer by the prefetch thread.
+    size_t prefetch;
+};
+
+void stream2_nxmx_config_default(struct stream2_nxmx_config* config);
+
+// Opens the master file of a series and starts the prefetch thread. The
+// data files referenced by the virtual dataset /entry/data/data are found
+// relative to the master file.
+//
+// Returns STREAM2_ERROR_NOT_IMPLEMENTED if the image data is not stored in
+// chunks of one image of one channel or with other filters than bitshuffle
+// with LZ4 or LZ4.
+enum stream2_result stream2_nxmx_open(const char* path,
+                                      const struct stream2_nxmx_config* config,
+                                      struct stream2_nxmx_reader** reader_out);
+
+// Stops the prefetch thread and closes the files. Messages returned by
+// stream2_nxmx_next() must be freed before.
+void stream2_nxmx_close(struct stream2_nxmx_reader* reader);
+
+// Gets the next message of the series: the start message, an image message
+// for every stored image in order of image_id and the end message. After the
+// end message, *msg_out is set to NULL.
+//
+// The image data of image messages is the stored chunks, still compressed.
+// The messages reference memory of the reader and must be freed with
+// stream2_nxmx_free_msg(). Both functions may be called from several
+// threads, e.g. from every decoder thread.
+enum stream2_result stream2_nxmx_next(struct stream2_nxmx_reader* reader,
+                                      struct stream2_msg** msg_out);
+
+// Frees a message returned by stream2_nxmx_next() and hands its buffer back
+// to the prefetch thread.
+void stream2_nxmx_free_msg(struct stream2_nxmx_reader* reader,
+                           struct stream2_msg* msg);
+
+#if defined(__cplusplus)
+}
+#endif
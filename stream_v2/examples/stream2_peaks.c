@@ -0,0 +1,553 @@
+#include "stream2_peaks.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Workspace of one slot.
+struct slot {
+    // Bitmap of candidate pixels, cleared while peaks are filled.
+    uint8_t* candidates;
+    // Background and integer threshold of every tile.
+    float* background;
+    uint32_t* thresholds;
+    // Pixel indices of the peak being filled.
+    size_t* stack;
+    size_t stack_capacity;
+    struct stream2_peak* peaks;
+};
+
+struct stream2_peak_finder {
+    struct stream2_peak_config config;
+    size_t width;
+    size_t height;
+    size_t elem_size;
+    uint32_t saturation;
+    // Bytes per row of the pixel bitmaps, a multiple of 8.
+    size_t stride;
+    size_t tiles_x;
+    size_t tiles_y;
+    // Bitmap of the valid pixels of every channel.
+    uint8_t** valid;
+    size_t channels;
+    struct slot* slots;
+};
+
+void stream2_peak_config_default(struct stream2_peak_config* config) {
+    config->tile_size = 64;
+    config->sigma = 5.0;
+    config->min_signal = 3.0;
+    config->min_pixels = 2;
+    config->max_pixels = 1000;
+    config->max_peaks = 4096;
+    config->slots = 1;
+}
+
+// Sets the bits of the pixels whose pixel mask value is 0.
+static enum stream2_result build_valid(struct stream2_peak_finder* finder,
+                                       const struct stream2_series* series,
+                                       const struct stream2_start_msg* msg,
+                                       size_t channel,
+                                       uint8_t* valid) {
+    enum stream2_result r;
+
+    uint32_t* mask = malloc(finder->width * finder->height * sizeof(uint32_t));
+    if (mask == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((r = stream2_series_pixel_mask(series, msg, channel, mask))) {
+        free(mask);
+        return r;
+    }
+    for (size_t y = 0; y < finder->height; y++) {
+        uint8_t* row = valid + y * finder->stride;
+        for (size_t x = 0; x < finder->width; x++) {
+            if (mask[y * finder->width + x] == 0)
+                row[x / 8] |= 1u << (x % 8);
+        }
+    }
+    free(mask);
+    return STREAM2_OK;
+}
+
+static enum stream2_result create_slot(struct stream2_peak_finder* finder,
+                                       struct slot* slot) {
+    const size_t tiles = finder->tiles_x * finder->tiles_y;
+    slot->stack_capacity = 1024;
+    if ((slot->candidates = calloc(finder->stride * finder->height, 1)) ==
+                NULL ||
+        (slot->background = malloc(tiles * sizeof(float))) == NULL ||
+        (slot->thresholds = malloc(tiles * sizeof(uint32_t))) == NULL ||
+        (slot->stack = malloc(slot->stack_capacity * sizeof(size_t))) ==
+                NULL ||
+        (slot->peaks = malloc(finder->config.max_peaks *
+                              sizeof(struct stream2_peak))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    return STREAM2_OK;
+}
+
+static enum stream2_result finder_init(struct stream2_peak_finder* finder,
+                                       const struct stream2_series* series,
+                                       const struct stream2_start_msg* msg) {
+    enum stream2_result r;
+
+    const struct stream2_peak_config* config = &finder->config;
+    if (config->tile_size == 0 || config->tile_size % 8 != 0 ||
+        config->slots == 0 || config->max_peaks == 0)
+        return STREAM2_ERROR_PARSE;
+
+    finder->width = series->image_size_x;
+    finder->height = series->image_size_y;
+    finder->elem_size = series->elem_size;
+    finder->saturation = series->saturation;
+    finder->stride = (finder->width + 63) / 64 * 8;
+    finder->tiles_x = (finder->width + config->tile_size - 1) /
+                      config->tile_size;
+    finder->tiles_y = (finder->height + config->tile_size - 1) /
+                      config->tile_size;
+
+    finder->channels = series->channels_len;
+    if ((finder->valid = calloc(finder->channels, sizeof(uint8_t*))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < finder->channels; i++) {
+        if ((finder->valid[i] = calloc(finder->stride * finder->height, 1)) ==
+            NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        if ((r = build_valid(finder, series, msg, i, finder->valid[i])))
+            return r;
+    }
+
+    if ((finder->slots = calloc(config->slots, sizeof(struct slot))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < config->slots; i++) {
+        if ((r = create_slot(finder, &finder->slots[i])))
+            return r;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_peak_finder_create(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        const struct stream2_peak_config* config,
+        struct stream2_peak_finder** finder_out) {
+    enum stream2_result r;
+
+    *finder_out = NULL;
+
+    struct stream2_peak_finder* finder =
+            calloc(1, sizeof(struct stream2_peak_finder));
+    if (finder == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (config)
+        finder->config = *config;
+    else
+        stream2_peak_config_default(&finder->config);
+
+    if ((r = finder_init(finder, series, msg))) {
+        stream2_peak_finder_free(finder);
+        return r;
+    }
+
+    *finder_out = finder;
+    return STREAM2_OK;
+}
+
+void stream2_peak_finder_free(struct stream2_peak_finder* finder) {
+    if (finder == NULL)
+        return;
+    if (finder->valid) {
+        for (size_t i = 0; i < finder->channels; i++)
+            free(finder->valid[i]);
+    }
+    free(finder->valid);
+    if (finder->slots) {
+        for (size_t i = 0; i < finder->config.slots; i++) {
+            struct slot* slot = &finder->slots[i];
+            free(slot->candidates);
+            free(slot->background);
+            free(slot->thresholds);
+            free(slot->stack);
+            free(slot->peaks);
+        }
+    }
+    free(finder->slots);
+    free(finder);
+}
+
+// Sums the valid pixels of a tile not above limit. Squares are summed as
+// SQUARE, which holds the sum of the squares of a tile of TYPE values.
+#define DEFINE_TILE_SUMS(NAME, TYPE, SQUARE)                                \
+    static uint64_t NAME(const struct stream2_peak_finder* finder,          \
+                         const uint8_t* valid, const TYPE* data, size_t x0, \
+                         size_t x1, size_t y0, size_t y1, uint32_t limit,   \
+                         double* sum_out, double* sum_sq_out) {             \
+        uint64_t sum = 0, n = 0;                                            \
+        SQUARE sum_sq = 0;                                                  \
+        for (size_t y = y0; y < y1; y++) {                                  \
+            const TYPE* row = data + y * finder->width;                     \
+            const uint8_t* v = valid + y * finder->stride;                  \
+            for (size_t x = x0; x < x1; x++) {                              \
+                const uint64_t value = row[x];                              \
+                if (((v[x / 8] >> (x % 8)) & 1) && value <= limit) {        \
+                    sum += value;                                           \
+                    sum_sq += (SQUARE)value * value;                        \
+                    n++;                                                    \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+        *sum_out = (double)sum;                                             \
+        *sum_sq_out = (double)sum_sq;                                       \
+        return n;                                                           \
+    }
+
+DEFINE_TILE_SUMS(tile_sums_u8, uint8_t, uint64_t)
+DEFINE_TILE_SUMS(tile_sums_u16, uint16_t, uint64_t)
+DEFINE_TILE_SUMS(tile_sums_u32, uint32_t, double)
+
+static uint64_t tile_sums(const struct stream2_peak_finder* finder,
+                          const uint8_t* valid,
+                          const void* data,
+                          size_t tx,
+                          size_t ty,
+                          uint32_t limit,
+                          double* sum,
+                          double* sum_sq) {
+    const size_t t = finder->config.tile_size;
+    const size_t x0 = tx * t;
+    const size_t x1 = x0 + t < finder->width ? x0 + t : finder->width;
+    const size_t y0 = ty * t;
+    const size_t y1 = y0 + t < finder->height ? y0 + t : finder->height;
+    switch (finder->elem_size) {
+        case 1:
+            return tile_sums_u8(finder, valid, data, x0, x1, y0, y1, limit,
+                                sum, sum_sq);
+        case 2:
+            return tile_sums_u16(finder, valid, data, x0, x1, y0, y1, limit,
+                                 sum, sum_sq);
+        default:
+            return tile_sums_u32(finder, valid, data, x0, x1, y0, y1, limit,
+                                 sum, sum_sq);
+    }
+}
+
+// Estimates the background of every tile and returns the mean background of
+// the frame.
+static float estimate_background(const struct stream2_peak_finder* finder,
+                                 const uint8_t* valid,
+                                 const void* data,
+                                 struct slot* slot) {
+    const struct stream2_peak_config* config = &finder->config;
+    double total = 0.0;
+    size_t tiles = 0;
+    for (size_t ty = 0; ty < finder->tiles_y; ty++) {
+        for (size_t tx = 0; tx < finder->tiles_x; tx++) {
+            const size_t i = ty * finder->tiles_x + tx;
+            double sum, sum_sq, mean = 0.0, sd = 0.0;
+            uint32_t limit = finder->saturation;
+            // The second pass leaves out the pixels above the first threshold.
+            for (int pass = 0; pass < 2; pass++) {
+                const uint64_t n = tile_sums(finder, valid, data, tx, ty,
+                                             limit, &sum, &sum_sq);
+                if (n == 0)
+                    break;
+                mean = sum / n;
+                const double var = sum_sq / n - mean * mean;
+                sd = var > 0.0 ? sqrt(var) : 0.0;
+                const double clip = mean + config->sigma * sd;
+                if (clip < limit)
+                    limit = (uint32_t)clip;
+            }
+
+            double threshold = config->sigma * sd;
+            if (threshold < config->min_signal)
+                threshold = config->min_signal;
+            threshold += mean;
+            slot->background[i] = (float)mean;
+            // v > threshold is v > floor(threshold) for integer v.
+            slot->thresholds[i] = threshold < finder->saturation
+                                          ? (uint32_t)threshold
+                                          : finder->saturation;
+            total += mean;
+            tiles++;
+        }
+    }
+    return tiles ? (float)(total / tiles) : 0.0f;
+}
+
+// Gets the bits of 8 pixels above threshold and not above saturation.
+#if defined(__SSE2__)
+static unsigned above_u8(const uint8_t* p,
+                         uint32_t threshold,
+                         uint32_t saturation) {
+    // Unsigned comparison as signed comparison of the values minus 0x80.
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i v =
+            _mm_xor_si128(_mm_loadl_epi64((const __m128i*)p), bias);
+    const __m128i above =
+            _mm_cmpgt_epi8(v, _mm_set1_epi8((char)(threshold ^ 0x80)));
+    const __m128i over =
+            _mm_cmpgt_epi8(v, _mm_set1_epi8((char)(saturation ^ 0x80)));
+    return _mm_movemask_epi8(_mm_andnot_si128(over, above)) & 0xff;
+}
+
+static unsigned above_u16(const uint16_t* p,
+                          uint32_t threshold,
+                          uint32_t saturation) {
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias);
+    const __m128i above =
+            _mm_cmpgt_epi16(v, _mm_set1_epi16((short)(threshold ^ 0x8000)));
+    const __m128i over =
+            _mm_cmpgt_epi16(v, _mm_set1_epi16((short)(saturation ^ 0x8000)));
+    const __m128i bits = _mm_andnot_si128(over, above);
+    return _mm_movemask_epi8(_mm_packs_epi16(bits, _mm_setzero_si128()));
+}
+
+static unsigned above_u32(const uint32_t* p,
+                          uint32_t threshold,
+                          uint32_t saturation) {
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    const __m128i t = _mm_set1_epi32((int)(threshold ^ 0x80000000u));
+    const __m128i s = _mm_set1_epi32((int)(saturation ^ 0x80000000u));
+    const __m128i v0 =
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias);
+    const __m128i v1 =
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + 4)), bias);
+    const __m128i bits0 =
+            _mm_andnot_si128(_mm_cmpgt_epi32(v0, s), _mm_cmpgt_epi32(v0, t));
+    const __m128i bits1 =
+            _mm_andnot_si128(_mm_cmpgt_epi32(v1, s), _mm_cmpgt_epi32(v1, t));
+    const __m128i bits = _mm_packs_epi32(bits0, bits1);
+    return _mm_movemask_epi8(_mm_packs_epi16(bits, _mm_setzero_si128()));
+}
+#else
+#define DEFINE_ABOVE(NAME, TYPE)                                            \
+    static unsigned NAME(const TYPE* p, uint32_t threshold,                 \
+                         uint32_t saturation) {                             \
+        unsigned bits = 0;                                                  \
+        for (unsigned i = 0; i < 8; i++)                                    \
+            bits |= (unsigned)(p[i] > threshold && p[i] <= saturation) << i; \
+        return bits;                                                        \
+    }
+
+DEFINE_ABOVE(above_u8, uint8_t)
+DEFINE_ABOVE(above_u16, uint16_t)
+DEFINE_ABOVE(above_u32, uint32_t)
+#endif
+
+// Sets the bitmap of candidate pixels, 8 pixels at a time.
+#define DEFINE_FIND_CANDIDATES(NAME, TYPE, ABOVE)                           \
+    static void NAME(const struct stream2_peak_finder* finder,              \
+                     const uint8_t* valid, const TYPE* data,                \
+                     struct slot* slot) {                                   \
+        const size_t tile = finder->config.tile_size;                       \
+        const size_t chunks = finder->width / 8;                            \
+        const uint32_t saturation = finder->saturation;                     \
+        for (size_t y = 0; y < finder->height; y++) {                       \
+            const TYPE* row = data + y * finder->width;                     \
+            const uint8_t* v = valid + y * finder->stride;                  \
+            uint8_t* c = slot->candidates + y * finder->stride;             \
+            const uint32_t* t =                                             \
+                    slot->thresholds + (y / tile) * finder->tiles_x;        \
+            for (size_t k = 0; k < chunks; k++) {                           \
+                c[k] = ABOVE(row + 8 * k, t[8 * k / tile], saturation) &    \
+                       v[k];                                                \
+            }                                                               \
+            size_t used = chunks;                                           \
+            if (chunks * 8 < finder->width) {                               \
+                unsigned bits = 0;                                          \
+                for (size_t x = chunks * 8; x < finder->width; x++) {       \
+                    bits |= (unsigned)(row[x] > t[x / tile] &&              \
+                                       row[x] <= saturation)                \
+                            << (x % 8);                                     \
+                }                                                           \
+                c[used++] = bits & v[chunks];                               \
+            }                                                               \
+            memset(c + used, 0, finder->stride - used);                     \
+        }                                                                   \
+    }
+
+DEFINE_FIND_CANDIDATES(find_candidates_u8, uint8_t, above_u8)
+DEFINE_FIND_CANDIDATES(find_candidates_u16, uint16_t, above_u16)
+DEFINE_FIND_CANDIDATES(find_candidates_u32, uint32_t, above_u32)
+
+static uint32_t load_pixel(const void* data, size_t elem_size, size_t i) {
+    switch (elem_size) {
+        case 1:
+            return ((const uint8_t*)data)[i];
+        case 2:
+            return ((const uint16_t*)data)[i];
+        default:
+            return ((const uint32_t*)data)[i];
+    }
+}
+
+// Clears the bit of a candidate pixel and returns whether it was set.
+static bool take_candidate(const struct stream2_peak_finder* finder,
+                           struct slot* slot,
+                           size_t x,
+                           size_t y) {
+    uint8_t* byte = &slot->candidates[y * finder->stride + x / 8];
+    const uint8_t bit = (uint8_t)(1u << (x % 8));
+    if ((*byte & bit) == 0)
+        return false;
+    *byte &= (uint8_t)~bit;
+    return true;
+}
+
+static enum stream2_result push(struct slot* slot, size_t* len, size_t p) {
+    if (*len == slot->stack_capacity) {
+        const size_t capacity = 2 * slot->stack_capacity;
+        size_t* stack = realloc(slot->stack, capacity * sizeof(size_t));
+        if (stack == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        slot->stack = stack;
+        slot->stack_capacity = capacity;
+    }
+    slot->stack[(*len)++] = p;
+    return STREAM2_OK;
+}
+
+// Takes the candidates connected to the candidate at x, y as one peak.
+static enum stream2_result fill_peak(const struct stream2_peak_finder* finder,
+                                     struct slot* slot,
+                                     const void* data,
+                                     size_t x,
+                                     size_t y,
+                                     struct stream2_peak* peak) {
+    enum stream2_result r;
+
+    const size_t width = finder->width;
+    const size_t tile = finder->config.tile_size;
+    double sum = 0.0, sum_x = 0.0, sum_y = 0.0;
+    uint32_t max_value = 0;
+    size_t pixels = 0;
+    size_t len = 0;
+    if ((r = push(slot, &len, y * width + x)))
+        return r;
+    while (len > 0) {
+        const size_t p = slot->stack[--len];
+        const size_t px = p % width;
+        const size_t py = p / width;
+        const uint32_t value = load_pixel(data, finder->elem_size, p);
+        const double signal =
+                value -
+                slot->background[(py / tile) * finder->tiles_x + px / tile];
+        sum += signal;
+        sum_x += signal * px;
+        sum_y += signal * py;
+        max_value = value > max_value ? value : max_value;
+        pixels++;
+
+        const size_t x0 = px > 0 ? px - 1 : px;
+        const size_t x1 = px + 1 < width ? px + 1 : px;
+        const size_t y0 = py > 0 ? py - 1 : py;
+        const size_t y1 = py + 1 < finder->height ? py + 1 : py;
+        for (size_t ny = y0; ny <= y1; ny++) {
+            for (size_t nx = x0; nx <= x1; nx++) {
+                if (take_candidate(finder, slot, nx, ny) &&
+                    (r = push(slot, &len, ny * width + nx)))
+                    return r;
+            }
+        }
+    }
+
+    peak->x = sum > 0.0 ? (float)(sum_x / sum) : (float)x;
+    peak->y = sum > 0.0 ? (float)(sum_y / sum) : (float)y;
+    peak->intensity = (float)sum;
+    peak->max_value = max_value;
+    peak->pixels = pixels < UINT32_MAX ? (uint32_t)pixels : UINT32_MAX;
+    return STREAM2_OK;
+}
+
+static enum stream2_result find_peaks(const struct stream2_peak_finder* finder,
+                                      struct slot* slot,
+                                      const void* data,
+                                      struct stream2_peak_list* list) {
+    enum stream2_result r;
+
+    const struct stream2_peak_config* config = &finder->config;
+    const size_t words = finder->stride / 8;
+    for (size_t y = 0; y < finder->height; y++) {
+        const uint8_t* row = slot->candidates + y * finder->stride;
+        for (size_t w = 0; w < words; w++) {
+            // Most of the bitmap is zero and skipped 64 pixels at a time.
+            uint64_t word;
+            memcpy(&word, row + 8 * w, sizeof(word));
+            if (word == 0)
+                continue;
+            for (size_t x = 64 * w; x < 64 * (w + 1); x++) {
+                if (!take_candidate(finder, slot, x, y))
+                    continue;
+
+                struct stream2_peak peak;
+                if ((r = fill_peak(finder, slot, data, x, y, &peak)))
+                    return r;
+                if (peak.pixels < config->min_pixels ||
+                    peak.pixels > config->max_pixels)
+                    continue;
+                if (list->len < config->max_peaks)
+                    list->peaks[list->len++] = peak;
+                list->found++;
+            }
+        }
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_peak_finder_find(
+        struct stream2_peak_finder* finder,
+        size_t slot_index,
+        size_t channel,
+        uint64_t image_id,
+        const void* data,
+        struct stream2_peak_list* list) {
+    if (slot_index >= finder->config.slots || channel >= finder->channels)
+        return STREAM2_ERROR_PARSE;
+    struct slot* slot = &finder->slots[slot_index];
+    const uint8_t* valid = finder->valid[channel];
+
+    list->image_id = image_id;
+    list->channel = channel;
+    list->background = estimate_background(finder, valid, data, slot);
+    list->peaks = slot->peaks;
+    list->len = 0;
+    list->found = 0;
+
+    switch (finder->elem_size) {
+        case 1:
+            find_candidates_u8(finder, valid, data, slot);
+            break;
+        case 2:
+            find_candidates_u16(finder, valid, data, slot);
+            break;
+        default:
+            find_candidates_u32(finder, valid, data, slot);
+            break;
+    }
+    return find_peaks(finder, slot, data, list);
+}
+
+size_t stream2_peak_record_size(const struct stream2_peak_list* list) {
+    return sizeof(struct stream2_peak_record) +
+           list->len * sizeof(struct stream2_peak);
+}
+
+void stream2_peak_record_encode(const struct stream2_peak_list* list,
+                                uint8_t* dst) {
+    const struct stream2_peak_record record = {
+            .image_id = list->image_id,
+            .channel = (uint32_t)list->channel,
+            .peaks = (uint32_t)list->len,
+            .found = list->found < UINT32_MAX ? (uint32_t)list->found
+                                              : UINT32_MAX,
+            .background = list->background,
+    };
+    memcpy(dst, &record, sizeof(record));
+    memcpy(dst + sizeof(record), list->peaks,
+           list->len * sizeof(struct stream2_peak));
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Finds bright spots in decoded frames, e.g. Bragg peaks for serial
+// crystallography, so that a frame is reduced to a short list of peaks.
+//
+// The background of a frame is estimated per tile from the mean and standard
+// deviation of its valid pixels, recomputed once without the pixels above the
+// threshold. Pixels above the threshold of their tile are candidates; masked
+// pixels and pixels above saturation_value are never candidates. Candidates
+// connected through their edges or corners form a peak.
+struct stream2_peak_finder;
+
+struct stream2_peak_config {
+    // Width and height of the background tiles in pixels, a multiple of 8.
+    size_t tile_size;
+    // Candidates are at least sigma standard deviations above the background
+    // of their tile...
+    double sigma;
+    // ... and at least min_signal counts above it.
+    double min_signal;
+    // Peaks of fewer or more pixels are discarded.
+    size_t min_pixels;
+    size_t max_pixels;
+    // Maximum number of peaks reported per frame.
+    size_t max_peaks;
+    // Number of workspaces, e.g. one per decoder thread.
+    size_t slots;
+};
+
+struct stream2_peak {
+    // Centroid weighted by the signal above background, with pixel centers
+    // at integer coordinates.
+    float x;
+    float y;
+    // Sum of the signal above background.
+    float intensity;
+    // Maximum pixel value.
+    uint32_t max_value;
+    uint32_t pixels;
+};
+
+// Peaks of one channel of one frame.
+struct stream2_peak_list {
+    uint64_t image_id;
+    size_t channel;
+    // Mean background of the frame.
+    float background;
+    struct stream2_peak* peaks;
+    size_t len;
+    // Number of peaks found, which is larger than len if more than max_peaks
+    // peaks were found.
+    size_t found;
+};
+
+// Header of an encoded peak list, followed by peaks of struct stream2_peak.
+// Records are in host byte order and can be written back to back.
+struct stream2_peak_record {
+    uint64_t image_id;
+    uint32_t channel;
+    uint32_t peaks;
+    uint32_t found;
+    float background;
+};
+
+void stream2_peak_config_default(struct stream2_peak_config* config);
+
+// Creates a peak finder for the frames of a series. The pixel mask of every
+// channel is decoded from the start message if pixel_mask_enabled. If config
+// is NULL, the default configuration is used.
+enum stream2_result stream2_peak_finder_create(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        const struct stream2_peak_config* config,
+        struct stream2_peak_finder** finder_out);
+void stream2_peak_finder_free(struct stream2_peak_finder* finder);
+
+// Finds the peaks of a decoded frame of a channel using the workspace of a
+// slot. The peaks stay valid until the slot is used again. Slots may be used
+// concurrently.
+enum stream2_result stream2_peak_finder_find(
+        struct stream2_peak_finder* finder,
+        size_t slot,
+        size_t channel,
+        uint64_t image_id,
+        const void* data,
+        struct stream2_peak_list* list);
+
+// Gets the size of the record of a peak list.
+size_t stream2_peak_record_size(const struct stream2_peak_list* list);
+
+// Encodes a peak list into a record of stream2_peak_record_size() bytes.
+void stream2_peak_record_encode(const struct stream2_peak_list* list,
+                                uint8_t* dst);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,789 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zmq.h>
+
+#include "stream2.h"
+#include "stream2_compress.h"
+#include "stream2_receiver.h"
+#include "stream2_series.h"
+#include "tinycbor/src/cbor.h"
+
+// Performance regression tests: benchmarks parsing, decoding and the receiver
+// pipeline on fixed synthetic workloads and compares their throughput with
+// baselines, so that a dependency or compiler upgrade that slows them down
+// fails ctest -L perf. The pipeline benchmark pushes images over an ipc://
+// endpoint, so no detector or network is needed.
+//
+// Each benchmark is run RUNS times for at least min_seconds / RUNS and the
+// best throughput counts, which filters out most of the noise of a shared
+// machine. The baselines file has a line per benchmark:
+//
+//   NAME VALUE UNIT TOLERANCE
+//
+// and a benchmark fails if its throughput is below VALUE * (1 - TOLERANCE),
+// or if the file has no line for it. Throughputs depend on the machine, so
+// baselines are recorded with -u on the machine the tests run on, and again
+// after an intended change of performance. Without baselines, the
+// throughputs are only printed.
+
+enum {
+    RUNS = 3,
+    MAX_BASELINES = 16,
+    // Images of the parse and decode workloads, which are reused.
+    WORKLOAD_IMAGES = 16,
+    PARSE_CHANNELS = 4,
+    PIPELINE_IMAGES = 2000,
+    PIPELINE_DECODERS = 2,
+    IMAGE_SIZE_X = 1028,
+    IMAGE_SIZE_Y = 1062,
+    SPOTS = 400,
+    TIME_BASE = 1000000000,
+};
+
+static const CborTag SELF_DESCRIBED_CBOR = 55799;
+static const CborTag DATE_TIME = 0;
+static const CborTag MULTI_DIMENSIONAL_ARRAY_ROW_MAJOR = 40;
+static const CborTag DECTRIS_COMPRESSION = 56500;
+
+static const char* const CHANNELS[PARSE_CHANNELS] = {
+        "threshold_1", "threshold_2", "threshold_3", "threshold_4"};
+
+struct baseline {
+    char name[32];
+    double value;
+    char unit[16];
+    double tolerance;
+};
+
+struct options {
+    const char* baselines;
+    bool update;
+    double min_seconds;
+};
+
+// Encoded messages of a synthetic series of uint32 images compressed with
+// bslz4.
+struct workload {
+    size_t channels;
+    uint64_t number_of_images;
+    uint8_t* start;
+    size_t start_size;
+    uint8_t* images[WORKLOAD_IMAGES];
+    size_t images_size[WORKLOAD_IMAGES];
+    // Offset of the 8 bytes of the image_id of every image message.
+    size_t image_id_offset[WORKLOAD_IMAGES];
+    uint8_t* end;
+    size_t end_size;
+};
+
+struct encode_args {
+    const struct workload* workload;
+    uint64_t image_id;
+    const uint8_t* compressed;
+    size_t compressed_size;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double uniform(uint64_t* state) {
+    return (xorshift64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Generates a diffraction-like uint32 image of a fixed seed, as stream2_sim:
+// a background of mostly zeros and ones with powder rings and Bragg spots.
+static void generate_image(uint32_t* data, uint64_t seed) {
+    const double cx = IMAGE_SIZE_X * 0.5;
+    const double cy = IMAGE_SIZE_Y * 0.5;
+    const double rings[3] = {0.15, 0.27, 0.41};
+
+    uint64_t state = 0x9e3779b97f4a7c15u ^ (seed * 0xbf58476d1ce4e5b9u);
+    xorshift64(&state);
+
+    for (size_t y = 0; y < IMAGE_SIZE_Y; y++) {
+        for (size_t x = 0; x < IMAGE_SIZE_X; x++) {
+            const double r = hypot(x - cx, y - cy) / IMAGE_SIZE_X;
+            double intensity = 0.0;
+            for (size_t k = 0; k < sizeof(rings) / sizeof(rings[0]); k++) {
+                const double d = (r - rings[k]) / 0.004;
+                intensity += 6.0 / (k + 1) * exp(-0.5 * d * d);
+            }
+            const double u = uniform(&state);
+            data[y * IMAGE_SIZE_X + x] =
+                    (uint32_t)(intensity * u * 2.0) + (u < 0.02);
+        }
+    }
+    for (size_t s = 0; s < SPOTS; s++) {
+        const size_t sx = 3 + (size_t)(uniform(&state) * (IMAGE_SIZE_X - 6));
+        const size_t sy = 3 + (size_t)(uniform(&state) * (IMAGE_SIZE_Y - 6));
+        const double peak = 10.0 + uniform(&state) * 2000.0;
+        for (int dy = -3; dy <= 3; dy++) {
+            for (int dx = -3; dx <= 3; dx++) {
+                data[(sy + dy) * IMAGE_SIZE_X + sx + dx] =
+                        (uint32_t)(peak * exp(-0.5 * (dx * dx + dy * dy)));
+            }
+        }
+    }
+}
+
+static CborError encode_start_msg(CborEncoder* enc, const void* arg) {
+    const struct encode_args* a = arg;
+    CborError e = CborNoError;
+    CborEncoder map;
+    CborEncoder inner;
+
+    e |= cbor_encode_tag(enc, SELF_DESCRIBED_CBOR);
+    e |= cbor_encoder_create_map(enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "start");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, 1);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "stream2_perf-1");
+    e |= cbor_encode_text_stringz(&map, "channels");
+    e |= cbor_encoder_create_array(&map, &inner, a->workload->channels);
+    for (size_t i = 0; i < a->workload->channels; i++)
+        e |= cbor_encode_text_stringz(&inner, CHANNELS[i]);
+    e |= cbor_encoder_close_container(&map, &inner);
+    e |= cbor_encode_text_stringz(&map, "image_dtype");
+    e |= cbor_encode_text_stringz(&map, "uint32");
+    e |= cbor_encode_text_stringz(&map, "image_size_x");
+    e |= cbor_encode_uint(&map, IMAGE_SIZE_X);
+    e |= cbor_encode_text_stringz(&map, "image_size_y");
+    e |= cbor_encode_uint(&map, IMAGE_SIZE_Y);
+    e |= cbor_encode_text_stringz(&map, "number_of_images");
+    e |= cbor_encode_uint(&map, a->workload->number_of_images);
+    e |= cbor_encode_text_stringz(&map, "saturation_value");
+    e |= cbor_encode_uint(&map, UINT32_MAX - 1);
+    e |= cbor_encoder_close_container(enc, &map);
+    return e;
+}
+
+static CborError encode_rational(CborEncoder* enc,
+                                 uint64_t numerator,
+                                 uint64_t denominator) {
+    CborError e = CborNoError;
+    CborEncoder array;
+    e |= cbor_encoder_create_array(enc, &array, 2);
+    e |= cbor_encode_uint(&array, numerator);
+    e |= cbor_encode_uint(&array, denominator);
+    e |= cbor_encoder_close_container(enc, &array);
+    return e;
+}
+
+// Encodes an image message whose image_id is a placeholder of 9 bytes, so
+// that the pipeline benchmark can patch it, with the same compressed frame in
+// every channel.
+static CborError encode_image_msg(CborEncoder* enc, const void* arg) {
+    const struct encode_args* a = arg;
+    CborError e = CborNoError;
+    CborEncoder map;
+    CborEncoder data;
+    CborEncoder multidim;
+    CborEncoder inner;
+
+    e |= cbor_encode_tag(enc, SELF_DESCRIBED_CBOR);
+    e |= cbor_encoder_create_map(enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "image");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, 1);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "stream2_perf-1");
+    e |= cbor_encode_text_stringz(&map, "image_id");
+    e |= cbor_encode_uint(&map, UINT64_MAX);
+    e |= cbor_encode_text_stringz(&map, "real_time");
+    e |= encode_rational(&map, TIME_BASE / 1000, TIME_BASE);
+    e |= cbor_encode_text_stringz(&map, "series_date");
+    e |= cbor_encode_tag(&map, DATE_TIME);
+    e |= cbor_encode_text_stringz(&map, "2024-01-01T00:00:00Z");
+    e |= cbor_encode_text_stringz(&map, "start_time");
+    e |= encode_rational(&map, a->image_id * TIME_BASE / 1000, TIME_BASE);
+    e |= cbor_encode_text_stringz(&map, "stop_time");
+    e |= encode_rational(&map, (a->image_id + 1) * TIME_BASE / 1000,
+                         TIME_BASE);
+    e |= cbor_encode_text_stringz(&map, "user_data");
+    e |= cbor_encode_null(&map);
+    e |= cbor_encode_text_stringz(&map, "data");
+    e |= cbor_encoder_create_map(&map, &data, a->workload->channels);
+    for (size_t i = 0; i < a->workload->channels; i++) {
+        e |= cbor_encode_text_stringz(&data, CHANNELS[i]);
+        e |= cbor_encode_tag(&data, MULTI_DIMENSIONAL_ARRAY_ROW_MAJOR);
+        e |= cbor_encoder_create_array(&data, &multidim, 2);
+        e |= cbor_encoder_create_array(&multidim, &inner, 2);
+        e |= cbor_encode_uint(&inner, IMAGE_SIZE_Y);
+        e |= cbor_encode_uint(&inner, IMAGE_SIZE_X);
+        e |= cbor_encoder_close_container(&multidim, &inner);
+        e |= cbor_encode_tag(&multidim,
+                             STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN);
+        e |= cbor_encode_tag(&multidim, DECTRIS_COMPRESSION);
+        e |= cbor_encoder_create_array(&multidim, &inner, 3);
+        e |= cbor_encode_text_stringz(&inner, "bslz4");
+        e |= cbor_encode_uint(&inner, sizeof(uint32_t));
+        e |= cbor_encode_byte_string(&inner, a->compressed,
+                                     a->compressed_size);
+        e |= cbor_encoder_close_container(&multidim, &inner);
+        e |= cbor_encoder_close_container(&data, &multidim);
+    }
+    e |= cbor_encoder_close_container(&map, &data);
+    e |= cbor_encoder_close_container(enc, &map);
+    return e;
+}
+
+static CborError encode_end_msg(CborEncoder* enc, const void* arg) {
+    (void)arg;
+    CborError e = CborNoError;
+    CborEncoder map;
+
+    e |= cbor_encode_tag(enc, SELF_DESCRIBED_CBOR);
+    e |= cbor_encoder_create_map(enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "end");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, 1);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "stream2_perf-1");
+    e |= cbor_encoder_close_container(enc, &map);
+    return e;
+}
+
+// Encodes a message into a new buffer.
+static enum stream2_result encode(uint8_t** buffer,
+                                  size_t* size,
+                                  CborError (*fn)(CborEncoder*, const void*),
+                                  const void* arg) {
+    size_t capacity = 4096;
+    *buffer = NULL;
+    for (;;) {
+        uint8_t* p = realloc(*buffer, capacity);
+        if (p == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        *buffer = p;
+
+        CborEncoder enc;
+        cbor_encoder_init(&enc, *buffer, capacity, 0);
+        const CborError e = fn(&enc, arg);
+        if (e == CborNoError) {
+            *size = cbor_encoder_get_buffer_size(&enc, *buffer);
+            return STREAM2_OK;
+        }
+        if (e != CborErrorOutOfMemory)
+            return STREAM2_ERROR_PARSE;
+        capacity += cbor_encoder_get_extra_bytes_needed(&enc);
+    }
+}
+
+// Finds the placeholder of the image_id: 0x1b followed by 8 bytes of ones.
+static enum stream2_result find_image_id(const uint8_t* data,
+                                         size_t size,
+                                         size_t* offset) {
+    static const uint8_t PATTERN[9] = {0x1b, 0xff, 0xff, 0xff, 0xff,
+                                       0xff, 0xff, 0xff, 0xff};
+    for (size_t i = 0; i + sizeof(PATTERN) <= size; i++) {
+        if (memcmp(data + i, PATTERN, sizeof(PATTERN)) == 0) {
+            *offset = i + 1;
+            return STREAM2_OK;
+        }
+    }
+    return STREAM2_ERROR_PARSE;
+}
+
+static void patch_image_id(uint8_t* data, size_t offset, uint64_t image_id) {
+    for (int i = 0; i < 8; i++)
+        data[offset + i] = (uint8_t)(image_id >> (56 - 8 * i));
+}
+
+static void workload_free(struct workload* workload) {
+    free(workload->start);
+    for (size_t i = 0; i < WORKLOAD_IMAGES; i++)
+        free(workload->images[i]);
+    free(workload->end);
+}
+
+// Encodes a series of WORKLOAD_IMAGES distinct images, which are numbered 0
+// to WORKLOAD_IMAGES - 1 until patched.
+static enum stream2_result workload_init(struct workload* workload,
+                                         size_t channels,
+                                         uint64_t number_of_images) {
+    enum stream2_result r = STREAM2_OK;
+    memset(workload, 0, sizeof(*workload));
+    workload->channels = channels;
+    workload->number_of_images = number_of_images;
+
+    const size_t frame_size = IMAGE_SIZE_X * IMAGE_SIZE_Y * sizeof(uint32_t);
+    const size_t bound =
+            stream2_compress_bound("bslz4", frame_size, sizeof(uint32_t));
+    uint32_t* frame = malloc(frame_size);
+    uint8_t* compressed = malloc(bound);
+    if (frame == NULL || compressed == NULL)
+        r = STREAM2_ERROR_OUT_OF_MEMORY;
+
+    struct encode_args args = {workload, 0, compressed, 0};
+    for (size_t i = 0; i < WORKLOAD_IMAGES && r == STREAM2_OK; i++) {
+        generate_image(frame, i);
+        args.image_id = i;
+        if ((r = stream2_compress("bslz4", (const uint8_t*)frame, frame_size,
+                                  sizeof(uint32_t), compressed, bound,
+                                  &args.compressed_size)) ||
+            (r = encode(&workload->images[i], &workload->images_size[i],
+                        encode_image_msg, &args)) ||
+            (r = find_image_id(workload->images[i], workload->images_size[i],
+                               &workload->image_id_offset[i])))
+            break;
+        patch_image_id(workload->images[i], workload->image_id_offset[i], i);
+    }
+    free(frame);
+    free(compressed);
+
+    if (r == STREAM2_OK &&
+        !(r = encode(&workload->start, &workload->start_size,
+                     encode_start_msg, &args)))
+        r = encode(&workload->end, &workload->end_size, encode_end_msg, &args);
+    if (r)
+        workload_free(workload);
+    return r;
+}
+
+// Runs a round of a benchmark, adding the amount of work done to *work.
+typedef enum stream2_result (*round_fn)(void* arg, double* work);
+
+// Measures the best throughput of RUNS runs of repeated rounds.
+static enum stream2_result measure(round_fn fn,
+                                   void* arg,
+                                   double min_seconds,
+                                   double* throughput) {
+    enum stream2_result r;
+    *throughput = 0.0;
+    for (int run = 0; run < RUNS; run++) {
+        double work = 0.0;
+        const double start = now();
+        double elapsed;
+        do {
+            if ((r = fn(arg, &work)))
+                return r;
+            elapsed = now() - start;
+        } while (elapsed < min_seconds / RUNS);
+        if (work / elapsed > *throughput)
+            *throughput = work / elapsed;
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result parse_round(void* arg, double* work) {
+    enum stream2_result r;
+    const struct workload* workload = arg;
+    for (size_t i = 0; i < WORKLOAD_IMAGES; i++) {
+        struct stream2_msg* msg;
+        if ((r = stream2_parse_msg(workload->images[i],
+                                   workload->images_size[i], &msg)))
+            return r;
+        stream2_free_msg(msg);
+    }
+    *work += WORKLOAD_IMAGES;
+    return STREAM2_OK;
+}
+
+// Parses image messages of PARSE_CHANNELS channels, in images per second.
+static enum stream2_result bench_parse(const struct options* options,
+                                       double* throughput) {
+    enum stream2_result r;
+    struct workload workload;
+    if ((r = workload_init(&workload, PARSE_CHANNELS, WORKLOAD_IMAGES)))
+        return r;
+    r = measure(parse_round, &workload, options->min_seconds, throughput);
+    workload_free(&workload);
+    return r;
+}
+
+struct decode_bench {
+    struct stream2_series* series;
+    struct stream2_image_msg* images[WORKLOAD_IMAGES];
+};
+
+static enum stream2_result decode_round(void* arg, double* work) {
+    enum stream2_result r;
+    struct decode_bench* bench = arg;
+    for (size_t i = 0; i < WORKLOAD_IMAGES; i++) {
+        const void* data;
+        if ((r = stream2_series_decode(bench->series, bench->images[i], 0, 0,
+                                       &data)))
+            return r;
+    }
+    *work += WORKLOAD_IMAGES * bench->series->frame_size * 1e-9;
+    return STREAM2_OK;
+}
+
+static enum stream2_result decode_sparse_round(void* arg, double* work) {
+    enum stream2_result r;
+    struct decode_bench* bench = arg;
+    for (size_t i = 0; i < WORKLOAD_IMAGES; i++) {
+        const struct stream2_sparse_frame* frame;
+        if ((r = stream2_series_decode_sparse(bench->series, bench->images[i],
+                                              0, 0, &frame)))
+            return r;
+    }
+    *work += WORKLOAD_IMAGES * bench->series->frame_size * 1e-9;
+    return STREAM2_OK;
+}
+
+// Decodes the images of a series of one channel, in GB/s of decoded frames.
+static enum stream2_result bench_decode(const struct options* options,
+                                        bool sparse,
+                                        double* throughput) {
+    enum stream2_result r;
+    struct workload workload;
+    if ((r = workload_init(&workload, 1, WORKLOAD_IMAGES)))
+        return r;
+
+    struct decode_bench bench;
+    memset(&bench, 0, sizeof(bench));
+    struct stream2_series_config config;
+    stream2_series_config_default(&config);
+    config.sparse = sparse;
+
+    struct stream2_msg* start = NULL;
+    if (!(r = stream2_parse_msg(workload.start, workload.start_size, &start)))
+        r = stream2_series_create((const struct stream2_start_msg*)start,
+                                  &config, &bench.series);
+    for (size_t i = 0; i < WORKLOAD_IMAGES && r == STREAM2_OK; i++) {
+        r = stream2_parse_msg(workload.images[i], workload.images_size[i],
+                              (struct stream2_msg**)&bench.images[i]);
+    }
+    if (r == STREAM2_OK) {
+        r = measure(sparse ? decode_sparse_round : decode_round, &bench,
+                    options->min_seconds, throughput);
+    }
+
+    for (size_t i = 0; i < WORKLOAD_IMAGES; i++) {
+        if (bench.images[i])
+            stream2_free_msg((struct stream2_msg*)bench.images[i]);
+    }
+    stream2_series_free(bench.series);
+    if (start)
+        stream2_free_msg(start);
+    workload_free(&workload);
+    return r;
+}
+
+struct pipeline_bench {
+    struct workload workload;
+    void* socket;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool ended;
+    enum stream2_result error;
+};
+
+static void handle_end(void* user,
+                       struct stream2_series* series,
+                       const struct stream2_end_msg* msg) {
+    (void)series;
+    (void)msg;
+    struct pipeline_bench* bench = user;
+    pthread_mutex_lock(&bench->mutex);
+    bench->ended = true;
+    pthread_cond_signal(&bench->cond);
+    pthread_mutex_unlock(&bench->mutex);
+}
+
+static void handle_error(void* user,
+                         enum stream2_result r,
+                         const struct stream2_msg* msg) {
+    (void)msg;
+    struct pipeline_bench* bench = user;
+    pthread_mutex_lock(&bench->mutex);
+    if (bench->error == STREAM2_OK)
+        bench->error = r;
+    pthread_cond_signal(&bench->cond);
+    pthread_mutex_unlock(&bench->mutex);
+}
+
+static enum stream2_result send_copy(void* socket,
+                                     const uint8_t* data,
+                                     size_t size) {
+    if (zmq_send(socket, data, size, 0) == -1)
+        return STREAM2_ERROR_SYSTEM;
+    return STREAM2_OK;
+}
+
+// Pushes a series of PIPELINE_IMAGES images to the receiver and waits until
+// it handled the end message. zmq_send() copies the messages, so the image
+// messages of the workload are patched in place.
+static enum stream2_result pipeline_round(void* arg, double* work) {
+    enum stream2_result r;
+    struct pipeline_bench* bench = arg;
+    struct workload* workload = &bench->workload;
+
+    bench->ended = false;
+    if ((r = send_copy(bench->socket, workload->start, workload->start_size)))
+        return r;
+    for (uint64_t image_id = 0; image_id < PIPELINE_IMAGES; image_id++) {
+        const size_t i = image_id % WORKLOAD_IMAGES;
+        patch_image_id(workload->images[i], workload->image_id_offset[i],
+                       image_id);
+        if ((r = send_copy(bench->socket, workload->images[i],
+                           workload->images_size[i])))
+            return r;
+    }
+    if ((r = send_copy(bench->socket, workload->end, workload->end_size)))
+        return r;
+
+    pthread_mutex_lock(&bench->mutex);
+    // The end callback is not called if the series failed.
+    while (!bench->ended && bench->error == STREAM2_OK)
+        pthread_cond_wait(&bench->cond, &bench->mutex);
+    r = bench->error;
+    pthread_mutex_unlock(&bench->mutex);
+    *work += PIPELINE_IMAGES;
+    return r;
+}
+
+// Receives, parses and decodes series of one channel with PIPELINE_DECODERS
+// decoder threads, in images per second.
+static enum stream2_result bench_pipeline(const struct options* options,
+                                          double* throughput) {
+    enum stream2_result r;
+    struct pipeline_bench bench;
+    memset(&bench, 0, sizeof(bench));
+    if ((r = workload_init(&bench.workload, 1, PIPELINE_IMAGES)))
+        return r;
+    pthread_mutex_init(&bench.mutex, NULL);
+    pthread_cond_init(&bench.cond, NULL);
+
+    char address[64];
+    snprintf(address, sizeof(address), "ipc:///tmp/stream2_perf-%ld",
+             (long)getpid());
+    void* ctx = zmq_ctx_new();
+    if (ctx == NULL || (bench.socket = zmq_socket(ctx, ZMQ_PUSH)) == NULL ||
+        zmq_bind(bench.socket, address))
+        r = STREAM2_ERROR_SYSTEM;
+
+    struct stream2_receiver_config config;
+    stream2_receiver_config_default(&config);
+    config.address = address;
+    config.decoder_threads = PIPELINE_DECODERS;
+    config.callbacks.user = &bench;
+    config.callbacks.end = handle_end;
+    config.callbacks.error = handle_error;
+    struct stream2_receiver* receiver = NULL;
+    if (r == STREAM2_OK &&
+        !(r = stream2_receiver_start(&config, &receiver)))
+    {
+        r = measure(pipeline_round, &bench, options->min_seconds,
+                    throughput);
+    }
+
+    if (receiver)
+        stream2_receiver_stop(receiver);
+    if (bench.socket) {
+        const int linger = 0;
+        zmq_setsockopt(bench.socket, ZMQ_LINGER, &linger, sizeof(linger));
+        zmq_close(bench.socket);
+    }
+    if (ctx)
+        zmq_ctx_term(ctx);
+    pthread_cond_destroy(&bench.cond);
+    pthread_mutex_destroy(&bench.mutex);
+    workload_free(&bench.workload);
+    return r;
+}
+
+static const char* benchmark_unit(const char* name) {
+    if (strcmp(name, "parse") == 0 || strcmp(name, "pipeline") == 0)
+        return "images/s";
+    return "GB/s";
+}
+
+static enum stream2_result run_benchmark(const char* name,
+                                         const struct options* options,
+                                         double* throughput) {
+    if (strcmp(name, "parse") == 0)
+        return bench_parse(options, throughput);
+    if (strcmp(name, "decode") == 0)
+        return bench_decode(options, false, throughput);
+    if (strcmp(name, "decode_sparse") == 0)
+        return bench_decode(options, true, throughput);
+    if (strcmp(name, "pipeline") == 0)
+        return bench_pipeline(options, throughput);
+    return STREAM2_ERROR_NOT_IMPLEMENTED;
+}
+
+// Reads the baselines of a file, which may not exist yet with -u.
+static enum stream2_result read_baselines(const char* path,
+                                          bool update,
+                                          struct baseline* baselines,
+                                          size_t* len) {
+    *len = 0;
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return update ? STREAM2_OK : STREAM2_ERROR_SYSTEM;
+
+    char line[256];
+    enum stream2_result r = STREAM2_OK;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (*len == MAX_BASELINES) {
+            r = STREAM2_ERROR_PARSE;
+            break;
+        }
+        struct baseline* b = &baselines[*len];
+        if (sscanf(line, "%31s %lf %15s %lf", b->name, &b->value, b->unit,
+                   &b->tolerance) != 4)
+        {
+            r = STREAM2_ERROR_PARSE;
+            break;
+        }
+        (*len)++;
+    }
+    fclose(file);
+    return r;
+}
+
+static enum stream2_result write_baselines(const char* path,
+                                           const struct baseline* baselines,
+                                           size_t len) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return STREAM2_ERROR_SYSTEM;
+    fprintf(file,
+            "# Baselines of stream2_perf on this machine, written by "
+            "stream2_perf -u.\n# A benchmark fails below VALUE * (1 - "
+            "TOLERANCE).\n#\n# NAME VALUE UNIT TOLERANCE\n");
+    for (size_t i = 0; i < len; i++) {
+        const struct baseline* b = &baselines[i];
+        fprintf(file, "%-14s %.4g %s %.2f\n", b->name, b->value, b->unit,
+                b->tolerance);
+    }
+    if (fclose(file) != 0)
+        return STREAM2_ERROR_SYSTEM;
+    return STREAM2_OK;
+}
+
+static struct baseline* find_baseline(struct baseline* baselines,
+                                      size_t* len,
+                                      const char* name,
+                                      bool add) {
+    for (size_t i = 0; i < *len; i++) {
+        if (strcmp(baselines[i].name, name) == 0)
+            return &baselines[i];
+    }
+    if (!add || *len == MAX_BASELINES)
+        return NULL;
+    struct baseline* b = &baselines[(*len)++];
+    memset(b, 0, sizeof(*b));
+    snprintf(b->name, sizeof(b->name), "%s", name);
+    snprintf(b->unit, sizeof(b->unit), "%s", benchmark_unit(name));
+    b->tolerance = 0.25;
+    return b;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-b BASELINES] [-u] [-t MIN_SECONDS] "
+            "parse|decode|decode_sparse|pipeline...\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r;
+    struct options options = {NULL, false, 1.5};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:ut:")) != -1) {
+        switch (opt) {
+            case 'b':
+                options.baselines = optarg;
+                break;
+            case 'u':
+                options.update = true;
+                break;
+            case 't':
+                options.min_seconds = strtod(optarg, NULL);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc || (options.update && options.baselines == NULL) ||
+        !(options.min_seconds > 0))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct baseline baselines[MAX_BASELINES];
+    size_t baselines_len = 0;
+    if (options.baselines &&
+        (r = read_baselines(options.baselines, options.update, baselines,
+                            &baselines_len)))
+    {
+        fprintf(stderr, "error: cannot read baselines %s (%d)\n",
+                options.baselines, r);
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        const char* name = argv[i];
+        double throughput;
+        if ((r = run_benchmark(name, &options, &throughput))) {
+            fprintf(stderr, "error: benchmark %s failed (%d)\n", name, r);
+            failed = 1;
+            continue;
+        }
+        printf("perf: %-14s %.4g %s", name, throughput, benchmark_unit(name));
+
+        struct baseline* b = find_baseline(baselines, &baselines_len, name,
+                                           options.update);
+        if (options.update && b) {
+            b->value = throughput;
+            printf(" (baseline updated)\n");
+        } else if (b) {
+            const double limit = b->value * (1.0 - b->tolerance);
+            const bool regressed = throughput < limit;
+            printf(" %.1f%% of baseline %.4g %s, limit %.4g%s\n",
+                   100.0 * throughput / b->value, b->value, b->unit, limit,
+                   regressed ? ": REGRESSION" : "");
+            if (regressed)
+                failed = 1;
+        } else if (options.baselines) {
+            // A truncated or stale baselines file must not disable the check.
+            printf(": NO BASELINE in %s\n", options.baselines);
+            failed = 1;
+        } else {
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+
+    if (options.update &&
+        (r = write_baselines(options.baselines, baselines, baselines_len)))
+    {
+        fprintf(stderr, "error: cannot write baselines %s (%d)\n",
+                options.baselines, r);
+        return EXIT_FAILURE;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,587 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_pixstats.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct channel {
+    uint64_t frames;
+    uint32_t* count;
+    uint32_t* hits;
+    double* mean;
+    double* m2;
+    uint32_t* mask;
+    // Sparse frames added, and the number of them every pixel was last
+    // updated at, if the series is decoded into sparse frames. The zeros a
+    // pixel missed since are added when it is next nonzero or on a flush.
+    uint32_t sparse_frames;
+    uint32_t* synced;
+};
+
+struct worker {
+    struct stream2_pixstats* stats;
+    size_t part;
+    pthread_t thread;
+};
+
+struct stream2_pixstats {
+    struct stream2_pixstats_config config;
+    size_t width;
+    size_t height;
+    size_t elem_size;
+    uint32_t saturation;
+
+    struct channel* channels;
+    size_t channels_len;
+
+    // Held while a frame is added, so that frames are added one at a time.
+    pthread_mutex_t add_mutex;
+
+    struct worker* workers;
+    size_t workers_len;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // Incremented for every frame to wake up the workers.
+    uint64_t generation;
+    size_t active;
+    bool stop;
+
+    // Frame being added.
+    struct channel* channel;
+    const void* data;
+    const struct stream2_sparse_frame* sparse;
+};
+
+void stream2_pixstats_config_default(struct stream2_pixstats_config* config) {
+    config->threads = 1;
+    config->hot_sigma = 5.0;
+    config->noisy_sigma = 5.0;
+    config->dead_hits = 20.0;
+}
+
+#if defined(__SSE2__)
+// Updates the mean and m2 of 2 pixels given their biased values, new counts
+// and validity in the low 2 lanes.
+static void update_x2(__m128i biased,
+                      __m128i n,
+                      __m128i valid,
+                      double* mean,
+                      double* m2) {
+    const __m128d mask = _mm_castsi128_pd(_mm_unpacklo_epi32(valid, valid));
+    const __m128d x = _mm_add_pd(_mm_cvtepi32_pd(biased),
+                                 _mm_set1_pd(2147483648.0));
+    const __m128d nd = _mm_max_pd(_mm_cvtepi32_pd(n), _mm_set1_pd(1.0));
+
+    const __m128d old_mean = _mm_loadu_pd(mean);
+    const __m128d delta = _mm_sub_pd(x, old_mean);
+    const __m128d new_mean =
+            _mm_add_pd(old_mean, _mm_and_pd(mask, _mm_div_pd(delta, nd)));
+    const __m128d step = _mm_mul_pd(delta, _mm_sub_pd(x, new_mean));
+    _mm_storeu_pd(mean, new_mean);
+    _mm_storeu_pd(m2, _mm_add_pd(_mm_loadu_pd(m2), _mm_and_pd(mask, step)));
+}
+
+// Updates 4 pixels as the scalar rows, dividing by the counts of the pixels
+// in double precision so that the results do not depend on the path taken.
+static void update_x4(__m128i v,
+                      __m128i biased_saturation,
+                      uint32_t* count,
+                      uint32_t* hits,
+                      double* mean,
+                      double* m2) {
+    const __m128i biased = _mm_xor_si128(v, _mm_set1_epi32((int)0x80000000u));
+    const __m128i valid = _mm_andnot_si128(
+            _mm_cmpgt_epi32(biased, biased_saturation), _mm_set1_epi32(-1));
+    const __m128i nonzero = _mm_andnot_si128(
+            _mm_cmpeq_epi32(v, _mm_setzero_si128()), valid);
+
+    // Masks are all ones, so subtracting them counts.
+    const __m128i n =
+            _mm_sub_epi32(_mm_loadu_si128((const __m128i*)count), valid);
+    _mm_storeu_si128((__m128i*)count, n);
+    _mm_storeu_si128(
+            (__m128i*)hits,
+            _mm_sub_epi32(_mm_loadu_si128((const __m128i*)hits), nonzero));
+
+    update_x2(biased, n, valid, mean, m2);
+    update_x2(_mm_srli_si128(biased, 8), _mm_srli_si128(n, 8),
+              _mm_srli_si128(valid, 8), mean + 2, m2 + 2);
+}
+
+static __m128i load_u8x4(const uint8_t* row) {
+    int32_t word;
+    memcpy(&word, row, sizeof(word));
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero), zero);
+}
+
+static __m128i load_u16x4(const uint16_t* row) {
+    return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)row),
+                              _mm_setzero_si128());
+}
+
+static __m128i load_u32x4(const uint32_t* row) {
+    return _mm_loadu_si128((const __m128i*)row);
+}
+#endif
+
+#if defined(__SSE2__)
+#define UPDATE_ROW_SIMD(LOAD)                                                 \
+    const __m128i biased_saturation =                                         \
+            _mm_set1_epi32((int)(saturation ^ 0x80000000u));                  \
+    for (; width - x >= 4; x += 4) {                                          \
+        update_x4(LOAD(row + x), biased_saturation, count + x, hits + x,      \
+                  mean + x, m2 + x);                                          \
+    }
+#else
+#define UPDATE_ROW_SIMD(LOAD)
+#endif
+
+// Updates the statistics of the pixels of one row with Welford's algorithm.
+#define DEFINE_UPDATE_ROW(NAME, TYPE, LOAD)                                   \
+    static void NAME(const TYPE* row,                                         \
+                     size_t width,                                            \
+                     uint32_t saturation,                                     \
+                     uint32_t* count,                                         \
+                     uint32_t* hits,                                          \
+                     double* mean,                                            \
+                     double* m2) {                                            \
+        size_t x = 0;                                                         \
+        UPDATE_ROW_SIMD(LOAD)                                                 \
+        for (; x < width; x++) {                                              \
+            const uint32_t v = row[x];                                        \
+            if (v > saturation)                                               \
+                continue;                                                     \
+            count[x]++;                                                       \
+            hits[x] += v != 0;                                                \
+            const double delta = (double)v - mean[x];                         \
+            mean[x] += delta / (double)count[x];                              \
+            m2[x] += delta * ((double)v - mean[x]);                           \
+        }                                                                     \
+    }
+
+DEFINE_UPDATE_ROW(update_row_u8, uint8_t, load_u8x4)
+DEFINE_UPDATE_ROW(update_row_u16, uint16_t, load_u16x4)
+DEFINE_UPDATE_ROW(update_row_u32, uint32_t, load_u32x4)
+
+// Adds zeros frames of zero to a pixel at once by combining its statistics
+// with those of the zeros, as in Chan et al.'s parallel variance.
+static void add_zeros(struct channel* channel, size_t i, uint32_t zeros) {
+    if (zeros == 0)
+        return;
+    const double n_a = channel->count[i];
+    const double n = n_a + zeros;
+    const double delta = -channel->mean[i];
+    channel->count[i] += zeros;
+    channel->mean[i] += delta * zeros / n;
+    channel->m2[i] += delta * delta * n_a * zeros / n;
+}
+
+// Updates the pixels of the rows of one thread that are nonzero in a sparse
+// frame, after adding the zeros they missed in earlier frames.
+static void update_part_sparse(const struct stream2_pixstats* stats,
+                               struct channel* channel,
+                               size_t part,
+                               const struct stream2_sparse_frame* frame) {
+    const size_t threads = stats->workers_len + 1;
+    const size_t first = stats->height * part / threads;
+    const size_t last = stats->height * (part + 1) / threads;
+    const uint32_t frames = channel->sparse_frames;
+    for (size_t y = first; y < last; y++) {
+        for (size_t j = frame->rows[y]; j < frame->rows[y + 1]; j++) {
+            const size_t i = y * stats->width + frame->columns[j];
+            const uint32_t v = frame->values[j];
+            add_zeros(channel, i, frames - 1 - channel->synced[i]);
+            channel->synced[i] = frames;
+            if (v > stats->saturation)
+                continue;
+            channel->count[i]++;
+            channel->hits[i]++;
+            const double delta = (double)v - channel->mean[i];
+            channel->mean[i] += delta / (double)channel->count[i];
+            channel->m2[i] += delta * ((double)v - channel->mean[i]);
+        }
+    }
+}
+
+// Adds the zeros all pixels missed since they were last updated, before the
+// statistics are read or a dense frame is added.
+static void flush_sparse(const struct stream2_pixstats* stats,
+                         struct channel* channel) {
+    if (channel->synced == NULL)
+        return;
+    const size_t pixels = stats->width * stats->height;
+    for (size_t i = 0; i < pixels; i++) {
+        add_zeros(channel, i, channel->sparse_frames - channel->synced[i]);
+        channel->synced[i] = channel->sparse_frames;
+    }
+}
+
+// Updates the rows of one thread.
+static void update_part(const struct stream2_pixstats* stats,
+                        struct channel* channel,
+                        size_t part,
+                        const void* data) {
+    const size_t threads = stats->workers_len + 1;
+    const size_t first = stats->height * part / threads;
+    const size_t last = stats->height * (part + 1) / threads;
+    for (size_t y = first; y < last; y++) {
+        const size_t i = y * stats->width;
+        const uint8_t* row = (const uint8_t*)data + i * stats->elem_size;
+        switch (stats->elem_size) {
+            case 1:
+                update_row_u8(row, stats->width, stats->saturation,
+                              channel->count + i, channel->hits + i,
+                              channel->mean + i, channel->m2 + i);
+                break;
+            case 2:
+                update_row_u16((const uint16_t*)row, stats->width,
+                               stats->saturation, channel->count + i,
+                               channel->hits + i, channel->mean + i,
+                               channel->m2 + i);
+                break;
+            default:
+                update_row_u32((const uint32_t*)row, stats->width,
+                               stats->saturation, channel->count + i,
+                               channel->hits + i, channel->mean + i,
+                               channel->m2 + i);
+                break;
+        }
+    }
+}
+
+static void* worker_thread(void* arg) {
+    struct worker* worker = arg;
+    struct stream2_pixstats* stats = worker->stats;
+
+    uint64_t generation = 0;
+    pthread_mutex_lock(&stats->mutex);
+    for (;;) {
+        while (!stats->stop && stats->generation == generation)
+            pthread_cond_wait(&stats->start, &stats->mutex);
+        if (stats->stop)
+            break;
+        generation = stats->generation;
+        pthread_mutex_unlock(&stats->mutex);
+
+        if (stats->sparse)
+            update_part_sparse(stats, stats->channel, worker->part,
+                               stats->sparse);
+        else
+            update_part(stats, stats->channel, worker->part, stats->data);
+
+        pthread_mutex_lock(&stats->mutex);
+        if (--stats->active == 0)
+            pthread_cond_signal(&stats->done);
+    }
+    pthread_mutex_unlock(&stats->mutex);
+    return NULL;
+}
+
+static enum stream2_result pixstats_init(struct stream2_pixstats* stats,
+                                         const struct stream2_series* series,
+                                         const struct stream2_start_msg* msg) {
+    enum stream2_result r;
+
+    const struct stream2_pixstats_config* config = &stats->config;
+    if (config->threads == 0)
+        return STREAM2_ERROR_PARSE;
+
+    stats->width = series->image_size_x;
+    stats->height = series->image_size_y;
+    stats->elem_size = series->elem_size;
+    stats->saturation = series->saturation;
+
+    const size_t pixels = stats->width * stats->height;
+    stats->channels_len = series->channels_len;
+    if ((stats->channels = calloc(stats->channels_len ? stats->channels_len
+                                                      : 1,
+                                  sizeof(struct channel))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < stats->channels_len; i++) {
+        struct channel* channel = &stats->channels[i];
+        if ((channel->count = calloc(pixels, sizeof(uint32_t))) == NULL ||
+            (channel->hits = calloc(pixels, sizeof(uint32_t))) == NULL ||
+            (channel->mean = calloc(pixels, sizeof(double))) == NULL ||
+            (channel->m2 = calloc(pixels, sizeof(double))) == NULL ||
+            (channel->mask = malloc(pixels * sizeof(uint32_t))) == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        if ((r = stream2_series_pixel_mask(series, msg, i, channel->mask)))
+            return r;
+        if (series->config.sparse &&
+            (channel->synced = calloc(pixels, sizeof(uint32_t))) == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    if ((stats->workers = calloc(config->threads, sizeof(struct worker))) ==
+        NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (; stats->workers_len < config->threads - 1; stats->workers_len++) {
+        struct worker* worker = &stats->workers[stats->workers_len];
+        worker->stats = stats;
+        worker->part = stats->workers_len + 1;
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker))
+            return STREAM2_ERROR_SYSTEM;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_pixstats_create(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        const struct stream2_pixstats_config* config,
+        struct stream2_pixstats** stats_out) {
+    enum stream2_result r;
+
+    *stats_out = NULL;
+
+    struct stream2_pixstats* stats = calloc(1, sizeof(struct stream2_pixstats));
+    if (stats == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (config)
+        stats->config = *config;
+    else
+        stream2_pixstats_config_default(&stats->config);
+    pthread_mutex_init(&stats->add_mutex, NULL);
+    pthread_mutex_init(&stats->mutex, NULL);
+    pthread_cond_init(&stats->start, NULL);
+    pthread_cond_init(&stats->done, NULL);
+
+    if ((r = pixstats_init(stats, series, msg))) {
+        stream2_pixstats_free(stats);
+        return r;
+    }
+
+    *stats_out = stats;
+    return STREAM2_OK;
+}
+
+void stream2_pixstats_free(struct stream2_pixstats* stats) {
+    if (stats == NULL)
+        return;
+
+    pthread_mutex_lock(&stats->mutex);
+    stats->stop = true;
+    pthread_cond_broadcast(&stats->start);
+    pthread_mutex_unlock(&stats->mutex);
+    for (size_t i = 0; i < stats->workers_len; i++)
+        pthread_join(stats->workers[i].thread, NULL);
+    free(stats->workers);
+
+    if (stats->channels) {
+        for (size_t i = 0; i < stats->channels_len; i++) {
+            struct channel* channel = &stats->channels[i];
+            free(channel->count);
+            free(channel->hits);
+            free(channel->mean);
+            free(channel->m2);
+            free(channel->mask);
+            free(channel->synced);
+        }
+    }
+    free(stats->channels);
+    pthread_cond_destroy(&stats->done);
+    pthread_cond_destroy(&stats->start);
+    pthread_mutex_destroy(&stats->mutex);
+    pthread_mutex_destroy(&stats->add_mutex);
+    free(stats);
+}
+
+// Adds a dense or sparse frame to a channel with the pool of threads.
+static void add_frame(struct stream2_pixstats* stats,
+                      struct channel* c,
+                      const void* data,
+                      const struct stream2_sparse_frame* sparse) {
+    pthread_mutex_lock(&stats->add_mutex);
+    c->frames++;
+    if (sparse)
+        c->sparse_frames++;
+    else
+        flush_sparse(stats, c);
+
+    if (stats->workers_len > 0) {
+        pthread_mutex_lock(&stats->mutex);
+        stats->channel = c;
+        stats->data = data;
+        stats->sparse = sparse;
+        stats->active = stats->workers_len;
+        stats->generation++;
+        pthread_cond_broadcast(&stats->start);
+        pthread_mutex_unlock(&stats->mutex);
+    }
+
+    if (sparse)
+        update_part_sparse(stats, c, 0, sparse);
+    else
+        update_part(stats, c, 0, data);
+
+    if (stats->workers_len > 0) {
+        pthread_mutex_lock(&stats->mutex);
+        while (stats->active > 0)
+            pthread_cond_wait(&stats->done, &stats->mutex);
+        pthread_mutex_unlock(&stats->mutex);
+    }
+    pthread_mutex_unlock(&stats->add_mutex);
+}
+
+enum stream2_result stream2_pixstats_add(struct stream2_pixstats* stats,
+                                         size_t channel,
+                                         const void* data) {
+    if (channel >= stats->channels_len)
+        return STREAM2_ERROR_PARSE;
+    add_frame(stats, &stats->channels[channel], data, NULL);
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_pixstats_add_sparse(
+        struct stream2_pixstats* stats,
+        size_t channel,
+        const struct stream2_sparse_frame* frame) {
+    if (channel >= stats->channels_len)
+        return STREAM2_ERROR_PARSE;
+    struct channel* c = &stats->channels[channel];
+    if (c->synced == NULL || frame->width != stats->width ||
+        frame->height != stats->height)
+        return STREAM2_ERROR_PARSE;
+    add_frame(stats, c, NULL, frame);
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_pixstats_pixels(
+        struct stream2_pixstats* stats,
+        size_t channel,
+        struct stream2_pixstats_pixels* pixels) {
+    if (channel >= stats->channels_len)
+        return STREAM2_ERROR_PARSE;
+    struct channel* c = &stats->channels[channel];
+    flush_sparse(stats, c);
+    pixels->count = c->count;
+    pixels->hits = c->hits;
+    pixels->mean = c->mean;
+    pixels->m2 = c->m2;
+    return STREAM2_OK;
+}
+
+struct moments {
+    double n;
+    double sum;
+    double sum2;
+};
+
+static void moments_add(struct moments* m, double v) {
+    m->n += 1.0;
+    m->sum += v;
+    m->sum2 += v * v;
+}
+
+static void moments_get(const struct moments* m,
+                        double* mean,
+                        double* stddev) {
+    *mean = m->n > 0.0 ? m->sum / m->n : 0.0;
+    const double variance = m->n > 0.0 ? m->sum2 / m->n - *mean * *mean : 0.0;
+    *stddev = variance > 0.0 ? sqrt(variance) : 0.0;
+}
+
+// Gets the mean and standard deviation of the means and variances of the
+// unmasked pixels, leaving out pixels more than the flagging thresholds above
+// them so that the outliers to be flagged do not hide each other.
+static void population(const struct stream2_pixstats* stats,
+                       const struct channel* c,
+                       struct stream2_pixstats_summary* summary) {
+    const size_t pixels = stats->width * stats->height;
+    const double hot_sigma = stats->config.hot_sigma;
+    const double noisy_sigma = stats->config.noisy_sigma;
+
+    for (int pass = 0; pass < 2; pass++) {
+        const double mean_max =
+                summary->mean + hot_sigma * summary->mean_stddev;
+        const double variance_max =
+                summary->variance + noisy_sigma * summary->variance_stddev;
+        struct moments means = {0}, variances = {0};
+        for (size_t i = 0; i < pixels; i++) {
+            if (c->mask[i] != 0 || c->count[i] == 0)
+                continue;
+            if (pass == 0 || c->mean[i] <= mean_max)
+                moments_add(&means, c->mean[i]);
+            if (c->count[i] < 2)
+                continue;
+            const double variance = c->m2[i] / (c->count[i] - 1);
+            if (pass == 0 || variance <= variance_max)
+                moments_add(&variances, variance);
+        }
+        moments_get(&means, &summary->mean, &summary->mean_stddev);
+        moments_get(&variances, &summary->variance,
+                    &summary->variance_stddev);
+    }
+}
+
+enum stream2_result stream2_pixstats_summarize(
+        struct stream2_pixstats* stats,
+        size_t channel,
+        struct stream2_pixstats_summary* summary,
+        uint32_t* candidates) {
+    if (channel >= stats->channels_len)
+        return STREAM2_ERROR_PARSE;
+    struct channel* c = &stats->channels[channel];
+    flush_sparse(stats, c);
+    const size_t pixels = stats->width * stats->height;
+
+    memset(summary, 0, sizeof(*summary));
+    summary->frames = c->frames;
+    population(stats, c, summary);
+
+    // Fraction of valid frames in which the unmasked pixels counted.
+    double hits = 0.0, valid = 0.0;
+    for (size_t i = 0; i < pixels; i++) {
+        if (c->mask[i] == 0) {
+            hits += c->hits[i];
+            valid += c->count[i];
+        }
+    }
+    const double hit_rate = valid > 0.0 ? hits / valid : 0.0;
+
+    const double mean_max =
+            summary->mean + stats->config.hot_sigma * summary->mean_stddev;
+    const double variance_max =
+            summary->variance +
+            stats->config.noisy_sigma * summary->variance_stddev;
+    const uint32_t flagged_mask = STREAM2_PIXSTATS_DEAD | STREAM2_PIXSTATS_HOT |
+                                  STREAM2_PIXSTATS_NOISY;
+    for (size_t i = 0; i < pixels; i++) {
+        uint32_t flags = 0;
+        if (c->mask[i] & 1u) {
+            if (candidates)
+                candidates[i] = 0;
+            continue;
+        }
+        summary->pixels++;
+        if (c->count[i] == 0 ||
+            (c->hits[i] == 0 &&
+             c->count[i] * hit_rate >= stats->config.dead_hits))
+            flags |= STREAM2_PIXSTATS_DEAD;
+        if (c->count[i] > 0 && c->mean[i] > mean_max)
+            flags |= STREAM2_PIXSTATS_HOT;
+        if (c->count[i] > 1 && c->m2[i] / (c->count[i] - 1) > variance_max)
+            flags |= STREAM2_PIXSTATS_NOISY;
+
+        summary->dead += (flags & STREAM2_PIXSTATS_DEAD) != 0;
+        summary->hot += (flags & STREAM2_PIXSTATS_HOT) != 0;
+        summary->noisy += (flags & STREAM2_PIXSTATS_NOISY) != 0;
+        if (flags != 0 && c->mask[i] == 0)
+            summary->flagged_unmasked++;
+        if (flags == 0 && (c->mask[i] & flagged_mask) != 0)
+            summary->masked_unflagged++;
+        if (candidates)
+            candidates[i] = flags;
+    }
+    return STREAM2_OK;
+}
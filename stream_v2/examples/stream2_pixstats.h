@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Accumulates the mean and variance of every pixel over the decoded frames of
+// a series with Welford's algorithm, e.g. to find hot and dead pixels and to
+// check the pixel mask of the detector.
+//
+// Pixels above saturation_value are not counted in the frames they are above
+// it. The memory of every channel is allocated when the stage is created.
+// If the series is decoded into sparse frames, only the nonzero pixels of a
+// frame are updated and the zeros of the others are added when they are next
+// nonzero or when the statistics are read.
+// Each frame is updated by a pool of threads that each take a band of rows.
+struct stream2_pixstats;
+
+// Flags of the candidate mask, the bits of the pixel mask of the detector
+// for the same condition.
+enum {
+    // Never valid, or without counts while other pixels counted.
+    STREAM2_PIXSTATS_DEAD = 1u << 1,
+    // Mean above the means of the other pixels.
+    STREAM2_PIXSTATS_HOT = 1u << 3,
+    // Variance above the variances of the other pixels.
+    STREAM2_PIXSTATS_NOISY = 1u << 4,
+};
+
+struct stream2_pixstats_config {
+    // Number of threads updating a frame, including the calling thread.
+    size_t threads;
+    // A pixel is hot or noisy if its mean or variance is more than this many
+    // standard deviations above the mean over the unmasked pixels.
+    double hot_sigma;
+    double noisy_sigma;
+    // A pixel without counts is dead if it was expected to count in at least
+    // this many frames given the fraction of frames with counts over the
+    // unmasked pixels.
+    double dead_hits;
+};
+
+// Statistics of the pixels of a channel, image_size_x * image_size_y values
+// each. The variance of a pixel is m2 / (count - 1).
+struct stream2_pixstats_pixels {
+    // Frames in which the pixel was valid.
+    const uint32_t* count;
+    // Frames in which the pixel was valid and nonzero.
+    const uint32_t* hits;
+    const double* mean;
+    const double* m2;
+};
+
+struct stream2_pixstats_summary {
+    uint64_t frames;
+    // Pixels not masked as gaps, the population the flags are relative to.
+    uint64_t pixels;
+    // Mean and standard deviation of the means and variances of the
+    // unmasked pixels, excluding outliers.
+    double mean;
+    double mean_stddev;
+    double variance;
+    double variance_stddev;
+    uint64_t dead;
+    uint64_t hot;
+    uint64_t noisy;
+    // Pixels flagged but not masked, and pixels masked as dead, hot or noisy
+    // but not flagged.
+    uint64_t flagged_unmasked;
+    uint64_t masked_unflagged;
+};
+
+void stream2_pixstats_config_default(struct stream2_pixstats_config* config);
+
+// Creates the statistics of a series. The pixel mask of every channel is
+// decoded from the start message if pixel_mask_enabled. If config is NULL,
+// the default configuration is used, which flags pixels 5 standard
+// deviations above the others with a single thread.
+enum stream2_result stream2_pixstats_create(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        const struct stream2_pixstats_config* config,
+        struct stream2_pixstats** stats_out);
+void stream2_pixstats_free(struct stream2_pixstats* stats);
+
+// Adds a decoded frame of a channel. Frames are added one at a time; may be
+// called from several threads, which then wait for each other, so use a
+// single thread per frame there.
+enum stream2_result stream2_pixstats_add(struct stream2_pixstats* stats,
+                                         size_t channel,
+                                         const void* data);
+
+// Adds a sparse frame of a channel of a series decoded into sparse frames.
+enum stream2_result stream2_pixstats_add_sparse(
+        struct stream2_pixstats* stats,
+        size_t channel,
+        const struct stream2_sparse_frame* frame);
+
+// Gets the statistics of the pixels of a channel. Must not be called while
+// frames are added.
+enum stream2_result stream2_pixstats_pixels(
+        struct stream2_pixstats* stats,
+        size_t channel,
+        struct stream2_pixstats_pixels* pixels);
+
+// Summarizes the statistics of a channel and fills candidates, if not NULL,
+// with image_size_x * image_size_y flags, e.g. after the end message. Gap
+// pixels, masked with bit 0, are never flagged. Must not be called while
+// frames are added.
+enum stream2_result stream2_pixstats_summarize(
+        struct stream2_pixstats* stats,
+        size_t channel,
+        struct stream2_pixstats_summary* summary,
+        uint32_t* candidates);
+
+#if defined(__cplusplus)
+}
+#endif
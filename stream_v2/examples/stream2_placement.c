@@ -0,0 +1,204 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "stream2_placement.h"
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+enum { MAX_NODES = 64 };
+
+void stream2_placement_default(struct stream2_placement* placement) {
+    placement->nic_node = -1;
+    placement->nic_interface = NULL;
+    placement->decoder_cpus = NULL;
+    placement->decoder_cpus_len = 0;
+    placement->first_touch = false;
+}
+
+void stream2_cpu_set_clear(struct stream2_cpu_set* set) {
+    memset(set, 0, sizeof(*set));
+}
+
+void stream2_cpu_set_add(struct stream2_cpu_set* set, int cpu) {
+    if (cpu >= 0 && cpu < STREAM2_MAX_CPUS)
+        set->bits[cpu / 64] |= UINT64_C(1) << (cpu % 64);
+}
+
+bool stream2_cpu_set_has(const struct stream2_cpu_set* set, int cpu) {
+    if (cpu < 0 || cpu >= STREAM2_MAX_CPUS)
+        return false;
+    return (set->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+size_t stream2_cpu_set_count(const struct stream2_cpu_set* set) {
+    size_t count = 0;
+    for (int cpu = 0; cpu < STREAM2_MAX_CPUS; cpu++)
+        count += stream2_cpu_set_has(set, cpu);
+    return count;
+}
+
+enum stream2_result stream2_cpu_set_parse(const char* list,
+                                          struct stream2_cpu_set* set) {
+    stream2_cpu_set_clear(set);
+
+    const char* p = list;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        const long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= STREAM2_MAX_CPUS)
+            return STREAM2_ERROR_PARSE;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= STREAM2_MAX_CPUS)
+                return STREAM2_ERROR_PARSE;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            stream2_cpu_set_add(set, (int)cpu);
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return STREAM2_ERROR_PARSE;
+    }
+    return STREAM2_OK;
+}
+
+void stream2_cpu_set_format(const struct stream2_cpu_set* set,
+                            char* buf,
+                            size_t size) {
+    size_t pos = 0;
+    if (size == 0)
+        return;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < STREAM2_MAX_CPUS; cpu++) {
+        if (!stream2_cpu_set_has(set, cpu))
+            continue;
+        int last = cpu;
+        while (stream2_cpu_set_has(set, last + 1))
+            last++;
+        int n;
+        if (last == cpu)
+            n = snprintf(buf + pos, size - pos, "%s%d", pos ? "," : "", cpu);
+        else
+            n = snprintf(buf + pos, size - pos, "%s%d-%d", pos ? "," : "", cpu,
+                         last);
+        if (n < 0 || (size_t)n >= size - pos)
+            return;
+        pos += (size_t)n;
+        cpu = last;
+    }
+}
+
+static enum stream2_result read_line(const char* path, char* buf, size_t size) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    const bool ok = fgets(buf, (int)size, file) != NULL;
+    fclose(file);
+    return ok ? STREAM2_OK : STREAM2_ERROR_PARSE;
+}
+
+enum stream2_result stream2_nic_node(const char* interface, int* node) {
+    enum stream2_result r;
+
+    char path[256];
+    char line[32];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+             interface);
+    if ((r = read_line(path, line, sizeof(line))))
+        return r;
+
+    // The kernel reports -1 for interfaces without NUMA affinity.
+    *node = atoi(line);
+    if (*node < 0)
+        *node = 0;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_node_cpus(int node, struct stream2_cpu_set* cpus) {
+    enum stream2_result r;
+
+    char path[256];
+    char line[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    if ((r = read_line(path, line, sizeof(line))))
+        return r;
+
+    return stream2_cpu_set_parse(line, cpus);
+}
+
+int stream2_cpu_node(int cpu) {
+    for (int node = 0; node < MAX_NODES; node++) {
+        struct stream2_cpu_set cpus;
+        if (stream2_node_cpus(node, &cpus) == STREAM2_OK &&
+            stream2_cpu_set_has(&cpus, cpu))
+            return node;
+    }
+    return -1;
+}
+
+enum stream2_result stream2_pin_thread(const struct stream2_cpu_set* cpus) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < STREAM2_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (stream2_cpu_set_has(cpus, cpu))
+            CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return STREAM2_ERROR_SYSTEM;
+    return STREAM2_OK;
+#else
+    (void)cpus;
+    return STREAM2_ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+void stream2_thread_placement_get(const char* role,
+                                  size_t index,
+                                  bool pinned,
+                                  struct stream2_thread_placement* placement) {
+    placement->role = role;
+    placement->index = index;
+    placement->pinned = pinned;
+    placement->requested = false;
+    placement->cpu = -1;
+    placement->node = -1;
+    stream2_cpu_set_clear(&placement->affinity);
+#if defined(__linux__)
+    placement->cpu = sched_getcpu();
+    placement->node = stream2_cpu_node(placement->cpu);
+    cpu_set_t set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < STREAM2_MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+                stream2_cpu_set_add(&placement->affinity, cpu);
+        }
+    }
+#endif
+}
+
+void stream2_thread_placement_print(
+        FILE* file,
+        const struct stream2_thread_placement* placement) {
+    char affinity[256];
+    stream2_cpu_set_format(&placement->affinity, affinity, sizeof(affinity));
+    const char* state = "";
+    if (placement->requested)
+        state = " requested";
+    else if (placement->pinned)
+        state = " pinned";
+    fprintf(file, "placement: %s %zu: cpu %d node %d affinity [%s]%s\n",
+            placement->role, placement->index, placement->cpu, placement->node,
+            affinity, state);
+}
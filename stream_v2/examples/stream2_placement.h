@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+enum { STREAM2_MAX_CPUS = 1024 };
+
+// A set of CPUs, independent of the platform's cpu_set_t.
+struct stream2_cpu_set {
+    uint64_t bits[STREAM2_MAX_CPUS / 64];
+};
+
+// Thread and memory placement policy of a receiver.
+//
+// On dual-socket nodes, the receive path should run on the NUMA node local to
+// the network interface while decoders run on cores of their own.
+struct stream2_placement {
+    // NUMA node local to the network interface, or -1 to resolve it from
+    // nic_interface. The ZeroMQ I/O thread and the receive thread are pinned to
+    // the CPUs of this node.
+    int nic_node;
+    // Name of the network interface, e.g. "eth0", or NULL.
+    const char* nic_interface;
+    // CPUs of the decoder threads, or NULL for no pinning. Decoder i is pinned
+    // to decoder_cpus[i % decoder_cpus_len].
+    const int* decoder_cpus;
+    size_t decoder_cpus_len;
+    // If true, decode buffers are first touched by the decoder threads using
+    // them so that their pages are allocated on the decoders' nodes.
+    bool first_touch;
+};
+
+// Actual placement of a thread, as observed by the thread itself.
+struct stream2_thread_placement {
+    // Role of the thread, e.g. "receive" or "decode".
+    const char* role;
+    size_t index;
+    // True if the thread was pinned successfully.
+    bool pinned;
+    // True if the affinity was only requested, e.g. of a thread of a library
+    // that cannot be observed, so that cpu and node are not known.
+    bool requested;
+    // CPU and NUMA node the thread last ran on, or -1 if unknown.
+    int cpu;
+    int node;
+    struct stream2_cpu_set affinity;
+};
+
+// Gets the default placement: no pinning and no first touch.
+void stream2_placement_default(struct stream2_placement* placement);
+
+void stream2_cpu_set_clear(struct stream2_cpu_set* set);
+void stream2_cpu_set_add(struct stream2_cpu_set* set, int cpu);
+bool stream2_cpu_set_has(const struct stream2_cpu_set* set, int cpu);
+size_t stream2_cpu_set_count(const struct stream2_cpu_set* set);
+
+// Parses a CPU list such as "0-3,8,10-11".
+enum stream2_result stream2_cpu_set_parse(const char* list,
+                                          struct stream2_cpu_set* set);
+
+// Formats a CPU set as a CPU list.
+void stream2_cpu_set_format(const struct stream2_cpu_set* set,
+                            char* buf,
+                            size_t size);
+
+// Gets the NUMA node local to a network interface.
+enum stream2_result stream2_nic_node(const char* interface, int* node);
+
+// Gets the CPUs of a NUMA node.
+enum stream2_result stream2_node_cpus(int node, struct stream2_cpu_set* cpus);
+
+// Gets the NUMA node of a CPU, or -1 if unknown.
+int stream2_cpu_node(int cpu);
+
+// Pins the calling thread to a set of CPUs.
+enum stream2_result stream2_pin_thread(const struct stream2_cpu_set* cpus);
+
+// Observes the placement of the calling thread.
+void stream2_thread_placement_get(const char* role,
+                                  size_t index,
+                                  bool pinned,
+                                  struct stream2_thread_placement* placement);
+
+void stream2_thread_placement_print(
+        FILE* file,
+        const struct stream2_thread_placement* placement);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_preview.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct level {
+    size_t width;
+    size_t height;
+    // Offset of the level in the pyramid of a channel.
+    size_t offset;
+};
+
+struct stream2_preview {
+    struct stream2_preview_config config;
+    size_t width;
+    size_t height;
+    size_t elem_size;
+    // saturation_value clamped below NODATA, the maximum value of the
+    // element type, so that NODATA pixels are never pooled.
+    uint32_t saturation;
+    uint32_t nodata;
+
+    // Levels from 1, with the frame as level 0.
+    struct level* levels;
+    size_t levels_len;
+    // Pyramid of every channel, all levels back to back.
+    uint8_t** pyramids;
+    size_t pyramid_size;
+    size_t channels;
+
+    uint64_t period_ns;
+    // Time the next preview is due and whether the pyramid is taken, updated
+    // atomically.
+    uint64_t next_ns;
+    uint32_t busy;
+};
+
+void stream2_preview_config_default(struct stream2_preview_config* config) {
+    config->pooling = STREAM2_PREVIEW_MAX;
+    config->rate = 10.0;
+    config->min_size = 512;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static enum stream2_result preview_init(struct stream2_preview* preview,
+                                        const struct stream2_series* series) {
+    const struct stream2_preview_config* config = &preview->config;
+    if (config->min_size == 0 || !(config->rate >= 0.0))
+        return STREAM2_ERROR_PARSE;
+
+    preview->width = series->image_size_x;
+    preview->height = series->image_size_y;
+    preview->elem_size = series->elem_size;
+    preview->saturation = series->saturation < series->nodata
+                                  ? series->saturation
+                                  : series->nodata - 1;
+    preview->nodata = series->nodata;
+    preview->period_ns =
+            config->rate > 0.0 ? (uint64_t)(1e9 / config->rate) : 0;
+
+    // There is at least one level even if the frame is small.
+    size_t width = preview->width;
+    size_t height = preview->height;
+    do {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        preview->levels_len++;
+    } while (width > config->min_size || height > config->min_size);
+
+    if ((preview->levels = calloc(preview->levels_len + 1,
+                                  sizeof(struct level))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    preview->levels[0].width = preview->width;
+    preview->levels[0].height = preview->height;
+    for (size_t i = 1; i <= preview->levels_len; i++) {
+        struct level* level = &preview->levels[i];
+        level->width = (preview->levels[i - 1].width + 1) / 2;
+        level->height = (preview->levels[i - 1].height + 1) / 2;
+        level->offset = preview->pyramid_size;
+        preview->pyramid_size +=
+                level->width * level->height * preview->elem_size;
+    }
+
+    preview->channels = series->channels_len;
+    if ((preview->pyramids = calloc(preview->channels ? preview->channels : 1,
+                                    sizeof(uint8_t*))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < preview->channels; i++) {
+        if ((preview->pyramids[i] = malloc(preview->pyramid_size)) == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_preview_create(
+        const struct stream2_series* series,
+        const struct stream2_preview_config* config,
+        struct stream2_preview** preview_out) {
+    enum stream2_result r;
+
+    *preview_out = NULL;
+
+    struct stream2_preview* preview =
+            calloc(1, sizeof(struct stream2_preview));
+    if (preview == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (config)
+        preview->config = *config;
+    else
+        stream2_preview_config_default(&preview->config);
+
+    if ((r = preview_init(preview, series))) {
+        stream2_preview_free(preview);
+        return r;
+    }
+
+    *preview_out = preview;
+    return STREAM2_OK;
+}
+
+void stream2_preview_free(struct stream2_preview* preview) {
+    if (preview == NULL)
+        return;
+    if (preview->pyramids) {
+        for (size_t i = 0; i < preview->channels; i++)
+            free(preview->pyramids[i]);
+    }
+    free(preview->pyramids);
+    free(preview->levels);
+    free(preview);
+}
+
+size_t stream2_preview_levels(const struct stream2_preview* preview) {
+    return preview->levels_len;
+}
+
+bool stream2_preview_begin(struct stream2_preview* preview) {
+    const uint64_t now = now_ns();
+    if (now < __atomic_load_n(&preview->next_ns, __ATOMIC_RELAXED))
+        return false;
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&preview->busy, &expected, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+    // Another thread may have built a preview since the time was checked.
+    if (now < __atomic_load_n(&preview->next_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&preview->busy, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+    __atomic_store_n(&preview->next_ns, now + preview->period_ns,
+                     __ATOMIC_RELAXED);
+    return true;
+}
+
+void stream2_preview_end(struct stream2_preview* preview) {
+    __atomic_store_n(&preview->busy, 0, __ATOMIC_RELEASE);
+}
+
+// Pools the pixels of rows a and b, or of row a only if b is NULL, into a row
+// of the next level, starting at pooled pixel from.
+#define DEFINE_POOL_ROW(NAME, TYPE)                                         \
+    static void NAME(const struct stream2_preview* preview, const TYPE* a,  \
+                     const TYPE* b, size_t width, size_t from, TYPE* out,   \
+                     size_t out_width) {                                    \
+        const uint32_t saturation = preview->saturation;                    \
+        const bool mean = preview->config.pooling == STREAM2_PREVIEW_MEAN;  \
+        for (size_t ox = from; ox < out_width; ox++) {                      \
+            uint32_t v[4];                                                  \
+            size_t len = 0;                                                 \
+            const size_t x = 2 * ox;                                        \
+            v[len++] = a[x];                                                \
+            if (x + 1 < width)                                              \
+                v[len++] = a[x + 1];                                        \
+            if (b) {                                                        \
+                v[len++] = b[x];                                            \
+                if (x + 1 < width)                                          \
+                    v[len++] = b[x + 1];                                    \
+            }                                                               \
+            uint64_t sum = 0;                                               \
+            uint32_t max = 0, count = 0;                                    \
+            for (size_t i = 0; i < len; i++) {                              \
+                if (v[i] > saturation)                                      \
+                    continue;                                               \
+                sum += v[i];                                                \
+                max = v[i] > max ? v[i] : max;                              \
+                count++;                                                    \
+            }                                                               \
+            if (count == 0)                                                 \
+                out[ox] = (TYPE)preview->nodata;                            \
+            else if (mean)                                                  \
+                out[ox] = (TYPE)((sum + count / 2) / count);                \
+            else                                                            \
+                out[ox] = (TYPE)max;                                        \
+        }                                                                   \
+    }
+
+DEFINE_POOL_ROW(pool_row_u8, uint8_t)
+DEFINE_POOL_ROW(pool_row_u16, uint16_t)
+DEFINE_POOL_ROW(pool_row_u32, uint32_t)
+
+#if defined(__SSE2__)
+// Pools 4 pixels from each of v[0] to v[3], which hold values of at most
+// 16 bits in 32-bit lanes, so that signed comparisons are exact.
+static __m128i pool_x4(const struct stream2_preview* preview,
+                       const __m128i* v) {
+    const __m128i saturation = _mm_set1_epi32((int)preview->saturation);
+    __m128i count = _mm_set1_epi32(4);
+    __m128i sum = _mm_setzero_si128();
+    __m128i max = _mm_setzero_si128();
+    for (int i = 0; i < 4; i++) {
+        const __m128i over = _mm_cmpgt_epi32(v[i], saturation);
+        const __m128i valid = _mm_andnot_si128(over, v[i]);
+        count = _mm_add_epi32(count, over);
+        sum = _mm_add_epi32(sum, valid);
+        const __m128i greater = _mm_cmpgt_epi32(valid, max);
+        max = _mm_or_si128(_mm_and_si128(greater, valid),
+                           _mm_andnot_si128(greater, max));
+    }
+
+    __m128i r = max;
+    if (preview->config.pooling == STREAM2_PREVIEW_MEAN) {
+        // Exact for sums of at most 4 values of 16 bits.
+        const __m128 mean =
+                _mm_div_ps(_mm_cvtepi32_ps(sum), _mm_cvtepi32_ps(count));
+        r = _mm_cvttps_epi32(_mm_add_ps(mean, _mm_set1_ps(0.5f)));
+    }
+    const __m128i none = _mm_cmpeq_epi32(count, _mm_setzero_si128());
+    return _mm_or_si128(
+            _mm_andnot_si128(none, r),
+            _mm_and_si128(none, _mm_set1_epi32((int)preview->nodata)));
+}
+
+// Splits 8 pixels of 16 bits into the even and the odd pixels in 32-bit
+// lanes.
+static void split_x8(__m128i p, __m128i* even, __m128i* odd) {
+    const __m128 lo = _mm_castsi128_ps(
+            _mm_unpacklo_epi16(p, _mm_setzero_si128()));
+    const __m128 hi = _mm_castsi128_ps(
+            _mm_unpackhi_epi16(p, _mm_setzero_si128()));
+    *even = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+    *odd = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+// Pools 4 pixels at a time from two full rows and returns the number of
+// pooled pixels.
+static size_t pool_rows_u8_sse2(const struct stream2_preview* preview,
+                                const uint8_t* a,
+                                const uint8_t* b,
+                                size_t width,
+                                uint8_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t ox = 0;
+    for (; width - 2 * ox >= 8; ox += 4) {
+        __m128i v[4];
+        split_x8(_mm_unpacklo_epi8(
+                         _mm_loadl_epi64((const __m128i*)(a + 2 * ox)), zero),
+                 &v[0], &v[1]);
+        split_x8(_mm_unpacklo_epi8(
+                         _mm_loadl_epi64((const __m128i*)(b + 2 * ox)), zero),
+                 &v[2], &v[3]);
+        const __m128i r = _mm_packs_epi32(pool_x4(preview, v), zero);
+        const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(r, zero));
+        memcpy(out + ox, &packed, 4);
+    }
+    return ox;
+}
+
+static size_t pool_rows_u16_sse2(const struct stream2_preview* preview,
+                                 const uint16_t* a,
+                                 const uint16_t* b,
+                                 size_t width,
+                                 uint16_t* out) {
+    // Values are packed into 16 bits as signed values minus 0x8000.
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    size_t ox = 0;
+    for (; width - 2 * ox >= 8; ox += 4) {
+        __m128i v[4];
+        split_x8(_mm_loadu_si128((const __m128i*)(a + 2 * ox)), &v[0], &v[1]);
+        split_x8(_mm_loadu_si128((const __m128i*)(b + 2 * ox)), &v[2], &v[3]);
+        const __m128i r = _mm_sub_epi32(pool_x4(preview, v), bias32);
+        _mm_storel_epi64(
+                (__m128i*)(out + ox),
+                _mm_xor_si128(_mm_packs_epi32(r, r), bias16));
+    }
+    return ox;
+}
+#endif
+
+static void build_level(const struct stream2_preview* preview,
+                        const uint8_t* src,
+                        const struct level* from,
+                        uint8_t* dst,
+                        const struct level* to) {
+    const size_t elem_size = preview->elem_size;
+    for (size_t oy = 0; oy < to->height; oy++) {
+        const uint8_t* a = src + 2 * oy * from->width * elem_size;
+        const uint8_t* b =
+                2 * oy + 1 < from->height ? a + from->width * elem_size : NULL;
+        uint8_t* out = dst + oy * to->width * elem_size;
+        size_t done = 0;
+        switch (elem_size) {
+            case 1:
+#if defined(__SSE2__)
+                if (b)
+                    done = pool_rows_u8_sse2(preview, a, b, from->width, out);
+#endif
+                pool_row_u8(preview, a, b, from->width, done, out, to->width);
+                break;
+            case 2:
+#if defined(__SSE2__)
+                if (b) {
+                    done = pool_rows_u16_sse2(
+                            preview, (const uint16_t*)a, (const uint16_t*)b,
+                            from->width, (uint16_t*)out);
+                }
+#endif
+                pool_row_u16(preview, (const uint16_t*)a, (const uint16_t*)b,
+                             from->width, done, (uint16_t*)out, to->width);
+                break;
+            default:
+                pool_row_u32(preview, (const uint32_t*)a, (const uint32_t*)b,
+                             from->width, 0, (uint32_t*)out, to->width);
+                break;
+        }
+    }
+}
+
+enum stream2_result stream2_preview_build(struct stream2_preview* preview,
+                                          size_t channel,
+                                          const void* data) {
+    if (channel >= preview->channels)
+        return STREAM2_ERROR_PARSE;
+
+    uint8_t* pyramid = preview->pyramids[channel];
+    const uint8_t* src = data;
+    for (size_t i = 1; i <= preview->levels_len; i++) {
+        const struct level* level = &preview->levels[i];
+        build_level(preview, src, &preview->levels[i - 1],
+                    pyramid + level->offset, level);
+        src = pyramid + level->offset;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_preview_level(
+        const struct stream2_preview* preview,
+        size_t channel,
+        size_t level,
+        struct stream2_preview_level* out) {
+    if (channel >= preview->channels || level == 0 ||
+        level > preview->levels_len)
+        return STREAM2_ERROR_PARSE;
+
+    const struct level* l = &preview->levels[level];
+    out->level = level;
+    out->width = l->width;
+    out->height = l->height;
+    out->data = preview->pyramids[channel] + l->offset;
+    out->size = l->width * l->height * preview->elem_size;
+    return STREAM2_OK;
+}
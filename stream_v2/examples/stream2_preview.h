@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Builds downsampled previews of frames sampled at a fixed rate, so that live
+// viewers can show a high-rate series without reading full frames.
+//
+// Each level of the pyramid of a channel pools blocks of 2x2 pixels of the
+// level before it, starting at the decoded frame, down to the first level
+// whose width and height are at most min_size. Levels have the element type of
+// the frames. Pixels above saturation_value and NODATA pixels, of the maximum
+// value of the type, are not pooled, and a pooled pixel without valid pixels
+// is NODATA.
+struct stream2_preview;
+
+enum stream2_preview_pooling {
+    // The maximum of the valid pixels, so that isolated spots stay visible.
+    STREAM2_PREVIEW_MAX,
+    // The mean of the valid pixels, rounded to the nearest integer.
+    STREAM2_PREVIEW_MEAN,
+};
+
+struct stream2_preview_config {
+    enum stream2_preview_pooling pooling;
+    // Previews per second, or 0 to preview every frame.
+    double rate;
+    size_t min_size;
+};
+
+struct stream2_preview_level {
+    // 1 for the level pooled once from the frame.
+    size_t level;
+    uint64_t width;
+    uint64_t height;
+    const void* data;
+    size_t size;
+};
+
+void stream2_preview_config_default(struct stream2_preview_config* config);
+
+// Creates the preview stage of a series. If config is NULL, the default
+// configuration is used, which previews frames 10 times per second with max
+// pooling down to 512x512 pixels.
+enum stream2_result stream2_preview_create(
+        const struct stream2_series* series,
+        const struct stream2_preview_config* config,
+        struct stream2_preview** preview_out);
+void stream2_preview_free(struct stream2_preview* preview);
+
+// Gets the number of levels of the pyramid of every channel.
+size_t stream2_preview_levels(const struct stream2_preview* preview);
+
+// Returns true if a preview is due and takes the pyramid until
+// stream2_preview_end(). Returns false if the previous preview was less than
+// 1 / rate seconds ago or is still being built. May be called from several
+// threads.
+bool stream2_preview_begin(struct stream2_preview* preview);
+
+// Builds the pyramid of a decoded frame of a channel. Called between
+// stream2_preview_begin() and stream2_preview_end().
+enum stream2_result stream2_preview_build(struct stream2_preview* preview,
+                                          size_t channel,
+                                          const void* data);
+
+// Gets a level of the pyramid of a channel, from 1 to
+// stream2_preview_levels(). The data is valid until stream2_preview_end().
+enum stream2_result stream2_preview_level(
+        const struct stream2_preview* preview,
+        size_t channel,
+        size_t level,
+        struct stream2_preview_level* out);
+
+// Releases the pyramid for the next preview.
+void stream2_preview_end(struct stream2_preview* preview);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,762 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_receiver.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zmq.h>
+
+enum { RECEIVE_TIMEOUT_MS = 100 };
+
+struct queue_item {
+    zmq_msg_t zmsg;
+    struct stream2_image_msg* msg;
+    struct stream2_series* series;
+    enum stream2_overload_mode mode;
+    // Time the image was queued at, if statistics are recorded.
+    uint64_t queued_ns;
+    // Time the message was received at, if latencies are tracked.
+    int64_t received_ns;
+};
+
+struct decoder {
+    struct stream2_receiver* receiver;
+    size_t index;
+    pthread_t thread;
+    uint64_t touch_generation;
+};
+
+struct stream2_receiver {
+    struct stream2_receiver_config config;
+    void* ctx;
+    void* socket;
+    pthread_t receive_thread;
+    struct decoder* decoders;
+    size_t decoders_started;
+
+    // Bounded queue of image messages, protected by mutex.
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+    struct queue_item* queue;
+    size_t queue_head;
+    size_t queue_len;
+    // Number of image messages queued or being decoded.
+    size_t pending;
+    bool stop;
+    struct stream2_overload_counters overload;
+    // Time the message being handled by the receive thread was received at,
+    // if latencies are tracked.
+    int64_t received_ns;
+
+    // Series whose decode buffers the decoder threads should first touch.
+    struct stream2_series* touch_series;
+    uint64_t touch_generation;
+    size_t touch_pending;
+    pthread_cond_t touched;
+
+    // Placement of the receive thread, the ZeroMQ I/O thread and the decoder
+    // threads, in that order.
+    struct stream2_thread_placement* placement;
+    size_t placement_len;
+    size_t placement_pending;
+    pthread_cond_t placed;
+
+    struct stream2_cpu_set nic_cpus;
+    bool nic_cpus_valid;
+};
+
+void stream2_receiver_config_default(struct stream2_receiver_config* config) {
+    memset(config, 0, sizeof(*config));
+    config->decoder_threads = 1;
+    config->queue_capacity = 64;
+    stream2_placement_default(&config->placement);
+}
+
+static void report_error(struct stream2_receiver* receiver,
+                         enum stream2_result r,
+                         const struct stream2_msg* msg) {
+    const struct stream2_receiver_callbacks* cb = &receiver->config.callbacks;
+    if (cb->error)
+        cb->error(cb->user, r, msg);
+}
+
+static void record_placement(struct stream2_receiver* receiver,
+                             size_t slot,
+                             const char* role,
+                             size_t index,
+                             bool pinned) {
+    struct stream2_thread_placement placement;
+    stream2_thread_placement_get(role, index, pinned, &placement);
+
+    pthread_mutex_lock(&receiver->mutex);
+    receiver->placement[slot] = placement;
+    if (--receiver->placement_pending == 0)
+        pthread_cond_broadcast(&receiver->placed);
+    pthread_mutex_unlock(&receiver->mutex);
+}
+
+static void touch_decode_buffers(const struct stream2_series* series,
+                                 size_t slot) {
+    for (size_t i = 0; !series->config.sparse && i < series->channels_len;
+         i++)
+        memset(series->channels[i].decode_buffers[slot], 0,
+               series->frame_size);
+}
+
+// Waits until every queued image was handled. Called with mutex locked.
+static void wait_idle(struct stream2_receiver* receiver) {
+    while (receiver->pending > 0)
+        pthread_cond_wait(&receiver->idle, &receiver->mutex);
+}
+
+static void decode_image(struct stream2_receiver* receiver,
+                         struct queue_item* item,
+                         size_t decoder) {
+    enum stream2_result r;
+    const struct stream2_receiver_callbacks* cb = &receiver->config.callbacks;
+    struct stream2_stats* stats = receiver->config.stats;
+    const uint64_t bytes = item->series->frame_size * item->msg->data.len;
+
+    uint64_t start = stats ? stream2_stats_now_ns() : 0;
+    for (size_t i = 0; i < item->msg->data.len; i++) {
+        const void* data;
+        const struct stream2_sparse_frame* frame;
+        if (item->mode == STREAM2_OVERLOAD_STATISTICS) {
+            r = stream2_series_update_stats(item->series, item->msg, i,
+                                            decoder);
+        } else if (item->series->config.sparse) {
+            r = stream2_series_decode_sparse(item->series, item->msg, i,
+                                             decoder, &frame);
+        } else {
+            r = stream2_series_decode(item->series, item->msg, i, decoder,
+                                      &data);
+        }
+        if (r) {
+            report_error(receiver, r, (const struct stream2_msg*)item->msg);
+            return;
+        }
+    }
+    if (stats) {
+        const uint64_t end = stream2_stats_now_ns();
+        stream2_stats_record(stats, 1 + decoder, STREAM2_STAGE_DECODE,
+                             end - start, bytes);
+        start = end;
+    }
+
+    if (item->mode == STREAM2_OVERLOAD_FULL && cb->image) {
+        cb->image(cb->user, item->series, item->msg, decoder);
+        if (stats) {
+            stream2_stats_record(stats, 1 + decoder, STREAM2_STAGE_IMAGE,
+                                 stream2_stats_now_ns() - start, bytes);
+        }
+    }
+    if (receiver->config.latency) {
+        stream2_latency_record(receiver->config.latency, decoder, item->msg,
+                               item->received_ns, stream2_latency_now_ns());
+    }
+}
+
+static void* decoder_main(void* arg) {
+    struct decoder* decoder = arg;
+    struct stream2_receiver* receiver = decoder->receiver;
+    const struct stream2_placement* placement = &receiver->config.placement;
+
+    bool pinned = false;
+    if (placement->decoder_cpus_len > 0) {
+        const size_t i = decoder->index % placement->decoder_cpus_len;
+        struct stream2_cpu_set cpus;
+        stream2_cpu_set_clear(&cpus);
+        stream2_cpu_set_add(&cpus, placement->decoder_cpus[i]);
+        pinned = stream2_pin_thread(&cpus) == STREAM2_OK;
+    }
+    record_placement(receiver, 2 + decoder->index, "decode", decoder->index,
+                     pinned);
+
+    pthread_mutex_lock(&receiver->mutex);
+    for (;;) {
+        while (!receiver->stop && receiver->queue_len == 0 &&
+               receiver->touch_generation == decoder->touch_generation)
+            pthread_cond_wait(&receiver->not_empty, &receiver->mutex);
+
+        if (receiver->touch_generation != decoder->touch_generation) {
+            decoder->touch_generation = receiver->touch_generation;
+            struct stream2_series* series = receiver->touch_series;
+            pthread_mutex_unlock(&receiver->mutex);
+            touch_decode_buffers(series, decoder->index);
+            pthread_mutex_lock(&receiver->mutex);
+            if (--receiver->touch_pending == 0)
+                pthread_cond_signal(&receiver->touched);
+            continue;
+        }
+
+        if (receiver->queue_len == 0)
+            break;
+
+        struct queue_item item;
+        struct queue_item* head = &receiver->queue[receiver->queue_head];
+        zmq_msg_init(&item.zmsg);
+        zmq_msg_move(&item.zmsg, &head->zmsg);
+        item.msg = head->msg;
+        item.series = head->series;
+        item.mode = head->mode;
+        item.queued_ns = head->queued_ns;
+        item.received_ns = head->received_ns;
+        receiver->queue_head =
+                (receiver->queue_head + 1) % receiver->config.queue_capacity;
+        receiver->queue_len--;
+        pthread_cond_signal(&receiver->not_full);
+        pthread_mutex_unlock(&receiver->mutex);
+
+        if (receiver->config.stats) {
+            stream2_stats_record(receiver->config.stats, 1 + decoder->index,
+                                 STREAM2_STAGE_QUEUE,
+                                 stream2_stats_now_ns() - item.queued_ns,
+                                 zmq_msg_size(&item.zmsg));
+        }
+        decode_image(receiver, &item, decoder->index);
+        stream2_free_msg_with_allocator((struct stream2_msg*)item.msg,
+                                        receiver->config.allocator);
+        zmq_msg_close(&item.zmsg);
+
+        pthread_mutex_lock(&receiver->mutex);
+        if (--receiver->pending == 0)
+            pthread_cond_broadcast(&receiver->idle);
+    }
+    pthread_mutex_unlock(&receiver->mutex);
+    return NULL;
+}
+
+struct transition {
+    enum stream2_overload_mode from;
+    enum stream2_overload_mode to;
+};
+
+// Steps the overload mode according to the queue depth. Called with mutex
+// locked. Returns the number of transitions.
+static size_t update_overload_mode(
+        struct stream2_receiver* receiver,
+        size_t depth,
+        struct transition transitions[STREAM2_OVERLOAD_MODES]) {
+    const struct stream2_overload_policy* policy = &receiver->config.overload;
+    enum stream2_overload_mode mode = receiver->overload.mode;
+    size_t n = 0;
+
+    while (mode < STREAM2_OVERLOAD_DROP && depth >= policy->enter[mode]) {
+        transitions[n].from = mode;
+        transitions[n].to = mode + 1;
+        mode = transitions[n++].to;
+    }
+    if (n == 0) {
+        while (mode > STREAM2_OVERLOAD_FULL && depth <= policy->leave[mode - 1])
+        {
+            transitions[n].from = mode;
+            transitions[n].to = mode - 1;
+            mode = transitions[n++].to;
+        }
+    }
+    receiver->overload.mode = mode;
+    receiver->overload.transitions += n;
+    return n;
+}
+
+// Parses an image message and records it in the series.
+static enum stream2_result parse_image(struct stream2_receiver* receiver,
+                                       zmq_msg_t* zmsg,
+                                       struct stream2_series* series,
+                                       struct stream2_image_msg** msg_out) {
+    enum stream2_result r;
+
+    struct stream2_stats* stats = receiver->config.stats;
+    const uint64_t start = stats ? stream2_stats_now_ns() : 0;
+    struct stream2_msg* msg;
+    if ((r = stream2_parse_msg_with_allocator(
+                 (const uint8_t*)zmq_msg_data(zmsg), zmq_msg_size(zmsg),
+                 receiver->config.allocator, &msg)))
+    {
+        report_error(receiver, r, NULL);
+        return r;
+    }
+    if (stats) {
+        stream2_stats_record(stats, 0, STREAM2_STAGE_PARSE,
+                             stream2_stats_now_ns() - start,
+                             zmq_msg_size(zmsg));
+    }
+
+    if (msg->type != STREAM2_MSG_IMAGE)
+        r = STREAM2_ERROR_PARSE;
+    else
+        r = stream2_series_add_image(series, (struct stream2_image_msg*)msg);
+    if (r) {
+        report_error(receiver, r, msg);
+        stream2_free_msg_with_allocator(msg, receiver->config.allocator);
+        return r;
+    }
+    if (receiver->config.telemetry) {
+        stream2_telemetry_record(receiver->config.telemetry,
+                                 (struct stream2_image_msg*)msg);
+    }
+    *msg_out = (struct stream2_image_msg*)msg;
+    return STREAM2_OK;
+}
+
+// Hands an image message to the decoder threads according to the overload
+// mode, which is decided before the message is parsed: images peeked or
+// dropped are neither parsed nor recorded in the series, so that they count
+// as missing. Moves the content of zmsg if the image is queued.
+static void handle_image(struct stream2_receiver* receiver,
+                         zmq_msg_t* zmsg,
+                         struct stream2_series* series,
+                         uint64_t image_id) {
+    const struct stream2_receiver_callbacks* cb = &receiver->config.callbacks;
+    const size_t capacity = receiver->config.queue_capacity;
+    const bool enabled = receiver->config.overload.enabled;
+
+    pthread_mutex_lock(&receiver->mutex);
+    struct transition transitions[STREAM2_OVERLOAD_MODES];
+    const size_t depth = receiver->queue_len;
+    size_t transitions_len = 0;
+    if (enabled)
+        transitions_len = update_overload_mode(receiver, depth, transitions);
+    enum stream2_overload_mode mode = receiver->overload.mode;
+
+    if (mode <= STREAM2_OVERLOAD_STATISTICS) {
+        while (!enabled && !receiver->stop && receiver->queue_len == capacity)
+            pthread_cond_wait(&receiver->not_full, &receiver->mutex);
+        if (receiver->stop) {
+            pthread_mutex_unlock(&receiver->mutex);
+            return;
+        }
+        // The policy drops images rather than blocking on a full queue.
+        if (receiver->queue_len == capacity)
+            mode = STREAM2_OVERLOAD_DROP;
+    }
+    if (mode == STREAM2_OVERLOAD_DROP)
+        receiver->overload.dropped++;
+    receiver->overload.images[mode]++;
+    pthread_mutex_unlock(&receiver->mutex);
+
+    for (size_t i = 0; i < transitions_len; i++) {
+        if (cb->overload)
+            cb->overload(cb->user, transitions[i].from, transitions[i].to,
+                         depth);
+    }
+
+    if (mode == STREAM2_OVERLOAD_PEEK) {
+        if (cb->peek) {
+            cb->peek(cb->user, series, image_id,
+                     (const uint8_t*)zmq_msg_data(zmsg), zmq_msg_size(zmsg));
+        }
+        return;
+    }
+    if (mode == STREAM2_OVERLOAD_DROP) {
+        if (cb->dropped)
+            cb->dropped(cb->user, series, image_id);
+        return;
+    }
+
+    // The message is parsed without the mutex. The receive thread is the
+    // only one to queue images, so the queue still has room afterwards.
+    struct stream2_image_msg* msg;
+    if (parse_image(receiver, zmsg, series, &msg))
+        return;
+    const uint64_t queued_ns =
+            receiver->config.stats ? stream2_stats_now_ns() : 0;
+
+    pthread_mutex_lock(&receiver->mutex);
+    if (receiver->stop) {
+        pthread_mutex_unlock(&receiver->mutex);
+        stream2_free_msg_with_allocator((struct stream2_msg*)msg,
+                                        receiver->config.allocator);
+        return;
+    }
+    struct queue_item* item =
+            &receiver->queue[(receiver->queue_head + receiver->queue_len) %
+                             capacity];
+    zmq_msg_init(&item->zmsg);
+    zmq_msg_move(&item->zmsg, zmsg);
+    item->msg = msg;
+    item->series = series;
+    item->mode = mode;
+    item->queued_ns = queued_ns;
+    item->received_ns = receiver->received_ns;
+    receiver->queue_len++;
+    receiver->pending++;
+    pthread_cond_signal(&receiver->not_empty);
+    pthread_mutex_unlock(&receiver->mutex);
+}
+
+// Waits for queued images of the current series and frees it.
+static void finish_series(struct stream2_receiver* receiver,
+                          struct stream2_series** series,
+                          const struct stream2_end_msg* msg) {
+    const struct stream2_receiver_callbacks* cb = &receiver->config.callbacks;
+
+    if (*series == NULL)
+        return;
+
+    pthread_mutex_lock(&receiver->mutex);
+    wait_idle(receiver);
+    pthread_mutex_unlock(&receiver->mutex);
+
+    if (msg && cb->end)
+        cb->end(cb->user, *series, msg);
+    stream2_series_free(*series);
+    *series = NULL;
+}
+
+static void start_series(struct stream2_receiver* receiver,
+                         struct stream2_series** series,
+                         const struct stream2_start_msg* msg) {
+    enum stream2_result r;
+    const struct stream2_receiver_callbacks* cb = &receiver->config.callbacks;
+
+    // A start message without end message aborts the previous series.
+    finish_series(receiver, series, NULL);
+
+    struct stream2_series_config config;
+    stream2_series_config_default(&config);
+    config.decode_slots = receiver->config.decoder_threads;
+    config.defer_first_touch = receiver->config.placement.first_touch;
+    config.sparse = receiver->config.sparse;
+    if ((r = stream2_series_create(msg, &config, series))) {
+        report_error(receiver, r, (const struct stream2_msg*)msg);
+        return;
+    }
+
+    // Decoder threads only exit once stop is set, so all of them take part in
+    // the first touch if stop is not set yet.
+    pthread_mutex_lock(&receiver->mutex);
+    if (receiver->config.placement.first_touch && !receiver->stop) {
+        receiver->touch_series = *series;
+        receiver->touch_generation++;
+        receiver->touch_pending = receiver->config.decoder_threads;
+        pthread_cond_broadcast(&receiver->not_empty);
+        while (receiver->touch_pending > 0)
+            pthread_cond_wait(&receiver->touched, &receiver->mutex);
+        receiver->touch_series = NULL;
+    }
+    pthread_mutex_unlock(&receiver->mutex);
+
+    if (cb->start)
+        cb->start(cb->user, *series, msg);
+}
+
+static void handle_msg(struct stream2_receiver* receiver,
+                       struct stream2_series** series,
+                       zmq_msg_t* zmsg) {
+    enum stream2_result r;
+
+    // Image messages are peeked first, so that the overload mode is decided
+    // before they are parsed.
+    enum stream2_msg_type type;
+    uint64_t image_id;
+    if ((r = stream2_peek_msg((const uint8_t*)zmq_msg_data(zmsg),
+                              zmq_msg_size(zmsg), &type, &image_id)))
+    {
+        report_error(receiver, r, NULL);
+        return;
+    }
+    if (type == STREAM2_MSG_IMAGE && *series != NULL) {
+        handle_image(receiver, zmsg, *series, image_id);
+        return;
+    }
+
+    struct stream2_stats* stats = receiver->config.stats;
+    const uint64_t start = stats ? stream2_stats_now_ns() : 0;
+    struct stream2_msg* msg;
+    if ((r = stream2_parse_msg_with_allocator(
+                 (const uint8_t*)zmq_msg_data(zmsg), zmq_msg_size(zmsg),
+                 receiver->config.allocator, &msg)))
+    {
+        report_error(receiver, r, NULL);
+        return;
+    }
+    if (stats) {
+        stream2_stats_record(stats, 0, STREAM2_STAGE_PARSE,
+                             stream2_stats_now_ns() - start,
+                             zmq_msg_size(zmsg));
+    }
+
+    switch (msg->type) {
+        case STREAM2_MSG_START:
+            start_series(receiver, series, (struct stream2_start_msg*)msg);
+            break;
+        case STREAM2_MSG_IMAGE:
+            // Images of a series are handled by handle_image().
+            report_error(receiver, STREAM2_ERROR_SERIES_MISMATCH, msg);
+            break;
+        case STREAM2_MSG_END:
+            if (*series && (r = stream2_series_end(
+                                    *series, (struct stream2_end_msg*)msg)))
+            {
+                report_error(receiver, r, msg);
+                break;
+            }
+            finish_series(receiver, series, (struct stream2_end_msg*)msg);
+            break;
+    }
+    stream2_free_msg_with_allocator(msg, receiver->config.allocator);
+}
+
+static void* receive_main(void* arg) {
+    struct stream2_receiver* receiver = arg;
+
+    const bool pinned = receiver->nic_cpus_valid &&
+                        stream2_pin_thread(&receiver->nic_cpus) == STREAM2_OK;
+    record_placement(receiver, 0, "receive", 0, pinned);
+
+    struct stream2_series* series = NULL;
+    zmq_msg_t zmsg;
+    zmq_msg_init(&zmsg);
+    for (;;) {
+        pthread_mutex_lock(&receiver->mutex);
+        const bool stop = receiver->stop;
+        pthread_mutex_unlock(&receiver->mutex);
+        if (stop)
+            break;
+
+        if (zmq_msg_recv(&zmsg, receiver->socket, 0) == -1) {
+            if (zmq_errno() == EAGAIN || zmq_errno() == EINTR)
+                continue;
+            report_error(receiver, STREAM2_ERROR_SYSTEM, NULL);
+            break;
+        }
+        if (receiver->config.latency)
+            receiver->received_ns = stream2_latency_now_ns();
+        struct stream2_stats* stats = receiver->config.stats;
+        const uint64_t start = stats ? stream2_stats_now_ns() : 0;
+        const size_t size = zmq_msg_size(&zmsg);
+        handle_msg(receiver, &series, &zmsg);
+        if (stats) {
+            stream2_stats_record(stats, 0, STREAM2_STAGE_RECEIVE,
+                                 stream2_stats_now_ns() - start, size);
+        }
+    }
+    zmq_msg_close(&zmsg);
+    finish_series(receiver, &series, NULL);
+    return NULL;
+}
+
+static enum stream2_result open_socket(struct stream2_receiver* receiver) {
+    const struct stream2_placement* placement = &receiver->config.placement;
+
+    int node = placement->nic_node;
+    if (node < 0 && placement->nic_interface &&
+        stream2_nic_node(placement->nic_interface, &node) != STREAM2_OK)
+        node = -1;
+    if (node >= 0)
+        receiver->nic_cpus_valid =
+                stream2_node_cpus(node, &receiver->nic_cpus) == STREAM2_OK;
+
+    if ((receiver->ctx = zmq_ctx_new()) == NULL)
+        return STREAM2_ERROR_SYSTEM;
+
+    // The I/O thread affinity must be set before the first socket is created.
+    // ZeroMQ does not expose its I/O thread, so its placement is reported as
+    // requested: the affinity passed to ZeroMQ and the node of the NIC.
+    struct stream2_thread_placement* io = &receiver->placement[1];
+    io->role = "zmq-io";
+    io->index = 0;
+    io->pinned = false;
+    io->requested = false;
+    io->cpu = -1;
+    io->node = node;
+    stream2_cpu_set_clear(&io->affinity);
+#if defined(ZMQ_THREAD_AFFINITY_CPU_ADD)
+    if (receiver->nic_cpus_valid) {
+        io->requested = true;
+        for (int cpu = 0; cpu < STREAM2_MAX_CPUS; cpu++) {
+            if (!stream2_cpu_set_has(&receiver->nic_cpus, cpu))
+                continue;
+            if (zmq_ctx_set(receiver->ctx, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) ==
+                0)
+                stream2_cpu_set_add(&io->affinity, cpu);
+            else
+                io->requested = false;
+        }
+    }
+#endif
+
+    if ((receiver->socket = zmq_socket(receiver->ctx, ZMQ_PULL)) == NULL)
+        return STREAM2_ERROR_SYSTEM;
+
+    const int timeout = RECEIVE_TIMEOUT_MS;
+    if (zmq_setsockopt(receiver->socket, ZMQ_RCVTIMEO, &timeout,
+                       sizeof(timeout)) != 0)
+        return STREAM2_ERROR_SYSTEM;
+
+    if (receiver->config.rcvhwm > 0 &&
+        zmq_setsockopt(receiver->socket, ZMQ_RCVHWM, &receiver->config.rcvhwm,
+                       sizeof(receiver->config.rcvhwm)) != 0)
+        return STREAM2_ERROR_SYSTEM;
+
+    if (zmq_connect(receiver->socket, receiver->config.address) != 0)
+        return STREAM2_ERROR_SYSTEM;
+
+    return STREAM2_OK;
+}
+
+static void set_default_watermarks(struct stream2_overload_policy* policy,
+                                   size_t capacity) {
+    static const size_t PERCENT[STREAM2_OVERLOAD_MODES - 1] = {50, 75, 90};
+    for (size_t i = 0; i < STREAM2_OVERLOAD_MODES - 1; i++) {
+        if (policy->enter[i] == 0) {
+            policy->enter[i] = capacity * PERCENT[i] / 100;
+            if (policy->enter[i] == 0)
+                policy->enter[i] = 1;
+        }
+        if (policy->leave[i] == 0 || policy->leave[i] >= policy->enter[i])
+            policy->leave[i] = policy->enter[i] / 2;
+    }
+}
+
+static void receiver_free(struct stream2_receiver* receiver) {
+    if (receiver->socket)
+        zmq_close(receiver->socket);
+    if (receiver->ctx)
+        zmq_ctx_term(receiver->ctx);
+    pthread_cond_destroy(&receiver->placed);
+    pthread_cond_destroy(&receiver->touched);
+    pthread_cond_destroy(&receiver->idle);
+    pthread_cond_destroy(&receiver->not_full);
+    pthread_cond_destroy(&receiver->not_empty);
+    pthread_mutex_destroy(&receiver->mutex);
+    free(receiver->placement);
+    free(receiver->decoders);
+    free(receiver->queue);
+    free(receiver);
+}
+
+static void join_threads(struct stream2_receiver* receiver,
+                         bool receive_started) {
+    pthread_mutex_lock(&receiver->mutex);
+    receiver->stop = true;
+    pthread_cond_broadcast(&receiver->not_full);
+    pthread_mutex_unlock(&receiver->mutex);
+
+    // The receive thread waits for queued images of its series before
+    // exiting, so the decoder threads must be stopped after it.
+    if (receive_started)
+        pthread_join(receiver->receive_thread, NULL);
+
+    pthread_mutex_lock(&receiver->mutex);
+    pthread_cond_broadcast(&receiver->not_empty);
+    pthread_mutex_unlock(&receiver->mutex);
+
+    for (size_t i = 0; i < receiver->decoders_started; i++)
+        pthread_join(receiver->decoders[i].thread, NULL);
+}
+
+enum stream2_result stream2_receiver_start(
+        const struct stream2_receiver_config* config,
+        struct stream2_receiver** receiver_out) {
+    enum stream2_result r;
+
+    *receiver_out = NULL;
+
+    if (config->address == NULL || config->decoder_threads == 0 ||
+        config->queue_capacity == 0)
+        return STREAM2_ERROR_PARSE;
+
+    struct stream2_receiver* receiver =
+            calloc(1, sizeof(struct stream2_receiver));
+    if (receiver == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    receiver->config = *config;
+    set_default_watermarks(&receiver->config.overload, config->queue_capacity);
+    pthread_mutex_init(&receiver->mutex, NULL);
+    pthread_cond_init(&receiver->not_empty, NULL);
+    pthread_cond_init(&receiver->not_full, NULL);
+    pthread_cond_init(&receiver->idle, NULL);
+    pthread_cond_init(&receiver->touched, NULL);
+    pthread_cond_init(&receiver->placed, NULL);
+
+    receiver->placement_len = 2 + config->decoder_threads;
+    receiver->queue = calloc(config->queue_capacity, sizeof(struct queue_item));
+    receiver->decoders =
+            calloc(config->decoder_threads, sizeof(struct decoder));
+    receiver->placement = calloc(receiver->placement_len,
+                                 sizeof(struct stream2_thread_placement));
+    if (!receiver->queue || !receiver->decoders || !receiver->placement) {
+        receiver_free(receiver);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    if ((r = open_socket(receiver))) {
+        receiver_free(receiver);
+        return r;
+    }
+
+    receiver->placement_pending = 1 + config->decoder_threads;
+    for (size_t i = 0; i < config->decoder_threads; i++) {
+        struct decoder* decoder = &receiver->decoders[i];
+        decoder->receiver = receiver;
+        decoder->index = i;
+        if (pthread_create(&decoder->thread, NULL, decoder_main, decoder) != 0)
+        {
+            join_threads(receiver, false);
+            receiver_free(receiver);
+            return STREAM2_ERROR_SYSTEM;
+        }
+        receiver->decoders_started++;
+    }
+    if (pthread_create(&receiver->receive_thread, NULL, receive_main,
+                       receiver) != 0)
+    {
+        join_threads(receiver, false);
+        receiver_free(receiver);
+        return STREAM2_ERROR_SYSTEM;
+    }
+
+    pthread_mutex_lock(&receiver->mutex);
+    while (receiver->placement_pending > 0)
+        pthread_cond_wait(&receiver->placed, &receiver->mutex);
+    pthread_mutex_unlock(&receiver->mutex);
+
+    *receiver_out = receiver;
+    return STREAM2_OK;
+}
+
+void stream2_receiver_stop(struct stream2_receiver* receiver) {
+    join_threads(receiver, true);
+    receiver_free(receiver);
+}
+
+void stream2_receiver_overload_counters(
+        struct stream2_receiver* receiver,
+        struct stream2_overload_counters* counters) {
+    pthread_mutex_lock(&receiver->mutex);
+    *counters = receiver->overload;
+    pthread_mutex_unlock(&receiver->mutex);
+}
+
+const char* stream2_overload_mode_name(enum stream2_overload_mode mode) {
+    switch (mode) {
+        case STREAM2_OVERLOAD_FULL:
+            return "full";
+        case STREAM2_OVERLOAD_STATISTICS:
+            return "statistics";
+        case STREAM2_OVERLOAD_PEEK:
+            return "peek";
+        case STREAM2_OVERLOAD_DROP:
+            return "drop";
+    }
+    return "unknown";
+}
+
+size_t stream2_receiver_placement(
+        const struct stream2_receiver* receiver,
+        const struct stream2_thread_placement** placement) {
+    *placement = receiver->placement;
+    return receiver->placement_len;
+}
+
+void stream2_receiver_print_placement(const struct stream2_receiver* receiver,
+                                      FILE* file) {
+    for (size_t i = 0; i < receiver->placement_len; i++)
+        stream2_thread_placement_print(file, &receiver->placement[i]);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stream2.h"
+#include "stream2_latency.h"
+#include "stream2_placement.h"
+#include "stream2_series.h"
+#include "stream2_stats.h"
+#include "stream2_telemetry.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct stream2_receiver;
+
+// Processing modes of image messages, from most to least expensive.
+enum stream2_overload_mode {
+    // Images are decoded and passed to the image callback.
+    STREAM2_OVERLOAD_FULL,
+    // Only the series statistics are updated, from the nonzero pixels of the
+    // images without decoding them into frames, see
+    // stream2_series_update_stats().
+    STREAM2_OVERLOAD_STATISTICS,
+    // Images are neither parsed nor decoded but passed to the peek callback
+    // by the receive thread.
+    STREAM2_OVERLOAD_PEEK,
+    // Images are dropped and reported to the dropped callback.
+    STREAM2_OVERLOAD_DROP,
+};
+
+enum { STREAM2_OVERLOAD_MODES = STREAM2_OVERLOAD_DROP + 1 };
+
+// Degradation policy applied when the decoder threads lag behind.
+//
+// The mode steps down from mode m to m + 1 when the queue depth reaches
+// enter[m] and steps back up from m + 1 to m when it falls to leave[m]. With
+// the policy enabled the receive thread never blocks on a full queue, so the
+// PULL socket keeps draining and the detector is never stalled.
+struct stream2_overload_policy {
+    bool enabled;
+    // Queue depth watermarks. Zero watermarks default to 50%, 75% and 90% of
+    // the queue capacity for enter and half of enter for leave.
+    size_t enter[STREAM2_OVERLOAD_MODES - 1];
+    size_t leave[STREAM2_OVERLOAD_MODES - 1];
+};
+
+struct stream2_overload_counters {
+    // Current mode.
+    enum stream2_overload_mode mode;
+    // Number of images handled in each mode.
+    uint64_t images[STREAM2_OVERLOAD_MODES];
+    // Number of images dropped, including images dropped on a full queue.
+    uint64_t dropped;
+    // Number of mode transitions.
+    uint64_t transitions;
+};
+
+struct stream2_receiver_callbacks {
+    void* user;
+    // Called on the receive thread after the series was created.
+    void (*start)(void* user,
+                  struct stream2_series* series,
+                  const struct stream2_start_msg* msg);
+    // Called on decoder thread `decoder` after every channel of the image was
+    // decoded into the decode buffers of slot `decoder` of the series, or
+    // into its sparse frames if sparse.
+    void (*image)(void* user,
+                  struct stream2_series* series,
+                  const struct stream2_image_msg* msg,
+                  size_t decoder);
+    // Called on the receive thread after all images of the series were
+    // handled.
+    void (*end)(void* user,
+                struct stream2_series* series,
+                const struct stream2_end_msg* msg);
+    // Called on the receive thread for images in STREAM2_OVERLOAD_PEEK mode
+    // with the encoded message, which is not parsed, e.g. to parse the
+    // fields needed with stream2_parse_msg().
+    void (*peek)(void* user,
+                 struct stream2_series* series,
+                 uint64_t image_id,
+                 const uint8_t* buffer,
+                 size_t size);
+    // Called on the receive thread for every dropped image.
+    void (*dropped)(void* user,
+                    struct stream2_series* series,
+                    uint64_t image_id);
+    // Called on the receive thread on every overload mode transition.
+    void (*overload)(void* user,
+                     enum stream2_overload_mode from,
+                     enum stream2_overload_mode to,
+                     size_t queue_depth);
+    // Called on errors. The message is NULL if it could not be parsed.
+    void (*error)(void* user,
+                  enum stream2_result r,
+                  const struct stream2_msg* msg);
+};
+
+struct stream2_receiver_config {
+    // ZeroMQ endpoint to connect to, e.g. "tcp://dcu:31001".
+    const char* address;
+    // Number of decoder threads.
+    size_t decoder_threads;
+    // Number of image messages queued between the receive thread and the
+    // decoder threads.
+    size_t queue_capacity;
+    // ZMQ_RCVHWM of the PULL socket, or 0 for the ZeroMQ default.
+    int rcvhwm;
+    // If true, images are decoded into sparse frames, e.g. for low-flux
+    // series, see stream2_series_decode_sparse().
+    bool sparse;
+    // Statistics the stages are recorded into, if not NULL, created with at
+    // least 1 + decoder_threads threads. The receive thread records as
+    // thread 0 and decoder thread d as thread 1 + d, so that the image
+    // callback may record into it as well.
+    struct stream2_stats* stats;
+    // Tracker the lag of every decoded image is recorded into, if not NULL,
+    // created with at least decoder_threads threads. Decoder thread d records
+    // as thread d once the image callback returned.
+    struct stream2_latency* latency;
+    // Telemetry the sizes of the image data of every parsed image message
+    // are recorded into by the receive thread, if not NULL.
+    struct stream2_telemetry* telemetry;
+    // Allocator of parsed messages, or NULL for malloc(). Messages are
+    // allocated on the receive thread and freed on any thread.
+    const struct stream2_allocator* allocator;
+    struct stream2_placement placement;
+    struct stream2_overload_policy overload;
+    struct stream2_receiver_callbacks callbacks;
+};
+
+void stream2_receiver_config_default(struct stream2_receiver_config* config);
+
+// Starts a receiver pipeline: a ZeroMQ PULL socket read by a receive thread
+// which parses messages and hands image messages to decoder threads.
+//
+// Returns once every thread has applied its placement.
+enum stream2_result stream2_receiver_start(
+        const struct stream2_receiver_config* config,
+        struct stream2_receiver** receiver_out);
+
+// Stops the receiver, handles queued images and frees it.
+void stream2_receiver_stop(struct stream2_receiver* receiver);
+
+// Gets the overload counters of the receiver.
+void stream2_receiver_overload_counters(
+        struct stream2_receiver* receiver,
+        struct stream2_overload_counters* counters);
+
+const char* stream2_overload_mode_name(enum stream2_overload_mode mode);
+
+// Gets the placement observed by each thread of the receiver.
+size_t stream2_receiver_placement(
+        const struct stream2_receiver* receiver,
+        const struct stream2_thread_placement** placement);
+
+void stream2_receiver_print_placement(const struct stream2_receiver* receiver,
+                                      FILE* file);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,591 @@
+#include "stream2_series.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compression/src/compression.h"
+#include "stream2_blockmap.h"
+
+static enum stream2_result parse_image_dtype(const char* dtype,
+                                             uint64_t* tag,
+                                             size_t* elem_size) {
+    if (dtype == NULL)
+        return STREAM2_ERROR_PARSE;
+
+    if (strcmp(dtype, "uint8") == 0) {
+        *tag = STREAM2_TYPED_ARRAY_UINT8;
+        *elem_size = 1;
+    } else if (strcmp(dtype, "uint16") == 0) {
+        *tag = STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN;
+        *elem_size = 2;
+    } else if (strcmp(dtype, "uint32") == 0) {
+        *tag = STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN;
+        *elem_size = 4;
+    } else {
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    }
+    return STREAM2_OK;
+}
+
+static char* dup_string(const char* s) {
+    if (s == NULL)
+        return NULL;
+    const size_t len = strlen(s) + 1;
+    char* d = malloc(len);
+    if (d)
+        memcpy(d, s, len);
+    return d;
+}
+
+static bool mul_size(uint64_t a, uint64_t b, size_t* product) {
+    if (a != 0 && b > SIZE_MAX / a)
+        return false;
+    *product = (size_t)(a * b);
+    return true;
+}
+
+static enum stream2_result alloc_channel(struct stream2_series* series,
+                                         struct stream2_series_channel* ch,
+                                         const char* name) {
+    enum stream2_result r;
+    const size_t n = series->number_of_images;
+
+    if (name && (ch->name = dup_string(name)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if (series->config.sparse) {
+        ch->sparse_frames = calloc(series->config.decode_slots,
+                                   sizeof(struct stream2_sparse_frame*));
+        if (ch->sparse_frames == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        for (size_t i = 0; i < series->config.decode_slots; i++) {
+            if ((r = stream2_sparse_frame_create(series->image_size_x,
+                                                 series->image_size_y,
+                                                 &ch->sparse_frames[i])))
+                return r;
+        }
+    } else if ((ch->decode_buffers = calloc(series->config.decode_slots,
+                                            sizeof(void*))) == NULL)
+    {
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; ch->decode_buffers && i < series->config.decode_slots;
+         i++)
+    {
+        // calloc() might hand out lazily mapped zero pages; touch the buffer
+        // now so that the first decode does not pay for the page faults.
+        ch->decode_buffers[i] = malloc(series->frame_size);
+        if (ch->decode_buffers[i] == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        if (!series->config.defer_first_touch)
+            memset(ch->decode_buffers[i], 0, series->frame_size);
+    }
+
+    if (series->config.output_elem_size > 0) {
+        size_t output_size;
+        if (!mul_size(series->image_size_x * series->image_size_y,
+                      series->config.output_elem_size, &output_size))
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        if ((ch->output = malloc(output_size)) == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        memset(ch->output, 0, output_size);
+    }
+
+    // calloc(0) may return NULL, and a series without images has no
+    // statistics.
+    if (n > 0 &&
+        ((ch->stats.sum = calloc(n, sizeof(uint64_t))) == NULL ||
+         (ch->stats.max = calloc(n, sizeof(uint64_t))) == NULL ||
+         (ch->stats.saturated = calloc(n, sizeof(uint64_t))) == NULL ||
+         (ch->stats.nodata = calloc(n, sizeof(uint64_t))) == NULL))
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    return STREAM2_OK;
+}
+
+void stream2_series_config_default(struct stream2_series_config* config) {
+    config->decode_slots = 1;
+    config->output_elem_size = 0;
+    config->defer_first_touch = false;
+    config->sparse = false;
+}
+
+static enum stream2_result series_init(struct stream2_series* series,
+                                       const struct stream2_start_msg* msg) {
+    enum stream2_result r;
+
+    series->series_id = msg->series_id;
+    series->number_of_images = msg->number_of_images;
+    series->image_size_x = msg->image_size_x;
+    series->image_size_y = msg->image_size_y;
+
+    if ((r = parse_image_dtype(msg->image_dtype, &series->tag,
+                               &series->elem_size)))
+        return r;
+
+    series->nodata = (uint32_t)(UINT64_MAX >> (64 - 8 * series->elem_size));
+    // A saturation_value of 0 means it was not sent; treat every value of
+    // the image data type as valid.
+    series->saturation_value = msg->saturation_value;
+    if (series->saturation_value == 0)
+        series->saturation_value = series->nodata;
+    series->saturation = series->saturation_value < series->nodata
+                                 ? (uint32_t)series->saturation_value
+                                 : series->nodata;
+
+    size_t pixels;
+    if (!mul_size(msg->image_size_x, msg->image_size_y, &pixels) ||
+        !mul_size(pixels, series->elem_size, &series->frame_size) ||
+        msg->number_of_images > SIZE_MAX / sizeof(uint64_t))
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if (msg->series_unique_id &&
+        (series->series_unique_id = dup_string(msg->series_unique_id)) ==
+                NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if (series->number_of_images > 0 &&
+        (series->received = calloc((series->number_of_images + 63) / 64,
+                                   sizeof(uint64_t))) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    // Without a channel list, image data is decoded into a single unnamed
+    // channel.
+    series->channels_len = msg->channels.len > 0 ? msg->channels.len : 1;
+    series->channels = calloc(series->channels_len,
+                              sizeof(struct stream2_series_channel));
+    if (series->channels == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < series->channels_len; i++) {
+        const char* name = i < msg->channels.len ? msg->channels.ptr[i] : NULL;
+        if ((r = alloc_channel(series, &series->channels[i], name)))
+            return r;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_create(
+        const struct stream2_start_msg* msg,
+        const struct stream2_series_config* config,
+        struct stream2_series** series_out) {
+    enum stream2_result r;
+
+    *series_out = NULL;
+
+    struct stream2_series* series = calloc(1, sizeof(struct stream2_series));
+    if (series == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    if (config)
+        series->config = *config;
+    else
+        stream2_series_config_default(&series->config);
+    if (series->config.decode_slots == 0)
+        series->config.decode_slots = 1;
+
+    if ((r = series_init(series, msg))) {
+        stream2_series_free(series);
+        return r;
+    }
+
+    *series_out = series;
+    return STREAM2_OK;
+}
+
+void stream2_series_free(struct stream2_series* series) {
+    if (series == NULL)
+        return;
+    for (size_t i = 0; i < series->channels_len; i++) {
+        struct stream2_series_channel* ch = &series->channels[i];
+        free(ch->name);
+        if (ch->decode_buffers) {
+            for (size_t j = 0; j < series->config.decode_slots; j++)
+                free(ch->decode_buffers[j]);
+        }
+        free(ch->decode_buffers);
+        if (ch->sparse_frames) {
+            for (size_t j = 0; j < series->config.decode_slots; j++)
+                stream2_sparse_frame_free(ch->sparse_frames[j]);
+        }
+        free(ch->sparse_frames);
+        free(ch->output);
+        free(ch->stats.sum);
+        free(ch->stats.max);
+        free(ch->stats.saturated);
+        free(ch->stats.nodata);
+    }
+    free(series->channels);
+    free(series->received);
+    free(series->series_unique_id);
+    free(series);
+}
+
+static enum stream2_result check_series(const struct stream2_series* series,
+                                        const struct stream2_msg* msg) {
+    if (msg->series_id != series->series_id)
+        return STREAM2_ERROR_SERIES_MISMATCH;
+    if (msg->series_unique_id && series->series_unique_id &&
+        strcmp(msg->series_unique_id, series->series_unique_id) != 0)
+        return STREAM2_ERROR_SERIES_MISMATCH;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_add_image(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg) {
+    enum stream2_result r;
+
+    if ((r = check_series(series, (const struct stream2_msg*)msg)))
+        return r;
+
+    const uint64_t id = msg->image_id;
+    if (id >= series->number_of_images)
+        return STREAM2_ERROR_IMAGE_ID;
+
+    const uint64_t bit = UINT64_C(1) << (id % 64);
+    if (series->received[id / 64] & bit)
+        return STREAM2_ERROR_IMAGE_ID;
+
+    series->received[id / 64] |= bit;
+    series->received_count++;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_end(struct stream2_series* series,
+                                       const struct stream2_end_msg* msg) {
+    enum stream2_result r;
+
+    if ((r = check_series(series, (const struct stream2_msg*)msg)))
+        return r;
+
+    series->ended = true;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_decode_bytes(const struct stream2_bytes* bytes,
+                                         void* dst,
+                                         size_t dst_len) {
+    const struct stream2_compression compression = bytes->compression;
+
+    if (compression.algorithm == NULL) {
+        if (bytes->len != dst_len)
+            return STREAM2_ERROR_DECODE;
+        memcpy(dst, bytes->ptr, dst_len);
+        return STREAM2_OK;
+    }
+
+    CompressionAlgorithm algorithm;
+    if (strcmp(compression.algorithm, "bslz4") == 0) {
+        algorithm = COMPRESSION_BSLZ4;
+    } else if (strcmp(compression.algorithm, "lz4") == 0) {
+        algorithm = COMPRESSION_LZ4;
+    } else {
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    }
+
+    if (compression.orig_size != dst_len)
+        return STREAM2_ERROR_DECODE;
+
+    if (compression_decompress_buffer(algorithm, (char*)dst, dst_len,
+                                      (const char*)bytes->ptr, bytes->len,
+                                      compression.elem_size) != dst_len)
+        return STREAM2_ERROR_DECODE;
+
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_pixel_mask(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        size_t channel,
+        uint32_t* mask) {
+    if (channel >= series->channels_len)
+        return STREAM2_ERROR_PARSE;
+    const char* name = series->channels[channel].name;
+    const size_t pixels = series->image_size_x * series->image_size_y;
+
+    for (size_t i = 0; msg->pixel_mask_enabled && i < msg->pixel_mask.len;
+         i++)
+    {
+        const struct stream2_pixel_mask* m = &msg->pixel_mask.ptr[i];
+        if (name && m->channel && strcmp(m->channel, name) != 0)
+            continue;
+        if (m->pixel_mask.dim[0] != series->image_size_y ||
+            m->pixel_mask.dim[1] != series->image_size_x ||
+            m->pixel_mask.array.tag !=
+                    STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN)
+            return STREAM2_ERROR_PARSE;
+        return stream2_decode_bytes(&m->pixel_mask.array.data, mask,
+                                    pixels * sizeof(uint32_t));
+    }
+    memset(mask, 0, pixels * sizeof(uint32_t));
+    return STREAM2_OK;
+}
+
+#define DEFINE_UPDATE_STATS(NAME, TYPE)                                     \
+    static void NAME(const TYPE* data, size_t len, uint64_t saturation,     \
+                     struct stream2_series_stats* stats, uint64_t id) {     \
+        uint64_t sum = 0, max = 0, saturated = 0, nodata = 0;               \
+        for (size_t i = 0; i < len; i++) {                                  \
+            const uint64_t v = data[i];                                     \
+            if (v > saturation) {                                           \
+                nodata++;                                                   \
+                continue;                                                   \
+            }                                                               \
+            sum += v;                                                       \
+            max = v > max ? v : max;                                        \
+            saturated += v == saturation;                                   \
+        }                                                                   \
+        stats->sum[id] = sum;                                               \
+        stats->max[id] = max;                                               \
+        stats->saturated[id] = saturated;                                   \
+        stats->nodata[id] = nodata;                                         \
+    }
+
+DEFINE_UPDATE_STATS(update_stats_u8, uint8_t)
+DEFINE_UPDATE_STATS(update_stats_u16, uint16_t)
+DEFINE_UPDATE_STATS(update_stats_u32, uint32_t)
+
+#define DEFINE_FILL(NAME, TYPE)                                             \
+    static void NAME(TYPE* data, size_t len, uint32_t value) {              \
+        for (size_t i = 0; i < len; i++)                                    \
+            data[i] = (TYPE)value;                                          \
+    }
+
+DEFINE_FILL(fill_u8, uint8_t)
+DEFINE_FILL(fill_u16, uint16_t)
+DEFINE_FILL(fill_u32, uint32_t)
+
+// Fills a frame whose elements all have the same value, found from its
+// compressed blocks, and its statistics without decompressing it.
+static void fill_constant(const struct stream2_series* series,
+                          struct stream2_series_channel* ch,
+                          uint64_t id,
+                          void* buffer,
+                          enum stream2_block_kind kind,
+                          uint32_t value) {
+    const size_t len = series->frame_size / series->elem_size;
+    if (kind == STREAM2_BLOCK_ZERO)
+        memset(buffer, 0, series->frame_size);
+    else if (series->elem_size == 1)
+        fill_u8(buffer, len, value);
+    else if (series->elem_size == 2)
+        fill_u16(buffer, len, value);
+    else
+        fill_u32(buffer, len, value);
+
+    const bool nodata = value > series->saturation_value;
+    ch->stats.sum[id] = nodata ? 0 : (uint64_t)value * len;
+    ch->stats.max[id] = nodata || len == 0 ? 0 : value;
+    ch->stats.saturated[id] =
+            !nodata && value == series->saturation_value ? len : 0;
+    ch->stats.nodata[id] = nodata ? len : 0;
+}
+
+// Gets the image data of a channel after checking it against the series.
+static enum stream2_result get_image_data(
+        const struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        const struct stream2_multidim_array** multidim_out) {
+    enum stream2_result r;
+
+    if ((r = check_series(series, (const struct stream2_msg*)msg)))
+        return r;
+
+    if (msg->image_id >= series->number_of_images)
+        return STREAM2_ERROR_IMAGE_ID;
+
+    if (channel >= series->channels_len || channel >= msg->data.len)
+        return STREAM2_ERROR_PARSE;
+
+    const struct stream2_series_channel* ch = &series->channels[channel];
+    const struct stream2_image_data* image_data = &msg->data.ptr[channel];
+    const struct stream2_multidim_array* multidim = &image_data->data;
+
+    if (ch->name && image_data->channel &&
+        strcmp(ch->name, image_data->channel) != 0)
+        return STREAM2_ERROR_PARSE;
+
+    if (multidim->dim[0] != series->image_size_y ||
+        multidim->dim[1] != series->image_size_x ||
+        multidim->array.tag != series->tag)
+        return STREAM2_ERROR_PARSE;
+
+    *multidim_out = multidim;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_decode_into(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        void* buffer) {
+    enum stream2_result r;
+
+    const struct stream2_multidim_array* multidim;
+    if ((r = get_image_data(series, msg, channel, &multidim)))
+        return r;
+    struct stream2_series_channel* ch = &series->channels[channel];
+
+    const size_t elems = series->frame_size / series->elem_size;
+    uint32_t value;
+    const enum stream2_block_kind kind = stream2_block_classify_frame(
+            &multidim->array.data, series->elem_size, elems, &value);
+    if (kind != STREAM2_BLOCK_MIXED) {
+        fill_constant(series, ch, msg->image_id, buffer, kind, value);
+        return STREAM2_OK;
+    }
+
+    if ((r = stream2_decode_bytes(&multidim->array.data, buffer,
+                                  series->frame_size)))
+        return r;
+
+    const size_t len = series->frame_size / series->elem_size;
+    switch (series->elem_size) {
+        case 1:
+            update_stats_u8(buffer, len, series->saturation_value, &ch->stats,
+                            msg->image_id);
+            break;
+        case 2:
+            update_stats_u16(buffer, len, series->saturation_value,
+                             &ch->stats, msg->image_id);
+            break;
+        case 4:
+            update_stats_u32(buffer, len, series->saturation_value,
+                             &ch->stats, msg->image_id);
+            break;
+    }
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_decode(struct stream2_series* series,
+                                          const struct stream2_image_msg* msg,
+                                          size_t channel,
+                                          size_t slot,
+                                          const void** data) {
+    enum stream2_result r;
+
+    if (channel >= series->channels_len ||
+        slot >= series->config.decode_slots ||
+        series->channels[channel].decode_buffers == NULL)
+        return STREAM2_ERROR_PARSE;
+
+    void* buffer = series->channels[channel].decode_buffers[slot];
+    if ((r = stream2_series_decode_into(series, msg, channel, buffer)))
+        return r;
+
+    *data = buffer;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_decode_sparse(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        size_t slot,
+        const struct stream2_sparse_frame** frame) {
+    enum stream2_result r;
+
+    if (channel >= series->channels_len ||
+        slot >= series->config.decode_slots ||
+        series->channels[channel].sparse_frames == NULL)
+        return STREAM2_ERROR_PARSE;
+
+    const struct stream2_multidim_array* multidim;
+    if ((r = get_image_data(series, msg, channel, &multidim)))
+        return r;
+    struct stream2_series_channel* ch = &series->channels[channel];
+    struct stream2_sparse_frame* sparse = ch->sparse_frames[slot];
+    if ((r = stream2_sparse_decode_bytes(&multidim->array.data,
+                                         series->elem_size, sparse)))
+        return r;
+
+    // Zero pixels add nothing to the statistics.
+    uint64_t sum = 0, max = 0, saturated = 0, nodata = 0;
+    for (size_t i = 0; i < sparse->len; i++) {
+        const uint64_t v = sparse->values[i];
+        if (v > series->saturation_value) {
+            nodata++;
+            continue;
+        }
+        sum += v;
+        max = v > max ? v : max;
+        saturated += v == series->saturation_value;
+    }
+    const uint64_t id = msg->image_id;
+    ch->stats.sum[id] = sum;
+    ch->stats.max[id] = max;
+    ch->stats.saturated[id] = saturated;
+    ch->stats.nodata[id] = nodata;
+
+    *frame = sparse;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_series_update_stats(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        size_t slot) {
+    enum stream2_result r;
+
+    if (channel >= series->channels_len ||
+        slot >= series->config.decode_slots)
+        return STREAM2_ERROR_PARSE;
+    struct stream2_series_channel* ch = &series->channels[channel];
+    if (ch->decode_buffers == NULL) {
+        const struct stream2_sparse_frame* frame;
+        return stream2_series_decode_sparse(series, msg, channel, slot,
+                                            &frame);
+    }
+
+    const struct stream2_multidim_array* multidim;
+    if ((r = get_image_data(series, msg, channel, &multidim)))
+        return r;
+    // The decode buffer of the slot is only written to if the data cannot be
+    // decoded block by block.
+    struct stream2_sparse_stats stats;
+    if ((r = stream2_sparse_stats_bytes(
+                 &multidim->array.data, series->elem_size,
+                 series->frame_size / series->elem_size,
+                 series->saturation_value, ch->decode_buffers[slot], &stats)))
+        return r;
+    const uint64_t id = msg->image_id;
+    ch->stats.sum[id] = stats.sum;
+    ch->stats.max[id] = stats.max;
+    ch->stats.saturated[id] = stats.saturated;
+    ch->stats.nodata[id] = stats.nodata;
+    return STREAM2_OK;
+}
+
+bool stream2_series_is_received(const struct stream2_series* series,
+                                uint64_t image_id) {
+    if (image_id >= series->number_of_images)
+        return false;
+    return (series->received[image_id / 64] >> (image_id % 64)) & 1;
+}
+
+bool stream2_series_next_missing(const struct stream2_series* series,
+                                 uint64_t from,
+                                 uint64_t* image_id) {
+    const uint64_t n = series->number_of_images;
+    for (uint64_t id = from; id < n;) {
+        const uint64_t word = ~series->received[id / 64] >> (id % 64);
+        if (word == 0) {
+            id = (id / 64 + 1) * 64;
+            continue;
+        }
+        uint64_t offset = 0;
+        while (((word >> offset) & 1) == 0)
+            offset++;
+        if (id + offset >= n)
+            return false;
+        *image_id = id + offset;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_sparse.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Per-image statistics of one channel, indexed by image_id. The arrays are
+// NULL if number_of_images is 0.
+struct stream2_series_stats {
+    // Sum of all valid pixel values (at most saturation_value).
+    uint64_t* sum;
+    // Maximum valid pixel value.
+    uint64_t* max;
+    // Number of pixels equal to saturation_value.
+    uint64_t* saturated;
+    // Number of pixels above saturation_value (NODATA, masked or overflow).
+    uint64_t* nodata;
+};
+
+struct stream2_series_channel {
+    // Channel name as listed in the start message.
+    char* name;
+    // Decode buffers of one frame each, one per decode slot, or NULL if the
+    // series is decoded into sparse frames.
+    void** decode_buffers;
+    // Sparse frames, one per decode slot, or NULL if the series is decoded
+    // into decode buffers.
+    struct stream2_sparse_frame** sparse_frames;
+    // Output slab of one frame of output_elem_size elements, or NULL.
+    void* output;
+    struct stream2_series_stats stats;
+};
+
+struct stream2_series_config {
+    // Number of decode buffers per channel, e.g. one per decoder thread.
+    size_t decode_slots;
+    // Element size of the per-channel output slab, or 0 for no output slab.
+    size_t output_elem_size;
+    // If true, decode buffers are not touched on creation so that the pages
+    // are allocated on the NUMA node of the thread that first writes them.
+    bool defer_first_touch;
+    // If true, images are decoded into sparse frames instead of decode
+    // buffers with stream2_series_decode_sparse().
+    bool sparse;
+};
+
+// State of one series, created from its start message and fed every image
+// and end message of the same series_unique_id.
+//
+// All buffers are allocated up front by stream2_series_create() so that no
+// allocation happens while images are received.
+struct stream2_series {
+    uint64_t series_id;
+    char* series_unique_id;
+    uint64_t number_of_images;
+    uint64_t image_size_x;
+    uint64_t image_size_y;
+    uint64_t saturation_value;
+    // Typed array tag and element size of image data derived from image_dtype.
+    uint64_t tag;
+    size_t elem_size;
+    // NODATA, the maximum value of the element type, and saturation_value
+    // clamped to it, for comparisons with pixels of 32 bits.
+    uint32_t nodata;
+    uint32_t saturation;
+    // Size in bytes of one decoded frame of one channel.
+    size_t frame_size;
+    struct stream2_series_config config;
+    struct stream2_series_channel* channels;
+    size_t channels_len;
+    // Bitmap of received image_ids, NULL if number_of_images is 0.
+    uint64_t* received;
+    uint64_t received_count;
+    bool ended;
+};
+
+// Gets the default series configuration with one decode slot and no output
+// slab.
+void stream2_series_config_default(struct stream2_series_config* config);
+
+// Creates a series from a start message. If config is NULL, the default
+// configuration is used.
+enum stream2_result stream2_series_create(
+        const struct stream2_start_msg* msg,
+        const struct stream2_series_config* config,
+        struct stream2_series** series_out);
+void stream2_series_free(struct stream2_series* series);
+
+// Records an image message of the series.
+//
+// Returns STREAM2_ERROR_SERIES_MISMATCH if the message belongs to another
+// series and STREAM2_ERROR_IMAGE_ID if the image_id is out of range or was
+// already received.
+enum stream2_result stream2_series_add_image(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg);
+
+// Records the end message of the series.
+enum stream2_result stream2_series_end(struct stream2_series* series,
+                                       const struct stream2_end_msg* msg);
+
+// Decodes the image data of a channel into the decode buffer of a slot and
+// updates the statistics of the image.
+//
+// Image data is matched to channels in the order of the start message.
+enum stream2_result stream2_series_decode(struct stream2_series* series,
+                                          const struct stream2_image_msg* msg,
+                                          size_t channel,
+                                          size_t slot,
+                                          const void** data);
+
+// Decodes the image data of a channel into the sparse frame of a slot and
+// updates the statistics of the image. Only pixels that are nonzero are
+// visited, so the cost scales with the number of counts.
+enum stream2_result stream2_series_decode_sparse(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        size_t slot,
+        const struct stream2_sparse_frame** frame);
+
+// Updates the statistics of the image from the image data of a channel
+// without decoding it into a frame, e.g. to keep the statistics of a series
+// complete while its images are not processed otherwise. Only the nonzero
+// pixels are visited, and zero and constant blocks of "bslz4" data are not
+// decompressed.
+enum stream2_result stream2_series_update_stats(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        size_t slot);
+
+// Decodes the image data of a channel into buffer, which holds frame_size
+// bytes, and updates the statistics of the image, e.g. to decode in place
+// into memory owned by the caller.
+enum stream2_result stream2_series_decode_into(
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        void* buffer);
+
+// Decodes bytes, compressed with "bslz4" or "lz4" or not compressed, into
+// dst of exactly dst_len bytes, e.g. the pixel mask of a start message.
+enum stream2_result stream2_decode_bytes(const struct stream2_bytes* bytes,
+                                         void* dst,
+                                         size_t dst_len);
+
+// Decodes the pixel mask of a channel from the start message of the series
+// into mask of image_size_x * image_size_y values, where pixels with a
+// nonzero value are excluded. If pixel_mask_enabled is false or there is no
+// pixel mask for the channel, mask is cleared.
+enum stream2_result stream2_series_pixel_mask(
+        const struct stream2_series* series,
+        const struct stream2_start_msg* msg,
+        size_t channel,
+        uint32_t* mask);
+
+// Returns true if the image was received.
+bool stream2_series_is_received(const struct stream2_series* series,
+                                uint64_t image_id);
+
+// Finds the first image_id not less than from that was not received.
+//
+// Returns false if there is no such image_id.
+bool stream2_series_next_missing(const struct stream2_series* series,
+                                 uint64_t from,
+                                 uint64_t* image_id);
+
+#if defined(__cplusplus)
+}
+#endif
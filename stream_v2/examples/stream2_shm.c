@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_shm.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum { CACHE_LINE = 64 };
+
+#define RING_MAGIC UINT64_C(0x474e495232585453)  // "STX2RING"
+#define RING_VERSION 2
+
+// Layout of the shared memory: a ring header followed by slot_count slots of
+// slot_stride bytes, each a slot header followed by the payload.
+struct ring_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t slot_count;
+    uint64_t slot_size;
+    uint64_t slot_stride;
+    uint8_t reserved[CACHE_LINE - 5 * sizeof(uint64_t)];
+    // Number of slots committed, written by the writer only. Kept on its own
+    // cache line as every reader polls it.
+    uint64_t head;
+};
+
+// The sequence of a slot is 0 if it was never written, 2 * s + 1 while slot
+// sequence s is written and 2 * s + 2 once it is committed. Readers check it
+// before and after reading the slot, like a seqlock.
+struct slot_header {
+    uint64_t sequence;
+    uint64_t type;
+    uint64_t size;
+    struct stream2_shm_frame frame;
+};
+
+struct stream2_shm_writer {
+    char* name;
+    uint8_t* map;
+    size_t map_size;
+    struct ring_header* header;
+    uint64_t next;
+    bool reserved;
+};
+
+struct stream2_shm_reader {
+    uint8_t* map;
+    size_t map_size;
+    const struct ring_header* header;
+    uint64_t next;
+    uint64_t lost;
+};
+
+static size_t round_up(size_t size) {
+    return (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static size_t header_size(void) {
+    return round_up(sizeof(struct ring_header));
+}
+
+static size_t payload_offset(void) {
+    return round_up(sizeof(struct slot_header));
+}
+
+static struct slot_header* slot_at(uint8_t* map,
+                                   const struct ring_header* header,
+                                   uint64_t sequence) {
+    return (struct slot_header*)(map + header_size() +
+                                 (sequence % header->slot_count) *
+                                         header->slot_stride);
+}
+
+static char* dup_string(const char* s) {
+    const size_t len = strlen(s) + 1;
+    char* dup = malloc(len);
+    if (dup)
+        memcpy(dup, s, len);
+    return dup;
+}
+
+enum stream2_result stream2_shm_writer_create(
+        const char* name,
+        size_t slot_count,
+        size_t slot_size,
+        struct stream2_shm_writer** writer_out) {
+    *writer_out = NULL;
+
+    if (slot_count == 0 || slot_size == 0 || slot_size > SIZE_MAX / 2)
+        return STREAM2_ERROR_PARSE;
+
+    const size_t slot_stride = payload_offset() + round_up(slot_size);
+    if (slot_count > (SIZE_MAX - header_size()) / slot_stride)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    const size_t map_size = header_size() + slot_count * slot_stride;
+
+    struct stream2_shm_writer* writer =
+            calloc(1, sizeof(struct stream2_shm_writer));
+    if (writer == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((writer->name = dup_string(name)) == NULL) {
+        free(writer);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    // Readers of a replaced ring keep their mapping of the old one.
+    shm_unlink(name);
+    const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        free(writer->name);
+        free(writer);
+        return STREAM2_ERROR_SYSTEM;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)map_size) == 0)
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name);
+        free(writer->name);
+        free(writer);
+        return STREAM2_ERROR_SYSTEM;
+    }
+
+    writer->map = map;
+    writer->map_size = map_size;
+    writer->header = map;
+    writer->header->version = RING_VERSION;
+    writer->header->slot_count = slot_count;
+    writer->header->slot_size = slot_size;
+    writer->header->slot_stride = slot_stride;
+    // Readers opening the ring before the magic is stored reject it.
+    __atomic_store_n(&writer->header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    *writer_out = writer;
+    return STREAM2_OK;
+}
+
+void stream2_shm_writer_free(struct stream2_shm_writer* writer) {
+    if (writer == NULL)
+        return;
+    munmap(writer->map, writer->map_size);
+    shm_unlink(writer->name);
+    free(writer->name);
+    free(writer);
+}
+
+size_t stream2_shm_writer_slot_size(const struct stream2_shm_writer* writer) {
+    return writer->header->slot_size;
+}
+
+uint8_t* stream2_shm_writer_reserve(struct stream2_shm_writer* writer) {
+    struct slot_header* slot =
+            slot_at(writer->map, writer->header, writer->next);
+    if (!writer->reserved) {
+        __atomic_store_n(&slot->sequence, 2 * writer->next + 1,
+                         __ATOMIC_RELAXED);
+        // Orders the odd sequence before the writes to the payload.
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        writer->reserved = true;
+    }
+    return (uint8_t*)slot + payload_offset();
+}
+
+enum stream2_result stream2_shm_writer_commit(
+        struct stream2_shm_writer* writer,
+        enum stream2_shm_slot_type type,
+        const struct stream2_shm_frame* frame,
+        size_t size) {
+    if (!writer->reserved || size > writer->header->slot_size)
+        return STREAM2_ERROR_PARSE;
+
+    struct slot_header* slot =
+            slot_at(writer->map, writer->header, writer->next);
+    slot->type = type;
+    slot->size = size;
+    if (type == STREAM2_SHM_FRAME && frame)
+        slot->frame = *frame;
+    else
+        memset(&slot->frame, 0, sizeof(slot->frame));
+    __atomic_store_n(&slot->sequence, 2 * writer->next + 2, __ATOMIC_RELEASE);
+
+    writer->next++;
+    writer->reserved = false;
+    __atomic_store_n(&writer->header->head, writer->next, __ATOMIC_RELEASE);
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_shm_writer_write_raw(
+        struct stream2_shm_writer* writer,
+        const uint8_t* data,
+        size_t size) {
+    if (size > writer->header->slot_size)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    memcpy(stream2_shm_writer_reserve(writer), data, size);
+    return stream2_shm_writer_commit(writer, STREAM2_SHM_RAW, NULL, size);
+}
+
+enum stream2_result stream2_shm_writer_write_frame(
+        struct stream2_shm_writer* writer,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        uint64_t tag,
+        const void* data,
+        size_t size) {
+    if (channel >= msg->data.len)
+        return STREAM2_ERROR_PARSE;
+    if (size > writer->header->slot_size)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    struct stream2_shm_frame frame;
+    stream2_shm_frame_from_msg(&frame, msg, channel, tag);
+    memcpy(stream2_shm_writer_reserve(writer), data, size);
+    return stream2_shm_writer_commit(writer, STREAM2_SHM_FRAME, &frame, size);
+}
+
+void stream2_shm_frame_from_msg(struct stream2_shm_frame* frame,
+                                const struct stream2_image_msg* msg,
+                                size_t channel,
+                                uint64_t tag) {
+    memset(frame, 0, sizeof(*frame));
+    frame->series_id = msg->series_id;
+    frame->image_id = msg->image_id;
+    memcpy(frame->real_time, msg->real_time, sizeof(frame->real_time));
+    memcpy(frame->start_time, msg->start_time, sizeof(frame->start_time));
+    memcpy(frame->stop_time, msg->stop_time, sizeof(frame->stop_time));
+    frame->channel = channel;
+    frame->tag = tag;
+    if (channel < msg->data.len) {
+        const struct stream2_image_data* data = &msg->data.ptr[channel];
+        if (data->channel) {
+            strncpy(frame->channel_name, data->channel,
+                    STREAM2_SHM_CHANNEL_LEN - 1);
+        }
+        frame->dim[0] = data->data.dim[0];
+        frame->dim[1] = data->data.dim[1];
+    }
+}
+
+enum stream2_result stream2_shm_reader_open(
+        const char* name,
+        struct stream2_shm_reader** reader_out) {
+    *reader_out = NULL;
+
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return STREAM2_ERROR_SYSTEM;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= header_size())
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return STREAM2_ERROR_SYSTEM;
+
+    const struct ring_header* header = map;
+    const size_t map_size = st.st_size;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+        header->version != RING_VERSION || header->slot_count == 0 ||
+        header->slot_stride < payload_offset() + header->slot_size ||
+        header->slot_count > (map_size - header_size()) / header->slot_stride)
+    {
+        munmap(map, map_size);
+        return STREAM2_ERROR_SIGNATURE;
+    }
+
+    struct stream2_shm_reader* reader =
+            calloc(1, sizeof(struct stream2_shm_reader));
+    if (reader == NULL) {
+        munmap(map, map_size);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    reader->map = map;
+    reader->map_size = map_size;
+    reader->header = header;
+    reader->next = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+    *reader_out = reader;
+    return STREAM2_OK;
+}
+
+void stream2_shm_reader_free(struct stream2_shm_reader* reader) {
+    if (reader == NULL)
+        return;
+    munmap(reader->map, reader->map_size);
+    free(reader);
+}
+
+bool stream2_shm_reader_next(struct stream2_shm_reader* reader,
+                             struct stream2_shm_slot* slot) {
+    const struct ring_header* header = reader->header;
+    for (;;) {
+        const uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (reader->next >= head)
+            return false;
+        if (head - reader->next > header->slot_count) {
+            reader->lost += head - header->slot_count - reader->next;
+            reader->next = head - header->slot_count;
+        }
+
+        const struct slot_header* s =
+                slot_at(reader->map, header, reader->next);
+        const uint64_t sequence =
+                __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != 2 * reader->next + 2) {
+            // Overwritten after head was read.
+            reader->lost++;
+            reader->next++;
+            continue;
+        }
+
+        slot->sequence = reader->next;
+        slot->type = (enum stream2_shm_slot_type)s->type;
+        slot->frame = s->type == STREAM2_SHM_FRAME ? &s->frame : NULL;
+        slot->data = (const uint8_t*)s + payload_offset();
+        // A torn size fails validation but must not exceed the slot.
+        slot->size = s->size < header->slot_size ? s->size : header->slot_size;
+        reader->next++;
+        return true;
+    }
+}
+
+bool stream2_shm_reader_validate(struct stream2_shm_reader* reader,
+                                 const struct stream2_shm_slot* slot) {
+    const struct slot_header* s = slot_at(reader->map, reader->header,
+                                          slot->sequence);
+    // Orders the reads of the slot before the second read of the sequence.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) ==
+        2 * slot->sequence + 2)
+        return true;
+    reader->lost++;
+    return false;
+}
+
+uint64_t stream2_shm_reader_lost(const struct stream2_shm_reader* reader) {
+    return reader->lost;
+}
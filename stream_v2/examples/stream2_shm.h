@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+enum { STREAM2_SHM_CHANNEL_LEN = 32 };
+
+enum stream2_shm_slot_type {
+    // A raw CBOR message as received from the detector.
+    STREAM2_SHM_RAW,
+    // A decoded frame of one channel of an image message.
+    STREAM2_SHM_FRAME,
+};
+
+// Metadata of a decoded frame: the fixed-size fields of the image message and
+// the layout of the channel data.
+struct stream2_shm_frame {
+    uint64_t series_id;
+    uint64_t image_id;
+    uint64_t real_time[2];
+    uint64_t start_time[2];
+    uint64_t stop_time[2];
+    // Index and name of the channel in the image message. The name is
+    // truncated to STREAM2_SHM_CHANNEL_LEN - 1 characters.
+    uint64_t channel;
+    char channel_name[STREAM2_SHM_CHANNEL_LEN];
+    // Typed array tag and dimensions of the decoded data.
+    uint64_t tag;
+    uint64_t dim[2];
+    // Level of a preview frame pooled 2^level times, or 0 for a frame at full
+    // resolution.
+    uint64_t level;
+};
+
+// A slot as seen by a reader. The pointers refer to the shared memory.
+struct stream2_shm_slot {
+    // Sequence number of the slot, starting at 0 and counting every slot
+    // written by the writer.
+    uint64_t sequence;
+    enum stream2_shm_slot_type type;
+    // Frame metadata, or NULL for raw messages.
+    const struct stream2_shm_frame* frame;
+    const uint8_t* data;
+    size_t size;
+};
+
+struct stream2_shm_writer;
+struct stream2_shm_reader;
+
+// Creates a POSIX shared memory ring of slot_count slots of slot_size bytes.
+//
+// There is a single writer per ring; readers never block it. A ring of the
+// same name left by a previous writer is replaced.
+enum stream2_result stream2_shm_writer_create(
+        const char* name,
+        size_t slot_count,
+        size_t slot_size,
+        struct stream2_shm_writer** writer_out);
+
+// Frees the writer and removes the name of the ring. Mapped readers keep
+// their mapping.
+void stream2_shm_writer_free(struct stream2_shm_writer* writer);
+
+size_t stream2_shm_writer_slot_size(const struct stream2_shm_writer* writer);
+
+// Reserves the next slot and returns its payload of slot size bytes, e.g. to
+// decode into it directly. Readers skip the slot until it is committed.
+uint8_t* stream2_shm_writer_reserve(struct stream2_shm_writer* writer);
+
+// Publishes the reserved slot. frame is ignored for raw messages.
+enum stream2_result stream2_shm_writer_commit(
+        struct stream2_shm_writer* writer,
+        enum stream2_shm_slot_type type,
+        const struct stream2_shm_frame* frame,
+        size_t size);
+
+// Copies a raw CBOR message into the next slot and publishes it.
+enum stream2_result stream2_shm_writer_write_raw(
+        struct stream2_shm_writer* writer,
+        const uint8_t* data,
+        size_t size);
+
+// Copies a decoded frame of a channel of an image message into the next slot
+// and publishes it. size must match the dimensions and tag of the channel.
+enum stream2_result stream2_shm_writer_write_frame(
+        struct stream2_shm_writer* writer,
+        const struct stream2_image_msg* msg,
+        size_t channel,
+        uint64_t tag,
+        const void* data,
+        size_t size);
+
+// Fills the frame metadata of a channel of an image message.
+void stream2_shm_frame_from_msg(struct stream2_shm_frame* frame,
+                                const struct stream2_image_msg* msg,
+                                size_t channel,
+                                uint64_t tag);
+
+// Opens a ring read-only. The reader starts at the next slot written.
+enum stream2_result stream2_shm_reader_open(
+        const char* name,
+        struct stream2_shm_reader** reader_out);
+void stream2_shm_reader_free(struct stream2_shm_reader* reader);
+
+// Gets the next published slot without copying it.
+//
+// Returns false if no slot was published since the last one. If the reader
+// fell behind by more than the ring size, the overwritten slots are skipped
+// and counted as lost.
+//
+// The slot may be overwritten while it is used; call
+// stream2_shm_reader_validate() after using it.
+bool stream2_shm_reader_next(struct stream2_shm_reader* reader,
+                             struct stream2_shm_slot* slot);
+
+// Returns true if the slot was not overwritten since stream2_shm_reader_next()
+// returned it, i.e. everything read from it is consistent.
+bool stream2_shm_reader_validate(struct stream2_shm_reader* reader,
+                                 const struct stream2_shm_slot* slot);
+
+// Number of slots the reader lost because it fell behind, including slots
+// that failed validation.
+uint64_t stream2_shm_reader_lost(const struct stream2_shm_reader* reader);
+
+#if defined(__cplusplus)
+}
+#endif
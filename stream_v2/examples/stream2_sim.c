@@ -0,0 +1,804 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zmq.h>
+
+#include "stream2.h"
+#include "stream2_compress.h"
+#include "stream2_compressor.h"
+#include "tinycbor/src/cbor.h"
+
+// Simulates a DCU: pushes start, image and end messages of synthetic series
+// at a given frame rate. Images are compressed and encoded before each series
+// so that sending an image only patches its image_id and times.
+
+enum {
+    MAX_CHANNELS = 4,
+    SPOTS = 400,
+    // Time base frequency of start_time, stop_time and real_time.
+    TIME_BASE = 1000000000,
+    LINGER_MS = 1000,
+};
+
+// Fields of image messages patched for every image.
+enum {
+    PATCH_IMAGE_ID,
+    PATCH_START_TIME,
+    PATCH_STOP_TIME,
+    PATCHES,
+};
+
+static const CborTag SELF_DESCRIBED_CBOR = 55799;
+static const CborTag DATE_TIME = 0;
+static const CborTag MULTI_DIMENSIONAL_ARRAY_ROW_MAJOR = 40;
+static const CborTag DECTRIS_COMPRESSION = 56500;
+
+struct options {
+    const char* address;
+    uint64_t number_of_images;
+    uint64_t series;
+    double frame_time;
+    uint64_t image_size_x;
+    uint64_t image_size_y;
+    const char* image_dtype;
+    size_t channels;
+    const char* compression;
+    size_t distinct_images;
+    size_t pool_size;
+    size_t compress_threads;
+};
+
+struct series_info {
+    uint64_t series_id;
+    char series_unique_id[64];
+    char date[32];
+    uint64_t saturation_value;
+    uint64_t tag;
+    size_t elem_size;
+    char channels[MAX_CHANNELS][16];
+};
+
+// A pre-encoded image message. Its bytes are sent without copies, so the
+// buffer is reused only after ZeroMQ released it.
+struct image_buffer {
+    uint8_t* data;
+    size_t size;
+    size_t patch[PATCHES];
+    int in_flight;
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_for(double dt) {
+    if (dt > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)dt;
+        ts.tv_nsec = (long)((dt - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double uniform(uint64_t* state) {
+    return (xorshift64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void store_pixel(uint8_t* data, size_t elem_size, uint64_t value) {
+    // Typed arrays are little-endian.
+    for (size_t i = 0; i < elem_size; i++)
+        data[i] = (uint8_t)(value >> (8 * i));
+}
+
+// Generates a diffraction-like image: a sparse background, powder rings
+// around the beam center and Bragg spots.
+static void generate_image(uint8_t* data,
+                           const struct options* options,
+                           const struct series_info* info,
+                           uint64_t seed) {
+    const uint64_t nx = options->image_size_x;
+    const uint64_t ny = options->image_size_y;
+    const double cx = nx * 0.5;
+    const double cy = ny * 0.5;
+    const double rings[3] = {0.15, 0.27, 0.41};
+    const double scale = nx < ny ? nx : ny;
+
+    uint64_t state = 0x9e3779b97f4a7c15u ^ (seed * 0xbf58476d1ce4e5b9u);
+    xorshift64(&state);
+
+    for (uint64_t y = 0; y < ny; y++) {
+        for (uint64_t x = 0; x < nx; x++) {
+            const double r = hypot(x - cx, y - cy) / scale;
+            double intensity = 0.0;
+            for (size_t k = 0; k < sizeof(rings) / sizeof(rings[0]); k++) {
+                const double d = (r - rings[k]) / 0.004;
+                intensity += 6.0 / (k + 1) * exp(-0.5 * d * d);
+            }
+            // Mostly zeros and ones, as in short exposures.
+            const double u = uniform(&state);
+            uint64_t value = (uint64_t)(intensity * u * 2.0);
+            if (u < 0.02)
+                value += 1;
+            store_pixel(data + (y * nx + x) * info->elem_size, info->elem_size,
+                        value);
+        }
+    }
+
+    for (size_t s = 0; s < SPOTS; s++) {
+        const int64_t sx = (int64_t)(uniform(&state) * nx);
+        const int64_t sy = (int64_t)(uniform(&state) * ny);
+        const double peak = 10.0 + uniform(&state) * 2000.0;
+        for (int64_t dy = -3; dy <= 3; dy++) {
+            for (int64_t dx = -3; dx <= 3; dx++) {
+                const int64_t x = sx + dx;
+                const int64_t y = sy + dy;
+                if (x < 0 || y < 0 || x >= (int64_t)nx || y >= (int64_t)ny)
+                    continue;
+                uint64_t value = (uint64_t)(peak * exp(-0.5 * (dx * dx +
+                                                               dy * dy)));
+                if (value > info->saturation_value)
+                    value = info->saturation_value;
+                store_pixel(data + (y * nx + x) * info->elem_size,
+                            info->elem_size, value);
+            }
+        }
+    }
+}
+
+static CborError encode_date(CborEncoder* enc, const char* date) {
+    CborError e = CborNoError;
+    e |= cbor_encode_tag(enc, DATE_TIME);
+    e |= cbor_encode_text_stringz(enc, date);
+    return e;
+}
+
+static CborError encode_rational(CborEncoder* enc,
+                                 uint64_t numerator,
+                                 uint64_t denominator) {
+    CborError e = CborNoError;
+    CborEncoder array;
+    e |= cbor_encoder_create_array(enc, &array, 2);
+    e |= cbor_encode_uint(&array, numerator);
+    e |= cbor_encode_uint(&array, denominator);
+    e |= cbor_encoder_close_container(enc, &array);
+    return e;
+}
+
+static CborError encode_start_msg(CborEncoder* enc,
+                                  const struct options* options,
+                                  const struct series_info* info) {
+    CborError e = CborNoError;
+    CborEncoder map;
+    CborEncoder inner;
+    CborEncoder axis;
+
+    e |= cbor_encode_tag(enc, SELF_DESCRIBED_CBOR);
+    e |= cbor_encoder_create_map(enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "start");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, info->series_id);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, info->series_unique_id);
+    e |= cbor_encode_text_stringz(&map, "arm_date");
+    e |= encode_date(&map, info->date);
+    e |= cbor_encode_text_stringz(&map, "beam_center_x");
+    e |= cbor_encode_double(&map, options->image_size_x * 0.5);
+    e |= cbor_encode_text_stringz(&map, "beam_center_y");
+    e |= cbor_encode_double(&map, options->image_size_y * 0.5);
+    e |= cbor_encode_text_stringz(&map, "channels");
+    e |= cbor_encoder_create_array(&map, &inner, options->channels);
+    for (size_t i = 0; i < options->channels; i++)
+        e |= cbor_encode_text_stringz(&inner, info->channels[i]);
+    e |= cbor_encoder_close_container(&map, &inner);
+    e |= cbor_encode_text_stringz(&map, "count_time");
+    e |= cbor_encode_double(&map, options->frame_time * 0.99);
+    e |= cbor_encode_text_stringz(&map, "countrate_correction_enabled");
+    e |= cbor_encode_boolean(&map, false);
+    e |= cbor_encode_text_stringz(&map, "detector_description");
+    e |= cbor_encode_text_stringz(&map, "stream2_sim");
+    e |= cbor_encode_text_stringz(&map, "detector_serial_number");
+    e |= cbor_encode_text_stringz(&map, "SIM-0000");
+    e |= cbor_encode_text_stringz(&map, "detector_translation");
+    e |= cbor_encoder_create_array(&map, &inner, 3);
+    e |= cbor_encode_double(&inner, 0.0);
+    e |= cbor_encode_double(&inner, 0.0);
+    e |= cbor_encode_double(&inner, 0.1);
+    e |= cbor_encoder_close_container(&map, &inner);
+    e |= cbor_encode_text_stringz(&map, "flatfield_enabled");
+    e |= cbor_encode_boolean(&map, false);
+    e |= cbor_encode_text_stringz(&map, "frame_time");
+    e |= cbor_encode_double(&map, options->frame_time);
+    e |= cbor_encode_text_stringz(&map, "goniometer");
+    e |= cbor_encoder_create_map(&map, &inner, 1);
+    e |= cbor_encode_text_stringz(&inner, "omega");
+    e |= cbor_encoder_create_map(&inner, &axis, 2);
+    e |= cbor_encode_text_stringz(&axis, "increment");
+    e |= cbor_encode_double(&axis, 0.1);
+    e |= cbor_encode_text_stringz(&axis, "start");
+    e |= cbor_encode_double(&axis, 0.0);
+    e |= cbor_encoder_close_container(&inner, &axis);
+    e |= cbor_encoder_close_container(&map, &inner);
+    e |= cbor_encode_text_stringz(&map, "image_dtype");
+    e |= cbor_encode_text_stringz(&map, options->image_dtype);
+    e |= cbor_encode_text_stringz(&map, "image_size_x");
+    e |= cbor_encode_uint(&map, options->image_size_x);
+    e |= cbor_encode_text_stringz(&map, "image_size_y");
+    e |= cbor_encode_uint(&map, options->image_size_y);
+    e |= cbor_encode_text_stringz(&map, "incident_energy");
+    e |= cbor_encode_double(&map, 12398.4);
+    e |= cbor_encode_text_stringz(&map, "incident_wavelength");
+    e |= cbor_encode_double(&map, 1.0);
+    e |= cbor_encode_text_stringz(&map, "number_of_images");
+    e |= cbor_encode_uint(&map, options->number_of_images);
+    e |= cbor_encode_text_stringz(&map, "pixel_mask_enabled");
+    e |= cbor_encode_boolean(&map, false);
+    e |= cbor_encode_text_stringz(&map, "pixel_size_x");
+    e |= cbor_encode_double(&map, 75e-6);
+    e |= cbor_encode_text_stringz(&map, "pixel_size_y");
+    e |= cbor_encode_double(&map, 75e-6);
+    e |= cbor_encode_text_stringz(&map, "saturation_value");
+    e |= cbor_encode_uint(&map, info->saturation_value);
+    e |= cbor_encode_text_stringz(&map, "sensor_material");
+    e |= cbor_encode_text_stringz(&map, "Si");
+    e |= cbor_encode_text_stringz(&map, "sensor_thickness");
+    e |= cbor_encode_double(&map, 450e-6);
+    e |= cbor_encode_text_stringz(&map, "threshold_energy");
+    e |= cbor_encoder_create_map(&map, &inner, options->channels);
+    for (size_t i = 0; i < options->channels; i++) {
+        e |= cbor_encode_text_stringz(&inner, info->channels[i]);
+        e |= cbor_encode_double(&inner, 6199.2 * (i + 1));
+    }
+    e |= cbor_encoder_close_container(&map, &inner);
+    e |= cbor_encode_text_stringz(&map, "user_data");
+    e |= cbor_encode_null(&map);
+    e |= cbor_encode_text_stringz(&map, "virtual_pixel_interpolation_enabled");
+    e |= cbor_encode_boolean(&map, false);
+    e |= cbor_encoder_close_container(enc, &map);
+    return e;
+}
+
+// Encodes an image message whose image_id, start_time and stop_time are
+// placeholders of 9 bytes each, found by find_patches().
+static CborError encode_image_msg(CborEncoder* enc,
+                                  const struct options* options,
+                                  const struct series_info* info,
+                                  const uint8_t* const* compressed,
+                                  const size_t* compressed_size) {
+    CborError e = CborNoError;
+    CborEncoder map;
+    CborEncoder data;
+    CborEncoder multidim;
+    CborEncoder inner;
+    const uint64_t count_time = (uint64_t)(options->frame_time * 0.99 *
+                                           TIME_BASE);
+
+    e |= cbor_encode_tag(enc, SELF_DESCRIBED_CBOR);
+    e |= cbor_encoder_create_map(enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "image");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, info->series_id);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, info->series_unique_id);
+    e |= cbor_encode_text_stringz(&map, "image_id");
+    e |= cbor_encode_uint(&map, UINT64_MAX - PATCH_IMAGE_ID);
+    e |= cbor_encode_text_stringz(&map, "real_time");
+    e |= encode_rational(&map, count_time, TIME_BASE);
+    e |= cbor_encode_text_stringz(&map, "series_date");
+    e |= encode_date(&map, info->date);
+    e |= cbor_encode_text_stringz(&map, "start_time");
+    e |= encode_rational(&map, UINT64_MAX - PATCH_START_TIME, TIME_BASE);
+    e |= cbor_encode_text_stringz(&map, "stop_time");
+    e |= encode_rational(&map, UINT64_MAX - PATCH_STOP_TIME, TIME_BASE);
+    e |= cbor_encode_text_stringz(&map, "user_data");
+    e |= cbor_encode_null(&map);
+    e |= cbor_encode_text_stringz(&map, "data");
+    e |= cbor_encoder_create_map(&map, &data, options->channels);
+    for (size_t i = 0; i < options->channels; i++) {
+        e |= cbor_encode_text_stringz(&data, info->channels[i]);
+        e |= cbor_encode_tag(&data, MULTI_DIMENSIONAL_ARRAY_ROW_MAJOR);
+        e |= cbor_encoder_create_array(&data, &multidim, 2);
+        e |= cbor_encoder_create_array(&multidim, &inner, 2);
+        e |= cbor_encode_uint(&inner, options->image_size_y);
+        e |= cbor_encode_uint(&inner, options->image_size_x);
+        e |= cbor_encoder_close_container(&multidim, &inner);
+        e |= cbor_encode_tag(&multidim, info->tag);
+        e |= cbor_encode_tag(&multidim, DECTRIS_COMPRESSION);
+        e |= cbor_encoder_create_array(&multidim, &inner, 3);
+        e |= cbor_encode_text_stringz(&inner, options->compression);
+        e |= cbor_encode_uint(&inner, strcmp(options->compression, "bslz4") == 0
+                                              ? info->elem_size
+                                              : 0);
+        e |= cbor_encode_byte_string(&inner, compressed[i],
+                                     compressed_size[i]);
+        e |= cbor_encoder_close_container(&multidim, &inner);
+        e |= cbor_encoder_close_container(&data, &multidim);
+    }
+    e |= cbor_encoder_close_container(&map, &data);
+    e |= cbor_encoder_close_container(enc, &map);
+    return e;
+}
+
+static CborError encode_end_msg(CborEncoder* enc,
+                                const struct series_info* info) {
+    CborError e = CborNoError;
+    CborEncoder map;
+
+    e |= cbor_encode_tag(enc, SELF_DESCRIBED_CBOR);
+    e |= cbor_encoder_create_map(enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "end");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, info->series_id);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, info->series_unique_id);
+    e |= cbor_encoder_close_container(enc, &map);
+    return e;
+}
+
+// Finds the placeholder of each patched field: a 64-bit unsigned integer
+// encoded as 0x1b followed by 8 big-endian bytes.
+static enum stream2_result find_patches(struct image_buffer* buffer) {
+    size_t from = 0;
+    for (int p = PATCH_IMAGE_ID; p < PATCHES; p++) {
+        uint8_t pattern[9] = {0x1b};
+        const uint64_t placeholder = UINT64_MAX - p;
+        for (int i = 0; i < 8; i++)
+            pattern[1 + i] = (uint8_t)(placeholder >> (56 - 8 * i));
+
+        size_t i = from;
+        while (i + sizeof(pattern) <= buffer->size &&
+               memcmp(buffer->data + i, pattern, sizeof(pattern)) != 0)
+            i++;
+        if (i + sizeof(pattern) > buffer->size)
+            return STREAM2_ERROR_PARSE;
+        buffer->patch[p] = i + 1;
+        from = i + sizeof(pattern);
+    }
+    return STREAM2_OK;
+}
+
+static void patch(struct image_buffer* buffer, int field, uint64_t value) {
+    uint8_t* p = buffer->data + buffer->patch[field];
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(value >> (56 - 8 * i));
+}
+
+static void release_buffer(void* data, void* hint) {
+    (void)data;
+    __atomic_store_n((int*)hint, 0, __ATOMIC_RELEASE);
+}
+
+static void wait_for_buffer(struct image_buffer* buffer) {
+    while (__atomic_load_n(&buffer->in_flight, __ATOMIC_ACQUIRE))
+        sleep_for(10e-6);
+}
+
+static enum stream2_result send_copy(void* socket,
+                                     const uint8_t* data,
+                                     size_t size) {
+    if (zmq_send(socket, data, size, 0) == -1)
+        return STREAM2_ERROR_SYSTEM;
+    return STREAM2_OK;
+}
+
+static enum stream2_result init_series(const struct options* options,
+                                       uint64_t series_id,
+                                       struct series_info* info) {
+    memset(info, 0, sizeof(*info));
+    info->series_id = series_id;
+    snprintf(info->series_unique_id, sizeof(info->series_unique_id),
+             "stream2_sim-%ld-%" PRIu64, (long)time(NULL), series_id);
+
+    const time_t t = time(NULL);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(info->date, sizeof(info->date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    if (strcmp(options->image_dtype, "uint8") == 0) {
+        info->tag = STREAM2_TYPED_ARRAY_UINT8;
+        info->elem_size = 1;
+    } else if (strcmp(options->image_dtype, "uint16") == 0) {
+        info->tag = STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN;
+        info->elem_size = 2;
+    } else if (strcmp(options->image_dtype, "uint32") == 0) {
+        info->tag = STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN;
+        info->elem_size = 4;
+    } else {
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    }
+    // The maximum value is NODATA.
+    info->saturation_value = (UINT64_MAX >> (64 - 8 * info->elem_size)) - 1;
+
+    for (size_t i = 0; i < options->channels; i++)
+        snprintf(info->channels[i], sizeof(info->channels[i]), "threshold_%zu",
+                 i + 1);
+    return STREAM2_OK;
+}
+
+// Encodes a message into a growing buffer.
+static enum stream2_result encode(uint8_t** buffer,
+                                  size_t* capacity,
+                                  size_t* size,
+                                  CborError (*fn)(CborEncoder*, const void*),
+                                  const void* arg) {
+    for (;;) {
+        CborEncoder enc;
+        cbor_encoder_init(&enc, *buffer, *capacity, 0);
+        const CborError e = fn(&enc, arg);
+        if (e == CborNoError) {
+            *size = cbor_encoder_get_buffer_size(&enc, *buffer);
+            return STREAM2_OK;
+        }
+        if (e != CborErrorOutOfMemory)
+            return STREAM2_ERROR_PARSE;
+
+        const size_t new_capacity =
+                *capacity + cbor_encoder_get_extra_bytes_needed(&enc);
+        uint8_t* p = realloc(*buffer, new_capacity);
+        if (p == NULL)
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        *buffer = p;
+        *capacity = new_capacity;
+    }
+}
+
+struct encode_args {
+    const struct options* options;
+    const struct series_info* info;
+    const uint8_t* const* compressed;
+    const size_t* compressed_size;
+};
+
+static CborError encode_start_fn(CborEncoder* enc, const void* arg) {
+    const struct encode_args* a = arg;
+    return encode_start_msg(enc, a->options, a->info);
+}
+
+static CborError encode_image_fn(CborEncoder* enc, const void* arg) {
+    const struct encode_args* a = arg;
+    return encode_image_msg(enc, a->options, a->info, a->compressed,
+                            a->compressed_size);
+}
+
+static CborError encode_end_fn(CborEncoder* enc, const void* arg) {
+    const struct encode_args* a = arg;
+    return encode_end_msg(enc, a->info);
+}
+
+struct simulator {
+    struct options options;
+    void* ctx;
+    void* socket;
+    struct stream2_compressor* compressor;
+    // Compressed frames of distinct_images images of every channel.
+    uint8_t** compressed;
+    size_t* compressed_size;
+    struct image_buffer* pool;
+    uint8_t* msg;
+    size_t msg_capacity;
+};
+
+static enum stream2_result prepare_frames(struct simulator* sim,
+                                          const struct series_info* info) {
+    enum stream2_result r;
+    const struct options* options = &sim->options;
+
+    const size_t frame_size =
+            options->image_size_x * options->image_size_y * info->elem_size;
+    const size_t bound = stream2_compress_bound(options->compression,
+                                                frame_size, info->elem_size);
+    uint8_t* frame = malloc(frame_size);
+    if (frame == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    const size_t frames = options->distinct_images * options->channels;
+    for (size_t i = 0; i < frames; i++) {
+        if ((sim->compressed[i] = malloc(bound)) == NULL) {
+            free(frame);
+            return STREAM2_ERROR_OUT_OF_MEMORY;
+        }
+        generate_image(frame, options, info, i);
+        if ((r = stream2_compressor_compress(
+                     sim->compressor, options->compression, frame,
+                     frame_size, info->elem_size, sim->compressed[i], bound,
+                     &sim->compressed_size[i])))
+        {
+            free(frame);
+            return r;
+        }
+    }
+    free(frame);
+    return STREAM2_OK;
+}
+
+static enum stream2_result prepare_pool(struct simulator* sim,
+                                        const struct series_info* info) {
+    enum stream2_result r;
+    const struct options* options = &sim->options;
+
+    for (size_t i = 0; i < options->pool_size; i++) {
+        struct image_buffer* buffer = &sim->pool[i];
+        wait_for_buffer(buffer);
+
+        const size_t image = i % options->distinct_images;
+        struct encode_args args = {
+                options, info,
+                (const uint8_t* const*)&sim->compressed[image *
+                                                        options->channels],
+                &sim->compressed_size[image * options->channels],
+        };
+        size_t capacity = buffer->size;
+        if ((r = encode(&buffer->data, &capacity, &buffer->size,
+                        encode_image_fn, &args)))
+            return r;
+        if ((r = find_patches(buffer)))
+            return r;
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result run_series(struct simulator* sim,
+                                      uint64_t series_id) {
+    enum stream2_result r;
+    const struct options* options = &sim->options;
+
+    struct series_info info;
+    if ((r = init_series(options, series_id, &info)))
+        return r;
+    // Images are compressed once for all series.
+    if (sim->compressed[0] == NULL && (r = prepare_frames(sim, &info)))
+        return r;
+    if ((r = prepare_pool(sim, &info)))
+        return r;
+
+    struct encode_args args = {options, &info, NULL, NULL};
+    size_t size;
+    if ((r = encode(&sim->msg, &sim->msg_capacity, &size, encode_start_fn,
+                    &args)) ||
+        (r = send_copy(sim->socket, sim->msg, size)))
+        return r;
+
+    const uint64_t frame_time = (uint64_t)(options->frame_time * TIME_BASE);
+    const uint64_t count_time = (uint64_t)(options->frame_time * 0.99 *
+                                           TIME_BASE);
+    uint64_t bytes = 0;
+    uint64_t image_id = 0;
+    double start = 0.0;
+    double last_report = 0.0;
+    uint64_t last_image_id = 0;
+    for (; image_id < options->number_of_images && !interrupted; image_id++) {
+        struct image_buffer* buffer =
+                &sim->pool[image_id % options->pool_size];
+        wait_for_buffer(buffer);
+        patch(buffer, PATCH_IMAGE_ID, image_id);
+        patch(buffer, PATCH_START_TIME, image_id * frame_time);
+        patch(buffer, PATCH_STOP_TIME, image_id * frame_time + count_time);
+
+        if (image_id == 0) {
+            start = now();
+            last_report = start;
+        } else {
+            sleep_for(start + image_id * options->frame_time - now());
+        }
+
+        zmq_msg_t msg;
+        buffer->in_flight = 1;
+        zmq_msg_init_data(&msg, buffer->data, buffer->size, release_buffer,
+                          &buffer->in_flight);
+        if (zmq_msg_send(&msg, sim->socket, 0) == -1) {
+            zmq_msg_close(&msg);
+            if (interrupted)
+                break;
+            return STREAM2_ERROR_SYSTEM;
+        }
+        // As the rate, the throughput counts the images sent after the first.
+        if (image_id > 0)
+            bytes += buffer->size;
+
+        const double t = now();
+        if (t - last_report >= 1.0) {
+            printf("series %" PRIu64 ": image_id %" PRIu64 " %.1f Hz\n",
+                   series_id, image_id,
+                   (image_id - last_image_id) / (t - last_report));
+            fflush(stdout);
+            last_report = t;
+            last_image_id = image_id;
+        }
+    }
+    // The rate is measured over the image_id - 1 frame times between the
+    // first and the last image.
+    const double elapsed = image_id > 1 ? now() - start : 0.0;
+
+    if ((r = encode(&sim->msg, &sim->msg_capacity, &size, encode_end_fn,
+                    &args)) ||
+        (r = send_copy(sim->socket, sim->msg, size)))
+        return r;
+
+    const double requested = 1.0 / options->frame_time;
+    const double achieved = elapsed > 0 ? (image_id - 1) / elapsed : 0.0;
+    printf("series %" PRIu64 ": %" PRIu64 " images in %.3f s: achieved "
+           "%.1f Hz of requested %.1f Hz (%.1f%%), %.2f GB/s\n",
+           series_id, image_id, elapsed, achieved, requested,
+           100.0 * achieved / requested,
+           elapsed > 0 ? bytes / elapsed * 1e-9 : 0.0);
+    fflush(stdout);
+    return STREAM2_OK;
+}
+
+static void simulator_free(struct simulator* sim) {
+    if (sim->socket)
+        zmq_close(sim->socket);
+    // Waits until ZeroMQ released all image buffers.
+    if (sim->ctx)
+        zmq_ctx_term(sim->ctx);
+    stream2_compressor_free(sim->compressor);
+    if (sim->compressed) {
+        const size_t frames =
+                sim->options.distinct_images * sim->options.channels;
+        for (size_t i = 0; i < frames; i++)
+            free(sim->compressed[i]);
+    }
+    free(sim->compressed);
+    free(sim->compressed_size);
+    if (sim->pool) {
+        for (size_t i = 0; i < sim->options.pool_size; i++)
+            free(sim->pool[i].data);
+    }
+    free(sim->pool);
+    free(sim->msg);
+}
+
+static enum stream2_result simulator_init(struct simulator* sim) {
+    enum stream2_result r;
+
+    const size_t frames = sim->options.distinct_images * sim->options.channels;
+    sim->compressed = calloc(frames, sizeof(uint8_t*));
+    sim->compressed_size = calloc(frames, sizeof(size_t));
+    sim->pool = calloc(sim->options.pool_size, sizeof(struct image_buffer));
+    if (sim->compressed == NULL || sim->compressed_size == NULL ||
+        sim->pool == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((r = stream2_compressor_create(sim->options.compress_threads,
+                                       &sim->compressor)))
+        return r;
+
+    const int linger = LINGER_MS;
+    if ((sim->ctx = zmq_ctx_new()) == NULL ||
+        (sim->socket = zmq_socket(sim->ctx, ZMQ_PUSH)) == NULL ||
+        zmq_setsockopt(sim->socket, ZMQ_LINGER, &linger, sizeof(linger)) ||
+        zmq_bind(sim->socket, sim->options.address))
+        return STREAM2_ERROR_SYSTEM;
+    return STREAM2_OK;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-a ADDRESS] [-n NUMBER_OF_IMAGES] [-s SERIES] "
+            "[-t FRAME_TIME] [-x IMAGE_SIZE_X] [-y IMAGE_SIZE_Y] "
+            "[-d uint8|uint16|uint32] [-c CHANNELS] [-z bslz4|lz4] "
+            "[-k DISTINCT_IMAGES] [-p POOL_SIZE] [-j COMPRESS_THREADS]\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    enum stream2_result r = STREAM2_OK;
+
+    struct simulator sim;
+    memset(&sim, 0, sizeof(sim));
+    struct options* options = &sim.options;
+    options->address = "tcp://*:31001";
+    options->number_of_images = 1000;
+    options->series = 1;
+    options->frame_time = 0.001;
+    options->image_size_x = 1028;
+    options->image_size_y = 1062;
+    options->image_dtype = "uint16";
+    options->channels = 1;
+    options->compression = "bslz4";
+    options->distinct_images = 16;
+    options->pool_size = 64;
+    options->compress_threads = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:n:s:t:x:y:d:c:z:k:p:j:")) != -1) {
+        switch (opt) {
+            case 'a':
+                options->address = optarg;
+                break;
+            case 'n':
+                options->number_of_images = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                options->series = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                options->frame_time = strtod(optarg, NULL);
+                break;
+            case 'x':
+                options->image_size_x = strtoull(optarg, NULL, 10);
+                break;
+            case 'y':
+                options->image_size_y = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                options->image_dtype = optarg;
+                break;
+            case 'c':
+                options->channels = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                options->compression = optarg;
+                break;
+            case 'k':
+                options->distinct_images = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                options->pool_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                options->compress_threads = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || options->frame_time <= 0 ||
+        options->image_size_x == 0 || options->image_size_y == 0 ||
+        options->channels == 0 || options->channels > MAX_CHANNELS ||
+        options->distinct_images == 0 || options->pool_size == 0 ||
+        options->compress_threads == 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if ((r = simulator_init(&sim))) {
+        fprintf(stderr, "error: error %i starting simulator\n", (int)r);
+        simulator_free(&sim);
+        return EXIT_FAILURE;
+    }
+
+    for (uint64_t series_id = 1;
+         series_id <= options->series && !interrupted; series_id++)
+    {
+        if ((r = run_series(&sim, series_id))) {
+            fprintf(stderr, "error: error %i in series %" PRIu64 "\n", (int)r,
+                    series_id);
+            break;
+        }
+    }
+
+    simulator_free(&sim);
+    return r == STREAM2_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
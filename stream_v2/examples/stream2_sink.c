@@ -0,0 +1,498 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "stream2_sink.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stream2_histogram.h"
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+enum {
+    DEFAULT_BUFFER_SIZE = 4 << 20,
+    DEFAULT_BUFFERS = 16,
+    DEFAULT_QUEUE_DEPTH = 8,
+    DEFAULT_ALIGNMENT = 4096,
+};
+
+void stream2_sink_config_default(struct stream2_sink_config* config) {
+    config->buffer_size = DEFAULT_BUFFER_SIZE;
+    config->buffers = DEFAULT_BUFFERS;
+    config->queue_depth = DEFAULT_QUEUE_DEPTH;
+    config->alignment = DEFAULT_ALIGNMENT;
+    config->direct = true;
+}
+
+static uint32_t compression_id(const struct stream2_compression* compression) {
+    if (compression->algorithm == NULL)
+        return 0;
+    if (strcmp(compression->algorithm, "bslz4") == 0)
+        return 1;
+    if (strcmp(compression->algorithm, "lz4") == 0)
+        return 2;
+    return UINT32_MAX;
+}
+
+#if defined(HAVE_IO_URING)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ring {
+    int fd;
+    unsigned entries;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+struct stream2_sink {
+    struct stream2_sink_config config;
+    int fd;
+    struct ring ring;
+
+    uint8_t* memory;
+    // Stack of free buffer indices.
+    size_t* free_buffers;
+    size_t free_len;
+    // Submission time and length of each buffer in flight.
+    uint64_t* submit_ns;
+    size_t* submit_len;
+    unsigned in_flight;
+
+    // Buffer being filled, or SIZE_MAX.
+    size_t current;
+    size_t fill;
+    // File offset of the next submitted buffer and number of bytes appended.
+    uint64_t offset;
+    uint64_t size;
+
+    enum stream2_result error;
+    uint64_t start_ns;
+    uint64_t bytes;
+    uint64_t writes;
+    uint64_t latency[STREAM2_HISTOGRAM_BUCKETS];
+    uint64_t latency_max_ns;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd,
+                              unsigned to_submit,
+                              unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd,
+                                 unsigned opcode,
+                                 const void* arg,
+                                 unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_free(struct ring* ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+static enum stream2_result ring_init(struct ring* ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if ((ring->fd = sys_io_uring_setup(entries, &p)) < 0)
+        return STREAM2_ERROR_SYSTEM;
+    ring->entries = p.sq_entries;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    void* ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+        return STREAM2_ERROR_SYSTEM;
+    ring->sq_ptr = ptr;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED)
+            return STREAM2_ERROR_SYSTEM;
+        ring->cq_ptr = ptr;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+        return STREAM2_ERROR_SYSTEM;
+    ring->sqes = ptr;
+
+    uint8_t* sq = ring->sq_ptr;
+    uint8_t* cq = ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return STREAM2_OK;
+}
+
+// Handles all completions, waiting for at least one if wait is true.
+static enum stream2_result reap(struct stream2_sink* sink, bool wait) {
+    struct ring* ring = &sink->ring;
+
+    if (wait) {
+        while (sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) <
+               0)
+        {
+            if (errno != EINTR)
+                return STREAM2_ERROR_SYSTEM;
+        }
+    }
+
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    const uint64_t now = now_ns();
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        const size_t buffer = (size_t)cqe->user_data;
+
+        // A failed or short write leaves a hole in the file.
+        if ((cqe->res < 0 || (size_t)cqe->res != sink->submit_len[buffer]) &&
+            sink->error == STREAM2_OK)
+            sink->error = STREAM2_ERROR_SYSTEM;
+        if (cqe->res > 0) {
+            sink->bytes += cqe->res;
+            sink->writes++;
+        }
+
+        const uint64_t latency = now - sink->submit_ns[buffer];
+        sink->latency[stream2_histogram_bucket(latency)]++;
+        if (latency > sink->latency_max_ns)
+            sink->latency_max_ns = latency;
+
+        sink->free_buffers[sink->free_len++] = buffer;
+        sink->in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return STREAM2_OK;
+}
+
+static enum stream2_result submit(struct stream2_sink* sink,
+                                  size_t buffer,
+                                  size_t len) {
+    enum stream2_result r;
+    struct ring* ring = &sink->ring;
+
+    while (sink->in_flight >= sink->config.queue_depth) {
+        if ((r = reap(sink, true)))
+            return r;
+    }
+
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = sink->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(sink->memory +
+                                      buffer * sink->config.buffer_size);
+    sqe->len = (uint32_t)len;
+    sqe->off = sink->offset;
+    sqe->buf_index = (uint16_t)buffer;
+    sqe->user_data = buffer;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    sink->submit_ns[buffer] = now_ns();
+    sink->submit_len[buffer] = len;
+    sink->in_flight++;
+    sink->offset += len;
+
+    while (sys_io_uring_enter(ring->fd, 1, 0, 0) < 0) {
+        if (errno != EINTR)
+            return STREAM2_ERROR_SYSTEM;
+    }
+    // Completed writes free their buffers without waiting.
+    return reap(sink, false);
+}
+
+static enum stream2_result next_buffer(struct stream2_sink* sink) {
+    enum stream2_result r;
+    while (sink->free_len == 0) {
+        if ((r = reap(sink, true)))
+            return r;
+    }
+    sink->current = sink->free_buffers[--sink->free_len];
+    sink->fill = 0;
+    return sink->error;
+}
+
+static void sink_free(struct stream2_sink* sink) {
+    ring_free(&sink->ring);
+    if (sink->fd >= 0)
+        close(sink->fd);
+    free(sink->memory);
+    free(sink->free_buffers);
+    free(sink->submit_ns);
+    free(sink->submit_len);
+    free(sink);
+}
+
+static enum stream2_result sink_init(struct stream2_sink* sink,
+                                     const char* path) {
+    enum stream2_result r;
+    const struct stream2_sink_config* config = &sink->config;
+
+    const size_t size = config->buffer_size * config->buffers;
+    if (posix_memalign((void**)&sink->memory, config->alignment, size))
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    sink->free_buffers = calloc(config->buffers, sizeof(size_t));
+    sink->submit_ns = calloc(config->buffers, sizeof(uint64_t));
+    sink->submit_len = calloc(config->buffers, sizeof(size_t));
+    if (sink->free_buffers == NULL || sink->submit_ns == NULL ||
+        sink->submit_len == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < config->buffers; i++)
+        sink->free_buffers[sink->free_len++] = config->buffers - 1 - i;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (config->direct)
+        flags |= O_DIRECT;
+    if ((sink->fd = open(path, flags, 0644)) < 0)
+        return STREAM2_ERROR_SYSTEM;
+
+    if ((r = ring_init(&sink->ring, config->queue_depth)))
+        return r;
+
+    // Registered buffers are pinned once instead of on every write.
+    struct iovec* iov = calloc(config->buffers, sizeof(struct iovec));
+    if (iov == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < config->buffers; i++) {
+        iov[i].iov_base = sink->memory + i * config->buffer_size;
+        iov[i].iov_len = config->buffer_size;
+    }
+    const int ret = sys_io_uring_register(sink->ring.fd,
+                                          IORING_REGISTER_BUFFERS, iov,
+                                          (unsigned)config->buffers);
+    free(iov);
+    if (ret < 0)
+        return STREAM2_ERROR_SYSTEM;
+
+    sink->start_ns = now_ns();
+    return next_buffer(sink);
+}
+
+enum stream2_result stream2_sink_open(const char* path,
+                                      const struct stream2_sink_config* config,
+                                      struct stream2_sink** sink_out) {
+    enum stream2_result r;
+
+    *sink_out = NULL;
+
+    if (config->alignment == 0 || config->buffer_size == 0 ||
+        config->buffer_size % config->alignment != 0 ||
+        config->buffers == 0 || config->buffers > UINT16_MAX ||
+        config->queue_depth == 0 || config->queue_depth > config->buffers)
+        return STREAM2_ERROR_PARSE;
+
+    struct stream2_sink* sink = calloc(1, sizeof(struct stream2_sink));
+    if (sink == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    sink->config = *config;
+    sink->fd = -1;
+    sink->ring.fd = -1;
+
+    if ((r = sink_init(sink, path))) {
+        sink_free(sink);
+        return r;
+    }
+
+    *sink_out = sink;
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_sink_write(struct stream2_sink* sink,
+                                       const void* data,
+                                       size_t size) {
+    enum stream2_result r;
+    const uint8_t* p = data;
+    const size_t buffer_size = sink->config.buffer_size;
+
+    while (size > 0) {
+        const size_t n = size < buffer_size - sink->fill
+                                 ? size
+                                 : buffer_size - sink->fill;
+        memcpy(sink->memory + sink->current * buffer_size + sink->fill, p, n);
+        sink->fill += n;
+        sink->size += n;
+        p += n;
+        size -= n;
+
+        if (sink->fill == buffer_size) {
+            if ((r = submit(sink, sink->current, buffer_size)) ||
+                (r = next_buffer(sink)))
+                return r;
+        }
+    }
+    return sink->error;
+}
+
+enum stream2_result stream2_sink_close(struct stream2_sink* sink) {
+    enum stream2_result r = STREAM2_OK;
+
+    // The last buffer is padded to the alignment and the file truncated to
+    // the bytes appended.
+    if (sink->fill > 0) {
+        const size_t alignment = sink->config.alignment;
+        const size_t len = (sink->fill + alignment - 1) / alignment * alignment;
+        memset(sink->memory + sink->current * sink->config.buffer_size +
+                       sink->fill,
+               0, len - sink->fill);
+        r = submit(sink, sink->current, len);
+    }
+    while (sink->in_flight > 0) {
+        enum stream2_result reap_r = reap(sink, true);
+        if (reap_r) {
+            r = reap_r;
+            break;
+        }
+    }
+    if (r == STREAM2_OK)
+        r = sink->error;
+    if (r == STREAM2_OK && ftruncate(sink->fd, (off_t)sink->size))
+        r = STREAM2_ERROR_SYSTEM;
+
+    sink_free(sink);
+    return r;
+}
+
+void stream2_sink_stats(const struct stream2_sink* sink,
+                        struct stream2_sink_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    // Only the last buffer is padded, beyond the bytes appended.
+    stats->bytes = sink->bytes < sink->size ? sink->bytes : sink->size;
+    stats->writes = sink->writes;
+    stats->seconds = (now_ns() - sink->start_ns) * 1e-9;
+    if (stats->seconds > 0)
+        stats->gbps = stats->bytes / stats->seconds * 1e-9;
+    stats->latency_max_us = sink->latency_max_ns * 1e-3;
+
+    static const double QUANTILES[] = {0.5, 0.99};
+    double ns[] = {0, 0};
+    stream2_histogram_quantiles(sink->latency, QUANTILES, 2, ns);
+    stats->latency_p50_us = ns[0] * 1e-3;
+    stats->latency_p99_us = ns[1] * 1e-3;
+}
+
+#else
+
+struct stream2_sink {
+    int unused;
+};
+
+enum stream2_result stream2_sink_open(const char* path,
+                                      const struct stream2_sink_config* config,
+                                      struct stream2_sink** sink_out) {
+    (void)path;
+    (void)config;
+    *sink_out = NULL;
+    return STREAM2_ERROR_NOT_IMPLEMENTED;
+}
+
+enum stream2_result stream2_sink_write(struct stream2_sink* sink,
+                                       const void* data,
+                                       size_t size) {
+    (void)sink;
+    (void)data;
+    (void)size;
+    return STREAM2_ERROR_NOT_IMPLEMENTED;
+}
+
+enum stream2_result stream2_sink_close(struct stream2_sink* sink) {
+    (void)sink;
+    return STREAM2_ERROR_NOT_IMPLEMENTED;
+}
+
+void stream2_sink_stats(const struct stream2_sink* sink,
+                        struct stream2_sink_stats* stats) {
+    (void)sink;
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
+enum stream2_result stream2_sink_write_image(
+        struct stream2_sink* sink,
+        const struct stream2_image_msg* msg) {
+    enum stream2_result r;
+
+    for (size_t i = 0; i < msg->data.len; i++) {
+        const struct stream2_bytes* bytes = &msg->data.ptr[i].data.array.data;
+        struct stream2_sink_record record;
+        memset(&record, 0, sizeof(record));
+        record.series_id = msg->series_id;
+        record.image_id = msg->image_id;
+        record.channel = (uint32_t)i;
+        record.compression = compression_id(&bytes->compression);
+        record.size = bytes->len;
+        record.orig_size = bytes->compression.algorithm
+                                   ? bytes->compression.orig_size
+                                   : bytes->len;
+        record.elem_size = bytes->compression.elem_size;
+
+        if ((r = stream2_sink_write(sink, &record, sizeof(record))) ||
+            (r = stream2_sink_write(sink, bytes->ptr, bytes->len)))
+            return r;
+    }
+    return STREAM2_OK;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct stream2_sink;
+
+struct stream2_sink_config {
+    // Size of each buffer, a multiple of alignment.
+    size_t buffer_size;
+    // Number of buffers registered with io_uring.
+    size_t buffers;
+    // Maximum number of writes in flight, at most buffers.
+    unsigned queue_depth;
+    // Alignment of buffers, file offsets and write sizes required by
+    // O_DIRECT, usually the logical block size of the device.
+    size_t alignment;
+    // If false, the file is opened without O_DIRECT, e.g. on tmpfs.
+    bool direct;
+};
+
+struct stream2_sink_stats {
+    // Bytes appended and written, without the padding to the alignment.
+    uint64_t bytes;
+    uint64_t writes;
+    double seconds;
+    // Sustained write bandwidth of bytes since the sink was opened.
+    double gbps;
+    // Latency from submission to completion of writes in microseconds.
+    double latency_p50_us;
+    double latency_p99_us;
+    double latency_max_us;
+};
+
+// Header preceding each channel payload written by stream2_sink_write_image(),
+// in host byte order.
+struct stream2_sink_record {
+    uint64_t series_id;
+    uint64_t image_id;
+    uint32_t channel;
+    // Algorithm of the payload: 0 if uncompressed, 1 for "bslz4", 2 for "lz4".
+    uint32_t compression;
+    // Size of the payload and of the decompressed data.
+    uint64_t size;
+    uint64_t orig_size;
+    uint64_t elem_size;
+};
+
+void stream2_sink_config_default(struct stream2_sink_config* config);
+
+// Creates a file written through io_uring with fixed buffers.
+//
+// Returns STREAM2_ERROR_NOT_IMPLEMENTED on systems without io_uring.
+enum stream2_result stream2_sink_open(const char* path,
+                                      const struct stream2_sink_config* config,
+                                      struct stream2_sink** sink_out);
+
+// Appends bytes to the file. Full buffers are submitted while the next
+// buffer is filled.
+enum stream2_result stream2_sink_write(struct stream2_sink* sink,
+                                       const void* data,
+                                       size_t size);
+
+// Appends a record for the payload of every channel of an image, as received,
+// i.e. without decompressing it.
+enum stream2_result stream2_sink_write_image(
+        struct stream2_sink* sink,
+        const struct stream2_image_msg* msg);
+
+void stream2_sink_stats(const struct stream2_sink* sink,
+                        struct stream2_sink_stats* stats);
+
+// Writes the last buffer, waits for all writes and closes the file. Returns
+// the first error of any write.
+enum stream2_result stream2_sink_close(struct stream2_sink* sink);
+
+#if defined(__cplusplus)
+}
+#endif
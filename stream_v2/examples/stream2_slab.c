@@ -0,0 +1,352 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "stream2_slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+enum {
+    // Compressed frames start at multiples of the cache line size.
+    FRAME_ALIGNMENT = 64,
+    DEFAULT_HUGEPAGE_SIZE = 2 << 20,
+};
+
+enum frame_state {
+    FRAME_FREE,
+    FRAME_WRITING,
+    FRAME_STORED,
+};
+
+struct frame_entry {
+    uint64_t offset;
+    uint64_t len;
+    const char* algorithm;
+    uint32_t elem_size;
+    // enum frame_state, updated atomically.
+    uint32_t state;
+};
+
+struct stream2_slab {
+    struct stream2_slab_config config;
+    uint8_t* ptr;
+    size_t size;
+    bool mapped;
+    bool hugepages;
+
+    uint64_t number_of_images;
+    size_t channels;
+    size_t frame_size;
+    // One entry per frame, indexed by image_id * channels + channel.
+    struct frame_entry* entries;
+    // Bytes taken by compressed frames and number of stored frames, updated
+    // atomically.
+    size_t used;
+    uint64_t frames;
+};
+
+void stream2_slab_config_default(struct stream2_slab_config* config) {
+    config->storage = STREAM2_SLAB_COMPRESSED;
+    config->pages = STREAM2_SLAB_PAGES_TRANSPARENT;
+    config->compressed_capacity = 0;
+    config->populate = false;
+}
+
+#if defined(__linux__)
+// Gets the default hugepage size used by MAP_HUGETLB.
+static size_t hugepage_size(void) {
+    size_t size = DEFAULT_HUGEPAGE_SIZE;
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file == NULL)
+        return size;
+    char line[256];
+    unsigned long kb;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+            size = (size_t)kb << 10;
+            break;
+        }
+    }
+    fclose(file);
+    return size;
+}
+
+static enum stream2_result map_slab(struct stream2_slab* slab) {
+    // Explicit hugepages are reserved so that the mapping fails instead of
+    // a later page fault if there are not enough.
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (slab->config.pages == STREAM2_SLAB_PAGES_EXPLICIT) {
+        const size_t huge = hugepage_size();
+        slab->size = (slab->size + huge - 1) / huge * huge;
+        flags |= MAP_HUGETLB;
+    } else {
+        flags |= MAP_NORESERVE;
+    }
+    void* ptr = mmap(NULL, slab->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED)
+        return STREAM2_ERROR_SYSTEM;
+    slab->ptr = ptr;
+    slab->mapped = true;
+
+    if (slab->config.pages == STREAM2_SLAB_PAGES_EXPLICIT) {
+        slab->hugepages = true;
+    } else if (slab->config.pages == STREAM2_SLAB_PAGES_TRANSPARENT) {
+        slab->hugepages = madvise(ptr, slab->size, MADV_HUGEPAGE) == 0;
+    }
+
+    // Pages are touched after madvise() so that they can be hugepages.
+    if (slab->config.populate) {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < slab->size; i += page)
+            ((volatile uint8_t*)slab->ptr)[i] = 0;
+    }
+    return STREAM2_OK;
+}
+#else
+// Transparent hugepages are a hint, so the slab has pages of the default
+// size instead.
+static enum stream2_result map_slab(struct stream2_slab* slab) {
+    if (slab->config.pages == STREAM2_SLAB_PAGES_EXPLICIT)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    if ((slab->ptr = malloc(slab->size)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (slab->config.populate)
+        memset(slab->ptr, 0, slab->size);
+    return STREAM2_OK;
+}
+#endif
+
+enum stream2_result stream2_slab_create(
+        const struct stream2_series* series,
+        const struct stream2_slab_config* config,
+        struct stream2_slab** slab_out) {
+    enum stream2_result r;
+
+    *slab_out = NULL;
+
+    struct stream2_slab* slab = calloc(1, sizeof(struct stream2_slab));
+    if (slab == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if (config)
+        slab->config = *config;
+    else
+        stream2_slab_config_default(&slab->config);
+    slab->number_of_images = series->number_of_images;
+    slab->channels = series->channels_len;
+    slab->frame_size = series->frame_size;
+
+    const size_t channels = slab->channels ? slab->channels : 1;
+    if (slab->number_of_images > SIZE_MAX / channels ||
+        (slab->frame_size > 0 &&
+         slab->number_of_images * channels > SIZE_MAX / slab->frame_size))
+    {
+        stream2_slab_free(slab);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    const size_t frames = slab->number_of_images * slab->channels;
+    slab->size = frames * slab->frame_size;
+    if (slab->config.storage == STREAM2_SLAB_COMPRESSED &&
+        slab->config.compressed_capacity > 0)
+        slab->size = slab->config.compressed_capacity;
+    if (slab->size == 0)
+        slab->size = 1;
+    if (slab->config.storage == STREAM2_SLAB_DECODED)
+        slab->used = frames * slab->frame_size;
+
+    if ((slab->entries = calloc(frames ? frames : 1,
+                                sizeof(struct frame_entry))) == NULL)
+    {
+        stream2_slab_free(slab);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    if ((r = map_slab(slab))) {
+        stream2_slab_free(slab);
+        return r;
+    }
+
+    *slab_out = slab;
+    return STREAM2_OK;
+}
+
+void stream2_slab_free(struct stream2_slab* slab) {
+    if (slab == NULL)
+        return;
+#if defined(__linux__)
+    if (slab->mapped)
+        munmap(slab->ptr, slab->size);
+#else
+    free(slab->ptr);
+#endif
+    free(slab->entries);
+    free(slab);
+}
+
+// Claims the entry of a frame for writing.
+static enum stream2_result claim_frame(struct stream2_slab* slab,
+                                       uint64_t image_id,
+                                       size_t channel,
+                                       struct frame_entry** entry_out) {
+    if (image_id >= slab->number_of_images || channel >= slab->channels)
+        return STREAM2_ERROR_IMAGE_ID;
+    struct frame_entry* entry =
+            &slab->entries[image_id * slab->channels + channel];
+    uint32_t expected = FRAME_FREE;
+    if (!__atomic_compare_exchange_n(&entry->state, &expected, FRAME_WRITING,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return STREAM2_ERROR_IMAGE_ID;
+    *entry_out = entry;
+    return STREAM2_OK;
+}
+
+static void publish_frame(struct stream2_slab* slab,
+                          struct frame_entry* entry) {
+    __atomic_store_n(&entry->state, FRAME_STORED, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&slab->frames, 1, __ATOMIC_RELAXED);
+}
+
+static void release_frame(struct frame_entry* entry) {
+    __atomic_store_n(&entry->state, FRAME_FREE, __ATOMIC_RELEASE);
+}
+
+// The algorithm of a stored frame outlives the message.
+static enum stream2_result algorithm_name(const char* algorithm,
+                                          const char** name) {
+    if (algorithm == NULL) {
+        *name = NULL;
+    } else if (strcmp(algorithm, "bslz4") == 0) {
+        *name = "bslz4";
+    } else if (strcmp(algorithm, "lz4") == 0) {
+        *name = "lz4";
+    } else {
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    }
+    return STREAM2_OK;
+}
+
+static enum stream2_result store_compressed(struct stream2_slab* slab,
+                                            const struct stream2_bytes* bytes,
+                                            struct frame_entry* entry) {
+    enum stream2_result r;
+
+    if ((r = algorithm_name(bytes->compression.algorithm, &entry->algorithm)))
+        return r;
+
+    const size_t len = bytes->len;
+    const size_t aligned =
+            (len + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT * FRAME_ALIGNMENT;
+    const size_t offset =
+            __atomic_fetch_add(&slab->used, aligned, __ATOMIC_RELAXED);
+    if (offset > slab->size || len > slab->size - offset)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    memcpy(slab->ptr + offset, bytes->ptr, len);
+    entry->offset = offset;
+    entry->len = len;
+    entry->elem_size = bytes->compression.elem_size;
+    return STREAM2_OK;
+}
+
+static enum stream2_result store_frame(struct stream2_slab* slab,
+                                       struct stream2_series* series,
+                                       const struct stream2_image_msg* msg,
+                                       size_t channel,
+                                       struct frame_entry* entry) {
+    if (slab->config.storage == STREAM2_SLAB_COMPRESSED)
+        return store_compressed(slab, &msg->data.ptr[channel].data.array.data,
+                                entry);
+    entry->offset =
+            (msg->image_id * slab->channels + channel) * slab->frame_size;
+    entry->len = slab->frame_size;
+    entry->algorithm = NULL;
+    entry->elem_size = 0;
+    return stream2_series_decode_into(series, msg, channel,
+                                      slab->ptr + entry->offset);
+}
+
+enum stream2_result stream2_slab_store_image(
+        struct stream2_slab* slab,
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg) {
+    enum stream2_result r = STREAM2_OK;
+
+    if (series->channels_len != slab->channels ||
+        series->frame_size != slab->frame_size)
+        return STREAM2_ERROR_SERIES_MISMATCH;
+    if (msg->data.len < slab->channels)
+        return STREAM2_ERROR_PARSE;
+
+    // The frames of an image are published together once all are stored, so
+    // that readers never see part of an image.
+    size_t claimed = 0;
+    while (claimed < slab->channels) {
+        struct frame_entry* entry;
+        if ((r = claim_frame(slab, msg->image_id, claimed, &entry)))
+            break;
+        if ((r = store_frame(slab, series, msg, claimed++, entry)))
+            break;
+    }
+    for (size_t i = 0; i < claimed; i++) {
+        struct frame_entry* entry =
+                &slab->entries[msg->image_id * slab->channels + i];
+        if (r)
+            release_frame(entry);
+        else
+            publish_frame(slab, entry);
+    }
+    return r;
+}
+
+enum stream2_result stream2_slab_store_decoded(struct stream2_slab* slab,
+                                               uint64_t image_id,
+                                               size_t channel,
+                                               const void* data) {
+    enum stream2_result r;
+
+    if (slab->config.storage != STREAM2_SLAB_DECODED)
+        return STREAM2_ERROR_PARSE;
+
+    struct frame_entry* entry;
+    if ((r = claim_frame(slab, image_id, channel, &entry)))
+        return r;
+    entry->offset = (image_id * slab->channels + channel) * slab->frame_size;
+    entry->len = slab->frame_size;
+    entry->algorithm = NULL;
+    entry->elem_size = 0;
+    memcpy(slab->ptr + entry->offset, data, slab->frame_size);
+    publish_frame(slab, entry);
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_slab_frame(const struct stream2_slab* slab,
+                                       uint64_t image_id,
+                                       size_t channel,
+                                       struct stream2_slab_frame* frame) {
+    if (image_id >= slab->number_of_images || channel >= slab->channels)
+        return STREAM2_ERROR_IMAGE_ID;
+    const struct frame_entry* entry =
+            &slab->entries[image_id * slab->channels + channel];
+    if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) != FRAME_STORED)
+        return STREAM2_ERROR_IMAGE_ID;
+
+    frame->ptr = slab->ptr + entry->offset;
+    frame->len = entry->len;
+    frame->algorithm = entry->algorithm;
+    frame->elem_size = entry->elem_size;
+    return STREAM2_OK;
+}
+
+void stream2_slab_stats(const struct stream2_slab* slab,
+                        struct stream2_slab_stats* stats) {
+    const size_t used = __atomic_load_n(&slab->used, __ATOMIC_RELAXED);
+    stats->size = slab->size;
+    stats->used = used < slab->size ? used : slab->size;
+    stats->frames = __atomic_load_n(&slab->frames, __ATOMIC_RELAXED);
+    stats->hugepages = slab->hugepages;
+}
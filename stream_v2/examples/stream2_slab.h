@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+#include "stream2_series.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Keeps every frame of a series in one contiguous mapping reserved from the
+// number_of_images and the frame geometry of the start message, so that short
+// high-rate series are held in memory without an allocation per frame.
+struct stream2_slab;
+
+enum stream2_slab_storage {
+    // Frames are stored as received. Each frame takes the next free bytes of
+    // the slab.
+    STREAM2_SLAB_COMPRESSED,
+    // Frames are stored decoded at an offset computed from image_id and
+    // channel.
+    STREAM2_SLAB_DECODED,
+};
+
+enum stream2_slab_pages {
+    // Pages of the default size.
+    STREAM2_SLAB_PAGES_DEFAULT,
+    // Transparent hugepages requested with madvise() on Linux, or pages of
+    // the default size if not available.
+    STREAM2_SLAB_PAGES_TRANSPARENT,
+    // Hugepages reserved in advance with MAP_HUGETLB on Linux, e.g. with
+    // vm.nr_hugepages.
+    STREAM2_SLAB_PAGES_EXPLICIT,
+};
+
+struct stream2_slab_config {
+    enum stream2_slab_storage storage;
+    enum stream2_slab_pages pages;
+    // Size of a compressed slab, or 0 for the size of all frames decoded.
+    // Address space is reserved for the whole slab but only pages written to
+    // are backed by memory.
+    size_t compressed_capacity;
+    // If true, every page is backed by memory on creation instead of when it
+    // is first written to.
+    bool populate;
+};
+
+struct stream2_slab_frame {
+    const uint8_t* ptr;
+    size_t len;
+    // Compression of the frame as in struct stream2_compression, or NULL if
+    // the frame is decoded or was received uncompressed.
+    const char* algorithm;
+    size_t elem_size;
+};
+
+struct stream2_slab_stats {
+    size_t size;
+    // Bytes taken by compressed frames, or by all frame slots if decoded.
+    size_t used;
+    uint64_t frames;
+    bool hugepages;
+};
+
+void stream2_slab_config_default(struct stream2_slab_config* config);
+
+// Reserves the slab of a series. If config is NULL, the default
+// configuration is used.
+//
+// Returns STREAM2_ERROR_NOT_IMPLEMENTED if explicit hugepages are requested
+// on systems other than Linux and STREAM2_ERROR_SYSTEM if the mapping fails,
+// e.g. if not enough explicit hugepages are available.
+enum stream2_result stream2_slab_create(
+        const struct stream2_series* series,
+        const struct stream2_slab_config* config,
+        struct stream2_slab** slab_out);
+void stream2_slab_free(struct stream2_slab* slab);
+
+// Stores the image data of every channel of an image message. Decoded frames
+// are decoded into their slot with stream2_series_decode_into(). The frames
+// are published together, and none of them if any fails.
+//
+// Returns STREAM2_ERROR_IMAGE_ID if a frame of the image is already stored
+// and STREAM2_ERROR_OUT_OF_MEMORY if a compressed slab is full. May be called
+// from several threads for different images.
+enum stream2_result stream2_slab_store_image(
+        struct stream2_slab* slab,
+        struct stream2_series* series,
+        const struct stream2_image_msg* msg);
+
+// Copies a frame of a decoded slab that was already decoded, e.g. from the
+// decode buffers in the image callback of the receiver.
+enum stream2_result stream2_slab_store_decoded(struct stream2_slab* slab,
+                                               uint64_t image_id,
+                                               size_t channel,
+                                               const void* data);
+
+// Looks up a stored frame in constant time. May be called while frames are
+// stored.
+//
+// Returns STREAM2_ERROR_IMAGE_ID if the frame is not stored.
+enum stream2_result stream2_slab_frame(const struct stream2_slab* slab,
+                                       uint64_t image_id,
+                                       size_t channel,
+                                       struct stream2_slab_frame* frame);
+
+void stream2_slab_stats(const struct stream2_slab* slab,
+                        struct stream2_slab_stats* stats);
+
+#if defined(__cplusplus)
+}
+#endif
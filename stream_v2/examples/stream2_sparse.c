@@ -0,0 +1,536 @@
+#include "stream2_sparse.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream2_blockmap.h"
+#include "stream2_series.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+enum {
+    // https://github.com/lz4/lz4/blob/master/doc/lz4_Block_format.md
+    LZ4_MIN_MATCH = 4,
+    // Bitshuffle blocks hold a multiple of this many elements, and blocks of
+    // up to this many bytes are decoded on the stack.
+    BSHUF_BLOCKED_MULT = 8,
+    MAX_BLOCK_SIZE = 8192,
+    // Bytes copied at once by the LZ4 decompressor, which may write up to
+    // WILD_COPY - 1 bytes past the end of its output.
+    WILD_COPY = 16,
+    HEADER_SIZE = 12,
+};
+
+// Appends the nonzero pixels of a frame in the order of their indices, or
+// adds them to statistics if frame is NULL.
+struct builder {
+    struct stream2_sparse_frame* frame;
+    struct stream2_sparse_stats* stats;
+    uint64_t saturation_value;
+    // Row of the last pixel appended and index of its first pixel.
+    size_t y;
+    size_t row_start;
+};
+
+enum stream2_result stream2_sparse_frame_create(
+        uint64_t width,
+        uint64_t height,
+        struct stream2_sparse_frame** frame_out) {
+    *frame_out = NULL;
+
+    if (width > UINT32_MAX || height >= SIZE_MAX / sizeof(size_t))
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    struct stream2_sparse_frame* frame =
+            calloc(1, sizeof(struct stream2_sparse_frame));
+    if (frame == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    frame->width = width;
+    frame->height = height;
+    if ((frame->rows = calloc(height + 1, sizeof(size_t))) == NULL) {
+        stream2_sparse_frame_free(frame);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+
+    *frame_out = frame;
+    return STREAM2_OK;
+}
+
+void stream2_sparse_frame_free(struct stream2_sparse_frame* frame) {
+    if (frame == NULL)
+        return;
+    free(frame->rows);
+    free(frame->columns);
+    free(frame->values);
+    free(frame->scratch);
+    free(frame);
+}
+
+static void builder_start(struct builder* b,
+                          struct stream2_sparse_frame* frame) {
+    b->frame = frame;
+    b->stats = NULL;
+    b->saturation_value = 0;
+    b->y = 0;
+    b->row_start = 0;
+    frame->len = 0;
+    frame->rows[0] = 0;
+}
+
+static void builder_start_stats(struct builder* b,
+                                struct stream2_sparse_stats* stats,
+                                uint64_t saturation_value) {
+    memset(b, 0, sizeof(*b));
+    memset(stats, 0, sizeof(*stats));
+    b->stats = stats;
+    b->saturation_value = saturation_value;
+}
+
+// Makes room for n more pixels.
+static enum stream2_result builder_reserve(struct builder* b, size_t n) {
+    struct stream2_sparse_frame* frame = b->frame;
+    if (frame == NULL || frame->capacity - frame->len >= n)
+        return STREAM2_OK;
+
+    size_t capacity = frame->capacity ? frame->capacity : 4096;
+    while (capacity - frame->len < n)
+        capacity *= 2;
+    uint32_t* columns = realloc(frame->columns, capacity * sizeof(uint32_t));
+    if (columns == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    frame->columns = columns;
+    uint32_t* values = realloc(frame->values, capacity * sizeof(uint32_t));
+    if (values == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    frame->values = values;
+    frame->capacity = capacity;
+    return STREAM2_OK;
+}
+
+// Adds n pixels of a nonzero value to the statistics.
+static void add_stats(struct builder* b, uint32_t value, size_t n) {
+    struct stream2_sparse_stats* stats = b->stats;
+    if (value > b->saturation_value) {
+        stats->nodata += n;
+        return;
+    }
+    stats->sum += (uint64_t)value * n;
+    if (value > stats->max)
+        stats->max = value;
+    if (value == b->saturation_value)
+        stats->saturated += n;
+}
+
+// Appends the pixel at index, which is larger than the index of the last
+// pixel appended, after reserving room for it.
+static void builder_append(struct builder* b, size_t index, uint32_t value) {
+    struct stream2_sparse_frame* frame = b->frame;
+    if (frame == NULL) {
+        add_stats(b, value, 1);
+        return;
+    }
+    while (index - b->row_start >= frame->width) {
+        b->row_start += frame->width;
+        frame->rows[++b->y] = frame->len;
+    }
+    frame->columns[frame->len] = (uint32_t)(index - b->row_start);
+    frame->values[frame->len] = value;
+    frame->len++;
+}
+
+static void builder_finish(struct builder* b) {
+    struct stream2_sparse_frame* frame = b->frame;
+    while (frame != NULL && b->y < frame->height)
+        frame->rows[++b->y] = frame->len;
+}
+
+static uint32_t read_value(const uint8_t* p, size_t elem_size) {
+    switch (elem_size) {
+        case 1:
+            return *p;
+        case 2:
+            return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+        default:
+            return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                   (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+}
+
+// Appends the nonzero elements of n dense elements starting at index first.
+// Chunks of 16 zero bytes are skipped with SSE2.
+static enum stream2_result scan_dense(struct builder* b,
+                                      const uint8_t* data,
+                                      size_t n,
+                                      size_t elem_size,
+                                      size_t first) {
+    enum stream2_result r;
+
+    const size_t size = n * elem_size;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; size - i >= 16; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0xffff)
+            continue;
+        if ((r = builder_reserve(b, 16 / elem_size)))
+            return r;
+        for (size_t j = i; j < i + 16; j += elem_size) {
+            const uint32_t value = read_value(data + j, elem_size);
+            if (value != 0)
+                builder_append(b, first + j / elem_size, value);
+        }
+    }
+#endif
+    for (; i < size; i += elem_size) {
+        const uint32_t value = read_value(data + i, elem_size);
+        if (value == 0)
+            continue;
+        if ((r = builder_reserve(b, 1)))
+            return r;
+        builder_append(b, first + i / elem_size, value);
+    }
+    return STREAM2_OK;
+}
+
+static uint32_t read_u32_be(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+}
+
+static uint64_t read_u64_be(const uint8_t* p) {
+    return (uint64_t)read_u32_be(p) << 32 | read_u32_be(p + 4);
+}
+
+// Reads a length of a sequence continued in bytes of 255.
+static bool lz4_read_length(const uint8_t** ip,
+                            const uint8_t* end,
+                            size_t* len) {
+    uint8_t byte;
+    do {
+        if (*ip == end)
+            return false;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Copies len bytes in chunks of WILD_COPY bytes, writing up to WILD_COPY - 1
+// bytes past dst + len. src and dst are at least WILD_COPY bytes apart.
+static void wild_copy(uint8_t* dst, const uint8_t* src, size_t len) {
+    for (size_t i = 0; i < len; i += WILD_COPY)
+        memcpy(dst + i, src + i, WILD_COPY);
+}
+
+// Decompresses an LZ4 block into exactly dst_len bytes. dst holds dst_len +
+// WILD_COPY bytes, so that short sequences are copied in chunks of fixed
+// size.
+static bool lz4_decompress_block(const uint8_t* src,
+                                 size_t src_len,
+                                 uint8_t* dst,
+                                 size_t dst_len) {
+    const uint8_t* ip = src;
+    const uint8_t* const end = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* const op_end = dst + dst_len;
+
+    for (;;) {
+        if (ip == end)
+            return false;
+        const unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15 && !lz4_read_length(&ip, end, &len))
+            return false;
+        if ((size_t)(end - ip) < len || (size_t)(op_end - op) < len)
+            return false;
+        if ((size_t)(end - ip) >= len + WILD_COPY)
+            wild_copy(op, ip, len);
+        else
+            memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        // The last sequence has literals only.
+        if (ip == end)
+            return op == op_end;
+
+        if (end - ip < 2)
+            return false;
+        const size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return false;
+        len = token & 15;
+        if (len == 15 && !lz4_read_length(&ip, end, &len))
+            return false;
+        len += LZ4_MIN_MATCH;
+        if ((size_t)(op_end - op) < len)
+            return false;
+
+        // Overlapping matches repeat the last offset bytes, e.g. runs of
+        // zeros, and are copied in chunks that double every time.
+        const uint8_t* match = op - offset;
+        if (offset >= WILD_COPY) {
+            wild_copy(op, match, len);
+            op += len;
+            continue;
+        }
+        while (len > 0) {
+            const size_t chunk = (size_t)(op - match) < len
+                                         ? (size_t)(op - match)
+                                         : len;
+            memcpy(op, match, chunk);
+            op += chunk;
+            len -= chunk;
+        }
+    }
+}
+
+// Or-s the bit planes of a bitshuffled block of n elements, so that bit e %
+// 8 of byte e / 8 of any is set if element e is nonzero.
+static void or_planes(const uint8_t* in,
+                      size_t n,
+                      size_t elem_size,
+                      uint8_t* any) {
+    const size_t row = n / 8;
+    memcpy(any, in, row);
+    for (size_t k = 1; k < 8 * elem_size; k++) {
+        const uint8_t* plane = in + k * row;
+        size_t i = 0;
+#if defined(__SSE2__)
+        for (; row - i >= 16; i += 16) {
+            const __m128i a = _mm_loadu_si128((const __m128i*)(any + i));
+            const __m128i p = _mm_loadu_si128((const __m128i*)(plane + i));
+            _mm_storeu_si128((__m128i*)(any + i), _mm_or_si128(a, p));
+        }
+#endif
+        for (; i < row; i++)
+            any[i] |= plane[i];
+    }
+}
+
+// Unshuffles the 8 elements of group g of a bitshuffled block of n elements,
+// the inverse of bshuf_trans_bit_elem() for one group.
+static void unshuffle_group(const uint8_t* in,
+                            size_t n,
+                            size_t elem_size,
+                            size_t g,
+                            uint32_t values[8]) {
+    const size_t row = n / 8;
+    memset(values, 0, 8 * sizeof(uint32_t));
+    for (size_t j = 0; j < elem_size; j++) {
+        uint64_t x = 0;
+        for (size_t i = 0; i < 8; i++)
+            x |= (uint64_t)in[(8 * j + i) * row + g] << (8 * i);
+
+        // Transposes the 8x8 bit matrix x, which is its own inverse.
+        uint64_t t;
+        t = (x ^ (x >> 7)) & UINT64_C(0x00AA00AA00AA00AA);
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & UINT64_C(0x0000CCCC0000CCCC);
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & UINT64_C(0x00000000F0F0F0F0);
+        x = x ^ t ^ (t << 28);
+
+        for (size_t m = 0; m < 8; m++)
+            values[m] |= (uint32_t)(uint8_t)(x >> (8 * m)) << (8 * j);
+    }
+}
+
+// Gets the index of the lowest set bit of nonzero bits.
+static unsigned lowest_bit(unsigned bits) {
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctz(bits);
+#else
+    unsigned m = 0;
+    while ((bits & 1u) == 0) {
+        bits >>= 1;
+        m++;
+    }
+    return m;
+#endif
+}
+
+// Appends the nonzero elements of a bitshuffled block of n elements starting
+// at index first.
+static enum stream2_result scan_shuffled(struct builder* b,
+                                         const uint8_t* in,
+                                         size_t n,
+                                         size_t elem_size,
+                                         size_t first) {
+    enum stream2_result r;
+
+    uint8_t any[MAX_BLOCK_SIZE / BSHUF_BLOCKED_MULT];
+    or_planes(in, n, elem_size, any);
+    const size_t row = n / 8;
+    for (size_t g = 0; g < row; g++) {
+        if (any[g] == 0)
+            continue;
+        uint32_t values[8];
+        unshuffle_group(in, n, elem_size, g, values);
+        if ((r = builder_reserve(b, 8)))
+            return r;
+        for (unsigned bits = any[g]; bits != 0; bits &= bits - 1) {
+            const unsigned m = lowest_bit(bits);
+            builder_append(b, first + 8 * g + m, values[m]);
+        }
+    }
+    return STREAM2_OK;
+}
+
+// Decodes "bslz4" data block by block. Returns STREAM2_ERROR_NOT_IMPLEMENTED
+// without appending any pixel if the blocks are too large to be decoded on
+// the stack.
+static enum stream2_result decode_bslz4(struct builder* b,
+                                        const uint8_t* src,
+                                        size_t len,
+                                        size_t elem_size,
+                                        size_t elems) {
+    enum stream2_result r;
+
+    if (len < HEADER_SIZE || read_u64_be(src) != elems * elem_size)
+        return STREAM2_ERROR_DECODE;
+    const size_t block_size = read_u32_be(src + 8);
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE ||
+        block_size % (elem_size * BSHUF_BLOCKED_MULT) != 0)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    const size_t block_elems = block_size / elem_size;
+
+    uint8_t block[MAX_BLOCK_SIZE + WILD_COPY];
+    size_t pos = HEADER_SIZE;
+    size_t first = 0;
+    // Blocks hold a multiple of 8 elements; the last block may be shorter
+    // and fewer than 8 remaining elements follow it uncompressed.
+    const size_t rest = elems % BSHUF_BLOCKED_MULT;
+    while (first < elems - rest) {
+        const size_t n = elems - rest - first < block_elems
+                                 ? elems - rest - first
+                                 : block_elems;
+        if (len - pos < 4)
+            return STREAM2_ERROR_DECODE;
+        const size_t compressed = read_u32_be(src + pos);
+        pos += 4;
+        if (len - pos < compressed)
+            return STREAM2_ERROR_DECODE;
+
+        // Blocks of zeros, most of those of dark frames, are skipped and
+        // constant blocks are appended without being decompressed.
+        uint32_t value;
+        const enum stream2_block_kind kind = stream2_block_classify_bslz4(
+                src + pos, compressed, n, elem_size, &value);
+        if (kind == STREAM2_BLOCK_CONSTANT && b->frame == NULL) {
+            add_stats(b, value, n);
+        } else if (kind == STREAM2_BLOCK_CONSTANT) {
+            if ((r = builder_reserve(b, n)))
+                return r;
+            for (size_t i = 0; i < n; i++)
+                builder_append(b, first + i, value);
+        } else if (kind == STREAM2_BLOCK_MIXED) {
+            if (!lz4_decompress_block(src + pos, compressed, block,
+                                      n * elem_size))
+                return STREAM2_ERROR_DECODE;
+            if ((r = scan_shuffled(b, block, n, elem_size, first)))
+                return r;
+        }
+        pos += compressed;
+        first += n;
+    }
+    if (len - pos != rest * elem_size)
+        return STREAM2_ERROR_DECODE;
+    return scan_dense(b, src + pos, rest, elem_size, first);
+}
+
+// Decodes bytes of elems elements into a builder. Data that cannot be
+// decoded block by block is decoded into *scratch first, which is allocated
+// if NULL, or is not supported if scratch is NULL.
+static enum stream2_result decode_into(struct builder* b,
+                                       const struct stream2_bytes* bytes,
+                                       size_t elem_size,
+                                       size_t elems,
+                                       void** scratch) {
+    enum stream2_result r;
+
+    const size_t size = elems * elem_size;
+    const struct stream2_compression compression = bytes->compression;
+
+    if (compression.algorithm == NULL) {
+        if (bytes->len != size)
+            return STREAM2_ERROR_DECODE;
+        if ((r = scan_dense(b, bytes->ptr, elems, elem_size, 0)))
+            return r;
+        builder_finish(b);
+        return STREAM2_OK;
+    }
+
+    if (strcmp(compression.algorithm, "bslz4") == 0) {
+        if (compression.orig_size != size ||
+            compression.elem_size != elem_size)
+            return STREAM2_ERROR_DECODE;
+        r = decode_bslz4(b, bytes->ptr, bytes->len, elem_size, elems);
+        if (r != STREAM2_ERROR_NOT_IMPLEMENTED) {
+            if (r == STREAM2_OK)
+                builder_finish(b);
+            return r;
+        }
+    }
+
+    if (scratch == NULL)
+        return STREAM2_ERROR_NOT_IMPLEMENTED;
+    if (*scratch == NULL && (*scratch = malloc(size)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((r = stream2_decode_bytes(bytes, *scratch, size)) ||
+        (r = scan_dense(b, *scratch, elems, elem_size, 0)))
+        return r;
+    builder_finish(b);
+    return STREAM2_OK;
+}
+
+enum stream2_result stream2_sparse_decode_bytes(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        struct stream2_sparse_frame* frame) {
+    struct builder b;
+    builder_start(&b, frame);
+    return decode_into(&b, bytes, elem_size, frame->width * frame->height,
+                       &frame->scratch);
+}
+
+enum stream2_result stream2_sparse_stats_bytes(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        size_t elems,
+        uint64_t saturation_value,
+        void* scratch,
+        struct stream2_sparse_stats* stats) {
+    struct builder b;
+    builder_start_stats(&b, stats, saturation_value);
+    return decode_into(&b, bytes, elem_size, elems,
+                       scratch ? &scratch : NULL);
+}
+
+void stream2_sparse_expand(const struct stream2_sparse_frame* frame,
+                           size_t elem_size,
+                           void* dst) {
+    memset(dst, 0, frame->width * frame->height * elem_size);
+    for (size_t y = 0; y < frame->height; y++) {
+        uint8_t* row = (uint8_t*)dst + y * frame->width * elem_size;
+        for (size_t i = frame->rows[y]; i < frame->rows[y + 1]; i++) {
+            const uint32_t v = frame->values[i];
+            const size_t x = frame->columns[i];
+            switch (elem_size) {
+                case 1:
+                    row[x] = (uint8_t)v;
+                    break;
+                case 2:
+                    ((uint16_t*)row)[x] = (uint16_t)v;
+                    break;
+                default:
+                    ((uint32_t*)row)[x] = v;
+                    break;
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// A frame of one channel holding only its nonzero pixels in compressed
+// sparse row form, e.g. for low-flux series where most pixels are zero, so
+// that its memory and the cost of walking it scale with the number of counts
+// rather than with the size of the detector.
+//
+// Pixels above saturation_value are nonzero and kept.
+struct stream2_sparse_frame {
+    uint64_t width;
+    uint64_t height;
+    // Offsets of the rows in columns and values, height + 1 entries.
+    size_t* rows;
+    uint32_t* columns;
+    uint32_t* values;
+    // Number of nonzero pixels, and capacity of columns and values.
+    size_t len;
+    size_t capacity;
+    // Dense frame that data which cannot be decoded block by block is
+    // decoded into first, allocated when first needed.
+    void* scratch;
+};
+
+enum stream2_result stream2_sparse_frame_create(
+        uint64_t width,
+        uint64_t height,
+        struct stream2_sparse_frame** frame_out);
+void stream2_sparse_frame_free(struct stream2_sparse_frame* frame);
+
+// Decodes bytes of width * height elements of elem_size bytes, compressed
+// with "bslz4" or "lz4" or not compressed, into frame.
+//
+// "bslz4" data is decompressed one bitshuffle block at a time into a buffer
+// on the stack, and the bit planes of each block are or-ed together to find
+// its nonzero pixels, so that only those are unshuffled and the dense frame
+// is never written. Uncompressed data is scanned in place. Other data is
+// decoded into the scratch frame first.
+enum stream2_result stream2_sparse_decode_bytes(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        struct stream2_sparse_frame* frame);
+
+// Statistics of the nonzero pixels of a frame.
+struct stream2_sparse_stats {
+    // Sum and maximum of the pixels up to saturation_value.
+    uint64_t sum;
+    uint64_t max;
+    // Number of pixels equal to and above saturation_value.
+    uint64_t saturated;
+    uint64_t nodata;
+};
+
+// Computes the statistics of bytes of elems elements as decoded by
+// stream2_sparse_decode_bytes(), without storing any pixel: zero blocks are
+// skipped and constant blocks counted without being decompressed. Data that
+// cannot be decoded block by block is decoded into scratch first, a buffer of
+// elems elements, or is not supported if scratch is NULL.
+enum stream2_result stream2_sparse_stats_bytes(
+        const struct stream2_bytes* bytes,
+        size_t elem_size,
+        size_t elems,
+        uint64_t saturation_value,
+        void* scratch,
+        struct stream2_sparse_stats* stats);
+
+// Writes the dense frame of elements of elem_size bytes, e.g. for stages
+// that only take dense frames.
+void stream2_sparse_expand(const struct stream2_sparse_frame* frame,
+                           size_t elem_size,
+                           void* dst);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_stats.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stream2_histogram.h"
+
+enum {
+    // Threads are padded to this many bytes so that they do not share cache
+    // lines.
+    CACHE_LINE = 64,
+};
+
+struct stage_counters {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t latency[STREAM2_HISTOGRAM_BUCKETS];
+};
+
+// Counters written by one thread only, and read by snapshots.
+struct thread_stats {
+    struct stage_counters stages[STREAM2_STAGES];
+    char padding[CACHE_LINE];
+};
+
+struct stream2_stats {
+    uint64_t start_ns;
+    struct thread_stats* threads;
+    size_t threads_len;
+};
+
+uint64_t stream2_stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+enum stream2_result stream2_stats_create(size_t threads,
+                                         struct stream2_stats** stats_out) {
+    *stats_out = NULL;
+
+    if (threads == 0)
+        return STREAM2_ERROR_PARSE;
+    struct stream2_stats* stats = calloc(1, sizeof(struct stream2_stats));
+    if (stats == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    if ((stats->threads = calloc(threads, sizeof(struct thread_stats))) ==
+        NULL)
+    {
+        free(stats);
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    }
+    stats->threads_len = threads;
+    stats->start_ns = stream2_stats_now_ns();
+
+    *stats_out = stats;
+    return STREAM2_OK;
+}
+
+void stream2_stats_free(struct stream2_stats* stats) {
+    if (stats == NULL)
+        return;
+    free(stats->threads);
+    free(stats);
+}
+
+// Adds to a counter that only the calling thread writes, storing the sum
+// atomically so that snapshots never read a torn value.
+static void add_relaxed(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void stream2_stats_record(struct stream2_stats* stats,
+                          size_t thread,
+                          enum stream2_stage stage,
+                          uint64_t ns,
+                          uint64_t bytes) {
+    if (thread >= stats->threads_len)
+        return;
+    struct stage_counters* c = &stats->threads[thread].stages[stage];
+    add_relaxed(&c->count, 1);
+    add_relaxed(&c->bytes, bytes);
+    add_relaxed(&c->total_ns, ns);
+    add_relaxed(&c->latency[stream2_histogram_bucket(ns)], 1);
+    if (ns > c->max_ns)
+        __atomic_store_n(&c->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t load_relaxed(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stream2_stats_snapshot(const struct stream2_stats* stats,
+                            struct stream2_stats_snapshot* snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->elapsed_s = (stream2_stats_now_ns() - stats->start_ns) * 1e-9;
+
+    uint64_t latency[STREAM2_HISTOGRAM_BUCKETS];
+    for (size_t s = 0; s < STREAM2_STAGES; s++) {
+        struct stream2_stats_stage* stage = &snapshot->stages[s];
+        memset(latency, 0, sizeof(latency));
+        for (size_t t = 0; t < stats->threads_len; t++) {
+            const struct stage_counters* c = &stats->threads[t].stages[s];
+            stage->count += load_relaxed(&c->count);
+            stage->bytes += load_relaxed(&c->bytes);
+            stage->total_ns += load_relaxed(&c->total_ns);
+            const uint64_t max_ns = load_relaxed(&c->max_ns);
+            if (max_ns > stage->max_ns)
+                stage->max_ns = max_ns;
+            for (size_t i = 0; i < STREAM2_HISTOGRAM_BUCKETS; i++)
+                latency[i] += load_relaxed(&c->latency[i]);
+        }
+
+        // The buckets may count a few samples more or less than count while
+        // samples are recorded.
+        static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+        double ns[] = {0, 0, 0, 0};
+        stream2_histogram_quantiles(latency, QUANTILES, 4, ns);
+        double* values[] = {&stage->p50_us, &stage->p90_us, &stage->p99_us,
+                            &stage->p999_us};
+        for (size_t q = 0; q < 4; q++) {
+            // The middle of the last bucket may be above the maximum.
+            *values[q] = (ns[q] < stage->max_ns ? ns[q] : stage->max_ns) * 1e-3;
+        }
+    }
+}
+
+const char* stream2_stage_name(enum stream2_stage stage) {
+    switch (stage) {
+        case STREAM2_STAGE_RECEIVE:
+            return "receive";
+        case STREAM2_STAGE_PARSE:
+            return "parse";
+        case STREAM2_STAGE_QUEUE:
+            return "queue";
+        case STREAM2_STAGE_DECODE:
+            return "decode";
+        case STREAM2_STAGE_IMAGE:
+            return "image";
+        case STREAM2_STAGE_WRITE:
+            return "write";
+    }
+    return "unknown";
+}
+
+void stream2_stats_print(const struct stream2_stats_snapshot* snapshot,
+                         FILE* file) {
+    const double elapsed = snapshot->elapsed_s > 0 ? snapshot->elapsed_s : 1;
+    for (size_t s = 0; s < STREAM2_STAGES; s++) {
+        const struct stream2_stats_stage* stage = &snapshot->stages[s];
+        if (stage->count == 0)
+            continue;
+        fprintf(file,
+                "stats: %-7s %" PRIu64 " (%.1f Hz) %.3f GB/s mean %.1f us "
+                "p50 %.1f us p99 %.1f us p99.9 %.1f us max %.1f us\n",
+                stream2_stage_name(s), stage->count, stage->count / elapsed,
+                stage->bytes / elapsed * 1e-9,
+                stage->total_ns * 1e-3 / stage->count, stage->p50_us,
+                stage->p99_us, stage->p999_us, stage->max_ns * 1e-3);
+    }
+}
+
+void stream2_stats_print_json(const struct stream2_stats_snapshot* snapshot,
+                              FILE* file) {
+    fprintf(file, "{\"elapsed_s\":%.3f,\"stages\":{", snapshot->elapsed_s);
+    for (size_t s = 0; s < STREAM2_STAGES; s++) {
+        const struct stream2_stats_stage* stage = &snapshot->stages[s];
+        fprintf(file,
+                "%s\"%s\":{\"count\":%" PRIu64 ",\"bytes\":%" PRIu64
+                ",\"total_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64
+                ",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,"
+                "\"p999_us\":%.3f}",
+                s > 0 ? "," : "", stream2_stage_name(s), stage->count,
+                stage->bytes, stage->total_ns, stage->max_ns, stage->p50_us,
+                stage->p90_us, stage->p99_us, stage->p999_us);
+    }
+    fprintf(file, "}}\n");
+}
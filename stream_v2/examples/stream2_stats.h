@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Latency histograms and throughput counters of the stages of a pipeline,
+// e.g. to find whether receiving, parsing, decoding or the image callback is
+// the bottleneck.
+//
+// Every thread records into its own histograms, so that recording a sample
+// takes a few nanoseconds without locks or atomic read-modify-writes, and a
+// snapshot merges the histograms of all threads without stopping them.
+// Histograms have 8 buckets per power of two, so latencies are accurate to
+// about 6%.
+struct stream2_stats;
+
+enum stream2_stage {
+    // Handling a message on the receive thread once it was received,
+    // including waiting for room in the queue. Bytes of the message.
+    STREAM2_STAGE_RECEIVE,
+    // Parsing a message. Bytes of the message.
+    STREAM2_STAGE_PARSE,
+    // Waiting in the queue for a decoder thread. Bytes of the message.
+    STREAM2_STAGE_QUEUE,
+    // Decoding every channel of an image. Bytes of the decoded frames.
+    STREAM2_STAGE_DECODE,
+    // Image callback, e.g. corrections and stages that take frames. Bytes of
+    // the decoded frames.
+    STREAM2_STAGE_IMAGE,
+    // Writing, recorded by the application. Bytes written.
+    STREAM2_STAGE_WRITE,
+};
+
+enum { STREAM2_STAGES = STREAM2_STAGE_WRITE + 1 };
+
+struct stream2_stats_stage {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double p999_us;
+};
+
+struct stream2_stats_snapshot {
+    // Time since the statistics were created.
+    double elapsed_s;
+    struct stream2_stats_stage stages[STREAM2_STAGES];
+};
+
+// Creates the statistics of a pipeline of threads threads.
+enum stream2_result stream2_stats_create(size_t threads,
+                                         struct stream2_stats** stats_out);
+void stream2_stats_free(struct stream2_stats* stats);
+
+// Gets a monotonic time in nanoseconds to measure latencies with.
+uint64_t stream2_stats_now_ns(void);
+
+// Records a sample of a stage that took ns nanoseconds and bytes bytes on
+// thread thread. A thread index must be used by one thread at a time.
+void stream2_stats_record(struct stream2_stats* stats,
+                          size_t thread,
+                          enum stream2_stage stage,
+                          uint64_t ns,
+                          uint64_t bytes);
+
+// Merges the counters and histograms of every thread. May be called while
+// samples are recorded, in which case the samples being recorded may be
+// counted in some of the counters only.
+void stream2_stats_snapshot(const struct stream2_stats* stats,
+                            struct stream2_stats_snapshot* snapshot);
+
+const char* stream2_stage_name(enum stream2_stage stage);
+
+// Prints a line per stage that recorded samples, with its count, rate,
+// throughput and latencies.
+void stream2_stats_print(const struct stream2_stats_snapshot* snapshot,
+                         FILE* file);
+
+// Prints the snapshot as a JSON object on one line.
+void stream2_stats_print_json(const struct stream2_stats_snapshot* snapshot,
+                              FILE* file);
+
+#if defined(__cplusplus)
+}
+#endif
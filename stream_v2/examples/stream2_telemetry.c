@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stream2_telemetry.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stream2_histogram.h"
+
+enum {
+    // Ratios are bucketed in fixed point with this many steps per unit.
+    RATIO_SCALE = 16,
+};
+
+struct window {
+    uint64_t images;
+    uint64_t compressed_bytes;
+    uint64_t uncompressed_bytes;
+    uint64_t ratio[STREAM2_HISTOGRAM_BUCKETS];
+};
+
+struct channel {
+    char name[32];
+    // Window being recorded into and totals of the complete windows, written
+    // by the recording thread only.
+    struct window current;
+    uint64_t images;
+    uint64_t compressed_bytes;
+    uint64_t uncompressed_bytes;
+    // Last complete window, protected by mutex.
+    struct stream2_telemetry_channel published;
+};
+
+struct stream2_telemetry {
+    struct stream2_telemetry_config config;
+    uint64_t window_ns;
+    uint64_t window_start_ns;
+    struct channel channels[STREAM2_TELEMETRY_CHANNELS];
+    size_t channels_len;
+
+    pthread_mutex_t mutex;
+    uint64_t published_ns;
+    size_t published_len;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stream2_telemetry_config_default(struct stream2_telemetry_config* config) {
+    memset(config, 0, sizeof(*config));
+    config->window_s = 1.0;
+    config->collapse_fraction = 0.5;
+}
+
+enum stream2_result stream2_telemetry_create(
+        const struct stream2_telemetry_config* config,
+        struct stream2_telemetry** telemetry_out) {
+    *telemetry_out = NULL;
+
+    if (!(config->window_s > 0))
+        return STREAM2_ERROR_PARSE;
+    struct stream2_telemetry* telemetry =
+            calloc(1, sizeof(struct stream2_telemetry));
+    if (telemetry == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    telemetry->config = *config;
+    telemetry->window_ns = (uint64_t)(config->window_s * 1e9);
+    if (telemetry->window_ns == 0)
+        telemetry->window_ns = 1;
+    pthread_mutex_init(&telemetry->mutex, NULL);
+
+    *telemetry_out = telemetry;
+    return STREAM2_OK;
+}
+
+void stream2_telemetry_free(struct stream2_telemetry* telemetry) {
+    if (telemetry == NULL)
+        return;
+    pthread_mutex_destroy(&telemetry->mutex);
+    free(telemetry);
+}
+
+static void ratio_quantiles(const struct window* w,
+                            struct stream2_telemetry_channel* c) {
+    static const double QUANTILES[] = {0.1, 0.5, 0.9};
+    double ratio[] = {0, 0, 0};
+    stream2_histogram_quantiles(w->ratio, QUANTILES, 3, ratio);
+    c->ratio_p10 = ratio[0] / RATIO_SCALE;
+    c->ratio_p50 = ratio[1] / RATIO_SCALE;
+    c->ratio_p90 = ratio[2] / RATIO_SCALE;
+}
+
+// Computes the complete window of a channel and the thresholds it crosses.
+static void complete_window(const struct stream2_telemetry* telemetry,
+                            struct channel* channel,
+                            double window_s,
+                            struct stream2_telemetry_channel* c) {
+    const struct stream2_telemetry_config* config = &telemetry->config;
+    const struct window* w = &channel->current;
+
+    memset(c, 0, sizeof(*c));
+    memcpy(c->name, channel->name, sizeof(c->name));
+    c->window_s = window_s;
+    c->images_per_s = w->images / window_s;
+    c->compressed_gbps = w->compressed_bytes / window_s * 1e-9;
+    c->uncompressed_gbps = w->uncompressed_bytes / window_s * 1e-9;
+    if (w->images > 0)
+        c->bytes_per_image = (double)w->compressed_bytes / w->images;
+    if (w->compressed_bytes > 0)
+        c->ratio = (double)w->uncompressed_bytes / w->compressed_bytes;
+    ratio_quantiles(w, c);
+
+    if (w->images > 0 && config->min_ratio > 0 && c->ratio < config->min_ratio)
+        c->alerts |= STREAM2_TELEMETRY_RATIO_LOW;
+    // Compared to the images before the window, so that a collapse is not
+    // diluted by the images collapsing.
+    if (w->images > 0 && config->collapse_fraction > 0 &&
+        channel->compressed_bytes > 0 &&
+        c->ratio_p10 < config->collapse_fraction *
+                               channel->uncompressed_bytes /
+                               channel->compressed_bytes)
+        c->alerts |= STREAM2_TELEMETRY_RATIO_COLLAPSE;
+    if (config->max_compressed_gbps > 0 &&
+        c->compressed_gbps > config->max_compressed_gbps)
+        c->alerts |= STREAM2_TELEMETRY_COMPRESSED_HIGH;
+    if (config->max_uncompressed_gbps > 0 &&
+        c->uncompressed_gbps > config->max_uncompressed_gbps)
+        c->alerts |= STREAM2_TELEMETRY_UNCOMPRESSED_HIGH;
+
+    channel->images += w->images;
+    channel->compressed_bytes += w->compressed_bytes;
+    channel->uncompressed_bytes += w->uncompressed_bytes;
+    c->images = channel->images;
+    c->compressed_bytes = channel->compressed_bytes;
+    c->uncompressed_bytes = channel->uncompressed_bytes;
+}
+
+// Publishes the windows of every channel and starts the next windows.
+static void publish(struct stream2_telemetry* telemetry, uint64_t now) {
+    const struct stream2_telemetry_config* config = &telemetry->config;
+    const double window_s = (now - telemetry->window_start_ns) * 1e-9;
+    struct stream2_telemetry_channel windows[STREAM2_TELEMETRY_CHANNELS];
+
+    for (size_t i = 0; i < telemetry->channels_len; i++) {
+        struct channel* channel = &telemetry->channels[i];
+        complete_window(telemetry, channel, window_s, &windows[i]);
+        memset(&channel->current, 0, sizeof(channel->current));
+    }
+
+    pthread_mutex_lock(&telemetry->mutex);
+    for (size_t i = 0; i < telemetry->channels_len; i++)
+        telemetry->channels[i].published = windows[i];
+    telemetry->published_len = telemetry->channels_len;
+    telemetry->published_ns = now;
+    pthread_mutex_unlock(&telemetry->mutex);
+
+    for (size_t i = 0; config->alert && i < telemetry->channels_len; i++) {
+        if (windows[i].alerts)
+            config->alert(config->user, i, &windows[i]);
+    }
+    telemetry->window_start_ns = now;
+}
+
+void stream2_telemetry_record(struct stream2_telemetry* telemetry,
+                              const struct stream2_image_msg* msg) {
+    const uint64_t now = now_ns();
+    if (telemetry->window_start_ns == 0)
+        telemetry->window_start_ns = now;
+    else if (now - telemetry->window_start_ns >= telemetry->window_ns)
+        publish(telemetry, now);
+
+    size_t len = msg->data.len;
+    if (len > STREAM2_TELEMETRY_CHANNELS)
+        len = STREAM2_TELEMETRY_CHANNELS;
+    if (len > telemetry->channels_len)
+        telemetry->channels_len = len;
+    for (size_t i = 0; i < len; i++) {
+        const struct stream2_image_data* data = &msg->data.ptr[i];
+        const struct stream2_bytes* bytes = &data->data.array.data;
+        struct channel* channel = &telemetry->channels[i];
+        struct window* w = &channel->current;
+
+        if (w->images == 0 && data->channel) {
+            strncpy(channel->name, data->channel, sizeof(channel->name) - 1);
+            channel->name[sizeof(channel->name) - 1] = '\0';
+        }
+        const uint64_t orig_size = bytes->compression.algorithm
+                                           ? bytes->compression.orig_size
+                                           : bytes->len;
+        w->images++;
+        w->compressed_bytes += bytes->len;
+        w->uncompressed_bytes += orig_size;
+        const uint64_t ratio =
+                bytes->len > 0 ? orig_size * RATIO_SCALE / bytes->len : 0;
+        w->ratio[stream2_histogram_bucket(ratio)]++;
+    }
+}
+
+void stream2_telemetry_snapshot(struct stream2_telemetry* telemetry,
+                                struct stream2_telemetry_snapshot* snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    const uint64_t now = now_ns();
+
+    pthread_mutex_lock(&telemetry->mutex);
+    snapshot->channels_len = telemetry->published_len;
+    for (size_t i = 0; i < snapshot->channels_len; i++)
+        snapshot->channels[i] = telemetry->channels[i].published;
+    const uint64_t published_ns = telemetry->published_ns;
+    pthread_mutex_unlock(&telemetry->mutex);
+
+    for (size_t i = 0; i < snapshot->channels_len; i++) {
+        struct stream2_telemetry_channel* c = &snapshot->channels[i];
+        c->age_s = (now - published_ns) * 1e-9;
+        snapshot->compressed_gbps += c->compressed_gbps;
+        snapshot->uncompressed_gbps += c->uncompressed_gbps;
+        snapshot->alerts |= c->alerts;
+    }
+    if (telemetry->config.decoder_gbps > 0) {
+        snapshot->decoder_threads = (size_t)ceil(
+                snapshot->uncompressed_gbps / telemetry->config.decoder_gbps);
+    }
+}
+
+const char* stream2_telemetry_alert_name(enum stream2_telemetry_alert alert) {
+    switch (alert) {
+        case STREAM2_TELEMETRY_RATIO_LOW:
+            return "ratio_low";
+        case STREAM2_TELEMETRY_RATIO_COLLAPSE:
+            return "ratio_collapse";
+        case STREAM2_TELEMETRY_COMPRESSED_HIGH:
+            return "compressed_high";
+        case STREAM2_TELEMETRY_UNCOMPRESSED_HIGH:
+            return "uncompressed_high";
+    }
+    return "unknown";
+}
+
+void stream2_telemetry_print(const struct stream2_telemetry_snapshot* snapshot,
+                             FILE* file) {
+    for (size_t i = 0; i < snapshot->channels_len; i++) {
+        const struct stream2_telemetry_channel* c = &snapshot->channels[i];
+        fprintf(file,
+                "telemetry: %s %.1f Hz %.3f GB/s compressed %.3f GB/s "
+                "uncompressed %.0f bytes/image ratio %.2f p10 %.2f p50 %.2f "
+                "p90 %.2f",
+                c->name, c->images_per_s, c->compressed_gbps,
+                c->uncompressed_gbps, c->bytes_per_image, c->ratio,
+                c->ratio_p10, c->ratio_p50, c->ratio_p90);
+        for (unsigned alert = 1; alert <= STREAM2_TELEMETRY_UNCOMPRESSED_HIGH;
+             alert <<= 1)
+        {
+            if (c->alerts & alert)
+                fprintf(file, " %s", stream2_telemetry_alert_name(alert));
+        }
+        fprintf(file, "\n");
+    }
+    if (snapshot->decoder_threads > 0) {
+        fprintf(file, "telemetry: %zu decoder threads needed\n",
+                snapshot->decoder_threads);
+    }
+}
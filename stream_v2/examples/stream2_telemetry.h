@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stream2.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Rolling compression ratio and bandwidth of every channel, from the sizes of
+// the image data of parsed image messages, i.e. without decoding them.
+//
+// The compressed bandwidth is the network load and the uncompressed bandwidth
+// the decode load, so that the ratio predicts how many decoder threads a
+// series needs before the queues fill. Images are recorded by one thread into
+// a window of its own, which is published once the window is complete, so
+// that recording an image only adds a few counters per channel.
+struct stream2_telemetry;
+
+// Channels beyond this are not recorded.
+enum { STREAM2_TELEMETRY_CHANNELS = 8 };
+
+// Thresholds crossed by a window.
+enum stream2_telemetry_alert {
+    // The mean ratio is below min_ratio.
+    STREAM2_TELEMETRY_RATIO_LOW = 1,
+    // The 10th percentile of the ratio fell below collapse_fraction of the
+    // ratio of the previous windows, e.g. when a sample saturates.
+    STREAM2_TELEMETRY_RATIO_COLLAPSE = 2,
+    // The compressed bandwidth is above max_compressed_gbps.
+    STREAM2_TELEMETRY_COMPRESSED_HIGH = 4,
+    // The uncompressed bandwidth is above max_uncompressed_gbps.
+    STREAM2_TELEMETRY_UNCOMPRESSED_HIGH = 8,
+};
+
+struct stream2_telemetry_channel {
+    char name[32];
+    // Totals of the images of all complete windows.
+    uint64_t images;
+    uint64_t compressed_bytes;
+    uint64_t uncompressed_bytes;
+    // Last complete window and how long ago it ended. A window completes
+    // with the first image recorded after window_s.
+    double window_s;
+    double age_s;
+    double images_per_s;
+    double compressed_gbps;
+    double uncompressed_gbps;
+    double bytes_per_image;
+    // Uncompressed over compressed size of the window and percentiles of the
+    // ratio of its images.
+    double ratio;
+    double ratio_p10;
+    double ratio_p50;
+    double ratio_p90;
+    // Bitwise or of enum stream2_telemetry_alert.
+    unsigned alerts;
+};
+
+struct stream2_telemetry_config {
+    // Duration of the windows rates and ratios are computed over.
+    double window_s;
+    // Thresholds of enum stream2_telemetry_alert, or 0 to disable them.
+    double min_ratio;
+    double collapse_fraction;
+    double max_compressed_gbps;
+    double max_uncompressed_gbps;
+    // Uncompressed bandwidth a decoder thread sustains, or 0 if unknown,
+    // from which the number of decoder threads needed is estimated.
+    double decoder_gbps;
+    // Called by the recording thread for every channel whose complete window
+    // crossed a threshold, if not NULL.
+    void* user;
+    void (*alert)(void* user,
+                  size_t channel,
+                  const struct stream2_telemetry_channel* telemetry);
+};
+
+struct stream2_telemetry_snapshot {
+    size_t channels_len;
+    struct stream2_telemetry_channel channels[STREAM2_TELEMETRY_CHANNELS];
+    // Sums of the last windows of every channel.
+    double compressed_gbps;
+    double uncompressed_gbps;
+    // Decoder threads needed for the uncompressed bandwidth, or 0 if
+    // decoder_gbps is 0.
+    size_t decoder_threads;
+    unsigned alerts;
+};
+
+void stream2_telemetry_config_default(struct stream2_telemetry_config* config);
+
+enum stream2_result stream2_telemetry_create(
+        const struct stream2_telemetry_config* config,
+        struct stream2_telemetry** telemetry_out);
+void stream2_telemetry_free(struct stream2_telemetry* telemetry);
+
+// Records the sizes of the image data of every channel of an image message.
+// Must be called by one thread at a time.
+void stream2_telemetry_record(struct stream2_telemetry* telemetry,
+                              const struct stream2_image_msg* msg);
+
+// Gets the totals and the last complete window of every channel. May be
+// called by any thread.
+void stream2_telemetry_snapshot(struct stream2_telemetry* telemetry,
+                                struct stream2_telemetry_snapshot* snapshot);
+
+// Gets the name of a single alert.
+const char* stream2_telemetry_alert_name(enum stream2_telemetry_alert alert);
+
+// Prints a line per channel with a complete window.
+void stream2_telemetry_print(const struct stream2_telemetry_snapshot* snapshot,
+                             FILE* file);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,310 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream2_blockmap.h"
+#include "stream2_compress.h"
+#include "stream2_series.h"
+
+// Checks the classification of "bslz4" blocks on frames built from blocks
+// of known kinds: all zero, constant, NODATA and mixed blocks, a partial last
+// block and the fewer than 8 elements copied after it. Frames that are
+// constant as a whole are filled by stream2_series_decode() without being
+// decompressed, which has to give the same frame and statistics.
+
+enum {
+    // Elements of the partial last block and after it.
+    PARTIAL_ELEMS = 24,
+    REST_ELEMS = 5,
+    // Number of bitshuffle blocks before the partial block.
+    BLOCKS = 4,
+    BSHUF_TARGET_BLOCK_SIZE = 8192,
+};
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void set_elems(uint8_t* frame,
+                      size_t elem_size,
+                      size_t first,
+                      size_t n,
+                      uint32_t value) {
+    // Typed arrays are little-endian.
+    for (size_t i = first; i < first + n; i++) {
+        for (size_t b = 0; b < elem_size; b++)
+            frame[i * elem_size + b] = (uint8_t)(value >> (8 * b));
+    }
+}
+
+static uint32_t get_elem(const uint8_t* frame, size_t elem_size, size_t i) {
+    uint32_t value = 0;
+    for (size_t b = 0; b < elem_size; b++)
+        value |= (uint32_t)frame[i * elem_size + b] << (8 * b);
+    return value;
+}
+
+static uint32_t max_value(size_t elem_size) {
+    return UINT32_MAX >> (32 - 8 * elem_size);
+}
+
+// Gets a constant value that uses every byte of the element.
+static uint32_t constant_value(size_t elem_size) {
+    return UINT32_C(0x12345678) & max_value(elem_size) & ~UINT32_C(1);
+}
+
+static size_t block_elems(size_t elem_size) {
+    return BSHUF_TARGET_BLOCK_SIZE / elem_size;
+}
+
+static size_t frame_elems(size_t elem_size) {
+    return BLOCKS * block_elems(elem_size) + PARTIAL_ELEMS + REST_ELEMS;
+}
+
+static enum stream2_result compress_frame(const uint8_t* frame,
+                                          size_t elem_size,
+                                          uint8_t** compressed,
+                                          struct stream2_bytes* bytes) {
+    enum stream2_result r;
+
+    const size_t size = frame_elems(elem_size) * elem_size;
+    const size_t bound = stream2_compress_bound("bslz4", size, elem_size);
+    if ((*compressed = malloc(bound)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+    memset(bytes, 0, sizeof(*bytes));
+    if ((r = stream2_compress("bslz4", frame, size, elem_size, *compressed,
+                              bound, &bytes->len)))
+        return r;
+    bytes->ptr = *compressed;
+    bytes->compression.algorithm = "bslz4";
+    bytes->compression.elem_size = elem_size;
+    bytes->compression.orig_size = size;
+    return STREAM2_OK;
+}
+
+static bool check_block(const struct stream2_block_map* map,
+                        size_t index,
+                        size_t first,
+                        size_t elems,
+                        enum stream2_block_kind kind,
+                        uint32_t value) {
+    if (index >= map->len) {
+        fprintf(stderr, "error: block %zu missing\n", index);
+        return false;
+    }
+    const struct stream2_block* block = &map->blocks[index];
+    if (block->first != first || block->elems != elems ||
+        block->kind != kind ||
+        (kind != STREAM2_BLOCK_MIXED && block->value != value))
+    {
+        fprintf(stderr,
+                "error: block %zu is %zu+%zu kind %i value %u instead of "
+                "%zu+%zu kind %i value %u\n",
+                index, block->first, block->elems, (int)block->kind,
+                block->value, first, elems, (int)kind, value);
+        return false;
+    }
+    return true;
+}
+
+// Classifies a frame of zero, constant, mixed, NODATA and constant blocks
+// followed by zero elements.
+static bool test_blocks(size_t elem_size) {
+    enum stream2_result r;
+
+    const size_t n = block_elems(elem_size);
+    const size_t elems = frame_elems(elem_size);
+    const uint32_t value = constant_value(elem_size);
+    uint8_t* frame = calloc(elems, elem_size);
+    uint8_t* compressed = NULL;
+    struct stream2_block_map* map = NULL;
+    bool ok = false;
+    if (frame == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+    } else {
+        set_elems(frame, elem_size, n, n, value);
+        uint64_t state = 0x9e3779b97f4a7c15 ^ elem_size;
+        for (size_t i = 0; i < n / 16; i++) {
+            set_elems(frame, elem_size, 2 * n + xorshift64(&state) % n, 1,
+                      (uint32_t)xorshift64(&state) & max_value(elem_size));
+        }
+        set_elems(frame, elem_size, 3 * n, n, max_value(elem_size));
+        set_elems(frame, elem_size, 4 * n, PARTIAL_ELEMS, value);
+
+        struct stream2_bytes bytes;
+        if ((r = compress_frame(frame, elem_size, &compressed, &bytes)) ||
+            (r = stream2_block_map_create(&map)) ||
+            (r = stream2_block_map_classify(&bytes, elem_size, elems, map)))
+        {
+            fprintf(stderr, "error: error %i classifying\n", (int)r);
+        } else {
+            ok = map->len == BLOCKS + 2 && map->kind == STREAM2_BLOCK_MIXED &&
+                 map->zero_elems == n + REST_ELEMS &&
+                 map->constant_elems == 2 * n + PARTIAL_ELEMS;
+            if (!ok)
+                fprintf(stderr, "error: bad block map\n");
+            ok &= check_block(map, 0, 0, n, STREAM2_BLOCK_ZERO, 0);
+            ok &= check_block(map, 1, n, n, STREAM2_BLOCK_CONSTANT, value);
+            ok &= check_block(map, 2, 2 * n, n, STREAM2_BLOCK_MIXED, 0);
+            ok &= check_block(map, 3, 3 * n, n, STREAM2_BLOCK_CONSTANT,
+                              max_value(elem_size));
+            ok &= check_block(map, 4, 4 * n, PARTIAL_ELEMS,
+                              STREAM2_BLOCK_CONSTANT, value);
+            ok &= check_block(map, 5, 4 * n + PARTIAL_ELEMS, REST_ELEMS,
+                              STREAM2_BLOCK_ZERO, 0);
+        }
+    }
+    printf("%s blocks uint%zu\n", ok ? "ok" : "FAILED", 8 * elem_size);
+
+    stream2_block_map_free(map);
+    free(compressed);
+    free(frame);
+    return ok;
+}
+
+static enum stream2_result create_series(size_t elem_size,
+                                         struct stream2_series** series) {
+    static const char* const IMAGE_DTYPES[] = {NULL, "uint8", "uint16", NULL,
+                                               "uint32"};
+    struct stream2_start_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = STREAM2_MSG_START;
+    msg.series_id = 1;
+    msg.image_dtype = (char*)IMAGE_DTYPES[elem_size];
+    msg.image_size_x = frame_elems(elem_size);
+    msg.image_size_y = 1;
+    msg.number_of_images = 1;
+    // The maximum value is NODATA.
+    msg.saturation_value = max_value(elem_size) - 1;
+    return stream2_series_create(&msg, NULL, series);
+}
+
+// Decodes a frame with stream2_series_decode() into a decode buffer holding
+// garbage and compares it and its statistics with the frame.
+static bool check_decode(struct stream2_series* series,
+                         const uint8_t* frame,
+                         const struct stream2_bytes* bytes) {
+    enum stream2_result r;
+
+    struct stream2_image_data data;
+    memset(&data, 0, sizeof(data));
+    data.data.dim[0] = series->image_size_y;
+    data.data.dim[1] = series->image_size_x;
+    data.data.array.tag = series->tag;
+    data.data.array.data = *bytes;
+
+    struct stream2_image_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = STREAM2_MSG_IMAGE;
+    msg.series_id = 1;
+    msg.data.ptr = &data;
+    msg.data.len = 1;
+
+    memset(series->channels[0].decode_buffers[0], 0xee, series->frame_size);
+    const void* decoded;
+    if ((r = stream2_series_decode(series, &msg, 0, 0, &decoded))) {
+        fprintf(stderr, "error: error %i decoding\n", (int)r);
+        return false;
+    }
+    if (memcmp(decoded, frame, series->frame_size) != 0) {
+        fprintf(stderr, "error: decoded frame differs\n");
+        return false;
+    }
+
+    const size_t elem_size = series->elem_size;
+    uint64_t sum = 0, max = 0, saturated = 0, nodata = 0;
+    for (size_t i = 0; i < frame_elems(elem_size); i++) {
+        const uint64_t v = get_elem(frame, elem_size, i);
+        if (v > series->saturation_value) {
+            nodata++;
+            continue;
+        }
+        sum += v;
+        max = v > max ? v : max;
+        saturated += v == series->saturation_value;
+    }
+    const struct stream2_series_stats* stats = &series->channels[0].stats;
+    if (stats->sum[0] != sum || stats->max[0] != max ||
+        stats->saturated[0] != saturated || stats->nodata[0] != nodata)
+    {
+        fprintf(stderr, "error: statistics differ\n");
+        return false;
+    }
+    return true;
+}
+
+// Classifies a frame of a single value, whose last element is changed to
+// last if it differs, and checks its filled output.
+static bool test_frame(struct stream2_series* series,
+                       uint32_t value,
+                       uint32_t last) {
+    enum stream2_result r;
+
+    const size_t elem_size = series->elem_size;
+    const size_t elems = frame_elems(elem_size);
+    const enum stream2_block_kind kind =
+            value != last ? STREAM2_BLOCK_MIXED
+            : value == 0  ? STREAM2_BLOCK_ZERO
+                          : STREAM2_BLOCK_CONSTANT;
+    uint8_t* frame = malloc(elems * elem_size);
+    uint8_t* compressed = NULL;
+    bool ok = false;
+    if (frame == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+    } else {
+        set_elems(frame, elem_size, 0, elems - 1, value);
+        set_elems(frame, elem_size, elems - 1, 1, last);
+
+        struct stream2_bytes bytes;
+        uint32_t classified = 0;
+        if ((r = compress_frame(frame, elem_size, &compressed, &bytes))) {
+            fprintf(stderr, "error: error %i compressing\n", (int)r);
+        } else if (stream2_block_classify_frame(&bytes, elem_size, elems,
+                                                &classified) != kind ||
+                   (kind != STREAM2_BLOCK_MIXED && classified != value))
+        {
+            fprintf(stderr, "error: frame classified wrongly\n");
+        } else {
+            ok = check_decode(series, frame, &bytes);
+        }
+    }
+    printf("%s frame uint%zu value %u last %u\n", ok ? "ok" : "FAILED",
+           8 * elem_size, value, last);
+
+    free(compressed);
+    free(frame);
+    return ok;
+}
+
+int main(void) {
+    enum stream2_result r;
+
+    static const size_t ELEM_SIZES[] = {1, 2, 4};
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(ELEM_SIZES) / sizeof(ELEM_SIZES[0]); i++) {
+        const size_t elem_size = ELEM_SIZES[i];
+        const uint32_t value = constant_value(elem_size);
+        const uint32_t nodata = max_value(elem_size);
+        ok &= test_blocks(elem_size);
+
+        struct stream2_series* series;
+        if ((r = create_series(elem_size, &series))) {
+            fprintf(stderr, "error: error %i creating series\n", (int)r);
+            return EXIT_FAILURE;
+        }
+        ok &= test_frame(series, 0, 0);
+        ok &= test_frame(series, value, value);
+        ok &= test_frame(series, nodata, nodata);
+        ok &= test_frame(series, value, value + 1);
+        ok &= test_frame(series, 0, 1);
+        stream2_series_free(series);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
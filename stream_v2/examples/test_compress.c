@@ -0,0 +1,167 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compression/src/compression.h"
+#include "stream2_compress.h"
+#include "stream2_compressor.h"
+
+// Round trip of stream2_compress() and stream2_compressor_compress() through
+// the dectris compression library: synthetic frames of every element size,
+// including frames with fewer than 8 elements left after the last block, are
+// compressed and decompressed and compared byte for byte. The output of the
+// compressor has to be identical to the output of stream2_compress().
+
+enum { COMPRESSOR_THREADS = 4 };
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Fills a frame with runs of zeros, small values as of photon counts and
+// random bytes, which do not compress.
+static void generate_frame(uint8_t* data, size_t size, size_t elem_size) {
+    uint64_t state = 0x9e3779b97f4a7c15 ^ size ^ elem_size;
+    size_t i = 0;
+    while (i < size) {
+        const uint64_t x = xorshift64(&state);
+        const size_t run = (size_t)(x >> 8) % 4096 * elem_size;
+        const size_t n = size - i < run ? size - i : run;
+        switch (x % 4) {
+            case 0:
+            case 1:
+                memset(data + i, 0, n);
+                break;
+            case 2:
+                for (size_t j = 0; j < n; j++)
+                    data[i + j] = j % elem_size == 0
+                                          ? (uint8_t)(xorshift64(&state) % 4)
+                                          : 0;
+                break;
+            default:
+                for (size_t j = 0; j < n; j++)
+                    data[i + j] = (uint8_t)xorshift64(&state);
+                break;
+        }
+        i += n;
+    }
+}
+
+// Compresses src with both compressors into compressed and parallel, which
+// hold stream2_compress_bound() bytes, and decompresses it into decompressed.
+static bool check(struct stream2_compressor* compressor,
+                  const char* algorithm,
+                  const uint8_t* src,
+                  size_t size,
+                  size_t elem_size,
+                  uint8_t* compressed,
+                  uint8_t* parallel,
+                  size_t bound,
+                  uint8_t* decompressed) {
+    enum stream2_result r;
+
+    size_t compressed_size;
+    size_t parallel_size;
+    if ((r = stream2_compress(algorithm, src, size, elem_size, compressed,
+                              bound, &compressed_size)) ||
+        (r = stream2_compressor_compress(compressor, algorithm, src, size,
+                                         elem_size, parallel, bound,
+                                         &parallel_size)))
+    {
+        fprintf(stderr, "error: error %i compressing\n", (int)r);
+        return false;
+    }
+    if (parallel_size != compressed_size ||
+        memcmp(parallel, compressed, compressed_size) != 0)
+    {
+        fprintf(stderr, "error: compressor output differs\n");
+        return false;
+    }
+
+    const CompressionAlgorithm a = strcmp(algorithm, "bslz4") == 0
+                                           ? COMPRESSION_BSLZ4
+                                           : COMPRESSION_LZ4;
+    if (compression_decompress_buffer(a, (char*)decompressed, size,
+                                      (const char*)compressed,
+                                      compressed_size, elem_size) != size)
+    {
+        fprintf(stderr, "error: decompression failed\n");
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (decompressed[i] != src[i]) {
+            fprintf(stderr, "error: byte %zu is %u instead of %u\n", i,
+                    decompressed[i], src[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool round_trip(struct stream2_compressor* compressor,
+                       const char* algorithm,
+                       size_t size,
+                       size_t elem_size) {
+    const size_t bound = stream2_compress_bound(algorithm, size, elem_size);
+    uint8_t* src = malloc(size);
+    uint8_t* compressed = malloc(bound);
+    uint8_t* parallel = malloc(bound);
+    uint8_t* decompressed = malloc(size);
+
+    bool ok;
+    if (src == NULL || compressed == NULL || parallel == NULL ||
+        decompressed == NULL)
+    {
+        fprintf(stderr, "error: out of memory\n");
+        ok = false;
+    } else {
+        generate_frame(src, size, elem_size);
+        ok = check(compressor, algorithm, src, size, elem_size, compressed,
+                   parallel, bound, decompressed);
+    }
+    printf("%s %s size %zu elem_size %zu\n", ok ? "ok" : "FAILED", algorithm,
+           size, elem_size);
+
+    free(decompressed);
+    free(parallel);
+    free(compressed);
+    free(src);
+    return ok;
+}
+
+int main(void) {
+    enum stream2_result r;
+
+    struct stream2_compressor* compressor;
+    if ((r = stream2_compressor_create(COMPRESSOR_THREADS, &compressor))) {
+        fprintf(stderr, "error: error %i creating compressor\n", (int)r);
+        return EXIT_FAILURE;
+    }
+
+    // Numbers of elements: fewer than 8, whole blocks of 1 byte elements
+    // followed by 3, whole blocks only, and a partial last block followed
+    // by 5.
+    static const size_t ELEMS[] = {5, 8195, 65536, 1028 * 1062 + 5};
+    static const size_t ELEM_SIZES[] = {1, 2, 4, 8};
+    // Sizes in bytes around the 1 MiB blocks of "lz4".
+    static const size_t LZ4_SIZES[] = {100, 1 << 20, (3 << 20) + 17};
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(ELEM_SIZES) / sizeof(ELEM_SIZES[0]); i++) {
+        for (size_t j = 0; j < sizeof(ELEMS) / sizeof(ELEMS[0]); j++) {
+            ok &= round_trip(compressor, "bslz4", ELEMS[j] * ELEM_SIZES[i],
+                             ELEM_SIZES[i]);
+        }
+    }
+    for (size_t i = 0; i < sizeof(LZ4_SIZES) / sizeof(LZ4_SIZES[0]); i++)
+        ok &= round_trip(compressor, "lz4", LZ4_SIZES[i], 1);
+
+    stream2_compressor_free(compressor);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
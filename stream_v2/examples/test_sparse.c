@@ -0,0 +1,286 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream2_compress.h"
+#include "stream2_series.h"
+#include "stream2_sparse.h"
+
+// Checks that stream2_series_decode_sparse() keeps exactly the nonzero
+// pixels of stream2_series_decode(), in row-major order, with the same
+// statistics. Frames are 517x33, so that "bslz4" data of every element size
+// ends with a partial block and fewer than 8 elements copied after it.
+
+enum {
+    WIDTH = 517,
+    HEIGHT = 33,
+    SATURATION_VALUE = 1000,
+    NODATA_ROW = 7,
+};
+
+enum pattern {
+    PATTERN_EMPTY,
+    PATTERN_SPOTS,
+    PATTERN_NODATA_ROW,
+    PATTERN_CONSTANT,
+    PATTERNS,
+};
+
+static const char* const PATTERN_NAMES[PATTERNS] = {
+        "empty", "spots", "nodata_row", "constant"};
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void set_pixel(uint8_t* frame, size_t elem_size, size_t i,
+                      uint64_t value) {
+    // Typed arrays are little-endian.
+    for (size_t b = 0; b < elem_size; b++)
+        frame[i * elem_size + b] = (uint8_t)(value >> (8 * b));
+}
+
+static uint64_t get_pixel(const uint8_t* frame, size_t elem_size, size_t i) {
+    uint64_t value = 0;
+    for (size_t b = 0; b < elem_size; b++)
+        value |= (uint64_t)frame[i * elem_size + b] << (8 * b);
+    return value;
+}
+
+static void generate_frame(uint8_t* frame, size_t elem_size,
+                           enum pattern pattern) {
+    const size_t pixels = (size_t)WIDTH * HEIGHT;
+    const uint64_t max_value = UINT64_MAX >> (64 - 8 * elem_size);
+    uint64_t state = 0x2545f4914f6cdd1d ^ elem_size ^ pattern;
+
+    memset(frame, 0, pixels * elem_size);
+    switch (pattern) {
+        case PATTERN_EMPTY:
+            break;
+        case PATTERN_NODATA_ROW:
+            for (size_t x = 0; x < WIDTH; x++)
+                set_pixel(frame, elem_size, NODATA_ROW * WIDTH + x, max_value);
+            // The other rows have spots.
+            // fall through
+        case PATTERN_SPOTS:
+            for (size_t i = 0; i < pixels / 50; i++) {
+                const size_t p = xorshift64(&state) % pixels;
+                if (pattern == PATTERN_NODATA_ROW && p / WIDTH == NODATA_ROW)
+                    continue;
+                const uint64_t v = xorshift64(&state) % (SATURATION_VALUE + 1);
+                set_pixel(frame, elem_size, p, v < max_value ? v : max_value);
+            }
+            // The last pixels fall into the elements copied after the blocks.
+            set_pixel(frame, elem_size, pixels - 1, 1);
+            break;
+        case PATTERN_CONSTANT:
+            for (size_t i = 0; i < pixels; i++)
+                set_pixel(frame, elem_size, i, 3);
+            break;
+        case PATTERNS:
+            break;
+    }
+}
+
+static enum stream2_result create_series(const char* image_dtype,
+                                         bool sparse,
+                                         struct stream2_series** series) {
+    struct stream2_start_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = STREAM2_MSG_START;
+    msg.series_id = 1;
+    msg.image_dtype = (char*)image_dtype;
+    msg.image_size_x = WIDTH;
+    msg.image_size_y = HEIGHT;
+    msg.number_of_images = 1;
+    msg.saturation_value = SATURATION_VALUE;
+
+    struct stream2_series_config config;
+    stream2_series_config_default(&config);
+    config.sparse = sparse;
+    return stream2_series_create(&msg, &config, series);
+}
+
+// Compares the sparse frame with the dense frame pixel by pixel.
+static bool compare(const struct stream2_sparse_frame* sparse,
+                    const uint8_t* dense,
+                    size_t elem_size) {
+    if (sparse->width != WIDTH || sparse->height != HEIGHT ||
+        sparse->rows[0] != 0)
+    {
+        fprintf(stderr, "error: bad sparse frame geometry\n");
+        return false;
+    }
+    size_t k = 0;
+    for (size_t y = 0; y < HEIGHT; y++) {
+        for (size_t x = 0; x < WIDTH; x++) {
+            const uint64_t v = get_pixel(dense, elem_size, y * WIDTH + x);
+            if (v == 0)
+                continue;
+            if (k >= sparse->rows[y + 1] || sparse->columns[k] != x ||
+                sparse->values[k] != v)
+            {
+                fprintf(stderr,
+                        "error: pixel %zu,%zu of value %llu missing or out of "
+                        "order\n",
+                        x, y, (unsigned long long)v);
+                return false;
+            }
+            k++;
+        }
+        if (k != sparse->rows[y + 1]) {
+            fprintf(stderr, "error: extra pixels in row %zu\n", y);
+            return false;
+        }
+    }
+    if (k != sparse->len) {
+        fprintf(stderr, "error: %zu pixels instead of %zu\n", sparse->len, k);
+        return false;
+    }
+    return true;
+}
+
+static bool compare_stats(const struct stream2_series* dense,
+                          const struct stream2_series* sparse) {
+    const struct stream2_series_stats* a = &dense->channels[0].stats;
+    const struct stream2_series_stats* b = &sparse->channels[0].stats;
+    if (a->sum[0] != b->sum[0] || a->max[0] != b->max[0] ||
+        a->saturated[0] != b->saturated[0] || a->nodata[0] != b->nodata[0])
+    {
+        fprintf(stderr, "error: statistics differ\n");
+        return false;
+    }
+    return true;
+}
+
+static bool check(struct stream2_series* dense,
+                  struct stream2_series* sparse,
+                  const struct stream2_bytes* bytes) {
+    enum stream2_result r;
+
+    struct stream2_image_data data;
+    memset(&data, 0, sizeof(data));
+    data.data.dim[0] = HEIGHT;
+    data.data.dim[1] = WIDTH;
+    data.data.array.tag = dense->tag;
+    data.data.array.data = *bytes;
+
+    struct stream2_image_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = STREAM2_MSG_IMAGE;
+    msg.series_id = 1;
+    msg.image_id = 0;
+    msg.data.ptr = &data;
+    msg.data.len = 1;
+
+    const void* decoded;
+    const struct stream2_sparse_frame* frame;
+    if ((r = stream2_series_decode(dense, &msg, 0, 0, &decoded)) ||
+        (r = stream2_series_decode_sparse(sparse, &msg, 0, 0, &frame)))
+    {
+        fprintf(stderr, "error: error %i decoding\n", (int)r);
+        return false;
+    }
+    return compare(frame, decoded, dense->elem_size) &&
+           compare_stats(dense, sparse);
+}
+
+// Gets the image data of a frame compressed with algorithm into compressed,
+// which holds stream2_compress_bound() bytes, or not compressed if NULL.
+static enum stream2_result encode_frame(const char* algorithm,
+                                        const uint8_t* frame,
+                                        size_t size,
+                                        size_t elem_size,
+                                        uint8_t* compressed,
+                                        size_t bound,
+                                        struct stream2_bytes* bytes) {
+    enum stream2_result r;
+
+    memset(bytes, 0, sizeof(*bytes));
+    if (algorithm == NULL) {
+        bytes->ptr = frame;
+        bytes->len = size;
+        return STREAM2_OK;
+    }
+    if ((r = stream2_compress(algorithm, frame, size, elem_size, compressed,
+                              bound, &bytes->len)))
+        return r;
+    bytes->ptr = compressed;
+    bytes->compression.algorithm = (char*)algorithm;
+    bytes->compression.elem_size = elem_size;
+    bytes->compression.orig_size = size;
+    return STREAM2_OK;
+}
+
+static bool run(struct stream2_series* dense,
+                struct stream2_series* sparse,
+                const char* algorithm,
+                enum pattern pattern) {
+    enum stream2_result r;
+
+    const size_t elem_size = dense->elem_size;
+    const size_t size = dense->frame_size;
+    const size_t bound =
+            algorithm ? stream2_compress_bound(algorithm, size, elem_size)
+                      : size;
+    uint8_t* frame = malloc(size);
+    uint8_t* compressed = malloc(bound);
+
+    bool ok = false;
+    struct stream2_bytes bytes;
+    if (frame == NULL || compressed == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+    } else {
+        generate_frame(frame, elem_size, pattern);
+        if ((r = encode_frame(algorithm, frame, size, elem_size, compressed,
+                              bound, &bytes)))
+            fprintf(stderr, "error: error %i compressing\n", (int)r);
+        else
+            ok = check(dense, sparse, &bytes);
+    }
+    printf("%s uint%zu %s %s\n", ok ? "ok" : "FAILED", 8 * elem_size,
+           algorithm ? algorithm : "none", PATTERN_NAMES[pattern]);
+
+    free(compressed);
+    free(frame);
+    return ok;
+}
+
+int main(void) {
+    enum stream2_result r;
+
+    static const char* const IMAGE_DTYPES[] = {"uint8", "uint16", "uint32"};
+    static const char* const ALGORITHMS[] = {"bslz4", "lz4", NULL};
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(IMAGE_DTYPES) / sizeof(IMAGE_DTYPES[0]);
+         i++)
+    {
+        struct stream2_series* dense;
+        struct stream2_series* sparse;
+        if ((r = create_series(IMAGE_DTYPES[i], false, &dense))) {
+            fprintf(stderr, "error: error %i creating series\n", (int)r);
+            return EXIT_FAILURE;
+        }
+        if ((r = create_series(IMAGE_DTYPES[i], true, &sparse))) {
+            fprintf(stderr, "error: error %i creating series\n", (int)r);
+            stream2_series_free(dense);
+            return EXIT_FAILURE;
+        }
+        for (size_t j = 0; j < sizeof(ALGORITHMS) / sizeof(ALGORITHMS[0]);
+             j++)
+        {
+            for (int pattern = 0; pattern < PATTERNS; pattern++)
+                ok &= run(dense, sparse, ALGORITHMS[j], pattern);
+        }
+        stream2_series_free(sparse);
+        stream2_series_free(dense);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}